@@ -0,0 +1,90 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Coalesces concurrent queries against the same database into
+           batched single-pass scans, completed through futures.
+*/
+
+#ifndef BATCHER_H
+#define BATCHER_H
+
+#include "cbir.h"
+#include "latency.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Batching tunables
+struct BatchParams {
+    int maxBatch;        // Most queries answered by one scan
+    double windowMs;     // Longest time the oldest queued query waits for company
+    int numExecutors;    // Threads running batch scans (0 = all hardware threads)
+
+    BatchParams() : maxBatch(16), windowMs(1.0), numExecutors(0) {}
+};
+
+// Counters for the batches run so far
+struct BatchStats {
+    size_t batches;
+    size_t queries;
+    size_t largestBatch;
+    double queueP50Ms;   // Time from submit() to the start of its batch scan
+    double queueP99Ms;
+
+    BatchStats() : batches(0), queries(0), largestBatch(0), queueP50Ms(0.0), queueP99Ms(0.0) {}
+    double meanBatch() const { return batches > 0 ? static_cast<double>(queries) / batches : 0.0; }
+};
+
+// Queries are queued per database. An executor takes the oldest query and
+// every other queued query for the same database, then answers them all
+// with CBIRSystem::queryBatch(). A query with no other queued for its
+// database goes at once; otherwise the executor waits until the batch is
+// full or the oldest has waited windowMs.
+class QueryBatcher {
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Request {
+        CBIRSystem* system;
+        FeatureVector target;
+        int topN;
+        Clock::time_point submitted;
+        std::promise<std::vector<MatchResult>> promise;
+    };
+
+    BatchParams params;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<Request> queue;
+    bool stopping;
+    std::vector<std::thread> executors;
+
+    LatencyRecorder queueDelay;
+    size_t batchCount;
+    size_t queryCount;
+    size_t largest;
+
+    void executorLoop();
+
+    // Number of queued requests for the given database
+    size_t queuedFor(const CBIRSystem* system) const;
+
+public:
+    explicit QueryBatcher(const BatchParams& batchParams);
+    ~QueryBatcher();
+
+    // Queue a target prepared with CBIRSystem::extractTargetFeature()
+    std::future<std::vector<MatchResult>> submit(CBIRSystem* system, const FeatureVector& target, int topN);
+
+    // Finish queued queries and stop the executors
+    void stop();
+
+    BatchStats stats();
+};
+
+#endif // BATCHER_H
@@ -0,0 +1,46 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Multi-stage cascade retrieval: a cheap feature database selects
+           candidates that more expensive databases rerank.
+*/
+
+#ifndef CASCADE_H
+#define CASCADE_H
+
+#include "cbir.h"
+#include <string>
+#include <vector>
+
+// One stage of a cascade
+struct CascadeStage {
+    CBIRSystem* system;  // Loaded feature database for this stage
+    int candidates;      // Matches passed on to the next stage (ignored for the last stage)
+
+    CascadeStage() : system(nullptr), candidates(0) {}
+    CascadeStage(CBIRSystem* s, int m) : system(s), candidates(m) {}
+};
+
+// Per-stage measurements
+struct CascadeStageStats {
+    FeatureType featureType;
+    size_t rowsCompared;    // Database rows this stage computed distances for
+    size_t candidatesOut;   // Matches passed on (final results for the last stage)
+    size_t missingImages;   // Candidates not found in this stage's database
+    double latencyMs;       // Feature extraction plus scan
+    float recall;           // Share of the last stage's exact top N still present (-1 if not measured)
+
+    CascadeStageStats() : featureType(FeatureType::BASELINE), rowsCompared(0), candidatesOut(0),
+                          missingImages(0), latencyMs(0.0), recall(-1.0f) {}
+};
+
+// Run a cascade query. Stage 0 scans its whole database; every later stage
+// reranks only the previous stage's candidates, joined by image filename.
+// With measureRecall, the last stage's database is also scanned exhaustively
+// and each stage reports how much of that exact top N it kept.
+// Returns 0 on success, -1 on error
+int cascadeQuery(const std::string& targetImage, const std::vector<CascadeStage>& stages, int topN,
+                 std::vector<MatchResult>& results, std::vector<CascadeStageStats>* stats = nullptr,
+                 bool measureRecall = false);
+
+#endif // CASCADE_H
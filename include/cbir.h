@@ -9,10 +9,16 @@
 
 #include "feature.h"
 #include "distance.h"
+#include "topk.h"
+#include "lru_cache.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <vector>
 #include <string>
 #include <utility>
 #include <map>
+#include <unordered_map>
 
 // Result structure for query matches
 struct MatchResult {
@@ -28,16 +34,124 @@ struct MatchResult {
     }
 };
 
+// Work counters for pruned scans
+struct ScanStats {
+    size_t rowsScanned;
+    size_t rowsPruned;      // Rows rejected before their full distance was computed
+    size_t dimsComputed;    // Dimensions (or bins) actually compared
+    size_t dimsTotal;       // Dimensions an exact scan would have compared
+
+    ScanStats() : rowsScanned(0), rowsPruned(0), dimsComputed(0), dimsTotal(0) {}
+
+    // Fraction of the exact scan's per-dimension work that was skipped
+    double workSaved() const {
+        return dimsTotal > 0 ? 1.0 - static_cast<double>(dimsComputed) / dimsTotal : 0.0;
+    }
+};
+
+// Target feature and result cache counters
+struct CacheStats {
+    size_t storedTargets;    // Targets answered from their database row without decoding
+    size_t featureHits;
+    size_t featureMisses;
+    size_t resultHits;
+    size_t resultMisses;
+
+    CacheStats() : storedTargets(0), featureHits(0), featureMisses(0), resultHits(0), resultMisses(0) {}
+
+    float featureHitRate() const {
+        size_t total = storedTargets + featureHits + featureMisses;
+        return total > 0 ? static_cast<float>(storedTargets + featureHits) / total : 0.0f;
+    }
+    float resultHitRate() const {
+        size_t total = resultHits + resultMisses;
+        return total > 0 ? static_cast<float>(resultHits) / total : 0.0f;
+    }
+};
+
+// Approximate heap memory held by a CBIRSystem, by category
+struct MemoryStats {
+    size_t featureBytes;   // Feature matrix
+    size_t pathBytes;      // Image paths and the filename lookup
+    size_t indexBytes;     // Content hashes, histogram pyramid, variance order, k-NN graph
+    size_t cacheBytes;     // Target feature and result caches
+    size_t decodeBytes;    // Largest image read and decode buffers (freed after each image)
+    size_t budgetBytes;    // 0 = no budget
+    bool compact;          // Rows held in the compact form (see setMemoryBudget())
+
+    MemoryStats()
+        : featureBytes(0), pathBytes(0), indexBytes(0), cacheBytes(0), decodeBytes(0), budgetBytes(0),
+          compact(false) {}
+
+    size_t total() const { return featureBytes + pathBytes + indexBytes + cacheBytes + decodeBytes; }
+};
+
+class KNNGraph;
+
+// Receives each range query match; return false to stop the query
+typedef std::function<bool(const MatchResult&)> MatchCallback;
+
+// Receives build progress: images finished (extracted or failed) out of the
+// total. Called from the build threads, one call at a time; return false to
+// cancel the build
+typedef std::function<bool(size_t done, size_t total)> BuildProgressCallback;
+
 // CBIR System class
 class CBIRSystem {
 private:
     std::vector<std::string> imagePaths;
     std::vector<FeatureVector> features;
+
+    // Directory scanned by buildDatabase(); saved CSVs store paths relative
+    // to it, so images in subdirectories keep their location. Empty after a
+    // load unless set with setImageDirectory()
+    std::string imageRoot;
+    // True when imagePaths are names as stored in a CSV (relative to some
+    // image directory) rather than full paths of a built database
+    bool relativePaths;
     FeatureType currentFeatureType;
     std::string dnnCsvPath;  // Path to DNN embeddings CSV
 
-    // Map for quick DNN feature lookup (filename -> feature index)
-    std::map<std::string, size_t> dnnFeatureMap;
+    // True when every stored vector has unit length (DNN embeddings), so
+    // cosine distance reduces to a single dot product per row
+    bool featuresNormalized;
+
+    // Map for quick lookup of database images (see indexKey())
+    std::unordered_map<std::string, size_t> nameIndex;
+
+    // Hash of each row's image file bytes (0 = unknown), the file's size
+    // (checked with the hash, so a collision alone is no match) and the
+    // hash lookup
+    std::vector<uint64_t> contentHashes;
+    std::vector<uint64_t> contentSizes;
+    std::unordered_multimap<uint64_t, size_t> hashIndex;
+
+    // Dimensions sorted by decreasing database variance (built on demand)
+    std::vector<uint32_t> varianceOrder;
+
+    // Coarse-to-fine pyramid of Task 2 colour histograms, coarsest level
+    // first: level l stores pyramidBins[l]^3 bins per row, row-major
+    std::vector<std::vector<float>> histogramPyramid;
+    std::vector<int> pyramidBins;
+
+    // Bumped whenever the database is built, loaded or cleared
+    uint64_t dbVersion;
+
+    // Extracted target features keyed by (feature type, path, mtime, size)
+    // and final results keyed by (DB version, N, target feature)
+    LRUCache<std::string, FeatureVector> featureCache;
+    LRUCache<std::string, std::vector<MatchResult>> resultCache;
+    std::atomic<size_t> storedTargetCount;
+
+    // Optional k-NN graph over the rows (not owned), see setNeighborGraph()
+    const KNNGraph* neighborGraph;
+
+    // Memory budget in bytes (0 = none), and whether the current rows are
+    // held in the compact form chosen to fit it
+    size_t memoryBudget;
+    bool compactRows;
+    size_t fullFeatureCacheEntries;  // Feature cache size to restore after compact rows
+    std::atomic<size_t> peakDecodeBytes;
 
 public:
     CBIRSystem();
@@ -46,37 +160,243 @@ public:
     // Set DNN CSV path for Task 5
     void setDNNCsvPath(const std::string& path);
 
-    // Build feature database from image directory
-    // Returns number of images processed, or -1 on error
-    int buildDatabase(const std::string& imageDir, FeatureType type);
+    // Build feature database from image directory and all its
+    // subdirectories (symbolic links to directories are not followed).
+    // Images are extracted on numThreads threads (0 = all hardware threads);
+    // rows keep file order whatever the count. progress, if set, may cancel
+    // the build, which leaves the database empty.
+    // Returns number of images processed, or -1 on error or cancellation
+    int buildDatabase(const std::string& imageDir, FeatureType type, int numThreads = 1,
+                      const BuildProgressCallback& progress = BuildProgressCallback());
 
     // Save features to CSV file
     int saveFeatures(const std::string& filename);
 
+    // Split the database into numShards CSV files by hash of stored image name
+    // (see shardOf() and shardFileName()). Returns 0 on success, -1 on error
+    int saveShards(const std::string& filename, int numShards);
+
     // Load features from CSV file
     int loadFeatures(const std::string& filename);
 
+    // Directory the loaded database's names are relative to, so a target
+    // under it is recognised as a database image by its path
+    void setImageDirectory(const std::string& imageDir);
+
+    // File of a database image named as in a row or a result: full paths
+    // (built databases) as they are, stored names under the image directory.
+    // Normalized, so one file always has one spelling (e.g. as a cache key)
+    std::string imageFilePath(const std::string& storedPath) const;
+
     // Query for similar images
     // Returns top N matches sorted by distance
     std::vector<MatchResult> query(const std::string& targetImage, int topN);
 
+    // Answer database images from a k-NN graph built over this database
+    // (see knngraph.h): the top N is the target's own row merged into its
+    // first N-1 graph neighbours, with no scan. Used by query() when N-1 <= K.
+    // The graph must outlive its use; nullptr detaches it, and so does any
+    // change to the database. Returns 0 on success, -1 if it does not match
+    int setNeighborGraph(const KNNGraph* graph);
+    bool hasNeighborGraph() const { return neighborGraph != nullptr; }
+
     // Query using pre-computed feature vector
     std::vector<MatchResult> query(const FeatureVector& targetFeature, int topN);
 
+    // Exact top N for SSD (baseline) databases with early abandoning: a row's
+    // running sum is checked against the current N-th best distance every
+    // block of dimensions. reorderDims visits high-variance dimensions first.
+    // Returns exactly the same matches as query(); other feature types fall
+    // back to the full scan.
+    std::vector<MatchResult> queryEarlyAbandon(const FeatureVector& targetFeature, int topN,
+                                               bool reorderDims, ScanStats* stats = nullptr);
+
+    // Exact top N for histogram databases. Rows are visited in order of
+    // their coarsest-level bound and each is compared level by level
+    // (2^3, 4^3, 8^3 bins, then the full histogram); a row is discarded as
+    // soon as a coarse intersection cannot beat the current N-th best.
+    // query() uses this automatically when the pyramid is available.
+    std::vector<MatchResult> queryHistogramCascade(const FeatureVector& targetFeature, int topN,
+                                                   ScanStats* stats = nullptr);
+
+    // Answer several queries with one pass over the database: rows are
+    // scanned in blocks and every query visits a block while it is still in
+    // cache. Same results as query() for each target; cached results are
+    // reused and stored. Histogram databases with a pyramid and batches of
+    // one are answered by query() instead
+    std::vector<std::vector<MatchResult>> queryBatch(const std::vector<FeatureVector>& targetFeatures,
+                                                     const std::vector<int>& topN);
+
+    // Stream every database image with distance <= radius to onMatch, in
+    // row order and without collecting or sorting them. Baseline rows are
+    // abandoned once their partial sum passes the radius and histogram rows
+    // by their pyramid bounds. Returns the number of matches delivered, or
+    // -1 on error
+    int rangeQuery(const FeatureVector& targetFeature, float radius, const MatchCallback& onMatch,
+                   ScanStats* stats = nullptr) const;
+
+    // Rows whose image file has exactly the same bytes as imagePath, found
+    // by content hash without decoding anything. Empty if the file cannot be
+    // read or the database has no hashes
+    std::vector<size_t> findExactDuplicates(const std::string& imagePath) const;
+    bool hasContentHashes() const { return !hashIndex.empty(); }
+
+    // Exact top N among the given database rows only (used to rerank
+    // candidates from another stage). The target must be prepared with
+    // extractTargetFeature().
+    std::vector<MatchResult> queryRows(const FeatureVector& targetFeature,
+                                       const std::vector<size_t>& rows, int topN) const;
+
+    // Distance between a prepared query vector (see extractTargetFeature())
+    // and a database row
+    float rowDistance(const FeatureVector& target, size_t row) const;
+
+    // Row of a database image, or -1 if the image is not in the database.
+    // The path matches a row when it ends with the row's stored name, so
+    // same-named images in different subdirectories stay apart
+    int findImage(const std::string& imagePath) const;
+
+    // Extract the target's feature the same way query() does, prepared for
+    // comparison with the database (normalized for cosine databases).
+    // Database images and byte-identical copies of them reuse their stored
+    // row; other targets go through the feature cache. Returns 0 on success,
+    // -1 on error
+    int extractTargetFeature(const std::string& targetImage, FeatureVector& targetFeature);
+
+    // Convert index search results (row ids) to image matches
+    std::vector<MatchResult> toMatchResults(const std::vector<Neighbor>& neighbors) const;
+
+    // Cache sizes in entries (0 disables a cache); defaults 1024 and 256
+    void setCacheCapacity(size_t featureEntries, size_t resultEntries);
+    void clearCaches();
+    CacheStats getCacheStats() const;
+    uint64_t getDatabaseVersion() const { return dbVersion; }
+
+    // Limit the memory a database may take (0 = no limit, the default).
+    // A build or load that would not fit is held in compact form: no second
+    // copy of each path, no content hashes, no histogram pyramid and no
+    // target feature cache, so results are unchanged but byte-identical
+    // targets are decoded and histogram queries scan every row. If even
+    // that does not fit, it fails with an error instead of paging: a load
+    // before reading any rows (the current database stays), a build as soon
+    // as the estimate is known
+    void setMemoryBudget(size_t bytes) { memoryBudget = bytes; }
+    size_t getMemoryBudget() const { return memoryBudget; }
+    MemoryStats getMemoryStats() const;
+
+    // Estimated bytes to load a feature CSV (or a DNN embedding CSV) in full
+    // form (with a full feature cache) or compact form, from its header or
+    // its size. Returns 0 if the file cannot be read
+    size_t estimateLoadBytes(const std::string& filename, bool compact) const;
+
+    // Exact top N over a feature CSV read one row at a time, for databases
+    // too large for the memory budget: memory stays at one row and the N
+    // best. Replaces the current database (the feature type comes from the
+    // file). Returns 0 on success, -1 on error
+    int streamQuery(const std::string& filename, const std::string& targetImage, int topN,
+                    std::vector<MatchResult>& results);
+
     // Getters
     size_t getDatabaseSize() const { return features.size(); }
     FeatureType getFeatureType() const { return currentFeatureType; }
+    bool isNormalized() const { return featuresNormalized; }
     const std::vector<std::string>& getImagePaths() const { return imagePaths; }
+    const std::vector<FeatureVector>& getFeatures() const { return features; }
 
     // Clear database
     void clear();
 
 private:
     // Helper to get filename from path
-    std::string getFilename(const std::string& path);
+    std::string getFilename(const std::string& path) const;
 
     // Helper to check if file is an image
     bool isImageFile(const std::string& filename);
+
+    // Image files under dir and its subdirectories, as paths relative to
+    // dir, sorted within each directory. Returns -1 if dir cannot be opened
+    int listImageFiles(const std::string& dir, const std::string& relativeDir,
+                       std::vector<std::string>& files);
+
+    // Name of a row's image in a saved CSV (see imageRoot)
+    std::string storedName(const std::string& path) const;
+
+    // nameIndex key of a row: its stored name, normalized (the path
+    // relative to the image directory, or the filename in flat databases)
+    std::string indexKey(const std::string& path) const;
+
+    // Write the given rows as a feature CSV, plus their content hashes to
+    // <filename>.hash when known
+    int writeFeatureRows(const std::string& filename, const std::vector<size_t>& rows);
+
+    // Read the <filename>.hash file written next to a feature CSV, if any
+    void loadContentHashes(const std::string& filename);
+
+    // Reset everything derived from the feature rows (lookups, pyramids, ...)
+    void clearDerivedData();
+
+    // Rebuild the filename and content hash -> row lookups
+    void buildNameIndex();
+
+    // Row holding the target's stored feature, or -1. The target must be
+    // the row's file: the same full path (under the image directory for a
+    // loaded database, see setImageDirectory()), or, when a loaded
+    // database's directory is unknown, a path ending in the row's stored
+    // name whose bytes hash to the row's. DNN rows match by filename.
+    int findStoredTarget(const std::string& targetImage) const;
+
+    // Cache keys
+    std::string featureCacheKey(const std::string& targetImage) const;
+    std::string resultCacheKey(const FeatureVector& target, int topN) const;
+
+    // L2-normalize all stored features (cosine-distance databases only)
+    void normalizeFeatures();
+
+    // Top N of a database row from the k-NN graph (N - 1 <= K)
+    std::vector<MatchResult> graphQuery(size_t row, int topN) const;
+
+    // Full linear scan used by query()
+    std::vector<MatchResult> exactScan(const FeatureVector& target, int topN) const;
+
+    // Rows whose image file has this content hash and size in bytes
+    std::vector<size_t> rowsWithHash(uint64_t hash, uint64_t size) const;
+
+    // Build the histogram pyramid for Task 2 databases (no-op otherwise)
+    void buildHistogramPyramid();
+
+    // The target's histogram at every pyramid level, coarsest first
+    void buildTargetPyramid(const FeatureVector& targetFeature, std::vector<std::vector<float>>& levels) const;
+
+    // Dimension order by decreasing variance over the database
+    const std::vector<uint32_t>& getVarianceOrder();
+
+    // Choose full or compact rows for a database of the given estimated
+    // sizes. Returns -1 (with an error) if neither fits the budget
+    int chooseRowForm(const std::string& what, size_t fullBytes, size_t compactBytes, bool& compact) const;
+
+    // Switch between full and compact rows; compact rows also turn off the
+    // target feature cache
+    void setCompactRows(bool compact);
+
+    // Remember the largest image read and decode buffers seen
+    void recordDecodeBytes(size_t bytes);
 };
 
+// Path with "." and ".." resolved and "/" separators (lexically; the file
+// need not exist)
+std::string normalizePath(const std::string& path);
+
+// Shard holding an image (by stored name) when a database is split numShards ways
+int shardOf(const std::string& imageName, int numShards);
+
+// File name of one shard: features.csv -> features.shard<i>.csv
+std::string shardFileName(const std::string& filename, int shard);
+
+// Hash and size of a file's bytes, for exact duplicate detection. Returns
+// 0 on success, -1 if the file cannot be read
+int fileContentHash(const std::string& path, uint64_t& hash, uint64_t& size);
+
+// Fraction of the exact top-K images that also appear in an approximate result
+float recallAtK(const std::vector<MatchResult>& exact, const std::vector<MatchResult>& approx);
+
 #endif // CBIR_H
@@ -0,0 +1,125 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Metric-aware k-means clustering of a feature database and
+           cluster-pruned search.
+*/
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "feature.h"
+#include "topk.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class CBIRSystem;
+
+// Clustering parameters
+struct ClusterParams {
+    int k;               // Number of clusters
+    int iterations;      // Lloyd iterations over the whole database
+    size_t batchSize;    // Rows per mini-batch step; 0 = Lloyd below 100k rows, 4096 above
+    int batchSteps;      // Mini-batch steps
+    int probes;          // Default clusters scanned per query
+    int numThreads;      // 0 = all hardware threads
+    unsigned int seed;
+
+    ClusterParams()
+        : k(64), iterations(20), batchSize(0), batchSteps(200), probes(4), numThreads(0), seed(42) {}
+};
+
+// What a clustering run did
+struct ClusterBuildStats {
+    bool miniBatch;
+    int iterationsRun;     // Lloyd iterations or mini-batch steps
+    double meanDistance;   // Mean distance from each image to its centroid, less its self-distance
+
+    ClusterBuildStats() : miniBatch(false), iterationsRun(0), meanDistance(0.0) {}
+};
+
+// Work done by one search
+struct ClusterSearchStats {
+    size_t clustersProbed;
+    size_t rowsScanned;
+
+    ClusterSearchStats() : clustersProbed(0), rowsScanned(0) {}
+};
+
+// K-means over a CBIRSystem database using the database's own distance
+// (SSD, histogram intersection, cosine, ...), so clusters match what queries
+// consider similar. Centroids are mean features, re-normalized for cosine
+// databases. Rows are stored grouped by cluster for pruned search and
+// browsing.
+class ClusterIndex {
+private:
+    const CBIRSystem* system;
+    FeatureType featureType;
+    bool normalized;
+    uint32_t dim;
+    int defaultProbes;
+
+    std::vector<FeatureVector> centroids;
+    std::vector<uint32_t> assignment;       // Cluster of each row
+    std::vector<float> memberDistance;      // Distance of each row to its centroid
+    std::vector<uint64_t> offsets;          // Cluster c owns members[offsets[c], offsets[c + 1])
+    std::vector<uint32_t> members;          // Rows by cluster, nearest to the centroid first
+    std::vector<float> centroidColumns;     // Centroids dimension-major (dim x k) while building
+
+    // Distance between a prepared query (or centroid) and a centroid
+    float centroidDistance(const FeatureVector& a, const FeatureVector& centroid) const;
+
+    // Copy the centroids into centroidColumns so the assignment step scores
+    // a row against all of them in one pass whose inner loop runs over
+    // centroids and vectorizes. Left empty for metrics that are not a plain
+    // per-dimension sum (SSD, histogram intersection, normalized cosine)
+    void packCentroids();
+
+    // Nearest centroid of a database row; sums is scratch space
+    uint32_t nearestCluster(size_t row, float& bestDist, std::vector<float>& sums) const;
+
+    // Nearest centroid of every row in parallel. Returns rows that changed
+    size_t assignAll(int numThreads);
+
+    void seedCentroids(const ClusterParams& params);
+    int runLloyd(const ClusterParams& params);
+    int runMiniBatch(const ClusterParams& params, size_t batchSize);
+    void groupMembers();
+
+public:
+    ClusterIndex();
+
+    // k-means++ seeding on a sample, then Lloyd iterations (or mini-batch
+    // steps on large databases) and a final parallel assignment of every
+    // row. Returns 0 on success, -1 on error
+    int build(const CBIRSystem& database, const ClusterParams& params, ClusterBuildStats* stats = nullptr);
+
+    // Exact top k within the `probes` clusters nearest the target (0 = the
+    // default stored in the index). The target must be prepared with
+    // CBIRSystem::extractTargetFeature()
+    std::vector<Neighbor> search(const FeatureVector& target, int k, int probes = 0,
+                                 ClusterSearchStats* stats = nullptr) const;
+
+    int save(const std::string& filename) const;
+    int load(const std::string& filename, const CBIRSystem& database);
+
+    // One line per image: filename,cluster,distance to centroid
+    int writeAssignments(const std::string& filename) const;
+
+    size_t numClusters() const { return centroids.size(); }
+    size_t clusterSize(size_t c) const { return offsets[c + 1] - offsets[c]; }
+    const uint32_t* clusterMembers(size_t c) const { return &members[offsets[c]]; }
+    const FeatureVector& centroid(size_t c) const { return centroids[c]; }
+    uint32_t clusterOf(size_t row) const { return assignment[row]; }
+    float distanceToCentroid(size_t row) const { return memberDistance[row]; }
+    int probes() const { return defaultProbes; }
+
+    size_t memoryBytes() const {
+        return centroids.size() * dim * sizeof(float) + assignment.size() * sizeof(uint32_t) +
+               memberDistance.size() * sizeof(float) + offsets.size() * sizeof(uint64_t) +
+               members.size() * sizeof(uint32_t);
+    }
+};
+
+#endif // CLUSTER_H
@@ -11,6 +11,7 @@
 #include <vector>
 #include <cmath>
 #include <algorithm>
+#include <cstdint>
 
 // Task 1: Sum of Squared Difference (SSD)
 // d = sum((a[i] - b[i])^2)
@@ -22,12 +23,19 @@ float sumSquaredDifference(const FeatureVector& a, const FeatureVector& b);
 float histogramIntersection(const FeatureVector& a, const FeatureVector& b);
 float histogramIntersectionDistance(const FeatureVector& a, const FeatureVector& b);
 
+// Histogram intersection on raw bin arrays of length n
+float histogramIntersection(const float* a, const float* b, size_t n);
+
 // Task 5: Cosine Distance
 // cos_theta = dot(a_norm, b_norm)
 // distance = 1 - cos_theta
 float cosineDistance(const FeatureVector& a, const FeatureVector& b);
 float cosineSimilarity(const FeatureVector& a, const FeatureVector& b);
 
+// Task 5: Cosine Distance for pre-normalized (unit length) vectors
+// cos_theta reduces to dot(a, b), so no per-pair norms or sqrt are needed
+float normalizedCosineDistance(const FeatureVector& a, const FeatureVector& b);
+
 // Weighted distance for combining multiple features
 // Used in Task 3, 4 for multi-feature matching
 float weightedDistance(const std::vector<float>& distances,
@@ -39,6 +47,16 @@ float l1Distance(const FeatureVector& a, const FeatureVector& b);
 // L2 Distance (Euclidean)
 float l2Distance(const FeatureVector& a, const FeatureVector& b);
 
+// Early-abandoning SSD for top-K and range scans.
+// The running sum is compared with `bound` after every `blockSize` dimensions
+// and the scan stops as soon as it exceeds it. The result is the exact
+// distance when it is <= bound, otherwise some value > bound.
+// `order` (optional) lists the dimensions to visit, largest contributors
+// first; *dimsVisited (optional) receives the number of dimensions summed.
+float sumSquaredDifferenceBounded(const FeatureVector& a, const FeatureVector& b, float bound,
+                                  const std::vector<uint32_t>* order, size_t blockSize,
+                                  size_t* dimsVisited);
+
 // Generic distance function dispatcher based on feature type
 float computeDistance(const FeatureVector& a, const FeatureVector& b, FeatureType type);
 
@@ -47,6 +47,11 @@ int extractBaseline(const cv::Mat& image, FeatureVector& feature);
 // binsPerChannel: number of bins per channel (default 16)
 int extractHistogram(const cv::Mat& image, FeatureVector& feature, int binsPerChannel = 16);
 
+// Sum a bins^3 RGB histogram (extractHistogram layout) into (bins/2)^3 bins.
+// Histogram intersection at the coarse level is an upper bound on the
+// intersection at the finer level, which lets queries prune rows early.
+void downsampleHistogram(const float* histogram, int binsPerChannel, float* coarse);
+
 // Task 3: Multi-histogram feature - split image into regions and compute histograms
 // splitHorizontal: if true, split into top/bottom halves; else left/right
 int extractMultiHistogram(const cv::Mat& image, FeatureVector& feature,
@@ -0,0 +1,63 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Weighted fusion of several feature databases built over the same
+           images, answered with a single scan and a single top-K.
+*/
+
+#ifndef FUSION_H
+#define FUSION_H
+
+#include "cbir.h"
+#include <string>
+#include <vector>
+
+// One feature database taking part in a fused query
+struct FusionColumn {
+    CBIRSystem* system;
+    float weight;
+    float mean;    // Distance normalization: (d - mean) * scale
+    float scale;
+
+    FusionColumn() : system(nullptr), weight(1.0f), mean(0.0f), scale(1.0f) {}
+};
+
+// Several CBIR databases joined by image filename. The first column defines
+// the images; rows missing from any other column are left out. Each
+// column's distances are z-score normalized (mean and standard deviation of
+// sampled database pairs) before they are combined with weightedDistance().
+class FusedDatabase {
+private:
+    std::vector<FusionColumn> columns;
+    std::vector<std::vector<uint32_t>> rowMaps;  // rowMaps[c][i]: row of joined image i in column c
+    size_t droppedRows;
+
+    // Rebuild the join after a column is added
+    void alignRows();
+
+public:
+    FusedDatabase();
+
+    // Add a loaded database with its weight. Returns 0 on success, -1 on error
+    int addColumn(CBIRSystem* system, float weight);
+
+    // Estimate every column's distance normalization from `samplePairs`
+    // random pairs of joined images
+    void calibrate(size_t samplePairs = 4096, unsigned int seed = 42);
+
+    // Fused top N for a target image: each column extracts its own target
+    // feature, then one pass over the joined rows scores every image.
+    // Returns an empty list on error
+    std::vector<MatchResult> query(const std::string& targetImage, int topN);
+
+    // Fused top N for per-column targets already prepared with
+    // CBIRSystem::extractTargetFeature()
+    std::vector<MatchResult> query(const std::vector<FeatureVector>& targets, int topN) const;
+
+    size_t size() const { return rowMaps.empty() ? 0 : rowMaps[0].size(); }
+    size_t columnCount() const { return columns.size(); }
+    size_t droppedImages() const { return droppedRows; }
+    const FusionColumn& column(size_t c) const { return columns[c]; }
+};
+
+#endif // FUSION_H
@@ -0,0 +1,95 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: HNSW (hierarchical navigable small world) approximate nearest
+           neighbour index over a CBIR feature database.
+*/
+
+#ifndef HNSW_H
+#define HNSW_H
+
+#include "feature.h"
+#include "topk.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Tunable HNSW parameters
+struct HNSWParams {
+    int M;               // Links per node on upper layers (2*M on layer 0)
+    int efConstruction;  // Candidate list size while inserting
+    int efSearch;        // Default candidate list size while searching
+    int numThreads;      // Construction threads (0 = all hardware threads)
+    unsigned int seed;   // Seed for the random layer assignment
+
+    HNSWParams() : M(16), efConstruction(200), efSearch(64), numThreads(0), seed(42) {}
+};
+
+// HNSW graph index. The index stores only graph links; feature vectors stay
+// in the CBIRSystem database and are referenced, not copied.
+class HNSWIndex {
+private:
+    const std::vector<FeatureVector>* data;
+    FeatureType featureType;
+    bool normalized;
+    HNSWParams params;
+    int maxM0;          // Link capacity on layer 0
+    double levelMult;   // 1 / ln(M), scale of the random layer distribution
+
+    std::vector<int> levels;                   // Top layer of every node
+    std::vector<uint32_t> level0Links;         // n * (maxM0 + 1): count then ids
+    std::vector<std::vector<uint32_t>> upperLinks;  // level * (M + 1) per node
+    uint32_t entryPoint;
+    int maxLevel;
+
+    // Only used while building
+    mutable std::vector<std::mutex> nodeLocks;
+    std::mutex globalLock;
+
+    typedef std::pair<float, uint32_t> Candidate;
+
+    float distance(const FeatureVector& query, uint32_t node) const;
+    float distance(uint32_t a, uint32_t b) const;
+    uint32_t* linksAt(uint32_t node, int level);
+    const uint32_t* linksAt(uint32_t node, int level) const;
+
+    // Greedy search on one layer; returns up to ef closest candidates (unsorted)
+    std::vector<Candidate> searchLayer(const FeatureVector& query, uint32_t entry,
+                                       int ef, int level, bool locked) const;
+
+    // Heuristic neighbour selection (HNSW paper, algorithm 4)
+    std::vector<uint32_t> selectNeighbors(std::vector<Candidate>& candidates, int m) const;
+
+    void insert(uint32_t node);
+
+public:
+    HNSWIndex();
+
+    // Build the graph over all features. For normalized (cosine) databases
+    // the distance is 1 - dot product, otherwise computeDistance(type).
+    // Returns 0 on success, -1 on error
+    int build(const std::vector<FeatureVector>& features, FeatureType type,
+              bool isNormalized, const HNSWParams& buildParams);
+
+    // Approximate k nearest neighbours, sorted by distance.
+    // The query must be prepared like the database (normalized if needed).
+    // efSearch <= 0 uses the index default.
+    std::vector<Neighbor> search(const FeatureVector& query, int k, int efSearch = 0) const;
+
+    // Save graph links to a binary file
+    int save(const std::string& filename) const;
+
+    // Load graph links and attach them to the database they were built from
+    int load(const std::string& filename, const std::vector<FeatureVector>& features);
+
+    void setEfSearch(int ef) { params.efSearch = ef; }
+    const HNSWParams& getParams() const { return params; }
+    size_t size() const { return levels.size(); }
+
+    // Bytes used by the graph links (feature vectors not included)
+    size_t memoryBytes() const;
+};
+
+#endif // HNSW_H
@@ -0,0 +1,90 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: IVF-PQ index (inverted file + product quantization) for compressed
+           approximate search over large CBIR feature databases.
+*/
+
+#ifndef IVFPQ_H
+#define IVFPQ_H
+
+#include "feature.h"
+#include "topk.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Tunable IVF-PQ parameters
+struct IVFPQParams {
+    int nlist;             // Coarse clusters (inverted lists)
+    int numSubquantizers;  // Bytes per encoded vector
+    int trainSize;         // Vectors sampled for training (0 = all)
+    int iterations;        // K-means iterations for both quantizers
+    int nprobe;            // Default number of lists scanned per query
+    int numThreads;        // Training/encoding threads (0 = all hardware threads)
+    unsigned int seed;
+
+    IVFPQParams() : nlist(256), numSubquantizers(16), trainSize(65536), iterations(20),
+                    nprobe(8), numThreads(0), seed(42) {}
+};
+
+// IVF-PQ index. Vectors are assigned to their nearest coarse centroid and
+// the residual is encoded as one byte per subspace. Queries scan the nprobe
+// closest lists with asymmetric distance (ADC) lookup tables.
+//
+// Supported feature types:
+//   baseline       - squared L2 (same ranking and scale as SSD)
+//   dnn_embedding  - cosine on normalized vectors, reported as 1 - cos
+class IVFPQIndex {
+private:
+    FeatureType featureType;
+    bool cosine;
+    size_t dim;
+    int nlist;
+    int M;                           // Subquantizers
+    int ksub;                        // Centroids per subquantizer (<= 256)
+    int nprobe;
+    std::vector<uint32_t> subOffsets;  // M + 1 subspace boundaries
+    std::vector<float> coarse;         // nlist x dim
+    std::vector<float> codebooks;      // Subspace m: ksub x dsub at ksub * subOffsets[m]
+    std::vector<std::vector<uint32_t>> listIds;
+    std::vector<std::vector<uint8_t>> listCodes;  // M bytes per vector
+    size_t count;
+
+    size_t subDim(int m) const { return subOffsets[m + 1] - subOffsets[m]; }
+    const float* codebook(int m) const { return &codebooks[static_cast<size_t>(ksub) * subOffsets[m]]; }
+
+    // Fill table[m * ksub + j] with the squared distance from the query
+    // residual's subvector m to codeword j
+    void computeLookupTable(const float* residual, std::vector<float>& table) const;
+
+    // Scan one inverted list with a precomputed lookup table
+    void scanList(int list, const std::vector<float>& table, TopK& top) const;
+
+public:
+    IVFPQIndex();
+
+    // Train both quantizers on (a sample of) the database and encode all rows
+    // Returns 0 on success, -1 on error or unsupported feature type
+    int build(const std::vector<FeatureVector>& features, FeatureType type,
+              bool isNormalized, const IVFPQParams& params);
+
+    // Approximate k nearest neighbours, sorted by estimated distance.
+    // The query must be prepared like the database (normalized if needed).
+    // probes <= 0 uses the index default.
+    std::vector<Neighbor> search(const FeatureVector& query, int k, int probes = 0) const;
+
+    int save(const std::string& filename) const;
+
+    // Load an index and check it against the database it was built from
+    int load(const std::string& filename, const std::vector<FeatureVector>& features);
+
+    void setNprobe(int probes) { nprobe = probes; }
+    size_t size() const { return count; }
+    size_t dimension() const { return dim; }
+
+    // Bytes used by codes, ids, centroids and codebooks
+    size_t memoryBytes() const;
+};
+
+#endif // IVFPQ_H
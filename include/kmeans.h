@@ -0,0 +1,29 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: K-means clustering on dense float matrices, used to train the
+           coarse quantizer and product-quantization codebooks.
+*/
+
+#ifndef KMEANS_H
+#define KMEANS_H
+
+#include <cstddef>
+#include <vector>
+
+// Squared L2 distance between two raw vectors
+float squaredL2(const float* a, const float* b, size_t dim);
+
+// Index of the centroid closest to point (squared L2).
+// Writes the distance to *dist when dist is not null.
+int nearestCentroid(const float* point, const float* centroids, int k, size_t dim,
+                    float* dist = nullptr);
+
+// Train k centroids on n points stored row-major (n x dim) with Lloyd
+// iterations. Centroids are returned row-major (k x dim).
+// numThreads <= 0 uses all hardware threads.
+// Returns 0 on success, -1 on error
+int kmeansTrain(const float* points, size_t n, size_t dim, int k, int iterations,
+                int numThreads, unsigned int seed, std::vector<float>& centroids);
+
+#endif // KMEANS_H
@@ -0,0 +1,74 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: All-pairs k-nearest-neighbour graph of a feature database (self-join).
+*/
+
+#ifndef KNNGRAPH_H
+#define KNNGRAPH_H
+
+#include "feature.h"
+#include "topk.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class CBIRSystem;
+
+// Construction parameters
+struct KNNGraphParams {
+    int k;              // Neighbours kept per image, not counting the image itself
+    int numThreads;     // 0 = all hardware threads
+    size_t blockBytes;  // Feature bytes of the two row blocks compared by one tile
+    bool symmetric;     // d(a, b) == d(b, a): compute each pair once (true for every built-in type)
+
+    KNNGraphParams() : k(10), numThreads(0), blockBytes(256 * 1024), symmetric(true) {}
+};
+
+// Construction counters
+struct KNNGraphStats {
+    size_t distanceComputations;
+    size_t tiles;
+    size_t blockRows;
+
+    KNNGraphStats() : distanceComputations(0), tiles(0), blockRows(0) {}
+};
+
+// The K nearest database rows of every database row, stored as a fixed-width
+// adjacency list (K entries per row, sorted by distance), so the neighbours
+// of a row are a single O(K) lookup
+class KNNGraph {
+private:
+    uint32_t k;
+    uint64_t count;
+    uint32_t dim;
+    FeatureType featureType;
+    bool normalized;
+    std::vector<Neighbor> edges;  // count * k, row-major
+
+public:
+    KNNGraph();
+
+    // Self-join over the system's database. Rows are split into blocks sized
+    // so two blocks fit in cache and every tile (pair of blocks) is compared
+    // as a unit. Symmetric distances visit each pair of blocks once and
+    // update both rows; tiles that share no blocks run in parallel without
+    // locks. Returns 0 on success, -1 on error
+    int build(const CBIRSystem& system, const KNNGraphParams& params, KNNGraphStats* stats = nullptr);
+
+    int save(const std::string& filename) const;
+    // Fails unless the graph was built for this database: same size,
+    // dimension, feature type and normalization, with every neighbour a row
+    int load(const std::string& filename, const CBIRSystem& database);
+
+    size_t size() const { return count; }
+    int neighborCount() const { return static_cast<int>(k); }
+    FeatureType getFeatureType() const { return featureType; }
+
+    // The k nearest other rows of `row`, sorted by distance
+    const Neighbor* neighbors(size_t row) const { return &edges[row * k]; }
+
+    size_t memoryBytes() const { return edges.size() * sizeof(Neighbor); }
+};
+
+#endif // KNNGRAPH_H
@@ -0,0 +1,61 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Thread-safe latency recorder with percentile reporting.
+*/
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Keeps the most recent `window` samples (milliseconds) in a ring buffer;
+// percentiles are computed over that window, the count over all samples
+class LatencyRecorder {
+private:
+    std::vector<double> samples;
+    size_t window;
+    size_t next;
+    size_t total;
+    mutable std::mutex lock;
+
+public:
+    explicit LatencyRecorder(size_t windowSize = 100000) : window(windowSize), next(0), total(0) {}
+
+    void record(double ms) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (samples.size() < window) {
+            samples.push_back(ms);
+        } else {
+            samples[next] = ms;
+            next = (next + 1) % window;
+        }
+        total++;
+    }
+
+    // p in [0, 100]; 0 if nothing was recorded
+    double percentile(double p) const {
+        std::vector<double> sorted;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            sorted = samples;
+        }
+        if (sorted.empty()) {
+            return 0.0;
+        }
+        size_t rank = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+        rank = std::min(rank, sorted.size() - 1);
+        std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank];
+    }
+
+    size_t count() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return total;
+    }
+};
+
+#endif // LATENCY_H
@@ -0,0 +1,121 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Bounded least-recently-used cache with hit/miss counters.
+*/
+
+#ifndef LRU_CACHE_H
+#define LRU_CACHE_H
+
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+// Thread-safe LRU cache. A capacity of 0 disables caching; every lookup is
+// then a miss and nothing is stored.
+template <typename Key, typename Value>
+class LRUCache {
+private:
+    typedef std::list<std::pair<Key, Value>> ItemList;
+
+    size_t maxItems;
+    ItemList items;  // Most recently used first
+    std::unordered_map<Key, typename ItemList::iterator> lookup;
+    size_t hitCount;
+    size_t missCount;
+    mutable std::mutex lock;
+
+    void evict() {
+        while (items.size() > maxItems) {
+            lookup.erase(items.back().first);
+            items.pop_back();
+        }
+    }
+
+public:
+    explicit LRUCache(size_t capacity) : maxItems(capacity), hitCount(0), missCount(0) {}
+
+    // Copy the cached value into out and mark it most recently used
+    bool get(const Key& key, Value& out) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = lookup.find(key);
+        if (it == lookup.end()) {
+            missCount++;
+            return false;
+        }
+        items.splice(items.begin(), items, it->second);
+        out = it->second->second;
+        hitCount++;
+        return true;
+    }
+
+    void put(const Key& key, const Value& value) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (maxItems == 0) {
+            return;
+        }
+        auto it = lookup.find(key);
+        if (it != lookup.end()) {
+            it->second->second = value;
+            items.splice(items.begin(), items, it->second);
+            return;
+        }
+        items.emplace_front(key, value);
+        lookup[key] = items.begin();
+        evict();
+    }
+
+    // Drop all entries; counters are kept
+    void clear() {
+        std::lock_guard<std::mutex> guard(lock);
+        items.clear();
+        lookup.clear();
+    }
+
+    void setCapacity(size_t capacity) {
+        std::lock_guard<std::mutex> guard(lock);
+        maxItems = capacity;
+        evict();
+    }
+
+    void resetCounters() {
+        std::lock_guard<std::mutex> guard(lock);
+        hitCount = 0;
+        missCount = 0;
+    }
+
+    // Approximate heap bytes of the entries; sizeOf(key, value) gives what
+    // one entry owns beyond its list and lookup nodes
+    template <typename SizeOf>
+    size_t memoryBytes(SizeOf sizeOf) const {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t bytes = lookup.bucket_count() * sizeof(void*);
+        for (const auto& item : items) {
+            bytes += sizeof(item) + 2 * sizeof(void*)                                   // List node
+                     + sizeof(Key) + sizeof(typename ItemList::iterator) + 2 * sizeof(void*)  // Lookup node
+                     + sizeOf(item.first, item.second);
+        }
+        return bytes;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return items.size();
+    }
+    size_t capacity() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return maxItems;
+    }
+    size_t hits() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return hitCount;
+    }
+    size_t misses() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return missCount;
+    }
+};
+
+#endif // LRU_CACHE_H
@@ -0,0 +1,112 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Binary signature index: packed 64-bit signatures compared by
+           Hamming distance (popcount), with multi-probe hash tables and
+           exact reranking.
+*/
+
+#ifndef LSH_H
+#define LSH_H
+
+#include "feature.h"
+#include "topk.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Build and search parameters
+struct LSHParams {
+    int bits;           // Signature bits for projected types, rounded up to 64
+    int tables;         // Hash tables for sub-linear lookup (0 = popcount scan only)
+    int keyBits;        // Signature bits sampled into each table key (at most 20)
+    int probeRadius;    // Key bits flipped while probing: 0, 1 or 2
+    int rerank;         // Default signature candidates reranked with the exact distance
+    int numThreads;     // Construction threads (0 = all hardware threads)
+    unsigned int seed;  // Seed for projections and key bit selection
+
+    LSHParams() : bits(256), tables(8), keyBits(12), probeRadius(1), rerank(200),
+                  numThreads(0), seed(42) {}
+};
+
+// Work counters for one search
+struct LSHStats {
+    size_t bucketsProbed;
+    size_t signaturesCompared;
+    size_t distanceComputations;
+    bool fellBackToScan;    // Table probes found fewer than k rows
+
+    LSHStats() : bucketsProbed(0), signaturesCompared(0), distanceComputations(0), fellBackToScan(false) {}
+};
+
+// Every row gets a signature of `words` 64-bit words:
+//   histogram, multi_histogram - one bit per bin, set if the bin is above its database mean
+//   other types                - signs of random Gaussian projections (centered on the
+//                                database mean, except cosine on normalized embeddings)
+// Candidates are ranked by Hamming distance and the best `rerank` of them are
+// compared with the same distance as CBIRSystem::query.
+class LSHIndex {
+private:
+    const std::vector<FeatureVector>* data;
+    FeatureType featureType;
+    bool cosine;
+    bool thresholded;
+    uint32_t dim;
+    uint32_t words;
+    uint32_t defaultRerank;
+    std::vector<float> projections;   // dim x (words * 64), projected types only
+    std::vector<float> offsets;       // Projection center or per-bin thresholds (dim)
+    std::vector<uint64_t> signatures; // rows x words
+
+    // Multi-probe tables: table t keeps its rows sorted by key in
+    // bucketRows[t * rows ...], bucket b spanning bucketStart[t][b, b + 1)
+    uint32_t numTables;
+    uint32_t keyBits;
+    uint32_t probeRadius;
+    std::vector<uint32_t> keyPositions;  // tables x keyBits signature bit positions
+    std::vector<uint32_t> bucketStart;   // tables x (2^keyBits + 1)
+    std::vector<uint32_t> bucketRows;    // tables x rows
+
+    float rowDistance(const FeatureVector& query, uint32_t row) const;
+    uint32_t tableKey(const uint64_t* signature, uint32_t table) const;
+    void buildTables(unsigned int seed, int numThreads);
+    std::vector<Neighbor> rerankCandidates(const FeatureVector& query, const std::vector<Neighbor>& candidates,
+                                           int k, LSHStats& stats) const;
+
+public:
+    LSHIndex();
+
+    // Compute signatures for all rows and build the tables.
+    // Returns 0 on success, -1 on error
+    int build(const std::vector<FeatureVector>& features, FeatureType type, bool isNormalized,
+              const LSHParams& params);
+
+    // Signature of a feature vector (words() 64-bit words written to out)
+    void signature(const FeatureVector& feature, uint64_t* out) const;
+
+    // Probe the tables (or scan every signature when there are none), then
+    // rerank the best `rerank` candidates exactly. rerank <= 0 uses the stored default
+    std::vector<Neighbor> search(const FeatureVector& query, int k, int rerank = 0,
+                                 LSHStats* stats = nullptr) const;
+
+    // Popcount prefilter over every signature followed by exact reranking
+    std::vector<Neighbor> scan(const FeatureVector& query, int k, int rerank = 0,
+                               LSHStats* stats = nullptr) const;
+
+    int save(const std::string& filename) const;
+
+    // Load an index and check it against the database it was built from
+    // (row count, dimension, feature type and normalization)
+    int load(const std::string& filename, const std::vector<FeatureVector>& features,
+             FeatureType type, bool isNormalized);
+
+    size_t size() const { return words > 0 ? signatures.size() / words : 0; }
+    uint32_t signatureBits() const { return words * 64; }
+    uint32_t tableCount() const { return numTables; }
+    size_t memoryBytes() const {
+        return signatures.size() * sizeof(uint64_t) + (projections.size() + offsets.size()) * sizeof(float) +
+               (keyPositions.size() + bucketStart.size() + bucketRows.size()) * sizeof(uint32_t);
+    }
+};
+
+#endif // LSH_H
@@ -0,0 +1,116 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Always-on pipeline metrics: per-stage timers and counters,
+           accumulated per thread and exported as JSON or Prometheus text.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include "trace.h"
+
+// Timed stages of the build and query pipelines
+enum class MetricStage {
+    SCAN_DIR,       // Listing the image directory tree
+    READ_FILE,      // Reading image bytes from disk
+    DECODE,         // Decoding them into pixels
+    EXTRACT,        // Feature extraction
+    DISTANCE_SCAN,  // Distance computations over the database
+    TOP_K,          // Final selection and ordering of the best rows
+    FORMAT,         // Building and printing or sending result lists
+    COUNT
+};
+
+enum class MetricCounter {
+    IMAGES_PROCESSED,  // Images read and extracted (database and targets)
+    IMAGES_FAILED,     // Images that could not be read, decoded or extracted
+    BYTES_READ,        // Image file bytes read
+    QUERIES,           // Targets answered by query() or queryBatch()
+    ROWS_SCANNED,      // Database rows compared against a target
+    ALLOCATIONS,       // Heap allocations (when the binary links metrics_alloc.o)
+    COUNT
+};
+
+static const int NUM_METRIC_STAGES = static_cast<int>(MetricStage::COUNT);
+static const int NUM_METRIC_COUNTERS = static_cast<int>(MetricCounter::COUNT);
+
+// Totals over every thread since start-up (or the last resetMetrics())
+struct MetricsSnapshot {
+    uint64_t stageCalls[NUM_METRIC_STAGES];
+    uint64_t stageNs[NUM_METRIC_STAGES];
+    uint64_t counters[NUM_METRIC_COUNTERS];
+    double uptimeSeconds;
+
+    MetricsSnapshot() : stageCalls(), stageNs(), counters(), uptimeSeconds(0.0) {}
+};
+
+// Each thread adds to its own block with plain relaxed stores, so recording
+// never contends; blocks of finished threads are folded into a shared total
+void recordStage(MetricStage stage, uint64_t ns);
+void addMetric(MetricCounter counter, uint64_t amount = 1);
+
+// Called by the operator new replacement in metrics_alloc.cpp
+void countAllocation();
+
+MetricsSnapshot metricsSnapshot();
+void resetMetrics();
+
+const char* metricStageName(MetricStage stage);
+const char* metricCounterName(MetricCounter counter);
+
+// compact = one line, e.g. for a server response
+void writeMetricsJSON(std::ostream& out, const MetricsSnapshot& snapshot, bool compact = false);
+void writeMetricsPrometheus(std::ostream& out, const MetricsSnapshot& snapshot);
+
+// Prometheus text for *.prom and *.txt files, JSON otherwise; "-" writes
+// JSON to stdout. Files are replaced atomically, so a scraper (e.g. the
+// node_exporter textfile collector) never sees a partial file.
+// Returns 0 on success, -1 on error
+int saveMetrics(const std::string& filename);
+
+// Times the enclosing scope as one call of a stage, and as a trace span
+// while tracing is on
+class ScopedStage {
+private:
+    MetricStage stage;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit ScopedStage(MetricStage s) : stage(s), start(std::chrono::steady_clock::now()) {}
+    ~ScopedStage() {
+        auto end = std::chrono::steady_clock::now();
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+        recordStage(stage, static_cast<uint64_t>(ns.count()));
+        if (tracingEnabled()) {
+            traceSpan(metricStageName(stage), "stage", start, end);
+        }
+    }
+
+    ScopedStage(const ScopedStage&) = delete;
+    ScopedStage& operator=(const ScopedStage&) = delete;
+};
+
+// Saves the metrics when it goes out of scope, so a tool exports them on
+// every return path; does nothing for an empty file name
+class MetricsExport {
+private:
+    std::string filename;
+
+public:
+    explicit MetricsExport(const std::string& file) : filename(file) {}
+    ~MetricsExport() {
+        if (!filename.empty()) {
+            saveMetrics(filename);
+        }
+    }
+
+    MetricsExport(const MetricsExport&) = delete;
+    MetricsExport& operator=(const MetricsExport&) = delete;
+};
+
+#endif // METRICS_H
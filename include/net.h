@@ -0,0 +1,68 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Small POSIX socket helpers and the line protocol shared by
+           cbir_server and the cbir_query client mode.
+*/
+
+#ifndef NET_H
+#define NET_H
+
+#include "cbir.h"
+#include <string>
+#include <vector>
+
+// Protocol (one request per line, UTF-8 text):
+//   QUERY <db> <n> <target path>   ->  OK <count>, then <count> lines "<distance>\t<path>"
+//                                      (a coordinator appends " partial=<k>" when k shards
+//                                      did not answer)
+//   STATS                          ->  OK <key>=<value> ...
+//   METRICS                        ->  OK <stage timers and counters as one-line JSON>
+//   PING                           ->  OK pong
+//   QUIT                           ->  connection closed
+// Errors are answered with a single "ERR <message>" line. The target path
+// is the rest of the line, so it may contain spaces.
+
+// Default Unix socket used when no address is given
+extern const char* DEFAULT_SERVER_SOCKET;
+
+// An address is either a Unix socket path or a localhost TCP port
+// ("8080" or "localhost:8080"). Returns a listening socket, or -1 on error
+int listenAddress(const std::string& address, int backlog = 64);
+
+// Connect to a server address, giving up after timeoutMs (negative waits
+// as long as the system does). Returns the socket, or -1 on error; errno is
+// ETIMEDOUT when the time ran out
+int connectAddress(const std::string& address, int timeoutMs = -1);
+
+// Read one '\n'-terminated line (without the newline). `pending` keeps bytes
+// read past the line for the next call. Returns false on EOF, error or when
+// no line arrives within timeoutMs (negative waits forever); errno is
+// ETIMEDOUT in the last case
+bool readLine(int fd, std::string& pending, std::string& line, int timeoutMs = -1);
+
+// Write the whole buffer. Returns false on error
+bool writeAll(int fd, const std::string& data);
+
+// Format a QUERY request / a successful query response
+std::string formatQueryRequest(const std::string& database, int topN, const std::string& targetImage);
+std::string formatQueryResponse(const std::vector<MatchResult>& results, int missingShards = 0);
+
+// How a remote query went, beyond its results
+struct RemoteQueryStatus {
+    bool timedOut;       // timeoutMs ran out while connecting or reading
+    int missingShards;   // Shards a coordinator reported as not answering
+    std::string error;
+
+    RemoteQueryStatus() : timedOut(false), missingShards(0) {}
+};
+
+// Send a query and read its results, giving up after timeoutMs (negative
+// waits forever); the whole exchange, connecting included, shares the
+// time. Returns 0 on success, -1 on error. The error message goes to
+// status->error if given, otherwise to std::cerr
+int remoteQuery(const std::string& address, const std::string& database, int topN,
+                const std::string& targetImage, std::vector<MatchResult>& results,
+                int timeoutMs = -1, RemoteQueryStatus* status = nullptr);
+
+#endif // NET_H
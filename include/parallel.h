@@ -0,0 +1,22 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Minimal thread helpers for parallel index construction and scans.
+*/
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <cstddef>
+#include <functional>
+
+// Number of hardware threads (at least 1); used when a caller passes 0 threads
+int defaultThreadCount();
+
+// Run body(begin, end, threadIndex) over [0, count) on numThreads threads.
+// Work is handed out in chunks of `grain` items so uneven items balance out.
+// numThreads <= 0 uses defaultThreadCount(); a single thread runs inline.
+void parallelFor(size_t count, int numThreads, size_t grain,
+                 const std::function<void(size_t, size_t, int)>& body);
+
+#endif // PARALLEL_H
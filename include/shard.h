@@ -0,0 +1,44 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Scatter-gather queries over database shards served by separate
+           cbir_server processes.
+*/
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "cbir.h"
+#include <string>
+#include <vector>
+
+enum class ShardStatus {
+    OK,
+    TIMEOUT,
+    FAILED
+};
+
+std::string shardStatusToString(ShardStatus status);
+
+// Outcome of one shard's part of a query
+struct ShardReport {
+    std::string address;
+    ShardStatus status;
+    double latencyMs;
+    size_t results;
+    int missingShards;   // Shards of its own a coordinator reported missing
+    std::string error;
+
+    ShardReport() : status(ShardStatus::FAILED), latencyMs(0.0), results(0), missingShards(0) {}
+};
+
+// Send the query to every shard in parallel and merge their top-N lists.
+// A shard that fails or has not answered within timeoutMs is left out and
+// the merged list is partial (as it is when a shard is itself a coordinator
+// that reports missing shards, see ShardReport::missingShards). Returns the
+// number of shards that answered, or -1 if none did
+int scatterGather(const std::vector<std::string>& shards, const std::string& database,
+                  const std::string& targetImage, int topN, int timeoutMs,
+                  std::vector<MatchResult>& results, std::vector<ShardReport>* reports = nullptr);
+
+#endif // SHARD_H
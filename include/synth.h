@@ -0,0 +1,83 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Deterministic synthetic images and DNN embeddings for benchmarks
+           and scale tests.
+*/
+
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <opencv2/opencv.hpp>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Colour distribution of the scenes
+enum class SynthPalette {
+    NATURAL,  // Blue, grey or sunset skies over green, brown or grey ground
+    RANDOM    // Uniform random sky, ground and blob colours
+};
+
+// Corpus parameters. Every image belongs to one of `scenes` scenes (sky and
+// ground colours, horizon, texture, a few blobs) and varies around it, so
+// images of a scene are each other's nearest neighbours under every feature
+// type. Image i is a pure function of (params, first, i), where first is the
+// first index generated in the same run: a near-duplicate only copies an
+// image at or after first, so its source is always part of the run
+struct SynthParams {
+    int width;
+    int height;
+    int scenes;
+    int embeddingDim;
+    unsigned int seed;
+    SynthPalette palette;
+    float textureStrength;   // Scales the ground texture; 0 = flat gradients
+    float duplicateRate;     // Fraction of images that are near-duplicates of an earlier one
+    int imagesPerDir;        // Images per leaf directory; 0 = one flat directory
+    std::string format;      // "jpg" or "png"
+    int jpegQuality;
+
+    SynthParams()
+        : width(320), height(240), scenes(64), embeddingDim(512), seed(42), palette(SynthPalette::RANDOM),
+          textureStrength(1.0f), duplicateRate(0.0f), imagesPerDir(0), format("jpg"), jpegQuality(90) {}
+};
+
+// File name of image `index`, e.g. synth00000042.jpg
+std::string synthImageName(size_t index, const std::string& extension = "jpg");
+
+// Path of image `index` relative to the corpus root: the file name, under
+// <leaf / 1000>/<leaf % 1000>/ (leaf = index / imagesPerDir) when the
+// corpus is sharded into directories
+std::string synthImagePath(const SynthParams& params, size_t index);
+
+// Image in [first, index) that `index` is a near-duplicate of, or -1 for an
+// original image
+long long synthDuplicateOf(const SynthParams& params, size_t index, size_t first = 0);
+
+// Scene that image `index` belongs to (a near-duplicate shares its source's)
+int synthSceneOf(const SynthParams& params, size_t index, size_t first = 0);
+
+// Render image `index` as an 8-bit BGR image of params.width x params.height
+void renderSynthImage(const SynthParams& params, size_t index, cv::Mat& image, size_t first = 0);
+
+// Embedding of image `index`: its scene's direction plus per-image noise
+// (much less noise for a near-duplicate, around its source's embedding)
+void synthEmbedding(const SynthParams& params, size_t index, std::vector<float>& embedding,
+                    size_t first = 0);
+
+// One line listing every parameter, to tell whether an existing corpus
+// was generated with the same settings
+std::string describeSynthParams(const SynthParams& params);
+
+// Write images [first, first + count) into dir (created if missing) on
+// numThreads threads (0 = all cores), plus <dir>/manifest.csv with each
+// image's scene and duplicate source. When embeddingsCsv is not empty the
+// embeddings are written there in the DNN CSV format (filename,v1,...,vN).
+// progress(done, count) is called from one thread as images are written.
+// Returns the number of images written, or -1 on error
+int writeSynthCorpus(const std::string& dir, size_t first, size_t count, const SynthParams& params,
+                     const std::string& embeddingsCsv, int numThreads = 0,
+                     const std::function<void(size_t, size_t)>& progress = nullptr);
+
+#endif // SYNTH_H
@@ -0,0 +1,138 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Result thumbnails: reduced-scale decoding, a packed on-disk
+           thumbnail file and a background loader for the GUI.
+*/
+
+#ifndef THUMBNAIL_H
+#define THUMBNAIL_H
+
+#include "lru_cache.h"
+#include <opencv2/opencv.hpp>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Box a thumbnail fits in, keeping the image's aspect ratio (the GUI's
+// result cell)
+static const int THUMBNAIL_WIDTH = 180;
+static const int THUMBNAIL_HEIGHT = 120;
+
+// Decode an image file straight to thumbnail size. JPEGs are scaled by 1/2,
+// 1/4 or 1/8 inside the decoder, so the full-size pixels are never built;
+// the rest is an area resize. Returns 0 on success, -1 on error
+int makeThumbnail(const std::string& path, cv::Mat& thumbnail);
+
+// Packed thumbnail file (<features.csv>.thumbs): JPEG thumbnails keyed by
+// image path, each stored with its image's mtime and size so a changed
+// image is made again. Records are only appended; a later record for a
+// path replaces the earlier one, and a truncated last record (an
+// interrupted write) is ignored. Thread-safe
+class ThumbnailCache {
+private:
+    struct Entry {
+        uint64_t offset;   // Of the JPEG bytes
+        uint32_t length;
+        int64_t mtime;
+        int64_t size;
+    };
+
+    mutable std::mutex lock;
+    std::string filename;
+    std::fstream file;
+    uint64_t fileEnd;
+    std::unordered_map<std::string, Entry> index;
+
+public:
+    ThumbnailCache();
+    ~ThumbnailCache();
+
+    // Open (or create) a thumbnail file and read its index; a file made
+    // for a different thumbnail size is started again.
+    // Returns the number of thumbnails, or -1 on error
+    int open(const std::string& path);
+    void close();
+
+    bool isOpen() const;
+    std::string getFilename() const;
+    size_t size() const;
+
+    // Stored thumbnail of an image, if the image is unchanged since
+    bool get(const std::string& path, cv::Mat& thumbnail);
+
+    // Append a thumbnail of an image. Returns 0 on success, -1 on error
+    int put(const std::string& path, const cv::Mat& thumbnail);
+
+    // Stored thumbnail, or a new one that is made and stored.
+    // Returns 0 on success, -1 if the image cannot be read
+    int fetch(const std::string& path, cv::Mat& thumbnail);
+
+    // Make and store thumbnails of every path that has none on numThreads
+    // threads (0 = all hardware threads). Returns the number made, or -1
+    // if the file is not open
+    int addImages(const std::vector<std::string>& paths, int numThreads);
+};
+
+// A finished thumbnail; image is empty when the file could not be read
+struct ThumbnailResult {
+    uint64_t generation;
+    size_t index;
+    cv::Mat image;
+};
+
+// Makes thumbnails on background threads. request() replaces whatever is
+// still queued, and the render thread collect()s the results in small
+// batches, so a new query never waits for the previous one's images.
+// Recent thumbnails are also kept in memory (keyed by path, mtime and size)
+class ThumbnailLoader {
+private:
+    struct Request {
+        uint64_t generation;
+        size_t index;
+        std::string path;
+    };
+
+    ThumbnailCache diskCache;
+    LRUCache<std::string, cv::Mat> memoryCache;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<Request> queue;
+    std::deque<ThumbnailResult> finished;
+    uint64_t generation;
+    bool stopping;
+    std::vector<std::thread> workers;
+
+    void workerLoop();
+
+public:
+    // numThreads = 0 uses all hardware threads; memoryEntries thumbnails
+    // stay decoded in memory
+    explicit ThumbnailLoader(int numThreads = 0, size_t memoryEntries = 512);
+    ~ThumbnailLoader();
+
+    ThumbnailCache& cache() { return diskCache; }
+
+    // Queue thumbnails of paths (result i is paths[i]) in place of any
+    // queued before. Returns the generation their results carry
+    uint64_t request(const std::vector<std::string>& paths);
+
+    // Drop queued requests and unclaimed results
+    void cancel();
+
+    // Move up to maxResults finished thumbnails of the latest request into
+    // out. Returns the number moved
+    size_t collect(std::vector<ThumbnailResult>& out, size_t maxResults);
+
+    ThumbnailLoader(const ThumbnailLoader&) = delete;
+    ThumbnailLoader& operator=(const ThumbnailLoader&) = delete;
+};
+
+#endif // THUMBNAIL_H
@@ -0,0 +1,79 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Bounded top-K selection shared by the exact scan and the search indexes.
+*/
+
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// A database row and its distance to the query
+struct Neighbor {
+    float distance;
+    uint32_t id;
+
+    Neighbor() : distance(0.0f), id(0) {}
+    Neighbor(float dist, uint32_t row) : distance(dist), id(row) {}
+
+    // Ties are broken by row so every search mode orders results identically
+    bool operator<(const Neighbor& other) const {
+        if (distance != other.distance) {
+            return distance < other.distance;
+        }
+        return id < other.id;
+    }
+};
+
+// Keeps the K smallest neighbors seen so far in a max-heap
+class TopK {
+private:
+    size_t k;
+    std::vector<Neighbor> heap;
+
+public:
+    explicit TopK(size_t capacity) : k(capacity) { heap.reserve(capacity + 1); }
+
+    size_t size() const { return heap.size(); }
+    size_t capacity() const { return k; }
+    bool full() const { return heap.size() >= k; }
+
+    // Current K-th best distance; infinity until K neighbors have been seen
+    float bound() const {
+        return full() && k > 0 ? heap.front().distance : std::numeric_limits<float>::infinity();
+    }
+
+    // Returns true if the neighbor was kept
+    bool push(float distance, uint32_t id) {
+        if (k == 0) {
+            return false;
+        }
+        Neighbor n(distance, id);
+        if (!full()) {
+            heap.push_back(n);
+            std::push_heap(heap.begin(), heap.end());
+            return true;
+        }
+        if (!(n < heap.front())) {
+            return false;
+        }
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = n;
+        std::push_heap(heap.begin(), heap.end());
+        return true;
+    }
+
+    // Sorted ascending by distance; empties the heap
+    std::vector<Neighbor> take() {
+        std::sort_heap(heap.begin(), heap.end());
+        std::vector<Neighbor> result;
+        result.swap(heap);
+        return result;
+    }
+};
+
+#endif // TOPK_H
@@ -0,0 +1,97 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Optional timeline tracing: scoped spans recorded into per-thread
+           ring buffers and written as Chrome trace JSON (chrome://tracing,
+           ui.perfetto.dev).
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+// Set by startTracing(); every span checks it first, so tracing costs one
+// relaxed load per span while it is off
+extern std::atomic<bool> g_tracingEnabled;
+
+inline bool tracingEnabled() {
+    return g_tracingEnabled.load(std::memory_order_relaxed);
+}
+
+// Start recording, keeping the last eventsPerThread spans of each thread.
+// Discards earlier events, so call it before the traced work starts
+void startTracing(size_t eventsPerThread = 1 << 15);
+void stopTracing();
+
+// Name the calling thread in the trace (default "thread <n>")
+void setTraceThreadName(const std::string& name);
+
+// Record one finished span on the calling thread. name and category must
+// be string literals (only the pointer is stored); detail is copied and
+// truncated to 47 characters
+void traceSpan(const char* name, const char* category, std::chrono::steady_clock::time_point start,
+               std::chrono::steady_clock::time_point end, const char* detail = nullptr);
+
+// Write every recorded span as Chrome trace JSON. Call once the traced work
+// has finished: a thread still recording may overwrite the span being
+// written. Returns 0 on success, -1 on error
+int writeTrace(const std::string& filename);
+
+// Times the enclosing scope as one span; does nothing while tracing is off.
+// The detail string must outlive the span
+class TraceSpan {
+private:
+    const char* name;
+    const char* category;
+    const char* detail;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    TraceSpan(const char* spanName, const char* spanCategory, const char* spanDetail = nullptr)
+        : name(spanName), category(spanCategory), detail(spanDetail), active(tracingEnabled()) {
+        if (active) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+    TraceSpan(const char* spanName, const char* spanCategory, const std::string& spanDetail)
+        : TraceSpan(spanName, spanCategory, spanDetail.c_str()) {}
+
+    ~TraceSpan() {
+        if (active) {
+            traceSpan(name, category, start, std::chrono::steady_clock::now(), detail);
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+// Starts tracing when given a file name and writes the trace there when it
+// goes out of scope, so a tool writes it on every return path
+class TraceExport {
+private:
+    std::string filename;
+
+public:
+    explicit TraceExport(const std::string& file) : filename(file) {
+        if (!filename.empty()) {
+            startTracing();
+        }
+    }
+    ~TraceExport() {
+        if (!filename.empty()) {
+            stopTracing();
+            writeTrace(filename);
+        }
+    }
+
+    TraceExport(const TraceExport&) = delete;
+    TraceExport& operator=(const TraceExport&) = delete;
+};
+
+#endif // TRACE_H
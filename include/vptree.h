@@ -0,0 +1,100 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Vantage-point tree for exact k-NN and range search over
+           L2-based feature databases.
+*/
+
+#ifndef VPTREE_H
+#define VPTREE_H
+
+#include "feature.h"
+#include "topk.h"
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+// Work counters for one tree search
+struct VPTreeStats {
+    size_t nodesVisited;
+    size_t distanceComputations;
+
+    VPTreeStats() : nodesVisited(0), distanceComputations(0) {}
+};
+
+// Vantage-point tree. Each internal node splits its rows at the median
+// distance from a vantage row; subtrees that cannot contain a closer row
+// are skipped using the triangle inequality, so results are exact.
+//
+// Supported feature types (distances match CBIRSystem::query):
+//   baseline       - SSD, searched as L2 = sqrt(SSD)
+//   dnn_embedding  - 1 - cos on normalized vectors, searched as sqrt(2 (1 - cos))
+class VPTree {
+private:
+    struct Node {
+        uint32_t vantage;   // Vantage row (internal nodes)
+        float radius;       // Median metric distance from the vantage row
+        int32_t inside;     // Child holding rows with distance <= radius
+        int32_t outside;    // Child holding rows with distance >= radius (ties
+                            // with the median, and the median row, go here)
+        uint32_t begin;     // Leaf rows are items[begin, end)
+        uint32_t end;
+
+        bool isLeaf() const { return inside < 0 && outside < 0; }
+    };
+
+    const std::vector<FeatureVector>* data;
+    FeatureType featureType;
+    bool cosine;
+    uint32_t leafSize;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> items;
+    int32_t root;
+
+    // Distance reported to callers (same value as the exact scan)
+    float rowDistance(const FeatureVector& query, uint32_t row) const;
+    // Metric distance used for pruning, derived from rowDistance
+    float toMetric(float distance) const;
+
+    int32_t buildNode(uint32_t begin, uint32_t end, std::vector<Node>& out,
+                      int parallelDepth, std::mt19937& rng);
+    void searchNode(int32_t node, const FeatureVector& query, TopK& top, VPTreeStats& stats) const;
+    bool rangeNode(int32_t node, const FeatureVector& query, float metricRadius, float radius,
+                   const std::function<bool(const Neighbor&)>& visit, VPTreeStats& stats) const;
+
+public:
+    VPTree();
+
+    // Build over all features. numThreads <= 0 uses all hardware threads.
+    // Returns 0 on success, -1 on error or unsupported feature type
+    int build(const std::vector<FeatureVector>& features, FeatureType type, bool isNormalized,
+              int numThreads = 0, uint32_t leafRows = 8, unsigned int seed = 42);
+
+    // Exact k nearest neighbours, sorted by distance
+    std::vector<Neighbor> search(const FeatureVector& query, int k, VPTreeStats* stats = nullptr) const;
+
+    // Every row whose distance is <= radius, sorted by distance
+    std::vector<Neighbor> rangeSearch(const FeatureVector& query, float radius,
+                                      VPTreeStats* stats = nullptr) const;
+
+    // Pass every row whose distance is <= radius to visit, in tree order and
+    // without collecting them, until visit returns false. Returns false if
+    // the walk was stopped early
+    bool rangeVisit(const FeatureVector& query, float radius,
+                    const std::function<bool(const Neighbor&)>& visit, VPTreeStats* stats = nullptr) const;
+
+    int save(const std::string& filename) const;
+
+    // Load a tree and check it against the database it was built from
+    // (row count, dimension, feature type and normalization)
+    int load(const std::string& filename, const std::vector<FeatureVector>& features,
+             FeatureType type, bool isNormalized);
+
+    size_t size() const { return items.size(); }
+    size_t nodeCount() const { return nodes.size(); }
+    size_t memoryBytes() const { return nodes.size() * sizeof(Node) + items.size() * sizeof(uint32_t); }
+};
+
+#endif // VPTREE_H
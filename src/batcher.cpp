@@ -0,0 +1,133 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Query batching implementation.
+*/
+
+#include "batcher.h"
+#include "parallel.h"
+#include <algorithm>
+
+QueryBatcher::QueryBatcher(const BatchParams& batchParams)
+    : params(batchParams), stopping(false), batchCount(0), queryCount(0), largest(0) {
+    params.maxBatch = std::max(1, params.maxBatch);
+    params.windowMs = std::max(0.0, params.windowMs);
+    int threads = params.numExecutors > 0 ? params.numExecutors : defaultThreadCount();
+    for (int i = 0; i < threads; i++) {
+        executors.push_back(std::thread(&QueryBatcher::executorLoop, this));
+    }
+}
+
+QueryBatcher::~QueryBatcher() {
+    stop();
+}
+
+std::future<std::vector<MatchResult>> QueryBatcher::submit(CBIRSystem* system, const FeatureVector& target,
+                                                           int topN) {
+    Request request;
+    request.system = system;
+    request.target = target;
+    request.topN = topN;
+    request.submitted = Clock::now();
+    std::future<std::vector<MatchResult>> result = request.promise.get_future();
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(std::move(request));
+    }
+    changed.notify_all();
+    return result;
+}
+
+size_t QueryBatcher::queuedFor(const CBIRSystem* system) const {
+    size_t count = 0;
+    for (const auto& r : queue) {
+        count += (r.system == system);
+    }
+    return count;
+}
+
+void QueryBatcher::executorLoop() {
+    while (true) {
+        std::vector<Request> batch;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;  // Stopping with nothing left to answer
+            }
+
+            // A lone request is answered straight away. Once requests queue
+            // up (the executors are behind), wait for company until the
+            // oldest request's window closes; a stop answers whatever is
+            // queued straight away
+            CBIRSystem* system = queue.front().system;
+            Clock::time_point oldest = queue.front().submitted;
+            auto deadline = oldest + std::chrono::duration_cast<Clock::duration>(
+                                         std::chrono::duration<double, std::milli>(params.windowMs));
+            auto frontChanged = [&]() {
+                return queue.empty() || queue.front().system != system || queue.front().submitted != oldest;
+            };
+            if (queuedFor(system) > 1) {
+                changed.wait_until(guard, deadline, [&]() {
+                    return stopping || frontChanged() || queuedFor(system) >= static_cast<size_t>(params.maxBatch);
+                });
+            }
+            if (frontChanged()) {
+                continue;  // Another executor took the batch
+            }
+
+            for (auto it = queue.begin(); it != queue.end() && batch.size() < static_cast<size_t>(params.maxBatch);) {
+                if (it->system == system) {
+                    batch.push_back(std::move(*it));
+                    it = queue.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+
+            batchCount++;
+            queryCount += batch.size();
+            largest = std::max(largest, batch.size());
+        }
+
+        auto start = Clock::now();
+        std::vector<FeatureVector> targets;
+        std::vector<int> topN;
+        for (auto& r : batch) {
+            queueDelay.record(std::chrono::duration<double, std::milli>(start - r.submitted).count());
+            targets.push_back(std::move(r.target));
+            topN.push_back(r.topN);
+        }
+
+        std::vector<std::vector<MatchResult>> results = batch[0].system->queryBatch(targets, topN);
+        for (size_t i = 0; i < batch.size(); i++) {
+            batch[i].promise.set_value(std::move(results[i]));
+        }
+    }
+}
+
+void QueryBatcher::stop() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (auto& executor : executors) {
+        executor.join();
+    }
+    executors.clear();
+}
+
+BatchStats QueryBatcher::stats() {
+    BatchStats s;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        s.batches = batchCount;
+        s.queries = queryCount;
+        s.largestBatch = largest;
+    }
+    s.queueP50Ms = queueDelay.percentile(50.0);
+    s.queueP99Ms = queueDelay.percentile(99.0);
+    return s;
+}
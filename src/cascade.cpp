@@ -0,0 +1,114 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Multi-stage cascade retrieval implementation.
+*/
+
+#include "cascade.h"
+#include <chrono>
+#include <iostream>
+#include <unordered_set>
+
+// Stages may index the same images under different directories, so
+// candidates are compared by filename only
+static std::string baseName(const std::string& path) {
+    size_t pos = path.find_last_of("/\\");
+    return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+static float recallByFilename(const std::vector<MatchResult>& exact, const std::vector<MatchResult>& kept) {
+    if (exact.empty()) {
+        return 1.0f;
+    }
+
+    std::unordered_set<std::string> names;
+    for (const auto& m : kept) {
+        names.insert(baseName(m.imagePath));
+    }
+
+    int hits = 0;
+    for (const auto& e : exact) {
+        if (names.count(baseName(e.imagePath))) {
+            hits++;
+        }
+    }
+    return static_cast<float>(hits) / exact.size();
+}
+
+int cascadeQuery(const std::string& targetImage, const std::vector<CascadeStage>& stages, int topN,
+                 std::vector<MatchResult>& results, std::vector<CascadeStageStats>* stats,
+                 bool measureRecall) {
+    results.clear();
+    if (stages.empty()) {
+        std::cerr << "Error: Cascade query needs at least one stage" << std::endl;
+        return -1;
+    }
+
+    std::vector<CascadeStageStats> stageStats(stages.size());
+    std::vector<std::vector<MatchResult>> stageOutputs(stages.size());
+
+    for (size_t s = 0; s < stages.size(); s++) {
+        CBIRSystem* system = stages[s].system;
+        if (system == nullptr || system->getDatabaseSize() == 0) {
+            std::cerr << "Error: Cascade stage " << s + 1 << " has no database" << std::endl;
+            return -1;
+        }
+
+        bool last = (s + 1 == stages.size());
+        int keep = last ? topN : stages[s].candidates;
+        CascadeStageStats& st = stageStats[s];
+        st.featureType = system->getFeatureType();
+
+        auto start = std::chrono::steady_clock::now();
+
+        FeatureVector target;
+        if (system->extractTargetFeature(targetImage, target) != 0) {
+            return -1;
+        }
+
+        if (s == 0) {
+            stageOutputs[s] = system->query(target, keep);
+            st.rowsCompared = system->getDatabaseSize();
+        } else {
+            // Join the previous stage's candidates to this database by filename
+            std::vector<size_t> rows;
+            rows.reserve(stageOutputs[s - 1].size());
+            for (const auto& m : stageOutputs[s - 1]) {
+                int row = system->findImage(m.imagePath);
+                if (row < 0) {
+                    st.missingImages++;
+                    continue;
+                }
+                rows.push_back(static_cast<size_t>(row));
+            }
+            stageOutputs[s] = system->queryRows(target, rows, keep);
+            st.rowsCompared = rows.size();
+        }
+
+        st.latencyMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        st.candidatesOut = stageOutputs[s].size();
+
+        if (st.missingImages > 0) {
+            std::cerr << "Warning: " << st.missingImages << " candidates from stage " << s
+                      << " are missing from stage " << s + 1 << "'s database" << std::endl;
+        }
+    }
+
+    results = stageOutputs.back();
+
+    if (measureRecall) {
+        CBIRSystem* last = stages.back().system;
+        FeatureVector target;
+        if (last->extractTargetFeature(targetImage, target) == 0) {
+            std::vector<MatchResult> exact = last->query(target, topN);
+            for (size_t s = 0; s < stages.size(); s++) {
+                stageStats[s].recall = recallByFilename(exact, stageOutputs[s]);
+            }
+        }
+    }
+
+    if (stats != nullptr) {
+        *stats = stageStats;
+    }
+    return 0;
+}
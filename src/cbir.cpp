@@ -5,22 +5,205 @@
 */
 
 #include "cbir.h"
+#include "knngraph.h"
+#include "metrics.h"
+#include "parallel.h"
 #include <dirent.h>
 #include <sys/stat.h>
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <numeric>
 #include <sstream>
 
-CBIRSystem::CBIRSystem() : currentFeatureType(FeatureType::BASELINE) {}
+// Dimensions summed between early-abandon bound checks
+static const size_t EARLY_ABANDON_BLOCK = 16;
+
+// Relative slack on histogram pyramid bounds. An intersection is a float sum
+// of non-negative bins, so its rounding error grows with the sum itself and a
+// coarse bound may undershoot the true value by that much
+static const float PYRAMID_SLACK = 1e-4f;
+
+// Largest bound that may still reach a distance at or under limit
+static float pyramidLimit(float limit) {
+    return limit + PYRAMID_SLACK * std::fabs(limit);
+}
+
+// Feature bytes per block in queryBatch(); small enough that a block stays
+// in L2 cache while every query in the batch visits it
+static const size_t BATCH_BLOCK_BYTES = 256 * 1024;
+
+// Rows per distance block in exactScan(); the scan and the top-N selection
+// are timed once per block
+static const size_t SCAN_BLOCK_ROWS = 256;
+
+// Default cache sizes in entries
+static const size_t FEATURE_CACHE_ENTRIES = 1024;
+static const size_t RESULT_CACHE_ENTRIES = 256;
+
+// Memory estimates: overhead of a hash map node (next pointer and cached
+// hash), and of a feature cache key (type, mtime, size and path)
+static const size_t HASH_NODE_BYTES = 2 * sizeof(void*);
+static const size_t FEATURE_CACHE_KEY_BYTES = 128;
+
+// Content hash: 64-bit multiply-xorshift over 8-byte words, length mixed in
+// last. hashBytes() may be called on consecutive chunks whose sizes are
+// multiples of 8, so a streamed file hashes like the same bytes in memory
+static const uint64_t HASH_PRIME = 0x9E3779B97F4A7C15ULL;
+static const uint64_t HASH_SEED = 0x2545F4914F6CDD1DULL;
+
+static uint64_t hashBytes(uint64_t h, const char* data, size_t count) {
+    size_t words = count / 8;
+    for (size_t w = 0; w < words; w++) {
+        uint64_t v;
+        std::memcpy(&v, data + w * 8, 8);
+        h = (h ^ (v * HASH_PRIME)) * HASH_PRIME;
+        h ^= h >> 29;
+    }
+    if (count % 8 != 0) {
+        uint64_t v = 0;
+        std::memcpy(&v, data + words * 8, count % 8);
+        h = (h ^ (v * HASH_PRIME)) * HASH_PRIME;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static uint64_t finishHash(uint64_t h, uint64_t length) {
+    h ^= length * HASH_PRIME;
+    h ^= h >> 32;
+    h *= HASH_PRIME;
+    h ^= h >> 29;
+    // 0 marks an unknown hash
+    return h != 0 ? h : 1;
+}
+
+static uint64_t bufferContentHash(const std::vector<uchar>& bytes) {
+    return finishHash(hashBytes(HASH_SEED, reinterpret_cast<const char*>(bytes.data()), bytes.size()),
+                      bytes.size());
+}
+
+// Whole file into memory, so it is read once for both hashing and decoding
+static int readImageBytes(const std::string& path, std::vector<uchar>& bytes) {
+    ScopedStage timer(MetricStage::READ_FILE);
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        return -1;
+    }
+    std::streamoff size = file.tellg();
+    if (size <= 0) {
+        return -1;
+    }
+    bytes.resize(static_cast<size_t>(size));
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char*>(bytes.data()), size)) {
+        return -1;
+    }
+    addMetric(MetricCounter::BYTES_READ, bytes.size());
+    return 0;
+}
+
+static int decodeImage(const std::vector<uchar>& bytes, cv::Mat& image) {
+    ScopedStage timer(MetricStage::DECODE);
+    image = cv::imdecode(bytes, cv::IMREAD_COLOR);
+    return image.empty() ? -1 : 0;
+}
+
+static uint64_t nanosecondsSince(std::chrono::steady_clock::time_point& mark) {
+    auto now = std::chrono::steady_clock::now();
+    uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - mark).count());
+    mark = now;
+    return ns;
+}
+
+// Heap bytes of a string with this capacity; libstdc++ keeps up to 15
+// characters inside the object
+static size_t stringHeapBytes(size_t capacity) {
+    return capacity > 15 ? capacity + 1 : 0;
+}
+
+static double megabytes(size_t bytes) {
+    return bytes / (1024.0 * 1024.0);
+}
+
+// Floats per row in the histogram pyramid (see buildHistogramPyramid())
+static size_t pyramidFloats(size_t dim) {
+    int bins = static_cast<int>(std::round(std::cbrt(static_cast<double>(dim))));
+    if (static_cast<size_t>(bins) * bins * bins != dim || bins < 4 || bins % 2 != 0) {
+        return 0;
+    }
+    size_t floats = 0;
+    for (int b = bins / 2; b >= 2; b /= 2) {
+        floats += static_cast<size_t>(b) * b * b;
+        if (b % 2 != 0) {
+            break;
+        }
+    }
+    return floats;
+}
+
+// Estimated heap bytes of one database row, counted as getMemoryStats() does
+static size_t estimateRowBytes(size_t dim, size_t pathLength, FeatureType type, bool compact) {
+    size_t path = sizeof(std::string) + stringHeapBytes(pathLength);
+    size_t bytes = sizeof(FeatureVector) + dim * sizeof(float);            // Feature
+    bytes += path;                                                         // imagePaths
+    bytes += path + sizeof(size_t) + HASH_NODE_BYTES + sizeof(void*);      // nameIndex
+    if (!compact) {
+        bytes += stringHeapBytes(pathLength);                              // Feature's path copy
+        bytes += 4 * sizeof(uint64_t) + HASH_NODE_BYTES + sizeof(void*);   // Content hash, size and lookup
+        if (type == FeatureType::HISTOGRAM) {
+            bytes += pyramidFloats(dim) * sizeof(float);
+        }
+    }
+    return bytes;
+}
+
+// Estimated bytes of a full target feature cache
+static size_t estimateCacheBytes(size_t entries, size_t dim) {
+    return entries * (sizeof(FeatureVector) + dim * sizeof(float) + FEATURE_CACHE_KEY_BYTES);
+}
+
+// One trace span for a block of database rows compared against a target
+static void traceScanBlock(const char* name, std::chrono::steady_clock::time_point start,
+                           std::chrono::steady_clock::time_point end, size_t beginRow, size_t endRow) {
+    char detail[48];
+    std::snprintf(detail, sizeof(detail), "rows %zu-%zu", beginRow, endRow);
+    traceSpan(name, "query", start, end, detail);
+}
+
+CBIRSystem::CBIRSystem()
+    : relativePaths(false), currentFeatureType(FeatureType::BASELINE), featuresNormalized(false), dbVersion(0),
+      featureCache(FEATURE_CACHE_ENTRIES), resultCache(RESULT_CACHE_ENTRIES), storedTargetCount(0),
+      neighborGraph(nullptr), memoryBudget(0), compactRows(false),
+      fullFeatureCacheEntries(FEATURE_CACHE_ENTRIES), peakDecodeBytes(0) {}
 
 CBIRSystem::~CBIRSystem() {}
 
 void CBIRSystem::setDNNCsvPath(const std::string& path) {
     dnnCsvPath = path;
+    featureCache.clear();
 }
 
-std::string CBIRSystem::getFilename(const std::string& path) {
+// Absolute form of a path (unchanged if the working directory is unknown)
+static std::string absolutePath(const std::string& path) {
+    std::error_code error;
+    std::filesystem::path absolute = std::filesystem::absolute(path, error);
+    return error ? path : absolute.string();
+}
+
+// True when two paths name the same file location (compared lexically)
+static bool samePath(const std::string& a, const std::string& b) {
+    return normalizePath(absolutePath(a)) == normalizePath(absolutePath(b));
+}
+
+std::string CBIRSystem::getFilename(const std::string& path) const {
     size_t lastSlash = path.find_last_of("/\\");
     if (lastSlash != std::string::npos) {
         return path.substr(lastSlash + 1);
@@ -28,6 +211,293 @@ std::string CBIRSystem::getFilename(const std::string& path) {
     return path;
 }
 
+void CBIRSystem::clearDerivedData() {
+    nameIndex.clear();
+    hashIndex.clear();
+    varianceOrder.clear();
+    histogramPyramid.clear();
+    pyramidBins.clear();
+    featuresNormalized = false;
+    neighborGraph = nullptr;
+
+    // Cached features and results may refer to the old rows
+    dbVersion++;
+    clearCaches();
+}
+
+void CBIRSystem::buildNameIndex() {
+    nameIndex.clear();
+    nameIndex.reserve(imagePaths.size());
+    for (size_t i = 0; i < imagePaths.size(); i++) {
+        nameIndex[indexKey(imagePaths[i])] = i;
+    }
+
+    hashIndex.clear();
+    if (contentHashes.size() == imagePaths.size() && contentSizes.size() == imagePaths.size()) {
+        for (size_t i = 0; i < contentHashes.size(); i++) {
+            if (contentHashes[i] != 0) {
+                hashIndex.insert(std::make_pair(contentHashes[i], i));
+            }
+        }
+    }
+}
+
+std::vector<size_t> CBIRSystem::findExactDuplicates(const std::string& imagePath) const {
+    uint64_t hash = 0, size = 0;
+    if (hashIndex.empty() || fileContentHash(imagePath, hash, size) != 0) {
+        return std::vector<size_t>();
+    }
+    return rowsWithHash(hash, size);
+}
+
+std::vector<size_t> CBIRSystem::rowsWithHash(uint64_t hash, uint64_t size) const {
+    // A 64-bit hash alone may collide; files of another size never match
+    std::vector<size_t> rows;
+    auto range = hashIndex.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (contentSizes[it->second] == size) {
+            rows.push_back(it->second);
+        }
+    }
+    std::sort(rows.begin(), rows.end());
+    return rows;
+}
+
+int CBIRSystem::findStoredTarget(const std::string& targetImage) const {
+    int row = findImage(targetImage);
+    if (row < 0) {
+        return -1;
+    }
+    // DNN embeddings are looked up by filename in any case
+    if (currentFeatureType == FeatureType::DNN_EMBEDDING) {
+        return row;
+    }
+    // Built databases must match the full path, and so must loaded ones
+    // when their image directory is known
+    if (!relativePaths) {
+        return samePath(imagePaths[row], targetImage) ? row : -1;
+    }
+    if (!imageRoot.empty()) {
+        return samePath(imageRoot + "/" + imagePaths[row], targetImage) ? row : -1;
+    }
+    // Otherwise only the tail of the path matched, so the file must also
+    // have the row's hash and size (still far cheaper than decoding it)
+    uint64_t hash = 0, size = 0;
+    if (static_cast<size_t>(row) < contentHashes.size() && contentHashes[row] != 0 &&
+        fileContentHash(targetImage, hash, size) == 0 && hash == contentHashes[row] &&
+        size == contentSizes[row]) {
+        return row;
+    }
+    return -1;
+}
+
+std::string CBIRSystem::featureCacheKey(const std::string& targetImage) const {
+    // Path plus modification time and size, so an edited file misses
+    struct stat info;
+    long long mtime = -1, bytes = -1;
+    if (stat(targetImage.c_str(), &info) == 0) {
+        mtime = static_cast<long long>(info.st_mtime);
+        bytes = static_cast<long long>(info.st_size);
+    }
+
+    // Spellings of one path (./x.jpg, a/../x.jpg) share an entry
+    std::ostringstream key;
+    key << static_cast<int>(currentFeatureType) << '|' << mtime << '|' << bytes << '|'
+        << normalizePath(absolutePath(targetImage));
+    return key.str();
+}
+
+std::string CBIRSystem::resultCacheKey(const FeatureVector& target, int topN) const {
+    // The raw feature bytes make the key exact; no hash collisions to verify
+    std::string key;
+    key.reserve(sizeof(uint64_t) + sizeof(int) + target.size() * sizeof(float));
+    key.append(reinterpret_cast<const char*>(&dbVersion), sizeof(dbVersion));
+    key.append(reinterpret_cast<const char*>(&topN), sizeof(topN));
+    key.append(reinterpret_cast<const char*>(target.data.data()), target.size() * sizeof(float));
+    return key;
+}
+
+void CBIRSystem::setCacheCapacity(size_t featureEntries, size_t resultEntries) {
+    if (compactRows) {
+        fullFeatureCacheEntries = featureEntries;
+    } else {
+        featureCache.setCapacity(featureEntries);
+    }
+    resultCache.setCapacity(resultEntries);
+}
+
+void CBIRSystem::clearCaches() {
+    featureCache.clear();
+    resultCache.clear();
+}
+
+CacheStats CBIRSystem::getCacheStats() const {
+    CacheStats stats;
+    stats.storedTargets = storedTargetCount;
+    stats.featureHits = featureCache.hits();
+    stats.featureMisses = featureCache.misses();
+    stats.resultHits = resultCache.hits();
+    stats.resultMisses = resultCache.misses();
+    return stats;
+}
+
+MemoryStats CBIRSystem::getMemoryStats() const {
+    MemoryStats stats;
+    stats.featureBytes = features.capacity() * sizeof(FeatureVector);
+    for (const auto& f : features) {
+        stats.featureBytes += f.data.capacity() * sizeof(float) + stringHeapBytes(f.imagePath.capacity());
+    }
+
+    stats.pathBytes = imagePaths.capacity() * sizeof(std::string) + nameIndex.bucket_count() * sizeof(void*);
+    for (const auto& path : imagePaths) {
+        stats.pathBytes += stringHeapBytes(path.capacity());
+    }
+    for (const auto& entry : nameIndex) {
+        stats.pathBytes += sizeof(entry) + stringHeapBytes(entry.first.capacity()) + HASH_NODE_BYTES;
+    }
+
+    stats.indexBytes = (contentHashes.capacity() + contentSizes.capacity()) * sizeof(uint64_t) +
+                       varianceOrder.capacity() * sizeof(uint32_t) +
+                       hashIndex.bucket_count() * sizeof(void*) +
+                       hashIndex.size() * (sizeof(std::pair<const uint64_t, size_t>) + HASH_NODE_BYTES);
+    for (const auto& level : histogramPyramid) {
+        stats.indexBytes += level.capacity() * sizeof(float);
+    }
+    if (neighborGraph != nullptr) {
+        stats.indexBytes += neighborGraph->memoryBytes();
+    }
+
+    // Keys are held twice, by the list and by the lookup
+    stats.cacheBytes = featureCache.memoryBytes([](const std::string& key, const FeatureVector& f) {
+        return 2 * stringHeapBytes(key.capacity()) + f.data.capacity() * sizeof(float) +
+               stringHeapBytes(f.imagePath.capacity());
+    });
+    stats.cacheBytes += resultCache.memoryBytes([](const std::string& key, const std::vector<MatchResult>& matches) {
+        size_t bytes = 2 * stringHeapBytes(key.capacity()) + matches.capacity() * sizeof(MatchResult);
+        for (const auto& m : matches) {
+            bytes += stringHeapBytes(m.imagePath.capacity());
+        }
+        return bytes;
+    });
+
+    stats.decodeBytes = peakDecodeBytes.load(std::memory_order_relaxed);
+    stats.budgetBytes = memoryBudget;
+    stats.compact = compactRows;
+    return stats;
+}
+
+size_t CBIRSystem::estimateLoadBytes(const std::string& filename, bool compact) const {
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        return 0;
+    }
+    size_t fileBytes = static_cast<size_t>(file.tellg());
+    file.seekg(0);
+
+    // Row count from the header when present, otherwise from the length of
+    // the first row (DNN embedding CSVs have no header)
+    FeatureType type = FeatureType::BASELINE;
+    long long rows = -1;
+    size_t dim = 0, pathLength = 0, headerBytes = 0;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            headerBytes += line.size() + 1;
+            size_t pos = line.find(": ");
+            if (pos == std::string::npos) {
+                continue;
+            }
+            if (line.find("Feature Type:") != std::string::npos) {
+                type = stringToFeatureType(line.substr(pos + 2));
+            } else if (line.find("Number of Images:") != std::string::npos) {
+                rows = std::atoll(line.c_str() + pos + 2);
+            }
+            continue;
+        }
+        size_t comma = line.find(',');
+        pathLength = (comma == std::string::npos) ? line.size() : comma;
+        dim = static_cast<size_t>(std::count(line.begin(), line.end(), ','));
+        if (rows < 0) {
+            rows = static_cast<long long>((fileBytes - headerBytes) / (line.size() + 1));
+        }
+        break;
+    }
+    size_t cacheEntries = compactRows ? fullFeatureCacheEntries : featureCache.capacity();
+    size_t bytes = compact ? 0 : estimateCacheBytes(cacheEntries, dim);
+    if (rows > 0) {
+        bytes += static_cast<size_t>(rows) * estimateRowBytes(dim, pathLength, type, compact);
+    }
+    return bytes;
+}
+
+int CBIRSystem::chooseRowForm(const std::string& what, size_t fullBytes, size_t compactBytes,
+                              bool& compact) const {
+    compact = false;
+    if (memoryBudget == 0 || fullBytes <= memoryBudget) {
+        return 0;
+    }
+    if (compactBytes <= memoryBudget) {
+        compact = true;
+        std::cout << "Note: " << what << " needs about " << megabytes(fullBytes) << " MB, over the memory budget of "
+                  << megabytes(memoryBudget) << " MB; holding it in compact form (about "
+                  << megabytes(compactBytes) << " MB)" << std::endl;
+        return 0;
+    }
+    std::cerr << "Error: " << what << " needs about " << megabytes(compactBytes)
+              << " MB even in compact form, over the memory budget of " << megabytes(memoryBudget) << " MB"
+              << std::endl;
+    return -1;
+}
+
+void CBIRSystem::setCompactRows(bool compact) {
+    if (compact && !compactRows) {
+        fullFeatureCacheEntries = featureCache.capacity();
+        featureCache.setCapacity(0);
+    } else if (!compact && compactRows) {
+        featureCache.setCapacity(fullFeatureCacheEntries);
+    }
+    compactRows = compact;
+}
+
+void CBIRSystem::recordDecodeBytes(size_t bytes) {
+    size_t peak = peakDecodeBytes.load(std::memory_order_relaxed);
+    // A failed exchange reloads peak
+    while (bytes > peak && !peakDecodeBytes.compare_exchange_weak(peak, bytes, std::memory_order_relaxed)) {
+    }
+}
+
+int CBIRSystem::findImage(const std::string& imagePath) const {
+    // Try each tail of the path, longest first: data/a/x.jpg finds the row
+    // stored as a/x.jpg (or x.jpg in a flat database), never b/x.jpg
+    std::string path = normalizePath(imagePath);
+    size_t start = 0;
+    while (true) {
+        auto it = nameIndex.find(path.substr(start));
+        if (it != nameIndex.end()) {
+            return static_cast<int>(it->second);
+        }
+        size_t slash = path.find('/', start);
+        if (slash == std::string::npos) {
+            return -1;
+        }
+        start = slash + 1;
+    }
+}
+
+void CBIRSystem::normalizeFeatures() {
+    for (auto& feature : features) {
+        feature.normalize();
+    }
+    featuresNormalized = true;
+}
+
+float CBIRSystem::rowDistance(const FeatureVector& target, size_t row) const {
+    if (featuresNormalized) {
+        return normalizedCosineDistance(target, features[row]);
+    }
+    return computeDistance(target, features[row], currentFeatureType);
+}
+
 bool CBIRSystem::isImageFile(const std::string& filename) {
     std::string lower = filename;
     std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
@@ -40,11 +510,79 @@ bool CBIRSystem::isImageFile(const std::string& filename) {
             lower.find(".bmp") != std::string::npos);
 }
 
-int CBIRSystem::buildDatabase(const std::string& imageDir, FeatureType type) {
+int CBIRSystem::listImageFiles(const std::string& dir, const std::string& relativeDir,
+                               std::vector<std::string>& files) {
+    DIR* dirp = opendir(dir.c_str());
+    if (dirp == nullptr) {
+        return -1;
+    }
+
+    std::vector<std::string> names, subdirs;
+    struct dirent* dp;
+    while ((dp = readdir(dirp)) != nullptr) {
+        std::string name = dp->d_name;
+        if (name.empty() || name[0] == '.') {
+            continue;
+        }
+
+        bool isDir = false;
+#ifdef DT_DIR
+        if (dp->d_type == DT_DIR) {
+            isDir = true;
+        } else if (dp->d_type == DT_UNKNOWN)
+#endif
+        {
+            struct stat info;
+            isDir = lstat((dir + "/" + name).c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+        }
+
+        if (isDir) {
+            subdirs.push_back(name);
+        } else if (isImageFile(name)) {
+            names.push_back(name);
+        }
+    }
+    closedir(dirp);
+
+    std::sort(names.begin(), names.end());
+    std::sort(subdirs.begin(), subdirs.end());
+    for (const auto& name : names) {
+        files.push_back(relativeDir + name);
+    }
+    for (const auto& sub : subdirs) {
+        if (listImageFiles(dir + "/" + sub, relativeDir + sub + "/", files) != 0) {
+            std::cerr << "Warning: Cannot open directory " << dir << "/" << sub << std::endl;
+        }
+    }
+    return 0;
+}
+
+std::string CBIRSystem::storedName(const std::string& path) const {
+    if (relativePaths) {
+        return path;
+    }
+    if (!imageRoot.empty() && path.size() > imageRoot.size() &&
+        path.compare(0, imageRoot.size(), imageRoot) == 0 && path[imageRoot.size()] == '/') {
+        return path.substr(imageRoot.size() + 1);
+    }
+    return getFilename(path);
+}
+
+std::string CBIRSystem::indexKey(const std::string& path) const {
+    return normalizePath(storedName(path));
+}
+
+int CBIRSystem::buildDatabase(const std::string& imageDir, FeatureType type, int numThreads,
+                              const BuildProgressCallback& progress) {
     currentFeatureType = type;
     imagePaths.clear();
     features.clear();
-    dnnFeatureMap.clear();
+    contentHashes.clear();
+    contentSizes.clear();
+    clearDerivedData();
+    imageRoot.clear();
+    relativePaths = false;
+    setCompactRows(false);
 
     // Special handling for DNN embeddings
     if (type == FeatureType::DNN_EMBEDDING) {
@@ -52,73 +590,197 @@ int CBIRSystem::buildDatabase(const std::string& imageDir, FeatureType type) {
             std::cerr << "Error: DNN CSV path not set. Use setDNNCsvPath() first." << std::endl;
             return -1;
         }
+        bool compact = false;
+        if (memoryBudget > 0 && chooseRowForm(dnnCsvPath, estimateLoadBytes(dnnCsvPath, false),
+                                              estimateLoadBytes(dnnCsvPath, true), compact) != 0) {
+            return -1;
+        }
+        setCompactRows(compact);
 
         // Load all DNN embeddings
         int count = loadDNNEmbeddings(dnnCsvPath, imagePaths, features);
         if (count < 0) {
             return -1;
         }
-
-        // Build lookup map
-        for (size_t i = 0; i < imagePaths.size(); i++) {
-            dnnFeatureMap[imagePaths[i]] = i;
+        if (compactRows) {
+            for (auto& f : features) {
+                std::string().swap(f.imagePath);
+            }
         }
 
+        // Store unit-length vectors so queries only need a dot product
+        normalizeFeatures();
+        // Embedding rows are filenames; the images are in imageDir
+        relativePaths = true;
+        imageRoot = imageDir;
+
+        buildNameIndex();
+        // One load with nothing left to cancel, so progress is reported once
+        if (progress) {
+            progress(static_cast<size_t>(count), static_cast<size_t>(count));
+        }
         return count;
     }
 
-    // Open directory
-    DIR* dirp = opendir(imageDir.c_str());
-    if (dirp == nullptr) {
+    // Collect image files from the whole directory tree
+    std::vector<std::string> files;
+    int listed;
+    {
+        ScopedStage timer(MetricStage::SCAN_DIR);
+        listed = listImageFiles(imageDir, "", files);
+    }
+    if (listed != 0) {
         std::cerr << "Error: Cannot open directory " << imageDir << std::endl;
         return -1;
     }
+    imageRoot = imageDir;
+    imagePaths.reserve(files.size());
+    features.reserve(files.size());
 
-    struct dirent* dp;
-    int count = 0;
+    const size_t total = files.size();
+    std::vector<FeatureVector> rows(total);
+    std::vector<uint64_t> hashes(total, 0);
+    std::vector<uint64_t> sizes(total, 0);
+    std::vector<char> extracted(total, 0);
+    std::atomic<size_t> done(0);
+    std::atomic<bool> cancelled(false);
+    std::mutex progressLock;
 
-    while ((dp = readdir(dirp)) != nullptr) {
-        std::string filename = dp->d_name;
+    // Read and extract image i into its own slot; rows are appended in file
+    // order afterwards, so the database does not depend on the thread count
+    auto processImage = [&](size_t i) {
+        TraceSpan span("image", "build", files[i]);
+        std::string fullPath = imageDir + "/" + files[i];
 
-        // Check if it's an image file
-        if (!isImageFile(filename)) {
-            continue;
+        // Load image; the bytes are also hashed for exact duplicate lookups
+        std::vector<uchar> bytes;
+        cv::Mat image;
+        if (readImageBytes(fullPath, bytes) != 0 || decodeImage(bytes, image) != 0) {
+            std::cerr << "Warning: Cannot load image " << fullPath << std::endl;
+            addMetric(MetricCounter::IMAGES_FAILED);
+        } else {
+            recordDecodeBytes(bytes.capacity() + image.total() * image.elemSize());
+            hashes[i] = compactRows ? 0 : bufferContentHash(bytes);
+            sizes[i] = bytes.size();
+
+            int result;
+            {
+                ScopedStage timer(MetricStage::EXTRACT);
+                result = extractFeature(image, rows[i], type);
+            }
+            if (result != 0) {
+                std::cerr << "Warning: Failed to extract feature from " << fullPath << std::endl;
+                addMetric(MetricCounter::IMAGES_FAILED);
+            } else {
+                addMetric(MetricCounter::IMAGES_PROCESSED);
+                extracted[i] = 1;
+            }
         }
 
-        // Build full path
-        std::string fullPath = imageDir + "/" + filename;
+        // Failed images count as done, so the progress reaches the total
+        size_t finished = done.fetch_add(1) + 1;
+        if (progress || finished % 100 == 0) {
+            std::lock_guard<std::mutex> guard(progressLock);
+            if (finished % 100 == 0) {
+                std::cout << "Processed " << finished << " of " << total << " images..." << std::endl;
+            }
+            // Reread under the lock so the reported count never goes back
+            if (progress && !progress(done.load(), total)) {
+                cancelled.store(true);
+            }
+        }
+    };
 
-        // Load image
-        cv::Mat image = cv::imread(fullPath);
-        if (image.empty()) {
-            std::cerr << "Warning: Cannot load image " << fullPath << std::endl;
-            continue;
+    // The first row gives the feature size, which the memory budget needs;
+    // the rest are extracted in parallel
+    size_t next = 0;
+    while (next < total && !cancelled.load()) {
+        processImage(next++);
+        if (extracted[next - 1]) {
+            break;
+        }
+    }
+
+    if (memoryBudget > 0 && next > 0 && extracted[next - 1]) {
+        size_t dim = rows[next - 1].size();
+        size_t cacheBytes = estimateCacheBytes(featureCache.capacity(), dim);
+        size_t fullBytes = cacheBytes;
+        size_t compactBytes = 0;
+        for (const auto& file : files) {
+            size_t pathLength = imageDir.size() + 1 + file.size();
+            fullBytes += estimateRowBytes(dim, pathLength, type, false);
+            compactBytes += estimateRowBytes(dim, pathLength, type, true);
+        }
+        bool compact = false;
+        if (chooseRowForm(imageDir, fullBytes, compactBytes, compact) != 0) {
+            clear();
+            return -1;
         }
+        setCompactRows(compact);
+    }
 
-        // Extract feature
-        FeatureVector feature;
-        if (extractFeature(image, feature, type) != 0) {
-            std::cerr << "Warning: Failed to extract feature from " << fullPath << std::endl;
-            continue;
+    parallelFor(total - next, numThreads, 4, [&](size_t begin, size_t end, int) {
+        for (size_t i = begin; i < end && !cancelled.load(std::memory_order_relaxed); i++) {
+            processImage(next + i);
         }
+    });
 
-        feature.imagePath = fullPath;
-        imagePaths.push_back(fullPath);
-        features.push_back(feature);
-        count++;
+    if (cancelled.load()) {
+        std::cout << "Build cancelled after " << done.load() << " of " << total << " images" << std::endl;
+        clear();
+        return -1;
+    }
 
-        if (count % 100 == 0) {
-            std::cout << "Processed " << count << " images..." << std::endl;
+    int count = 0;
+    for (size_t i = 0; i < total; i++) {
+        if (!extracted[i]) {
+            continue;
+        }
+        std::string fullPath = imageDir + "/" + files[i];
+        if (!compactRows) {
+            rows[i].imagePath = fullPath;
+            contentHashes.push_back(hashes[i]);
+            contentSizes.push_back(sizes[i]);
         }
+        imagePaths.push_back(fullPath);
+        features.push_back(std::move(rows[i]));
+        count++;
     }
+    std::vector<FeatureVector>().swap(rows);
 
-    closedir(dirp);
+    buildNameIndex();
+    buildHistogramPyramid();
 
     std::cout << "Built database with " << count << " images" << std::endl;
     return count;
 }
 
 int CBIRSystem::saveFeatures(const std::string& filename) {
+    std::vector<size_t> rows(features.size());
+    std::iota(rows.begin(), rows.end(), 0);
+    return writeFeatureRows(filename, rows);
+}
+
+int CBIRSystem::saveShards(const std::string& filename, int numShards) {
+    if (numShards < 1) {
+        std::cerr << "Error: Invalid shard count " << numShards << std::endl;
+        return -1;
+    }
+
+    std::vector<std::vector<size_t>> shardRows(numShards);
+    for (size_t i = 0; i < imagePaths.size(); i++) {
+        shardRows[shardOf(indexKey(imagePaths[i]), numShards)].push_back(i);
+    }
+    for (int s = 0; s < numShards; s++) {
+        if (writeFeatureRows(shardFileName(filename, s), shardRows[s]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int CBIRSystem::writeFeatureRows(const std::string& filename, const std::vector<size_t>& rows) {
+    TraceSpan span("write", "build", filename);
     std::ofstream file(filename);
     if (!file.is_open()) {
         std::cerr << "Error: Cannot open file for writing: " << filename << std::endl;
@@ -129,11 +791,12 @@ int CBIRSystem::saveFeatures(const std::string& filename) {
     file << "# CBIR Feature Database\n";
     file << "# Feature Type: " << featureTypeToString(currentFeatureType) << "\n";
     file << "# Feature Dimension: " << (features.empty() ? 0 : features[0].size()) << "\n";
-    file << "# Number of Images: " << features.size() << "\n";
+    file << "# Number of Images: " << rows.size() << "\n";
+    file << "# Normalized: " << (featuresNormalized ? "yes" : "no") << "\n";
 
     // Write features
-    for (size_t i = 0; i < features.size(); i++) {
-        file << getFilename(imagePaths[i]);
+    for (size_t i : rows) {
+        file << storedName(imagePaths[i]);
         for (size_t j = 0; j < features[i].size(); j++) {
             file << "," << features[i][j];
         }
@@ -141,23 +804,116 @@ int CBIRSystem::saveFeatures(const std::string& filename) {
     }
 
     file.close();
-    std::cout << "Saved " << features.size() << " features to " << filename << std::endl;
+
+    // Content hashes go to a side file so the CSV format stays unchanged
+    std::string hashFile = filename + ".hash";
+    if (contentHashes.size() != imagePaths.size()) {
+        std::remove(hashFile.c_str());
+    } else {
+        std::ofstream hashes(hashFile);
+        if (!hashes.is_open()) {
+            std::cerr << "Warning: Cannot write content hashes to " << hashFile << std::endl;
+        } else {
+            hashes << std::hex;
+            for (size_t i : rows) {
+                if (contentHashes[i] != 0) {
+                    hashes << storedName(imagePaths[i]) << "," << contentHashes[i] << "," << std::dec
+                           << contentSizes[i] << std::hex << "\n";
+                }
+            }
+        }
+    }
+
+    std::cout << "Saved " << rows.size() << " features to " << filename << std::endl;
     return 0;
 }
 
+void CBIRSystem::loadContentHashes(const std::string& filename) {
+    contentHashes.clear();
+    contentSizes.clear();
+    if (compactRows) {
+        return;
+    }
+    std::ifstream file(filename + ".hash");
+    if (!file.is_open()) {
+        return;
+    }
+
+    std::unordered_map<std::string, size_t> rows;
+    for (size_t i = 0; i < imagePaths.size(); i++) {
+        rows[storedName(imagePaths[i])] = i;
+    }
+
+    // Lines are "<name>,<hex hash>,<size>"; names may contain commas. Rows
+    // with no line (or an old line without a size) keep an unknown hash
+    contentHashes.assign(imagePaths.size(), 0);
+    contentSizes.assign(imagePaths.size(), 0);
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t sizeComma = line.find_last_of(',');
+        if (sizeComma == std::string::npos || sizeComma == 0) {
+            continue;
+        }
+        size_t hashComma = line.find_last_of(',', sizeComma - 1);
+        if (hashComma == std::string::npos) {
+            continue;
+        }
+        auto it = rows.find(line.substr(0, hashComma));
+        if (it != rows.end()) {
+            contentHashes[it->second] = std::strtoull(line.c_str() + hashComma + 1, nullptr, 16);
+            contentSizes[it->second] = std::strtoull(line.c_str() + sizeComma + 1, nullptr, 10);
+        }
+    }
+}
+
+void CBIRSystem::setImageDirectory(const std::string& imageDir) {
+    // Built databases keep the directory they were built from
+    if (relativePaths) {
+        imageRoot = imageDir;
+    }
+}
+
+std::string CBIRSystem::imageFilePath(const std::string& storedPath) const {
+    if (relativePaths && !imageRoot.empty()) {
+        return normalizePath(imageRoot + "/" + storedPath);
+    }
+    return normalizePath(storedPath);
+}
+
 int CBIRSystem::loadFeatures(const std::string& filename) {
+    TraceSpan span("load", "query", filename);
     std::ifstream file(filename);
     if (!file.is_open()) {
         std::cerr << "Error: Cannot open file for reading: " << filename << std::endl;
         return -1;
     }
 
+    // Check the budget before dropping the current database
+    bool compact = false;
+    if (memoryBudget > 0 &&
+        chooseRowForm(filename, estimateLoadBytes(filename, false), estimateLoadBytes(filename, true), compact) != 0) {
+        return -1;
+    }
+
     imagePaths.clear();
     features.clear();
+    contentHashes.clear();
+    contentSizes.clear();
+    clearDerivedData();
+    imageRoot.clear();
+    relativePaths = true;
+    setCompactRows(compact);
+
+    // The header's image count sizes the arrays up front; a count larger
+    // than the file could hold is ignored
+    file.seekg(0, std::ios::end);
+    std::streamoff fileBytes = file.tellg();
+    file.seekg(0);
 
     std::string line;
     int lineCount = 0;
     int featureDim = -1;
+    bool fileNormalized = false;
 
     while (std::getline(file, line)) {
         // Skip comments and empty lines
@@ -176,6 +932,17 @@ int CBIRSystem::loadFeatures(const std::string& filename) {
                     featureDim = std::stoi(line.substr(pos + 2));
                 }
             }
+            if (line.find("Number of Images:") != std::string::npos) {
+                size_t pos = line.find(":");
+                unsigned long long count = std::strtoull(line.c_str() + pos + 1, nullptr, 10);
+                if (count > 0 && count <= static_cast<unsigned long long>(std::max<std::streamoff>(0, fileBytes))) {
+                    imagePaths.reserve(static_cast<size_t>(count));
+                    features.reserve(static_cast<size_t>(count));
+                }
+            }
+            if (line.find("Normalized:") != std::string::npos) {
+                fileNormalized = line.find("yes") != std::string::npos;
+            }
             continue;
         }
 
@@ -187,12 +954,18 @@ int CBIRSystem::loadFeatures(const std::string& filename) {
             continue;
         }
 
-        imagePaths.push_back(token);
+        std::string name = std::move(token);
 
         // Read feature values
         FeatureVector feature;
-        feature.imagePath = token;
+        if (!compactRows) {
+            feature.imagePath = name;
+        }
         feature.type = currentFeatureType;
+        // Each value takes at least two characters of the line
+        if (featureDim > 0 && static_cast<size_t>(featureDim) <= line.size() / 2) {
+            feature.data.reserve(featureDim);
+        }
 
         while (std::getline(ss, token, ',')) {
             try {
@@ -206,57 +979,168 @@ int CBIRSystem::loadFeatures(const std::string& filename) {
             featureDim = feature.size();
         }
 
-        features.push_back(feature);
+        imagePaths.push_back(std::move(name));
+        features.push_back(std::move(feature));
         lineCount++;
     }
 
     file.close();
+
+    loadContentHashes(filename);
+    buildNameIndex();
+    buildHistogramPyramid();
+
+    if (currentFeatureType == FeatureType::DNN_EMBEDDING) {
+        // Older databases store raw embeddings; normalize them once here
+        if (fileNormalized) {
+            featuresNormalized = true;
+        } else {
+            normalizeFeatures();
+        }
+    }
+
     std::cout << "Loaded " << lineCount << " features from " << filename << std::endl;
     return lineCount;
 }
 
-std::vector<MatchResult> CBIRSystem::query(const std::string& targetImage, int topN) {
-    std::vector<MatchResult> results;
+int CBIRSystem::extractTargetFeature(const std::string& targetImage, FeatureVector& targetFeature) {
+    TraceSpan span("target", "query", targetImage);
 
-    // Load target image
-    cv::Mat image = cv::imread(targetImage);
-    if (image.empty()) {
-        std::cerr << "Error: Cannot load target image " << targetImage << std::endl;
-        return results;
+    // Database images already have their feature; no need to decode them
+    int row = findStoredTarget(targetImage);
+    if (row >= 0) {
+        targetFeature = features[row];
+        targetFeature.imagePath = targetImage;
+        storedTargetCount++;
+        return 0;
     }
 
-    // Extract feature
-    FeatureVector targetFeature;
+    std::string key = featureCacheKey(targetImage);
+    if (featureCache.get(key, targetFeature)) {
+        return 0;
+    }
 
-    // Special handling for DNN embeddings
+    // Special handling for DNN embeddings: the image itself is never read
     if (currentFeatureType == FeatureType::DNN_EMBEDDING) {
-        std::string filename = getFilename(targetImage);
+        if (extractDNNFromCSV(dnnCsvPath, getFilename(targetImage), targetFeature) != 0) {
+            std::cerr << "Error: Target image not found in DNN database" << std::endl;
+            return -1;
+        }
+    } else {
+        std::vector<uchar> bytes;
+        if (readImageBytes(targetImage, bytes) != 0) {
+            std::cerr << "Error: Cannot load target image " << targetImage << std::endl;
+            addMetric(MetricCounter::IMAGES_FAILED);
+            return -1;
+        }
 
-        // Check if we have this image in our DNN database
-        auto it = dnnFeatureMap.find(filename);
-        if (it != dnnFeatureMap.end()) {
-            targetFeature = features[it->second];
-        } else {
-            // Try to extract from CSV
-            if (extractDNNFromCSV(dnnCsvPath, filename, targetFeature) != 0) {
-                std::cerr << "Error: Target image not found in DNN database" << std::endl;
-                return results;
+        // A byte-identical copy of a database image has the same feature;
+        // hashing the bytes costs far less than decoding them
+        if (!hashIndex.empty()) {
+            std::vector<size_t> duplicates = rowsWithHash(bufferContentHash(bytes), bytes.size());
+            if (!duplicates.empty()) {
+                targetFeature = features[duplicates[0]];
+                targetFeature.imagePath = targetImage;
+                storedTargetCount++;
+                return 0;
             }
         }
-    } else {
-        if (extractFeature(image, targetFeature, currentFeatureType) != 0) {
+
+        cv::Mat image;
+        if (decodeImage(bytes, image) != 0) {
+            std::cerr << "Error: Cannot load target image " << targetImage << std::endl;
+            addMetric(MetricCounter::IMAGES_FAILED);
+            return -1;
+        }
+        recordDecodeBytes(bytes.capacity() + image.total() * image.elemSize());
+        int extracted;
+        {
+            ScopedStage timer(MetricStage::EXTRACT);
+            extracted = extractFeature(image, targetFeature, currentFeatureType);
+        }
+        if (extracted != 0) {
             std::cerr << "Error: Failed to extract feature from target image" << std::endl;
-            return results;
+            addMetric(MetricCounter::IMAGES_FAILED);
+            return -1;
         }
+        addMetric(MetricCounter::IMAGES_PROCESSED);
     }
 
     targetFeature.imagePath = targetImage;
     targetFeature.type = currentFeatureType;
+    if (featuresNormalized) {
+        targetFeature.normalize();
+    }
+
+    featureCache.put(key, targetFeature);
+    return 0;
+}
+
+std::vector<MatchResult> CBIRSystem::query(const std::string& targetImage, int topN) {
+    // Database images are a lookup in the k-NN graph when it is deep enough
+    if (neighborGraph != nullptr && topN > 0 && topN - 1 <= neighborGraph->neighborCount()) {
+        int row = findStoredTarget(targetImage);
+        if (row >= 0) {
+            storedTargetCount++;
+            addMetric(MetricCounter::QUERIES);
+            return graphQuery(static_cast<size_t>(row), topN);
+        }
+    }
+
+    FeatureVector targetFeature;
+    if (extractTargetFeature(targetImage, targetFeature) != 0) {
+        return std::vector<MatchResult>();
+    }
 
     return query(targetFeature, topN);
 }
 
+int CBIRSystem::setNeighborGraph(const KNNGraph* graph) {
+    if (graph != nullptr && graph->size() != features.size()) {
+        std::cerr << "Error: k-NN graph has " << graph->size() << " images, database has "
+                  << features.size() << std::endl;
+        return -1;
+    }
+    neighborGraph = graph;
+    return 0;
+}
+
+std::vector<MatchResult> CBIRSystem::graphQuery(size_t row, int topN) const {
+    // The graph leaves out the row itself; merge it back in where a full
+    // scan would rank it (ties by row, as in TopK)
+    Neighbor self(rowDistance(features[row], row), static_cast<uint32_t>(row));
+    const Neighbor* neighbors = neighborGraph->neighbors(row);
+    std::vector<Neighbor> top;
+    top.reserve(topN);
+    bool selfAdded = false;
+    for (int i = 0; i < neighborGraph->neighborCount() && static_cast<int>(top.size()) < topN; i++) {
+        if (!selfAdded && self < neighbors[i]) {
+            top.push_back(self);
+            selfAdded = true;
+            if (static_cast<int>(top.size()) == topN) {
+                break;
+            }
+        }
+        top.push_back(neighbors[i]);
+    }
+    if (!selfAdded && static_cast<int>(top.size()) < topN) {
+        top.push_back(self);
+    }
+    return toMatchResults(top);
+}
+
+std::vector<MatchResult> CBIRSystem::toMatchResults(const std::vector<Neighbor>& neighbors) const {
+    ScopedStage timer(MetricStage::FORMAT);
+    std::vector<MatchResult> results;
+    results.reserve(neighbors.size());
+    for (const Neighbor& n : neighbors) {
+        results.push_back(MatchResult(imagePaths[n.id], n.distance));
+    }
+    return results;
+}
+
 std::vector<MatchResult> CBIRSystem::query(const FeatureVector& targetFeature, int topN) {
+    TraceSpan span("query", "query");
     std::vector<MatchResult> results;
 
     if (features.empty()) {
@@ -264,25 +1148,632 @@ std::vector<MatchResult> CBIRSystem::query(const FeatureVector& targetFeature, i
         return results;
     }
 
-    // Compute distances to all images
-    for (size_t i = 0; i < features.size(); i++) {
-        float dist = computeDistance(targetFeature, features[i], currentFeatureType);
-        results.push_back(MatchResult(imagePaths[i], dist));
+    addMetric(MetricCounter::QUERIES);
+    std::string key = resultCacheKey(targetFeature, topN);
+    if (resultCache.get(key, results)) {
+        return results;
+    }
+
+    if (!histogramPyramid.empty() && targetFeature.size() == features[0].size()) {
+        // Histogram databases can skip most rows with the pyramid bounds
+        results = queryHistogramCascade(targetFeature, topN);
+    } else {
+        // Normalize the target once so each row costs a single dot product
+        FeatureVector target = targetFeature;
+        if (featuresNormalized) {
+            target.normalize();
+        }
+        results = exactScan(target, topN);
+    }
+
+    resultCache.put(key, results);
+    return results;
+}
+
+std::vector<std::vector<MatchResult>> CBIRSystem::queryBatch(const std::vector<FeatureVector>& targetFeatures,
+                                                             const std::vector<int>& topN) {
+    TraceSpan span("query_batch", "query");
+    std::vector<std::vector<MatchResult>> results(targetFeatures.size());
+    if (topN.size() != targetFeatures.size()) {
+        std::cerr << "Error: queryBatch() needs one topN per target (" << topN.size() << " for "
+                  << targetFeatures.size() << " targets)" << std::endl;
+        return results;
+    }
+    if (features.empty()) {
+        std::cerr << "Error: Database is empty" << std::endl;
+        return results;
     }
 
-    // Sort by distance (ascending)
-    std::sort(results.begin(), results.end());
+    // Histogram pyramid bounds skip most rows, which beats a shared exact
+    // scan, and a single target has nothing to share the scan with
+    if (targetFeatures.size() == 1 || !histogramPyramid.empty()) {
+        for (size_t q = 0; q < targetFeatures.size(); q++) {
+            results[q] = query(targetFeatures[q], topN[q]);
+        }
+        return results;
+    }
 
-    // Return top N
-    if (results.size() > static_cast<size_t>(topN)) {
-        results.resize(topN);
+    // Only targets without a cached result take part in the scan
+    std::vector<size_t> pending;
+    std::vector<std::string> keys;
+    std::vector<FeatureVector> targets;
+    std::vector<TopK> tops;
+    for (size_t q = 0; q < targetFeatures.size(); q++) {
+        std::string key = resultCacheKey(targetFeatures[q], topN[q]);
+        if (resultCache.get(key, results[q])) {
+            continue;
+        }
+        pending.push_back(q);
+        keys.push_back(key);
+        targets.push_back(targetFeatures[q]);
+        if (featuresNormalized) {
+            targets.back().normalize();
+        }
+        tops.push_back(TopK(topN[q] < 0 ? features.size() : static_cast<size_t>(topN[q])));
     }
 
+    addMetric(MetricCounter::QUERIES, targetFeatures.size());
+    if (pending.empty()) {
+        return results;
+    }
+    addMetric(MetricCounter::ROWS_SCANNED, pending.size() * features.size());
+
+    size_t blockRows = std::max<size_t>(1, BATCH_BLOCK_BYTES / (features[0].size() * sizeof(float) + 1));
+    {
+        ScopedStage timer(MetricStage::DISTANCE_SCAN);
+        bool tracing = tracingEnabled();
+        for (size_t begin = 0; begin < features.size(); begin += blockRows) {
+            size_t end = std::min(features.size(), begin + blockRows);
+            auto blockStart = tracing ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+            for (size_t p = 0; p < pending.size(); p++) {
+                for (size_t row = begin; row < end; row++) {
+                    tops[p].push(rowDistance(targets[p], row), static_cast<uint32_t>(row));
+                }
+            }
+            if (tracing) {
+                traceScanBlock("scan_block", blockStart, std::chrono::steady_clock::now(), begin, end);
+            }
+        }
+    }
+
+    for (size_t p = 0; p < pending.size(); p++) {
+        std::vector<Neighbor> best;
+        {
+            ScopedStage timer(MetricStage::TOP_K);
+            best = tops[p].take();
+        }
+        results[pending[p]] = toMatchResults(best);
+        resultCache.put(keys[p], results[pending[p]]);
+    }
     return results;
 }
 
+std::vector<MatchResult> CBIRSystem::exactScan(const FeatureVector& target, int topN) const {
+    // Compute distances to all images, keeping the N best (a negative N
+    // keeps every image). Distances are computed a block at a time so the
+    // scan and the selection can be timed separately
+    TopK top(topN < 0 ? features.size() : static_cast<size_t>(topN));
+    float distances[SCAN_BLOCK_ROWS];
+    uint64_t scanNs = 0, selectNs = 0;
+    bool tracing = tracingEnabled();
+    auto mark = std::chrono::steady_clock::now();
+    for (size_t begin = 0; begin < features.size(); begin += SCAN_BLOCK_ROWS) {
+        size_t count = std::min(SCAN_BLOCK_ROWS, features.size() - begin);
+        auto blockStart = mark;
+        for (size_t i = 0; i < count; i++) {
+            distances[i] = rowDistance(target, begin + i);
+        }
+        scanNs += nanosecondsSince(mark);
+        if (tracing) {
+            traceScanBlock("scan_block", blockStart, mark, begin, begin + count);
+        }
+        for (size_t i = 0; i < count; i++) {
+            top.push(distances[i], static_cast<uint32_t>(begin + i));
+        }
+        selectNs += nanosecondsSince(mark);
+    }
+    auto mergeStart = mark;
+    std::vector<Neighbor> best = top.take();
+    selectNs += nanosecondsSince(mark);
+    if (tracing) {
+        traceSpan("merge", "query", mergeStart, mark);
+    }
+
+    recordStage(MetricStage::DISTANCE_SCAN, scanNs);
+    recordStage(MetricStage::TOP_K, selectNs);
+    addMetric(MetricCounter::ROWS_SCANNED, features.size());
+    return toMatchResults(best);
+}
+
+int CBIRSystem::streamQuery(const std::string& filename, const std::string& targetImage, int topN,
+                            std::vector<MatchResult>& results) {
+    TraceSpan span("stream_query", "query", filename);
+    results.clear();
+    if (topN <= 0) {
+        std::cerr << "Error: A streaming query needs a positive number of results" << std::endl;
+        return -1;
+    }
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for reading: " << filename << std::endl;
+        return -1;
+    }
+
+    clear();
+    relativePaths = true;
+
+    FeatureVector target, row;
+    bool haveTarget = false, fileNormalized = false;
+    TopK top(static_cast<size_t>(topN));
+    // Names of rows that entered the top N; pruned to the current top N
+    // whenever it grows well past it
+    std::unordered_map<uint32_t, std::string> names;
+    uint32_t rowCount = 0;
+    std::string line;
+
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            size_t pos = line.find(": ");
+            if (pos != std::string::npos && line.find("Feature Type:") != std::string::npos) {
+                currentFeatureType = stringToFeatureType(line.substr(pos + 2));
+            }
+            if (line.find("Normalized:") != std::string::npos) {
+                fileNormalized = line.find("yes") != std::string::npos;
+            }
+            continue;
+        }
+
+        // The header is complete: prepare the target as for a loaded database
+        if (!haveTarget) {
+            featuresNormalized = currentFeatureType == FeatureType::DNN_EMBEDDING;
+            if (extractTargetFeature(targetImage, target) != 0) {
+                return -1;
+            }
+            row.type = currentFeatureType;
+            haveTarget = true;
+        }
+
+        size_t comma = line.find(',');
+        if (comma == std::string::npos) {
+            continue;
+        }
+        row.data.clear();
+        const char* p = line.c_str() + comma;
+        while (*p == ',') {
+            char* end;
+            row.data.push_back(std::strtof(p + 1, &end));
+            p = std::strchr(end, ',');
+            if (p == nullptr) {
+                break;
+            }
+        }
+        if (row.size() != target.size()) {
+            continue;
+        }
+        if (featuresNormalized && !fileNormalized) {
+            row.normalize();
+        }
+
+        float distance = featuresNormalized ? normalizedCosineDistance(target, row)
+                                            : computeDistance(target, row, currentFeatureType);
+        if (top.push(distance, rowCount)) {
+            names[rowCount] = line.substr(0, comma);
+            if (names.size() > 4 * top.capacity() + 1024) {
+                TopK current = top;
+                std::unordered_map<uint32_t, std::string> kept;
+                for (const Neighbor& n : current.take()) {
+                    kept[n.id] = std::move(names[n.id]);
+                }
+                names.swap(kept);
+            }
+        }
+        rowCount++;
+    }
+
+    if (!haveTarget) {
+        std::cerr << "Error: No features in " << filename << std::endl;
+        return -1;
+    }
+    addMetric(MetricCounter::QUERIES);
+    addMetric(MetricCounter::ROWS_SCANNED, rowCount);
+    for (const Neighbor& n : top.take()) {
+        results.push_back(MatchResult(names[n.id], n.distance));
+    }
+    return 0;
+}
+
+void CBIRSystem::buildHistogramPyramid() {
+    histogramPyramid.clear();
+    pyramidBins.clear();
+    if (currentFeatureType != FeatureType::HISTOGRAM || features.empty() || compactRows) {
+        return;
+    }
+
+    // Recover bins per channel from the dimension (16^3 = 4096 by default)
+    size_t dim = features[0].size();
+    int bins = static_cast<int>(std::round(std::cbrt(static_cast<double>(dim))));
+    if (static_cast<size_t>(bins) * bins * bins != dim || bins < 4 || bins % 2 != 0) {
+        return;
+    }
+    for (const auto& f : features) {
+        if (f.size() != dim) {
+            return;
+        }
+    }
+
+    // Finest coarse level first, each summed from the level above it
+    std::vector<std::vector<float>> levels;
+    std::vector<int> levelBins;
+    for (int b = bins / 2; b >= 2; b /= 2) {
+        size_t levelSize = static_cast<size_t>(b) * b * b;
+        std::vector<float> level(features.size() * levelSize);
+        for (size_t i = 0; i < features.size(); i++) {
+            const float* finer = levels.empty() ? features[i].data.data()
+                                                : &levels.back()[i * (2 * b) * (2 * b) * (2 * b)];
+            downsampleHistogram(finer, 2 * b, &level[i * levelSize]);
+        }
+        levels.push_back(std::move(level));
+        levelBins.push_back(b);
+        if (b % 2 != 0) {
+            break;
+        }
+    }
+
+    // Store coarsest first, the order queries evaluate them in
+    histogramPyramid.assign(levels.rbegin(), levels.rend());
+    pyramidBins.assign(levelBins.rbegin(), levelBins.rend());
+}
+
+void CBIRSystem::buildTargetPyramid(const FeatureVector& targetFeature,
+                                    std::vector<std::vector<float>>& levels) const {
+    // Built the same way as the database levels, finest first
+    levels.assign(histogramPyramid.size(), std::vector<float>());
+    const float* finer = targetFeature.data.data();
+    int finerBins = pyramidBins.back() * 2;
+    for (size_t l = levels.size(); l-- > 0;) {
+        levels[l].resize(static_cast<size_t>(pyramidBins[l]) * pyramidBins[l] * pyramidBins[l]);
+        downsampleHistogram(finer, finerBins, levels[l].data());
+        finer = levels[l].data();
+        finerBins = pyramidBins[l];
+    }
+}
+
+std::vector<MatchResult> CBIRSystem::queryHistogramCascade(const FeatureVector& targetFeature, int topN,
+                                                           ScanStats* stats) {
+    if (histogramPyramid.empty() || features.empty() || targetFeature.size() != features[0].size()) {
+        if (stats != nullptr) {
+            *stats = ScanStats();
+            stats->rowsScanned = features.size();
+            stats->dimsTotal = features.size() * targetFeature.size();
+            stats->dimsComputed = stats->dimsTotal;
+        }
+        return exactScan(targetFeature, topN);
+    }
+
+    size_t n = features.size();
+    size_t dim = targetFeature.size();
+    size_t levels = histogramPyramid.size();
+    ScanStats local;
+    auto mark = std::chrono::steady_clock::now();
+
+    std::vector<std::vector<float>> target;
+    buildTargetPyramid(targetFeature, target);
+    std::vector<size_t> levelSize(levels);
+    for (size_t l = 0; l < levels; l++) {
+        levelSize[l] = target[l].size();
+    }
+
+    // Coarsest bound for every row; visiting the most promising rows first
+    // tightens the N-th best distance quickly
+    std::vector<Neighbor> candidates(n);
+    for (size_t i = 0; i < n; i++) {
+        float bound = -histogramIntersection(target[0].data(), &histogramPyramid[0][i * levelSize[0]],
+                                             levelSize[0]);
+        candidates[i] = Neighbor(bound, static_cast<uint32_t>(i));
+    }
+    local.dimsComputed += n * levelSize[0];
+    std::sort(candidates.begin(), candidates.end());
+
+    TopK top(topN < 0 ? n : static_cast<size_t>(topN));
+    for (size_t c = 0; c < n; c++) {
+        const Neighbor& cand = candidates[c];
+
+        // Candidates are sorted by bound, so none of the rest can qualify
+        if (cand.distance > pyramidLimit(top.bound())) {
+            local.rowsPruned += n - c;
+            break;
+        }
+
+        bool pruned = false;
+        for (size_t l = 1; l < levels; l++) {
+            float bound = -histogramIntersection(target[l].data(),
+                                                 &histogramPyramid[l][cand.id * levelSize[l]], levelSize[l]);
+            local.dimsComputed += levelSize[l];
+            if (bound > pyramidLimit(top.bound())) {
+                pruned = true;
+                break;
+            }
+        }
+        if (pruned) {
+            local.rowsPruned++;
+            continue;
+        }
+
+        top.push(rowDistance(targetFeature, cand.id), cand.id);
+        local.dimsComputed += dim;
+    }
+
+    recordStage(MetricStage::DISTANCE_SCAN, nanosecondsSince(mark));
+    std::vector<Neighbor> best = top.take();
+    recordStage(MetricStage::TOP_K, nanosecondsSince(mark));
+    addMetric(MetricCounter::ROWS_SCANNED, n);
+
+    local.rowsScanned = n;
+    local.dimsTotal = n * dim;
+    if (stats != nullptr) {
+        *stats = local;
+    }
+    return toMatchResults(best);
+}
+
+std::vector<MatchResult> CBIRSystem::queryRows(const FeatureVector& targetFeature,
+                                               const std::vector<size_t>& rows, int topN) const {
+    TopK top(topN < 0 ? rows.size() : static_cast<size_t>(topN));
+    auto mark = std::chrono::steady_clock::now();
+    for (size_t row : rows) {
+        if (row < features.size()) {
+            top.push(rowDistance(targetFeature, row), static_cast<uint32_t>(row));
+        }
+    }
+    recordStage(MetricStage::DISTANCE_SCAN, nanosecondsSince(mark));
+    std::vector<Neighbor> best = top.take();
+    recordStage(MetricStage::TOP_K, nanosecondsSince(mark));
+    addMetric(MetricCounter::ROWS_SCANNED, rows.size());
+    return toMatchResults(best);
+}
+
+int CBIRSystem::rangeQuery(const FeatureVector& targetFeature, float radius, const MatchCallback& onMatch,
+                           ScanStats* stats) const {
+    if (features.empty()) {
+        std::cerr << "Error: Database is empty" << std::endl;
+        return -1;
+    }
+    // The distance functions return -1 on a size mismatch, which is under
+    // any radius, so every row would match
+    if (targetFeature.size() != features[0].size()) {
+        std::cerr << "Error: Target feature has " << targetFeature.size() << " values, database rows have "
+                  << features[0].size() << std::endl;
+        return -1;
+    }
+
+    FeatureVector target = targetFeature;
+    if (featuresNormalized) {
+        target.normalize();
+    }
+
+    bool baseline = currentFeatureType == FeatureType::BASELINE;
+    bool cascade = !histogramPyramid.empty();
+    std::vector<std::vector<float>> levels;
+    if (cascade) {
+        buildTargetPyramid(target, levels);
+    }
+
+    size_t dim = target.size();
+    ScanStats local;
+    int matches = 0;
+    addMetric(MetricCounter::QUERIES);
+    ScopedStage timer(MetricStage::DISTANCE_SCAN);
+    for (size_t i = 0; i < features.size(); i++) {
+        local.rowsScanned++;
+        float dist;
+        if (baseline) {
+            // Unordered bounded sums equal the full sum when <= radius
+            size_t visited = 0;
+            dist = sumSquaredDifferenceBounded(target, features[i], radius, nullptr,
+                                               EARLY_ABANDON_BLOCK, &visited);
+            local.dimsComputed += visited;
+        } else {
+            // Each coarser intersection bounds the distance from below
+            bool pruned = false;
+            for (size_t l = 0; l < levels.size() && !pruned; l++) {
+                size_t size = levels[l].size();
+                pruned = -histogramIntersection(levels[l].data(), &histogramPyramid[l][i * size], size) >
+                         pyramidLimit(radius);
+                local.dimsComputed += size;
+            }
+            if (pruned) {
+                local.rowsPruned++;
+                continue;
+            }
+            dist = rowDistance(target, i);
+            local.dimsComputed += dim;
+        }
+
+        if (dist > radius) {
+            if (baseline) {
+                local.rowsPruned++;
+            }
+            continue;
+        }
+        matches++;
+        if (!onMatch(MatchResult(imagePaths[i], dist))) {
+            break;
+        }
+    }
+
+    local.dimsTotal = local.rowsScanned * dim;
+    addMetric(MetricCounter::ROWS_SCANNED, local.rowsScanned);
+    if (stats != nullptr) {
+        *stats = local;
+    }
+    return matches;
+}
+
+const std::vector<uint32_t>& CBIRSystem::getVarianceOrder() {
+    if (!varianceOrder.empty() || features.empty()) {
+        return varianceOrder;
+    }
+
+    size_t dim = features[0].size();
+    std::vector<double> mean(dim, 0.0);
+    std::vector<double> sumSq(dim, 0.0);
+    for (const auto& f : features) {
+        for (size_t d = 0; d < dim && d < f.size(); d++) {
+            mean[d] += f[d];
+            sumSq[d] += static_cast<double>(f[d]) * f[d];
+        }
+    }
+
+    std::vector<double> variance(dim);
+    double n = static_cast<double>(features.size());
+    for (size_t d = 0; d < dim; d++) {
+        mean[d] /= n;
+        variance[d] = sumSq[d] / n - mean[d] * mean[d];
+    }
+
+    varianceOrder.resize(dim);
+    std::iota(varianceOrder.begin(), varianceOrder.end(), 0);
+    std::stable_sort(varianceOrder.begin(), varianceOrder.end(),
+                     [&](uint32_t a, uint32_t b) { return variance[a] > variance[b]; });
+    return varianceOrder;
+}
+
+std::vector<MatchResult> CBIRSystem::queryEarlyAbandon(const FeatureVector& targetFeature, int topN,
+                                                       bool reorderDims, ScanStats* stats) {
+    if (currentFeatureType == FeatureType::HISTOGRAM) {
+        addMetric(MetricCounter::QUERIES);
+        return queryHistogramCascade(targetFeature, topN, stats);
+    }
+    if (currentFeatureType != FeatureType::BASELINE || features.empty()) {
+        if (stats != nullptr) {
+            *stats = ScanStats();
+            stats->rowsScanned = features.size();
+            stats->dimsTotal = features.size() * targetFeature.size();
+            stats->dimsComputed = stats->dimsTotal;
+        }
+        return query(targetFeature, topN);
+    }
+
+    const std::vector<uint32_t>* order = reorderDims ? &getVarianceOrder() : nullptr;
+    size_t dim = targetFeature.size();
+    ScanStats local;
+    addMetric(MetricCounter::QUERIES);
+    auto mark = std::chrono::steady_clock::now();
+
+    TopK top(topN < 0 ? features.size() : static_cast<size_t>(topN));
+    for (size_t i = 0; i < features.size(); i++) {
+        float bound = top.bound();
+        if (order != nullptr) {
+            // A reordered sum can differ from the exact one by rounding, so
+            // only abandon rows that are clearly worse than the bound
+            bound *= 1.0001f;
+        }
+
+        size_t visited = 0;
+        float dist = sumSquaredDifferenceBounded(targetFeature, features[i], bound, order,
+                                                 EARLY_ABANDON_BLOCK, &visited);
+        local.dimsComputed += visited;
+        if (dist > bound) {
+            local.rowsPruned++;
+            continue;
+        }
+        if (order != nullptr) {
+            // Rank survivors by the exact sum so results match query()
+            dist = sumSquaredDifference(targetFeature, features[i]);
+            local.dimsComputed += dim;
+        }
+        top.push(dist, static_cast<uint32_t>(i));
+    }
+
+    recordStage(MetricStage::DISTANCE_SCAN, nanosecondsSince(mark));
+    std::vector<Neighbor> best = top.take();
+    recordStage(MetricStage::TOP_K, nanosecondsSince(mark));
+    addMetric(MetricCounter::ROWS_SCANNED, features.size());
+
+    local.rowsScanned = features.size();
+    local.dimsTotal = features.size() * dim;
+    if (stats != nullptr) {
+        *stats = local;
+    }
+    return toMatchResults(best);
+}
+
 void CBIRSystem::clear() {
     imagePaths.clear();
     features.clear();
-    dnnFeatureMap.clear();
+    contentHashes.clear();
+    contentSizes.clear();
+    clearDerivedData();
+    imageRoot.clear();
+    relativePaths = false;
+    setCompactRows(false);
+}
+
+float recallAtK(const std::vector<MatchResult>& exact, const std::vector<MatchResult>& approx) {
+    if (exact.empty()) {
+        return 1.0f;
+    }
+
+    int hits = 0;
+    for (const auto& e : exact) {
+        for (const auto& a : approx) {
+            if (a.imagePath == e.imagePath) {
+                hits++;
+                break;
+            }
+        }
+    }
+    return static_cast<float>(hits) / exact.size();
+}
+
+int fileContentHash(const std::string& path, uint64_t& hash, uint64_t& size) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return -1;
+    }
+
+    uint64_t h = HASH_SEED;
+    uint64_t length = 0;
+    char buffer[1 << 16];
+    while (file) {
+        file.read(buffer, sizeof(buffer));
+        size_t count = static_cast<size_t>(file.gcount());
+        h = hashBytes(h, buffer, count);
+        length += count;
+    }
+    if (file.bad()) {
+        return -1;
+    }
+
+    hash = finishHash(h, length);
+    size = length;
+    return 0;
+}
+
+std::string normalizePath(const std::string& path) {
+    if (path.empty()) {
+        return path;
+    }
+    return std::filesystem::path(path).lexically_normal().generic_string();
+}
+
+int shardOf(const std::string& imageName, int numShards) {
+    // FNV-1a: stable across runs and platforms, unlike std::hash
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : imageName) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return numShards > 1 ? static_cast<int>(hash % static_cast<uint64_t>(numShards)) : 0;
+}
+
+std::string shardFileName(const std::string& filename, int shard) {
+    // features.csv -> features.shard0.csv
+    size_t dot = filename.find_last_of('.');
+    size_t slash = filename.find_last_of("/\\");
+    std::string suffix = ".shard" + std::to_string(shard);
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return filename + suffix;
+    }
+    return filename.substr(0, dot) + suffix + filename.substr(dot);
 }
@@ -0,0 +1,1000 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Micro-benchmarks for every feature extractor and distance kernel, and
+           end-to-end build/query throughput on a generated corpus.
+  Usage: ./cbir_bench [-s <WxH,...>] [-r <repetitions>] [-w <warmup>] [-t <ms>] [-f <filter>] [-o <results.json>]
+         ./cbir_bench -E <db_sizes> [-F <types>] [-m <modes>] [-q <queries>] [-k <K>] [-o <results.json>]
+*/
+
+#include "cbir.h"
+#include "cluster.h"
+#include "distance.h"
+#include "feature.h"
+#include "hnsw.h"
+#include "ivfpq.h"
+#include "lsh.h"
+#include "synth.h"
+#include "vptree.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <random>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+
+// Heap allocations made through operator new (std::vector, std::string,
+// cv::Mat headers). OpenCV pixel buffers come from cv::fastMalloc and are
+// not counted
+static std::atomic<size_t> allocCount(0);
+static std::atomic<size_t> allocBytes(0);
+
+void* operator new(size_t size) {
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    allocBytes.fetch_add(size, std::memory_order_relaxed);
+    void* p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+// Results are folded in here so the compiler cannot drop the work
+static volatile float sink = 0.0f;
+
+struct BenchConfig {
+    int repetitions;   // Timed repetitions per benchmark
+    int warmup;        // Untimed repetitions before them
+    double minRepMs;   // Each repetition runs enough iterations to last this long
+    std::string filter;
+
+    BenchConfig() : repetitions(10), warmup(2), minRepMs(50.0) {}
+};
+
+struct BenchResult {
+    std::string group;   // "extractor" or "distance"
+    std::string name;
+    std::string shape;   // "640x480" or "dim=4096"
+    size_t iterations;   // Per repetition
+    std::vector<double> nsPerOp;
+    double pixelsPerOp;  // 0 for distances
+    double bytesPerOp;   // Input bytes read by one call
+    double allocsPerOp;
+    double allocBytesPerOp;
+
+    BenchResult() : iterations(0), pixelsPerOp(0.0), bytesPerOp(0.0), allocsPerOp(0.0), allocBytesPerOp(0.0) {}
+};
+
+struct Summary {
+    double mean, median, min, max, stddev;
+};
+
+void printUsage(const char* programName) {
+    std::cout << "Usage: " << programName << " [options]" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -s <WxH,...>        Synthetic image sizes for the extractors" << std::endl;
+    std::cout << "                      (default 320x240,640x480,1280x720,1920x1080)" << std::endl;
+    std::cout << "  -r <repetitions>    Timed repetitions per benchmark (default 10)" << std::endl;
+    std::cout << "  -w <warmup>         Untimed warmup repetitions (default 2)" << std::endl;
+    std::cout << "  -t <ms>             Minimum duration of one repetition (default 50)" << std::endl;
+    std::cout << "  -f <filter>         Only run benchmarks whose name contains this text" << std::endl;
+    std::cout << "  -o <results.json>   Write the results as JSON ('-' for stdout instead of the table)" << std::endl;
+    std::cout << "  -h                  Show this help message" << std::endl;
+    std::cout << std::endl;
+    std::cout << "End-to-end mode (generated corpus, first -s size):" << std::endl;
+    std::cout << "  -E <sizes>          Database sizes to build and query, e.g. 1000,10000" << std::endl;
+    std::cout << "  -F <types>          Feature types (default: all six)" << std::endl;
+    std::cout << "  -m <modes>          Approximate search modes checked for recall" << std::endl;
+    std::cout << "                      (default hnsw,ivfpq,vptree,lsh,cluster)" << std::endl;
+    std::cout << "  -q <queries>        Query images, not in the database (default 100)" << std::endl;
+    std::cout << "  -k <K>              Matches per query and recall depth (default 10)" << std::endl;
+    std::cout << "  -b <batch>          Queries per queryBatch() call (default 32)" << std::endl;
+    std::cout << "  -j <threads>        Index construction threads (default: all cores)" << std::endl;
+    std::cout << "  -d <dir>            Corpus and database directory, reused across runs" << std::endl;
+    std::cout << "                      (default /tmp/cbir_e2e)" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Examples:" << std::endl;
+    std::cout << "  " << programName << " -o bench_before.json" << std::endl;
+    std::cout << "  " << programName << " -f Histogram -s 640x480 -r 20" << std::endl;
+    std::cout << "  " << programName << " -E 1000,10000 -F baseline,histogram,dnn_embedding -o e2e.json" << std::endl;
+}
+
+Summary summarize(std::vector<double> values) {
+    Summary s;
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    double sum = 0.0;
+    for (double v : values) {
+        sum += v;
+    }
+    s.mean = sum / n;
+    s.median = (n % 2 == 1) ? values[n / 2] : 0.5 * (values[n / 2 - 1] + values[n / 2]);
+    s.min = values.front();
+    s.max = values.back();
+    double var = 0.0;
+    for (double v : values) {
+        var += (v - s.mean) * (v - s.mean);
+    }
+    s.stddev = n > 1 ? std::sqrt(var / (n - 1)) : 0.0;
+    return s;
+}
+
+// Time op() (which returns a float result) over config.repetitions
+// repetitions, after calibrating the iteration count and warming up
+template <typename Op>
+BenchResult runBenchmark(const BenchConfig& config, const std::string& group, const std::string& name,
+                         const std::string& shape, double pixels, double bytes, Op op) {
+    typedef std::chrono::steady_clock Clock;
+    BenchResult result;
+    result.group = group;
+    result.name = name;
+    result.shape = shape;
+    result.pixelsPerOp = pixels;
+    result.bytesPerOp = bytes;
+
+    // Calibrate: double the batch until it lasts a tenth of a repetition
+    size_t batch = 1;
+    while (true) {
+        auto start = Clock::now();
+        for (size_t i = 0; i < batch; i++) {
+            sink = sink + op();
+        }
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        if (ms >= config.minRepMs / 10.0 || batch >= (size_t(1) << 30)) {
+            double perOp = std::max(ms / batch, 1e-6);
+            result.iterations = std::max<size_t>(1, static_cast<size_t>(config.minRepMs / perOp));
+            break;
+        }
+        batch *= 2;
+    }
+
+    for (int w = 0; w < config.warmup; w++) {
+        for (size_t i = 0; i < result.iterations; i++) {
+            sink = sink + op();
+        }
+    }
+
+    result.nsPerOp.reserve(config.repetitions);
+    size_t allocsBefore = allocCount.load();
+    size_t bytesBefore = allocBytes.load();
+    for (int r = 0; r < config.repetitions; r++) {
+        auto start = Clock::now();
+        for (size_t i = 0; i < result.iterations; i++) {
+            sink = sink + op();
+        }
+        double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        result.nsPerOp.push_back(ns / result.iterations);
+    }
+    double ops = static_cast<double>(result.iterations) * config.repetitions;
+    result.allocsPerOp = (allocCount.load() - allocsBefore) / ops;
+    result.allocBytesPerOp = (allocBytes.load() - bytesBefore) / ops;
+    return result;
+}
+
+// Deterministic photo-like image: smooth colour gradients with a bright
+// top band (so the sky detector has work to do) plus pixel noise
+cv::Mat makeSyntheticImage(int width, int height, unsigned int seed) {
+    cv::Mat image(height, width, CV_8UC3);
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> noise(-24, 24);
+
+    for (int y = 0; y < height; y++) {
+        cv::Vec3b* row = image.ptr<cv::Vec3b>(y);
+        bool sky = y < height / 3;
+        for (int x = 0; x < width; x++) {
+            int b = sky ? 200 : 60 + (120 * x) / width;
+            int g = sky ? 150 : 40 + (160 * y) / height;
+            int r = sky ? 90 : 128 + (100 * (x + y)) / (width + height);
+            row[x][0] = static_cast<uchar>(std::min(255, std::max(0, b + noise(rng))));
+            row[x][1] = static_cast<uchar>(std::min(255, std::max(0, g + noise(rng))));
+            row[x][2] = static_cast<uchar>(std::min(255, std::max(0, r + noise(rng))));
+        }
+    }
+    return image;
+}
+
+// Random feature with the value range of the given type: pixel values,
+// histograms summing to 1, or gaussian embeddings
+FeatureVector makeSyntheticFeature(size_t dim, FeatureType type, std::mt19937& rng) {
+    FeatureVector feature(dim, type);
+    if (type == FeatureType::BASELINE) {
+        std::uniform_real_distribution<float> pixel(0.0f, 255.0f);
+        for (auto& v : feature.data) {
+            v = std::round(pixel(rng));
+        }
+    } else if (type == FeatureType::DNN_EMBEDDING) {
+        std::normal_distribution<float> gauss(0.0f, 1.0f);
+        for (auto& v : feature.data) {
+            v = gauss(rng);
+        }
+    } else {
+        // Sparse like real histograms: most bins empty
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        float sum = 0.0f;
+        for (auto& v : feature.data) {
+            v = unit(rng) < 0.25f ? unit(rng) : 0.0f;
+            sum += v;
+        }
+        for (auto& v : feature.data) {
+            v /= std::max(sum, 1e-6f);
+        }
+    }
+    return feature;
+}
+
+std::vector<BenchResult> runExtractorBenchmarks(const BenchConfig& config, const std::vector<cv::Size>& sizes) {
+    std::vector<BenchResult> results;
+    auto wanted = [&](const std::string& name) {
+        return config.filter.empty() || name.find(config.filter) != std::string::npos;
+    };
+
+    for (const auto& size : sizes) {
+        cv::Mat image;  // Generated on first use, so filtered runs skip it
+        std::string shape = std::to_string(size.width) + "x" + std::to_string(size.height);
+        double pixels = static_cast<double>(size.width) * size.height;
+        double imageBytes = pixels * 3;
+        FeatureVector feature;
+
+        auto run = [&](const std::string& name, double opPixels, double bytes, const std::function<float()>& op) {
+            if (!wanted(name)) {
+                return;
+            }
+            if (image.empty()) {
+                image = makeSyntheticImage(size.width, size.height, 42);
+            }
+            std::cerr << "  " << name << " " << shape << "..." << std::endl;
+            results.push_back(runBenchmark(config, "extractor", name, shape, opPixels, bytes, op));
+        };
+
+        // The baseline reads only the centre 7x7 block
+        run("extractBaseline", 7 * 7, 7 * 7 * 3, [&]() {
+            extractBaseline(image, feature);
+            return feature.data[0];
+        });
+        run("extractHistogram", pixels, imageBytes, [&]() {
+            extractHistogram(image, feature, 16);
+            return feature.data[0];
+        });
+        run("extractMultiHistogram", pixels, imageBytes, [&]() {
+            extractMultiHistogram(image, feature, 8, true);
+            return feature.data[0];
+        });
+        run("extractTextureColor", pixels, imageBytes, [&]() {
+            extractTextureColor(image, feature, 8, 8);
+            return feature.data[0];
+        });
+        run("extractCustom", pixels, imageBytes, [&]() {
+            extractCustom(image, feature);
+            return feature.data[0];
+        });
+
+        cv::Mat magnitude;
+        run("computeGradientMagnitude", pixels, imageBytes, [&]() {
+            computeGradientMagnitude(image, magnitude);
+            return static_cast<float>(magnitude.ptr<uchar>(0)[0]);
+        });
+
+        if (wanted("computeMagnitudeHistogram")) {
+            if (image.empty()) {
+                image = makeSyntheticImage(size.width, size.height, 42);
+            }
+            computeGradientMagnitude(image, magnitude);
+            std::vector<float> hist;
+            run("computeMagnitudeHistogram", pixels, pixels, [&]() {
+                computeMagnitudeHistogram(magnitude, hist, 8);
+                return hist[0];
+            });
+        }
+    }
+    return results;
+}
+
+std::vector<BenchResult> runDistanceBenchmarks(const BenchConfig& config) {
+    std::vector<BenchResult> results;
+    std::mt19937 rng(7);
+
+    // Dimensions produced by the extractors with the cbir_build defaults
+    FeatureVector baseA = makeSyntheticFeature(147, FeatureType::BASELINE, rng);
+    FeatureVector baseB = makeSyntheticFeature(147, FeatureType::BASELINE, rng);
+    FeatureVector histA = makeSyntheticFeature(4096, FeatureType::HISTOGRAM, rng);
+    FeatureVector histB = makeSyntheticFeature(4096, FeatureType::HISTOGRAM, rng);
+    FeatureVector multiA = makeSyntheticFeature(1024, FeatureType::MULTI_HISTOGRAM, rng);
+    FeatureVector multiB = makeSyntheticFeature(1024, FeatureType::MULTI_HISTOGRAM, rng);
+    FeatureVector texA = makeSyntheticFeature(520, FeatureType::TEXTURE_COLOR, rng);
+    FeatureVector texB = makeSyntheticFeature(520, FeatureType::TEXTURE_COLOR, rng);
+    FeatureVector dnnA = makeSyntheticFeature(512, FeatureType::DNN_EMBEDDING, rng);
+    FeatureVector dnnB = makeSyntheticFeature(512, FeatureType::DNN_EMBEDDING, rng);
+    FeatureVector customA = makeSyntheticFeature(30, FeatureType::CUSTOM, rng);
+    FeatureVector customB = makeSyntheticFeature(30, FeatureType::CUSTOM, rng);
+    FeatureVector unitA = dnnA, unitB = dnnB;
+    unitA.normalize();
+    unitB.normalize();
+    std::vector<float> coarse(8 * 8 * 8);
+    const float inf = std::numeric_limits<float>::infinity();
+
+    auto run = [&](const std::string& name, size_t dim, const std::function<float()>& op) {
+        if (!config.filter.empty() && name.find(config.filter) == std::string::npos) {
+            return;
+        }
+        std::cerr << "  " << name << " dim=" << dim << "..." << std::endl;
+        // Both operands are read once
+        results.push_back(runBenchmark(config, "distance", name, "dim=" + std::to_string(dim), 0.0,
+                                       2.0 * dim * sizeof(float), op));
+    };
+
+    run("sumSquaredDifference", 147, [&]() { return sumSquaredDifference(baseA, baseB); });
+    run("sumSquaredDifferenceBounded", 147, [&]() {
+        return sumSquaredDifferenceBounded(baseA, baseB, inf, nullptr, 16, nullptr);
+    });
+    run("l1Distance", 147, [&]() { return l1Distance(baseA, baseB); });
+    run("l2Distance", 147, [&]() { return l2Distance(baseA, baseB); });
+    run("histogramIntersectionDistance", 4096, [&]() { return histogramIntersectionDistance(histA, histB); });
+    run("histogramIntersection(raw)", 4096, [&]() {
+        return histogramIntersection(histA.data.data(), histB.data.data(), histA.size());
+    });
+    run("downsampleHistogram", 4096, [&]() {
+        downsampleHistogram(histA.data.data(), 16, coarse.data());
+        return coarse[0];
+    });
+    run("computeDistance(multi_histogram)", 1024, [&]() {
+        return computeDistance(multiA, multiB, FeatureType::MULTI_HISTOGRAM);
+    });
+    run("computeDistance(texture_color)", 520, [&]() {
+        return computeDistance(texA, texB, FeatureType::TEXTURE_COLOR);
+    });
+    run("cosineDistance", 512, [&]() { return cosineDistance(dnnA, dnnB); });
+    run("normalizedCosineDistance", 512, [&]() { return normalizedCosineDistance(unitA, unitB); });
+    run("computeDistance(custom)", 30, [&]() { return computeDistance(customA, customB, FeatureType::CUSTOM); });
+    return results;
+}
+
+std::string jsonString(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out + "\"";
+}
+
+// Timestamp, then the compiler and machine a run is only comparable with
+void writeBuildContext(std::ostream& out) {
+    out << "    \"compiler\": " << jsonString(__VERSION__) << ",\n";
+    out << "    \"opencv\": " << jsonString(CV_VERSION) << ",\n";
+#ifdef __AVX2__
+    out << "    \"avx2\": true,\n";
+#else
+    out << "    \"avx2\": false,\n";
+#endif
+    out << "    \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+}
+
+std::string utcTimestamp() {
+    char timestamp[32];
+    std::time_t now = std::time(nullptr);
+    std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    return timestamp;
+}
+
+// One object per benchmark, keyed by group/name/shape so runs can be diffed
+void writeJSON(std::ostream& out, const BenchConfig& config, const std::vector<BenchResult>& results) {
+    out << std::setprecision(6);
+    out << "{\n";
+    out << "  \"tool\": \"cbir_bench\",\n";
+    out << "  \"mode\": \"micro\",\n";
+    out << "  \"timestamp\": " << jsonString(utcTimestamp()) << ",\n";
+    out << "  \"context\": {\n";
+    writeBuildContext(out);
+    out << "    \"repetitions\": " << config.repetitions << ",\n";
+    out << "    \"warmup\": " << config.warmup << ",\n";
+    out << "    \"min_repetition_ms\": " << config.minRepMs << "\n";
+    out << "  },\n";
+    out << "  \"results\": [";
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        Summary s = summarize(r.nsPerOp);
+        double opsPerSec = 1e9 / s.median;
+        out << (i == 0 ? "\n" : ",\n");
+        out << "    {\"group\": " << jsonString(r.group) << ", \"name\": " << jsonString(r.name)
+            << ", \"shape\": " << jsonString(r.shape) << ", \"iterations\": " << r.iterations
+            << ", \"repetitions\": " << r.nsPerOp.size() << ",\n";
+        out << "     \"ns_per_op\": {\"mean\": " << s.mean << ", \"median\": " << s.median
+            << ", \"min\": " << s.min << ", \"max\": " << s.max << ", \"stddev\": " << s.stddev
+            << ", \"cv\": " << s.stddev / s.mean << "},\n";
+        out << "     \"ops_per_sec\": " << opsPerSec << ", \"pixels_per_sec\": " << r.pixelsPerOp * opsPerSec
+            << ", \"gb_per_sec\": " << r.bytesPerOp * opsPerSec / 1e9 << ", \"allocs_per_op\": "
+            << r.allocsPerOp << ", \"alloc_bytes_per_op\": " << r.allocBytesPerOp << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+void printTable(const std::vector<BenchResult>& results) {
+    std::cout << std::left << std::setw(34) << "benchmark" << std::setw(11) << "shape" << std::right
+              << std::setw(13) << "median ns" << std::setw(8) << "cv %" << std::setw(13) << "min ns"
+              << std::setw(11) << "Mpix/s" << std::setw(9) << "GB/s" << std::setw(10) << "allocs"
+              << std::endl;
+    std::cout << std::fixed;
+    for (const auto& r : results) {
+        Summary s = summarize(r.nsPerOp);
+        double opsPerSec = 1e9 / s.median;
+        std::cout << std::left << std::setw(34) << r.name << std::setw(11) << r.shape << std::right
+                  << std::setprecision(1) << std::setw(13) << s.median << std::setw(8)
+                  << 100.0 * s.stddev / s.mean << std::setw(13) << s.min << std::setw(11);
+        if (r.pixelsPerOp > 0.0) {
+            std::cout << std::setprecision(1) << r.pixelsPerOp * opsPerSec / 1e6;
+        } else {
+            std::cout << "-";
+        }
+        std::cout << std::setprecision(2) << std::setw(9) << r.bytesPerOp * opsPerSec / 1e9
+                  << std::setprecision(1) << std::setw(10) << r.allocsPerOp << std::endl;
+    }
+    std::cout.unsetf(std::ios::floatfield);
+}
+
+// ---------------------------------------------------------------------------
+// End-to-end benchmark
+// ---------------------------------------------------------------------------
+
+// Query images are numbered far above any database image, so they come from
+// the same scenes without ever being in the database
+const size_t QUERY_FIRST_INDEX = 1000000000;
+
+struct E2EConfig {
+    std::vector<size_t> dbSizes;
+    std::vector<FeatureType> types;
+    std::vector<std::string> modes;
+    int queries;
+    int k;
+    int batch;
+    int numThreads;
+    std::string workDir;
+    SynthParams synth;
+
+    E2EConfig() : queries(100), k(10), batch(32), numThreads(0), workDir("/tmp/cbir_e2e") {}
+};
+
+struct Latency {
+    double p50, p99, mean;   // Milliseconds
+};
+
+struct ModeResult {
+    std::string mode;
+    std::string skipped;     // Why the mode did not run, empty if it did
+    double buildSeconds;
+    Latency latency;
+    double recall;           // Mean recall@K against the exact query
+    size_t indexBytes;
+
+    ModeResult() : buildSeconds(0.0), latency(), recall(0.0), indexBytes(0) {}
+};
+
+struct E2EResult {
+    FeatureType type;
+    size_t images;
+    double buildSeconds;
+    double loadMs;
+    size_t csvBytes;
+    Latency query;           // Target extraction plus exact scan
+    Latency scan;            // Exact scan of a prepared target
+    double batchQueriesPerSec;
+    std::vector<ModeResult> modes;
+
+    E2EResult() : type(FeatureType::BASELINE), images(0), buildSeconds(0.0), loadMs(0.0), csvBytes(0),
+                  query(), scan(), batchQueriesPerSec(0.0) {}
+};
+
+// Swallows the progress lines the library prints while it is being timed
+struct NullBuffer : std::streambuf {
+    int overflow(int c) override { return c; }
+};
+
+double msSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Nearest-rank percentiles
+Latency summarizeLatency(std::vector<double> ms) {
+    Latency l = {0.0, 0.0, 0.0};
+    if (ms.empty()) {
+        return l;
+    }
+    std::sort(ms.begin(), ms.end());
+    auto rank = [&](double p) {
+        size_t r = static_cast<size_t>(std::ceil(p * ms.size()));
+        return ms[std::min(ms.size(), std::max<size_t>(r, 1)) - 1];
+    };
+    double sum = 0.0;
+    for (double v : ms) {
+        sum += v;
+    }
+    l.p50 = rank(0.50);
+    l.p99 = rank(0.99);
+    l.mean = sum / ms.size();
+    return l;
+}
+
+// Generate images [first, first + count) into workDir/name, or reuse them
+// when a previous run left a matching corpus there
+int prepareCorpus(const E2EConfig& config, const std::string& name, size_t first, size_t count,
+                  std::string& dir, std::string& embeddingsCsv) {
+    const SynthParams& p = config.synth;
+    dir = config.workDir + "/" + name;
+    embeddingsCsv = dir + ".embeddings.csv";
+    std::string marker = dir + "/corpus.txt";
+
+    std::ostringstream stamp;
+    stamp << first << " " << count << " " << describeSynthParams(p);
+    std::ifstream existing(marker);
+    std::string line;
+    if (existing.is_open() && std::getline(existing, line) && line == stamp.str()) {
+        return 0;
+    }
+
+    std::cerr << "Generating " << count << " images in " << dir << "..." << std::endl;
+    if (mkdir(config.workDir.c_str(), 0755) != 0 && errno != EEXIST) {
+        std::cerr << "Error: Cannot create directory " << config.workDir << std::endl;
+        return -1;
+    }
+    if (writeSynthCorpus(dir, first, count, p, embeddingsCsv, config.numThreads) < 0) {
+        return -1;
+    }
+    std::ofstream out(marker);
+    out << stamp.str() << "\n";
+    return out ? 0 : -1;
+}
+
+// Build one index over the loaded database, then time its searches and
+// compare each answer with the exact one
+ModeResult runSearchMode(const CBIRSystem& cbir, const std::string& mode, const E2EConfig& config,
+                         const std::vector<FeatureVector>& targets,
+                         const std::vector<std::vector<MatchResult>>& exact) {
+    ModeResult result;
+    result.mode = mode;
+    FeatureType type = cbir.getFeatureType();
+    size_t n = cbir.getDatabaseSize();
+    bool metric = type == FeatureType::BASELINE || (type == FeatureType::DNN_EMBEDDING && cbir.isNormalized());
+
+    HNSWIndex hnsw;
+    IVFPQIndex ivfpq;
+    VPTree tree;
+    LSHIndex lsh;
+    ClusterIndex clusters;
+    std::function<std::vector<Neighbor>(const FeatureVector&)> search;
+
+    NullBuffer null;
+    std::streambuf* saved = std::cout.rdbuf(&null);
+    auto start = std::chrono::steady_clock::now();
+    int rc = 0;
+
+    if (mode == "hnsw") {
+        HNSWParams params;
+        params.numThreads = config.numThreads;
+        rc = hnsw.build(cbir.getFeatures(), type, cbir.isNormalized(), params);
+        search = [&](const FeatureVector& t) { return hnsw.search(t, config.k); };
+    } else if (mode == "ivfpq" && metric) {
+        IVFPQParams params;
+        params.numThreads = config.numThreads;
+        // Keep lists populated on small databases
+        params.nlist = static_cast<int>(std::min<size_t>(params.nlist, std::max<size_t>(1, n / 32)));
+        rc = ivfpq.build(cbir.getFeatures(), type, cbir.isNormalized(), params);
+        search = [&](const FeatureVector& t) { return ivfpq.search(t, config.k); };
+    } else if (mode == "vptree" && metric) {
+        rc = tree.build(cbir.getFeatures(), type, cbir.isNormalized(), config.numThreads);
+        search = [&](const FeatureVector& t) { return tree.search(t, config.k); };
+    } else if (mode == "lsh") {
+        LSHParams params;
+        params.numThreads = config.numThreads;
+        rc = lsh.build(cbir.getFeatures(), type, cbir.isNormalized(), params);
+        search = [&](const FeatureVector& t) { return lsh.search(t, config.k); };
+    } else if (mode == "cluster") {
+        ClusterParams params;
+        params.numThreads = config.numThreads;
+        params.k = static_cast<int>(std::min<size_t>(params.k, n));
+        rc = clusters.build(cbir, params);
+        search = [&](const FeatureVector& t) { return clusters.search(t, config.k); };
+    } else {
+        result.skipped = "needs baseline or dnn_embedding";
+    }
+    result.buildSeconds = msSince(start) / 1000.0;
+    std::cout.rdbuf(saved);
+
+    if (!result.skipped.empty()) {
+        return result;
+    }
+    if (rc != 0) {
+        result.skipped = "build failed";
+        return result;
+    }
+    // Index sizes are only known once built
+    if (mode == "hnsw") {
+        result.indexBytes = hnsw.memoryBytes();
+    } else if (mode == "ivfpq") {
+        result.indexBytes = ivfpq.memoryBytes();
+    } else if (mode == "vptree") {
+        result.indexBytes = tree.memoryBytes();
+    } else if (mode == "lsh") {
+        result.indexBytes = lsh.memoryBytes();
+    } else {
+        result.indexBytes = clusters.memoryBytes();
+    }
+
+    std::vector<double> ms;
+    double recall = 0.0;
+    for (size_t q = 0; q < targets.size(); q++) {
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<MatchResult> approx = cbir.toMatchResults(search(targets[q]));
+        ms.push_back(msSince(t0));
+        recall += recallAtK(exact[q], approx);
+    }
+    result.latency = summarizeLatency(ms);
+    result.recall = targets.empty() ? 0.0 : recall / targets.size();
+    return result;
+}
+
+// Build, save, reload and query one database
+int runEndToEnd(const E2EConfig& config, FeatureType type, size_t count, const std::string& dbDir,
+                const std::string& dbCsv, const std::string& queryDir, const std::string& queryCsv,
+                E2EResult& result) {
+    std::string typeName = featureTypeToString(type);
+    std::string featuresFile = dbDir + "." + typeName + ".csv";
+    result.type = type;
+    NullBuffer null;
+
+    // Build from the image files (DNN embeddings from their CSV) and save
+    {
+        CBIRSystem builder;
+        builder.setDNNCsvPath(dbCsv);
+        std::streambuf* saved = std::cout.rdbuf(&null);
+        auto start = std::chrono::steady_clock::now();
+        int built = builder.buildDatabase(dbDir, type);
+        result.buildSeconds = msSince(start) / 1000.0;
+        int rc = built > 0 ? builder.saveFeatures(featuresFile) : -1;
+        std::cout.rdbuf(saved);
+        if (built <= 0 || rc != 0) {
+            std::cerr << "Error: Failed to build " << typeName << " database from " << dbDir << std::endl;
+            return -1;
+        }
+        result.images = static_cast<size_t>(built);
+    }
+
+    // Reload the way cbir_query and the server do. Caches are off so every
+    // query below does its full work
+    CBIRSystem cbir;
+    cbir.setCacheCapacity(0, 0);
+    std::streambuf* saved = std::cout.rdbuf(&null);
+    auto start = std::chrono::steady_clock::now();
+    int loaded = cbir.loadFeatures(featuresFile);
+    result.loadMs = msSince(start);
+    std::cout.rdbuf(saved);
+    if (loaded <= 0) {
+        std::cerr << "Error: Failed to reload " << featuresFile << std::endl;
+        return -1;
+    }
+    struct stat st;
+    result.csvBytes = stat(featuresFile.c_str(), &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+    cbir.setDNNCsvPath(queryCsv);
+
+    // Single queries: extract the target, then the exact scan
+    std::vector<FeatureVector> targets;
+    std::vector<std::vector<MatchResult>> exact;
+    std::vector<double> queryMs, scanMs;
+    for (int q = 0; q < config.queries; q++) {
+        std::string path = queryDir + "/" + synthImageName(QUERY_FIRST_INDEX + q);
+        FeatureVector target;
+        auto t0 = std::chrono::steady_clock::now();
+        saved = std::cout.rdbuf(&null);
+        int rc = cbir.extractTargetFeature(path, target);
+        std::cout.rdbuf(saved);
+        if (rc != 0) {
+            std::cerr << "Error: Cannot extract query " << path << std::endl;
+            return -1;
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        exact.push_back(cbir.query(target, config.k));
+        scanMs.push_back(msSince(t1));
+        queryMs.push_back(msSince(t0));
+        targets.push_back(target);
+    }
+    result.query = summarizeLatency(queryMs);
+    result.scan = summarizeLatency(scanMs);
+
+    // Batched scans of the same prepared targets
+    start = std::chrono::steady_clock::now();
+    for (size_t first = 0; first < targets.size(); first += config.batch) {
+        size_t last = std::min(targets.size(), first + config.batch);
+        std::vector<FeatureVector> chunk(targets.begin() + first, targets.begin() + last);
+        cbir.queryBatch(chunk, std::vector<int>(chunk.size(), config.k));
+    }
+    double batchMs = msSince(start);
+    result.batchQueriesPerSec = batchMs > 0.0 ? targets.size() * 1000.0 / batchMs : 0.0;
+
+    for (const auto& mode : config.modes) {
+        std::cerr << "  " << typeName << " " << count << ": " << mode << "..." << std::endl;
+        result.modes.push_back(runSearchMode(cbir, mode, config, targets, exact));
+    }
+    return 0;
+}
+
+void printEndToEnd(const E2EConfig& config, const std::vector<E2EResult>& results) {
+    std::cout << std::fixed;
+    for (size_t i = 0; i < results.size(); i++) {
+        const E2EResult& r = results[i];
+        if (i == 0 || results[i - 1].type != r.type) {
+            std::cout << std::endl << "== " << featureTypeToString(r.type) << " ==" << std::endl;
+            std::cout << std::setw(10) << "images" << std::setw(12) << "build img/s" << std::setw(11) << "load ms"
+                      << std::setw(19) << "query p50/p99 ms" << std::setw(18) << "scan p50/p99 ms"
+                      << std::setw(13) << "batch q/s" << std::endl;
+        }
+        std::cout << std::setprecision(1) << std::setw(10) << r.images << std::setw(12)
+                  << r.images / std::max(r.buildSeconds, 1e-9) << std::setw(11) << r.loadMs
+                  << std::setprecision(2) << std::setw(11) << r.query.p50 << " /" << std::setw(6) << r.query.p99
+                  << std::setw(10) << r.scan.p50 << " /" << std::setw(6) << r.scan.p99
+                  << std::setprecision(1) << std::setw(13) << r.batchQueriesPerSec << std::endl;
+        for (const auto& m : r.modes) {
+            std::cout << std::setw(14) << m.mode << ": ";
+            if (!m.skipped.empty()) {
+                std::cout << "skipped (" << m.skipped << ")" << std::endl;
+                continue;
+            }
+            std::cout << std::setprecision(2) << "build " << m.buildSeconds << " s, p50 " << m.latency.p50
+                      << " ms, p99 " << m.latency.p99 << " ms, recall@" << config.k << " "
+                      << std::setprecision(3) << m.recall << std::setprecision(1) << ", "
+                      << m.indexBytes / (1024.0 * 1024.0) << " MB" << std::endl;
+        }
+    }
+    std::cout.unsetf(std::ios::floatfield);
+}
+
+void writeLatency(std::ostream& out, const Latency& l) {
+    out << "{\"p50\": " << l.p50 << ", \"p99\": " << l.p99 << ", \"mean\": " << l.mean << "}";
+}
+
+// One object per (feature type, database size)
+void writeEndToEndJSON(std::ostream& out, const E2EConfig& config, const std::vector<E2EResult>& results) {
+    out << std::setprecision(6);
+    out << "{\n";
+    out << "  \"tool\": \"cbir_bench\",\n";
+    out << "  \"mode\": \"end_to_end\",\n";
+    out << "  \"timestamp\": " << jsonString(utcTimestamp()) << ",\n";
+    out << "  \"context\": {\n";
+    writeBuildContext(out);
+    out << "    \"image_size\": \"" << config.synth.width << "x" << config.synth.height << "\",\n";
+    out << "    \"scenes\": " << config.synth.scenes << ",\n";
+    out << "    \"queries\": " << config.queries << ",\n";
+    out << "    \"k\": " << config.k << ",\n";
+    out << "    \"batch\": " << config.batch << "\n";
+    out << "  },\n";
+    out << "  \"results\": [";
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const E2EResult& r = results[i];
+        out << (i == 0 ? "\n" : ",\n");
+        out << "    {\"feature_type\": " << jsonString(featureTypeToString(r.type)) << ", \"images\": "
+            << r.images << ", \"build_seconds\": " << r.buildSeconds << ", \"images_per_sec\": "
+            << r.images / std::max(r.buildSeconds, 1e-9) << ", \"load_ms\": " << r.loadMs
+            << ", \"csv_bytes\": " << r.csvBytes << ",\n";
+        out << "     \"query_ms\": ";
+        writeLatency(out, r.query);
+        out << ", \"scan_ms\": ";
+        writeLatency(out, r.scan);
+        out << ", \"batch_queries_per_sec\": " << r.batchQueriesPerSec << ",\n";
+        out << "     \"modes\": [";
+        for (size_t m = 0; m < r.modes.size(); m++) {
+            const ModeResult& mode = r.modes[m];
+            out << (m == 0 ? "" : ", ") << "\n       {\"mode\": " << jsonString(mode.mode);
+            if (!mode.skipped.empty()) {
+                out << ", \"skipped\": " << jsonString(mode.skipped) << "}";
+                continue;
+            }
+            out << ", \"build_seconds\": " << mode.buildSeconds << ", \"latency_ms\": ";
+            writeLatency(out, mode.latency);
+            out << ", \"recall\": " << mode.recall << ", \"index_bytes\": " << mode.indexBytes << "}";
+        }
+        out << "]}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+int runEndToEndBenchmarks(const E2EConfig& config, const std::string& outputFile) {
+    std::string tag = std::to_string(config.synth.width) + "x" + std::to_string(config.synth.height);
+    std::string queryDir, queryCsv;
+    if (prepareCorpus(config, "queries" + std::to_string(config.queries) + "_" + tag, QUERY_FIRST_INDEX,
+                      config.queries, queryDir, queryCsv) != 0) {
+        return -1;
+    }
+
+    std::vector<E2EResult> results;
+    for (FeatureType type : config.types) {
+        for (size_t count : config.dbSizes) {
+            std::string dbDir, dbCsv;
+            if (prepareCorpus(config, "db" + std::to_string(count) + "_" + tag, 0, count, dbDir, dbCsv) != 0) {
+                return -1;
+            }
+            std::cerr << "Benchmarking " << featureTypeToString(type) << " with " << count << " images..."
+                      << std::endl;
+            E2EResult result;
+            if (runEndToEnd(config, type, count, dbDir, dbCsv, queryDir, queryCsv, result) != 0) {
+                return -1;
+            }
+            results.push_back(result);
+        }
+    }
+
+    if (outputFile == "-") {
+        writeEndToEndJSON(std::cout, config, results);
+        return 0;
+    }
+    printEndToEnd(config, results);
+    if (!outputFile.empty()) {
+        std::ofstream file(outputFile);
+        if (!file.is_open()) {
+            std::cerr << "Error: Cannot open file for writing: " << outputFile << std::endl;
+            return -1;
+        }
+        writeEndToEndJSON(file, config, results);
+        std::cout << std::endl << "Saved results to " << outputFile << std::endl;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    E2EConfig e2e;
+    std::string sizeList = "320x240,640x480,1280x720,1920x1080";
+    std::string outputFile;
+    std::string dbSizeList;
+    std::string typeList = "baseline,histogram,multi_histogram,texture_color,custom,dnn_embedding";
+    std::string modeList = "hnsw,ivfpq,vptree,lsh,cluster";
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            sizeList = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            config.repetitions = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            config.warmup = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            config.minRepMs = std::atof(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            config.filter = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outputFile = argv[++i];
+        } else if (strcmp(argv[i], "-E") == 0 && i + 1 < argc) {
+            dbSizeList = argv[++i];
+        } else if (strcmp(argv[i], "-F") == 0 && i + 1 < argc) {
+            typeList = argv[++i];
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            modeList = argv[++i];
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            e2e.queries = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            e2e.k = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            e2e.batch = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            e2e.numThreads = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            e2e.workDir = argv[++i];
+        } else if (strcmp(argv[i], "-h") == 0) {
+            printUsage(argv[0]);
+            return 0;
+        } else {
+            std::cerr << "Unknown option: " << argv[i] << std::endl;
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (config.repetitions <= 0 || config.warmup < 0 || config.minRepMs <= 0.0) {
+        std::cerr << "Error: Repetitions and duration must be positive" << std::endl;
+        return -1;
+    }
+
+    std::vector<cv::Size> sizes;
+    std::stringstream ss(sizeList);
+    std::string token;
+    while (std::getline(ss, token, ',')) {
+        int width = 0, height = 0;
+        char x = 0;
+        std::stringstream dims(token);
+        if (!(dims >> width >> x >> height) || x != 'x' || width < 8 || height < 8) {
+            std::cerr << "Error: Invalid image size " << token << " (expected WxH, at least 8x8)" << std::endl;
+            return -1;
+        }
+        sizes.push_back(cv::Size(width, height));
+    }
+    if (sizes.empty()) {
+        std::cerr << "Error: No image sizes given" << std::endl;
+        return -1;
+    }
+
+    if (!dbSizeList.empty()) {
+        std::stringstream sizeStream(dbSizeList);
+        while (std::getline(sizeStream, token, ',')) {
+            size_t count = std::strtoull(token.c_str(), nullptr, 10);
+            if (count < 2) {
+                std::cerr << "Error: Invalid database size " << token << std::endl;
+                return -1;
+            }
+            e2e.dbSizes.push_back(count);
+        }
+        std::stringstream typeStream(typeList);
+        while (std::getline(typeStream, token, ',')) {
+            FeatureType type = stringToFeatureType(token);
+            if (featureTypeToString(type) != token) {
+                std::cerr << "Error: Unknown feature type " << token << std::endl;
+                return -1;
+            }
+            e2e.types.push_back(type);
+        }
+        std::stringstream modeStream(modeList);
+        while (std::getline(modeStream, token, ',')) {
+            if (token != "hnsw" && token != "ivfpq" && token != "vptree" && token != "lsh" && token != "cluster") {
+                std::cerr << "Error: Unknown search mode " << token << std::endl;
+                return -1;
+            }
+            e2e.modes.push_back(token);
+        }
+        if (e2e.queries <= 0 || e2e.k <= 0 || e2e.batch <= 0) {
+            std::cerr << "Error: Queries, K and batch size must be positive" << std::endl;
+            return -1;
+        }
+        e2e.synth.width = sizes[0].width;
+        e2e.synth.height = sizes[0].height;
+        return runEndToEndBenchmarks(e2e, outputFile);
+    }
+
+    // Progress goes to stderr so "-o -" leaves clean JSON on stdout
+    std::cerr << "Running extractor benchmarks..." << std::endl;
+    std::vector<BenchResult> results = runExtractorBenchmarks(config, sizes);
+    std::cerr << "Running distance benchmarks..." << std::endl;
+    std::vector<BenchResult> distances = runDistanceBenchmarks(config);
+    results.insert(results.end(), distances.begin(), distances.end());
+
+    if (results.empty()) {
+        std::cerr << "Error: No benchmark matches filter " << config.filter << std::endl;
+        return -1;
+    }
+
+    if (outputFile == "-") {
+        writeJSON(std::cout, config, results);
+        return 0;
+    }
+
+    printTable(results);
+    if (!outputFile.empty()) {
+        std::ofstream file(outputFile);
+        if (!file.is_open()) {
+            std::cerr << "Error: Cannot open file for writing: " << outputFile << std::endl;
+            return -1;
+        }
+        writeJSON(file, config, results);
+        std::cout << std::endl << "Saved results to " << outputFile << std::endl;
+    }
+    return 0;
+}
@@ -2,17 +2,21 @@
   Name: Borui Chen
   Date: 2026-02-03
   Purpose: Build feature database for CBIR system.
-  Usage: ./cbir_build -d <image_dir> -f <feature_type> -o <output.csv> [-c <dnn_csv>]
+  Usage: ./cbir_build -d <image_dir> -f <feature_type> -o <output.csv> [-c <dnn_csv>] [-s <shards>]
+         [-j <threads>] [-T] [-P <metrics_file>] [-X <trace.json>]
 */
 
 #include "cbir.h"
 #include "feature.h"
+#include "metrics.h"
+#include "thumbnail.h"
+#include "trace.h"
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
 
 void printUsage(const char* programName) {
-    std::cout << "Usage: " << programName << " -d <image_dir> -f <feature_type> -o <output.csv> [-c <dnn_csv>]" << std::endl;
+    std::cout << "Usage: " << programName << " -d <image_dir> -f <feature_type> -o <output.csv> [-c <dnn_csv>] [-s <shards>] [-j <threads>] [-T] [-P <metrics_file>] [-X <trace.json>]" << std::endl;
     std::cout << std::endl;
     std::cout << "Options:" << std::endl;
     std::cout << "  -d <image_dir>     Directory containing images" << std::endl;
@@ -25,12 +29,24 @@ void printUsage(const char* programName) {
     std::cout << "                       custom          - Custom features (Task 7)" << std::endl;
     std::cout << "  -o <output.csv>    Output feature database file" << std::endl;
     std::cout << "  -c <dnn_csv>       Path to DNN embeddings CSV (required for dnn_embedding)" << std::endl;
+    std::cout << "  -s <shards>        Split the output into <shards> files by hash of image name" << std::endl;
+    std::cout << "                     (output.shard0.csv, output.shard1.csv, ...)" << std::endl;
+    std::cout << "  -j <threads>       Extract features on <threads> threads (default 1, 0 = all cores)" << std::endl;
+    std::cout << "  -T                 Also write result thumbnails for the GUI to <output.csv>.thumbs" << std::endl;
+    std::cout << "  -P <metrics_file>  Write time per stage and counters on exit: Prometheus text for" << std::endl;
+    std::cout << "                     *.prom, JSON otherwise, - for JSON on stdout" << std::endl;
+    std::cout << "  -X <trace.json>    Record a timeline (per image: read, decode, extract; file writes)" << std::endl;
+    std::cout << "                     as Chrome trace JSON for chrome://tracing or ui.perfetto.dev" << std::endl;
     std::cout << "  -h                 Show this help message" << std::endl;
     std::cout << std::endl;
     std::cout << "Examples:" << std::endl;
     std::cout << "  " << programName << " -d data/olympus -f baseline -o features_baseline.csv" << std::endl;
     std::cout << "  " << programName << " -d data/olympus -f histogram -o features_hist.csv" << std::endl;
     std::cout << "  " << programName << " -d data/olympus -f dnn_embedding -c resnet18_features.csv -o features_dnn.csv" << std::endl;
+    std::cout << "  " << programName << " -d data/olympus -f histogram -o features_hist.csv -s 4" << std::endl;
+    std::cout << "  " << programName << " -d data/olympus -f custom -o features_custom.csv -j 0" << std::endl;
+    std::cout << "  " << programName << " -d data/olympus -f texture_color -o features_texture.csv -P build.prom" << std::endl;
+    std::cout << "  " << programName << " -d data/olympus -f histogram -o features_hist.csv -X build_trace.json" << std::endl;
 }
 
 int main(int argc, char* argv[]) {
@@ -38,6 +54,11 @@ int main(int argc, char* argv[]) {
     std::string featureTypeStr;
     std::string outputFile;
     std::string dnnCsvPath;
+    int numShards = 1;
+    int numThreads = 1;
+    bool writeThumbnails = false;
+    std::string metricsFile;
+    std::string traceFile;
 
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
@@ -49,6 +70,16 @@ int main(int argc, char* argv[]) {
             outputFile = argv[++i];
         } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
             dnnCsvPath = argv[++i];
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            numShards = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            numThreads = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-T") == 0) {
+            writeThumbnails = true;
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } else if (strcmp(argv[i], "-X") == 0 && i + 1 < argc) {
+            traceFile = argv[++i];
         } else if (strcmp(argv[i], "-h") == 0) {
             printUsage(argv[0]);
             return 0;
@@ -65,6 +96,14 @@ int main(int argc, char* argv[]) {
         printUsage(argv[0]);
         return -1;
     }
+    if (numShards < 1) {
+        std::cerr << "Error: Shard count must be at least 1" << std::endl;
+        return -1;
+    }
+    if (numThreads < 0) {
+        std::cerr << "Error: Thread count must be 0 (all cores) or more" << std::endl;
+        return -1;
+    }
 
     // Convert feature type string to enum
     FeatureType featureType = stringToFeatureType(featureTypeStr);
@@ -86,6 +125,10 @@ int main(int argc, char* argv[]) {
     }
     std::cout << std::endl;
 
+    // Exported when main returns, whether or not the build succeeded
+    MetricsExport metricsExport(metricsFile);
+    TraceExport traceExport(traceFile);
+
     // Create CBIR system
     CBIRSystem cbir;
 
@@ -94,18 +137,36 @@ int main(int argc, char* argv[]) {
     }
 
     // Build database
-    int count = cbir.buildDatabase(imageDir, featureType);
+    int count = cbir.buildDatabase(imageDir, featureType, numThreads);
     if (count < 0) {
         std::cerr << "Error: Failed to build database" << std::endl;
         return -1;
     }
 
     // Save features
-    if (cbir.saveFeatures(outputFile) != 0) {
+    int saved = (numShards > 1) ? cbir.saveShards(outputFile, numShards) : cbir.saveFeatures(outputFile);
+    if (saved != 0) {
         std::cerr << "Error: Failed to save features" << std::endl;
         return -1;
     }
 
+    // Thumbnails keyed by the paths the GUI opens (see imageFilePath())
+    if (writeThumbnails) {
+        std::vector<std::string> paths;
+        for (const auto& path : cbir.getImagePaths()) {
+            paths.push_back(cbir.imageFilePath(path));
+        }
+        ThumbnailCache thumbnails;
+        std::string thumbnailFile = outputFile + ".thumbs";
+        int made = thumbnails.open(thumbnailFile) < 0 ? -1 : thumbnails.addImages(paths, numThreads);
+        if (made < 0) {
+            std::cerr << "Error: Failed to write thumbnails" << std::endl;
+            return -1;
+        }
+        std::cout << "Saved " << thumbnails.size() << " thumbnails (" << made << " new) to " << thumbnailFile
+                  << std::endl;
+    }
+
     std::cout << std::endl;
     std::cout << "Successfully built feature database with " << count << " images" << std::endl;
 
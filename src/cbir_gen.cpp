@@ -0,0 +1,183 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Generate a synthetic image corpus (and matching DNN embeddings)
+           for scale-testing the build, query and index tools.
+  Usage: ./cbir_gen -o <output_dir> -n <count> [options]
+*/
+
+#include "synth.h"
+#include "parallel.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+void printUsage(const char* programName) {
+    std::cout << "Usage: " << programName << " -o <output_dir> -n <count> [options]" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -o <output_dir>    Directory to write the images into (created if missing)" << std::endl;
+    std::cout << "  -n <count>         Number of images" << std::endl;
+    std::cout << "  -F <first>         Index of the first image (default: 0), to generate a" << std::endl;
+    std::cout << "                     large corpus in chunks or a disjoint query set;" << std::endl;
+    std::cout << "                     near-duplicates only copy images of the same run" << std::endl;
+    std::cout << "  -s <WxH>           Image size (default: 640x480)" << std::endl;
+    std::cout << "  -S <scenes>        Number of scenes (default: count / 500, at least 16)" << std::endl;
+    std::cout << "  -p <palette>       natural or random colours (default: natural)" << std::endl;
+    std::cout << "  -T <strength>      Ground texture strength, 0 = flat (default: 1.0)" << std::endl;
+    std::cout << "  -D <rate>          Fraction of near-duplicate images (default: 0.01)" << std::endl;
+    std::cout << "  -f <format>        jpg or png (default: jpg)" << std::endl;
+    std::cout << "  -q <quality>       JPEG quality (default: 90)" << std::endl;
+    std::cout << "  -d <per_dir>       Images per leaf directory, in a <dir>/000/001/ tree;" << std::endl;
+    std::cout << "                     0 = one flat directory (default: 1000)" << std::endl;
+    std::cout << "  -c <dnn_csv>       Also write DNN embeddings in the cbir_build -c format" << std::endl;
+    std::cout << "  -e <dim>           Embedding dimension (default: 512)" << std::endl;
+    std::cout << "  -R <seed>          Random seed (default: 42)" << std::endl;
+    std::cout << "  -j <threads>       Worker threads (default: all cores)" << std::endl;
+    std::cout << "  -h                 Show this help message" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Every image is a pure function of the options and its index, so the same" << std::endl;
+    std::cout << "options always produce the same corpus. <output_dir>/manifest.csv lists each" << std::endl;
+    std::cout << "image's scene and, for near-duplicates, the image it was derived from." << std::endl;
+    std::cout << std::endl;
+    std::cout << "Examples:" << std::endl;
+    std::cout << "  " << programName << " -o data/synth100k -n 100000 -c data/synth100k_dnn.csv" << std::endl;
+    std::cout << "  " << programName << " -o data/synth1m -n 1000000 -s 320x240 -f png -d 2000" << std::endl;
+    std::cout << "  " << programName << " -o data/queries -n 1000 -F 1000000000 -d 0" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string outputDir;
+    std::string sizeStr = "640x480";
+    std::string paletteStr = "natural";
+    std::string dnnCsvPath;
+    size_t count = 0;
+    size_t first = 0;
+    int scenes = 0;
+    int numThreads = 0;
+    SynthParams params;
+    params.duplicateRate = 0.01f;
+    params.imagesPerDir = 1000;
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outputDir = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            count = std::strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-F") == 0 && i + 1 < argc) {
+            first = std::strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            sizeStr = argv[++i];
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            scenes = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            paletteStr = argv[++i];
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            params.textureStrength = static_cast<float>(std::atof(argv[++i]));
+        } else if (strcmp(argv[i], "-D") == 0 && i + 1 < argc) {
+            params.duplicateRate = static_cast<float>(std::atof(argv[++i]));
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            params.format = argv[++i];
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            params.jpegQuality = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            params.imagesPerDir = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            dnnCsvPath = argv[++i];
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            params.embeddingDim = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+            params.seed = static_cast<unsigned int>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            numThreads = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-h") == 0) {
+            printUsage(argv[0]);
+            return 0;
+        } else {
+            std::cerr << "Unknown option: " << argv[i] << std::endl;
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    // Validate arguments
+    if (outputDir.empty() || count == 0) {
+        std::cerr << "Error: Missing required arguments" << std::endl;
+        printUsage(argv[0]);
+        return -1;
+    }
+    char x = 0;
+    std::stringstream dims(sizeStr);
+    if (!(dims >> params.width >> x >> params.height) || x != 'x' || params.width < 8 || params.height < 8) {
+        std::cerr << "Error: Invalid image size " << sizeStr << " (expected WxH, at least 8x8)" << std::endl;
+        return -1;
+    }
+    if (paletteStr == "natural") {
+        params.palette = SynthPalette::NATURAL;
+    } else if (paletteStr == "random") {
+        params.palette = SynthPalette::RANDOM;
+    } else {
+        std::cerr << "Error: Unknown palette " << paletteStr << " (expected natural or random)" << std::endl;
+        return -1;
+    }
+    if (params.format != "jpg" && params.format != "png") {
+        std::cerr << "Error: Unknown format " << params.format << " (expected jpg or png)" << std::endl;
+        return -1;
+    }
+    if (params.duplicateRate < 0.0f || params.duplicateRate > 1.0f || params.textureStrength < 0.0f) {
+        std::cerr << "Error: Duplicate rate must be in [0, 1] and texture strength non-negative" << std::endl;
+        return -1;
+    }
+    if (params.jpegQuality < 0 || params.jpegQuality > 100 || params.imagesPerDir < 0 || params.embeddingDim < 1) {
+        std::cerr << "Error: Invalid quality, images per directory or embedding dimension" << std::endl;
+        return -1;
+    }
+    // Scenes are fixed by the options rather than by -F, so chunks of one
+    // corpus must be generated with the same -S (or the same -n)
+    params.scenes = scenes > 0 ? scenes : static_cast<int>(std::max<size_t>(16, count / 500));
+
+    std::cout << "CBIR Corpus Generator" << std::endl;
+    std::cout << "=====================" << std::endl;
+    std::cout << "Output directory: " << outputDir << std::endl;
+    std::cout << "Images: " << count << " (" << first << " to " << first + count - 1 << ")" << std::endl;
+    std::cout << "Image size: " << params.width << "x" << params.height << " " << params.format << std::endl;
+    std::cout << "Scenes: " << params.scenes << " (" << paletteStr << " palette)" << std::endl;
+    std::cout << "Near-duplicate rate: " << params.duplicateRate << std::endl;
+    if (params.imagesPerDir > 0) {
+        std::cout << "Images per directory: " << params.imagesPerDir << std::endl;
+    }
+    if (!dnnCsvPath.empty()) {
+        std::cout << "DNN CSV: " << dnnCsvPath << " (" << params.embeddingDim << " dimensions)" << std::endl;
+    }
+    std::cout << "Threads: " << (numThreads > 0 ? numThreads : defaultThreadCount()) << std::endl;
+    std::cout << std::endl;
+
+    // Report roughly every 1% (and at least every 1000 images)
+    auto start = std::chrono::steady_clock::now();
+    size_t step = std::max<size_t>(1000, count / 100);
+    size_t nextReport = step;
+    auto progress = [&](size_t done, size_t total) {
+        if (done < nextReport && done < total) {
+            return;
+        }
+        nextReport = done + step;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "  " << done << " / " << total << " images (" << static_cast<int>(done / std::max(seconds, 1e-3))
+                  << " images/s)" << std::endl;
+    };
+
+    int written = writeSynthCorpus(outputDir, first, count, params, dnnCsvPath, numThreads, progress);
+    if (written < 0) {
+        std::cerr << "Error: Failed to generate corpus" << std::endl;
+        return -1;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::endl;
+    std::cout << "Successfully generated " << written << " images in " << seconds << " s" << std::endl;
+    return 0;
+}
@@ -2,50 +2,80 @@
   Name: Borui Chen
   Date: 2026-02-03
   Purpose: GUI application for CBIR system using ImGui + OpenGL + GLFW
-  Usage: ./cbir_gui -d <image_dir> [-c <dnn_csv>]
+  Usage: ./cbir_gui -d <image_dir> [-c <dnn_csv>] [-B <megabytes>]
 */
 
 #include "cbir.h"
+#include "cluster.h"
 #include "feature.h"
+#include "knngraph.h"
+#include "thumbnail.h"
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
+// Core profile header: pixel buffer mapping and GL_BGR need GL 3 entry points
+#define GLFW_INCLUDE_GLCOREARB
+#define GL_GLEXT_PROTOTYPES
 #include <GLFW/glfw3.h>
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 #include <string>
+#include <cstdlib>
 #include <cstring>
 #include <filesystem>
 
+// Thumbnails uploaded per frame, so a large result set cannot stall a frame
+static const size_t THUMBNAIL_UPLOADS_PER_FRAME = 8;
+
+// Thumbnail atlas: ATLAS_PAGES textures of ATLAS_PAGE_SIZE^2 texels (187
+// slots each), filled through a ring of pixel buffers
+static const int ATLAS_PAGE_SIZE = 2048;
+static const int ATLAS_PAGES = 2;
+static const int ATLAS_UPLOAD_BUFFERS = 3;
+
+// Largest result count the slider offers
+static const int MAX_QUERY_RESULTS = 1000;
+
 // Texture structure for OpenGL
 typedef struct {
     GLuint texID;
     int width, height;
 } Texture;
 
-// Load OpenCV image to OpenGL texture
+// Load OpenCV image to OpenGL texture. BGR(A) pixels are uploaded as they
+// are and the driver swizzles them, so there is no CPU colour conversion
 Texture loadTextureFromMat(const cv::Mat& image) {
     Texture tex = {0, 0, 0};
     if (image.empty()) return tex;
 
-    cv::Mat rgbImage;
-    if (image.channels() == 3) {
-        cv::cvtColor(image, rgbImage, cv::COLOR_BGR2RGBA);
-    } else if (image.channels() == 1) {
-        cv::cvtColor(image, rgbImage, cv::COLOR_GRAY2RGBA);
-    } else {
-        rgbImage = image.clone();
+    cv::Mat bgrImage = image;
+    if (image.channels() == 1) {
+        cv::cvtColor(image, bgrImage, cv::COLOR_GRAY2BGR);
     }
+    GLenum format = bgrImage.channels() == 4 ? GL_BGRA : GL_BGR;
 
-    tex.width = rgbImage.cols;
-    tex.height = rgbImage.rows;
+    tex.width = bgrImage.cols;
+    tex.height = bgrImage.rows;
 
     glGenTextures(1, &tex.texID);
     glBindTexture(GL_TEXTURE_2D, tex.texID);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, tex.width, tex.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgbImage.data);
+    // Rows are step bytes apart and need not be 4-byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(bgrImage.step / bgrImage.elemSize()));
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, tex.width, tex.height, 0, format, GL_UNSIGNED_BYTE, bgrImage.data);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
     glBindTexture(GL_TEXTURE_2D, 0);
 
     return tex;
@@ -58,10 +88,214 @@ void deleteTexture(Texture& tex) {
     }
 }
 
+// Result thumbnails share a few large textures (pages) cut into
+// thumbnail-sized slots. A slot is reused for another image once it has
+// not been drawn for a frame, so texture memory stays fixed however many
+// results a query returns
+class ThumbnailAtlas {
+private:
+    struct Slot {
+        int page;
+        int x, y;               // Top-left texel
+        int width, height;      // Of the thumbnail in it
+        std::string path;       // Empty while free
+        uint64_t lastFrame;     // Last frame it was drawn or filled
+    };
+
+    std::vector<GLuint> pages;
+    std::vector<Slot> slots;
+    std::unordered_map<std::string, size_t> slotOf;
+    GLuint uploadBuffers[ATLAS_UPLOAD_BUFFERS] = {0};
+    size_t uploadBufferBytes = 0;
+    int nextBuffer = 0;
+    uint64_t frame = 0;
+
+    // Slot for path: its own, a free one, or the least recently drawn one
+    // that was not on screen in this or the previous frame. -1 when every
+    // slot is on screen
+    int acquire(const std::string& path) {
+        auto it = slotOf.find(path);
+        if (it != slotOf.end()) {
+            slots[it->second].lastFrame = frame;
+            return static_cast<int>(it->second);
+        }
+        int chosen = -1;
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (slots[i].path.empty()) {
+                chosen = static_cast<int>(i);
+                break;
+            }
+            if (slots[i].lastFrame + 1 < frame &&
+                (chosen < 0 || slots[i].lastFrame < slots[chosen].lastFrame)) {
+                chosen = static_cast<int>(i);
+            }
+        }
+        if (chosen < 0) {
+            return -1;
+        }
+        Slot& slot = slots[chosen];
+        if (!slot.path.empty()) {
+            slotOf.erase(slot.path);
+        }
+        slot.path = path;
+        slot.lastFrame = frame;
+        slotOf[path] = static_cast<size_t>(chosen);
+        return chosen;
+    }
+
+public:
+    // Needs the GL context
+    void init() {
+        int columns = ATLAS_PAGE_SIZE / THUMBNAIL_WIDTH;
+        int rows = ATLAS_PAGE_SIZE / THUMBNAIL_HEIGHT;
+        pages.resize(ATLAS_PAGES);
+        glGenTextures(ATLAS_PAGES, pages.data());
+        for (int p = 0; p < ATLAS_PAGES; p++) {
+            glBindTexture(GL_TEXTURE_2D, pages[p]);
+            // Thumbnails are drawn at their own size; nearest sampling
+            // never blends in texels of the neighbouring slot
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE, 0, GL_BGR, GL_UNSIGNED_BYTE,
+                         nullptr);
+            for (int r = 0; r < rows; r++) {
+                for (int c = 0; c < columns; c++) {
+                    slots.push_back(Slot{p, c * THUMBNAIL_WIDTH, r * THUMBNAIL_HEIGHT, 0, 0, "", 0});
+                }
+            }
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        // Each buffer holds one frame's uploads
+        uploadBufferBytes = THUMBNAIL_UPLOADS_PER_FRAME * THUMBNAIL_WIDTH * THUMBNAIL_HEIGHT * 3;
+        glGenBuffers(ATLAS_UPLOAD_BUFFERS, uploadBuffers);
+        for (int i = 0; i < ATLAS_UPLOAD_BUFFERS; i++) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, uploadBuffers[i]);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, uploadBufferBytes, nullptr, GL_STREAM_DRAW);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    void shutdown() {
+        if (!pages.empty()) {
+            glDeleteTextures(static_cast<GLsizei>(pages.size()), pages.data());
+            glDeleteBuffers(ATLAS_UPLOAD_BUFFERS, uploadBuffers);
+        }
+        pages.clear();
+        slots.clear();
+        slotOf.clear();
+    }
+
+    void beginFrame() {
+        frame++;
+    }
+
+    bool contains(const std::string& path) const {
+        return slotOf.count(path) > 0;
+    }
+
+    // Slot holding path's thumbnail, marked as drawn this frame; -1 if none
+    int find(const std::string& path) {
+        auto it = slotOf.find(path);
+        if (it == slotOf.end()) {
+            return -1;
+        }
+        slots[it->second].lastFrame = frame;
+        return static_cast<int>(it->second);
+    }
+
+    // Copy BGR thumbnails into the next pixel buffer and have the driver
+    // move them into their slots from there: glTexSubImage2D returns at
+    // once and the copy overlaps rendering. Paths that found no room (no
+    // buffer, no free slot) go to retry, thumbnails that can never be
+    // uploaded to rejected. Returns the number uploaded
+    size_t upload(const std::vector<std::pair<std::string, cv::Mat>>& thumbnails,
+                  std::vector<std::string>& retry, std::vector<std::string>& rejected) {
+        if (thumbnails.empty()) {
+            return 0;
+        }
+        if (pages.empty()) {
+            for (const auto& thumbnail : thumbnails) {
+                retry.push_back(thumbnail.first);
+            }
+            return 0;
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, uploadBuffers[nextBuffer]);
+        nextBuffer = (nextBuffer + 1) % ATLAS_UPLOAD_BUFFERS;
+        // Invalidating lets the driver hand out fresh memory rather than
+        // wait for the GPU to finish reading this buffer's last upload
+        uchar* staging = static_cast<uchar*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, uploadBufferBytes,
+                                                              GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+        if (staging == nullptr) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            for (const auto& thumbnail : thumbnails) {
+                retry.push_back(thumbnail.first);
+            }
+            return 0;
+        }
+
+        std::vector<std::pair<int, size_t>> copied;  // Slot, buffer offset
+        size_t offset = 0;
+        for (size_t t = 0; t < thumbnails.size(); t++) {
+            const std::string& path = thumbnails[t].first;
+            const cv::Mat& image = thumbnails[t].second;
+            size_t rowBytes = static_cast<size_t>(image.cols) * 3;
+            if (image.type() != CV_8UC3 || image.cols > THUMBNAIL_WIDTH || image.rows > THUMBNAIL_HEIGHT) {
+                rejected.push_back(path);
+                continue;
+            }
+            if (offset + rowBytes * image.rows > uploadBufferBytes) {
+                retry.push_back(path);
+                continue;
+            }
+            int slot = acquire(path);
+            if (slot < 0) {
+                // Every slot is on screen; the rest wait for a later frame
+                for (; t < thumbnails.size(); t++) {
+                    retry.push_back(thumbnails[t].first);
+                }
+                break;
+            }
+            for (int y = 0; y < image.rows; y++) {
+                std::memcpy(staging + offset + y * rowBytes, image.ptr(y), rowBytes);
+            }
+            slots[slot].width = image.cols;
+            slots[slot].height = image.rows;
+            copied.push_back(std::make_pair(slot, offset));
+            offset += rowBytes * image.rows;
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        // BGR rows are packed without padding; the driver swizzles to RGBA
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (const auto& item : copied) {
+            const Slot& slot = slots[item.first];
+            glBindTexture(GL_TEXTURE_2D, pages[slot.page]);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, slot.x, slot.y, slot.width, slot.height, GL_BGR, GL_UNSIGNED_BYTE,
+                            reinterpret_cast<const void*>(item.second));
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return copied.size();
+    }
+
+    // Draw a slot's thumbnail with its top-left corner at pos (screen space)
+    void draw(int slot, ImVec2 pos) const {
+        const Slot& s = slots[slot];
+        float scale = 1.0f / ATLAS_PAGE_SIZE;
+        ImGui::GetWindowDrawList()->AddImage((ImTextureID)(intptr_t)pages[s.page], pos,
+                                             ImVec2(pos.x + s.width, pos.y + s.height),
+                                             ImVec2(s.x * scale, s.y * scale),
+                                             ImVec2((s.x + s.width) * scale, (s.y + s.height) * scale));
+    }
+};
+
 // File dialog helper functions using native OS dialogs
 #ifdef __APPLE__
 #include <array>
-#include <memory>
 
 // Execute command and return output
 std::string execCommand(const char* cmd) {
@@ -130,7 +364,12 @@ std::string openDirectoryDialog() { return ""; }
 // CBIR GUI App state
 class CBIRGUIApp {
 public:
-    CBIRSystem cbir;
+    // Queried by the render thread; a finished background build replaces it
+    std::unique_ptr<CBIRSystem> cbir;
+    KNNGraph neighborGraph;  // Loaded from <features.csv>.knn when present
+    ClusterIndex clusters;   // Loaded from <features.csv>.cluster when present
+    bool hasClusters = false;
+    int browseCluster = 0;
     std::string imageDir;
     std::string dnnCsvPath;
 
@@ -145,24 +384,50 @@ public:
     cv::Mat targetImage;
     Texture targetTexture;
 
-    // Query results
+    // Query results and the image path of each
     std::vector<MatchResult> results;
-    std::vector<Texture> resultTextures;
-    std::vector<cv::Mat> resultImages;
+    std::vector<std::string> resultPaths;
     int numResults = 5;
     bool hasResults = false;
 
+    // Result thumbnails are made on background threads for the visible
+    // cells, kept in <features.csv>.thumbs once a feature file is loaded or
+    // saved, and drawn from the atlas
+    ThumbnailLoader thumbnails;
+    ThumbnailAtlas atlas;
+    uint64_t thumbnailGeneration = 0;
+    std::vector<std::string> requestedPaths;     // Of the latest request, by index
+    std::unordered_set<std::string> requestedSet;
+    std::unordered_set<std::string> failedThumbnails;
+
     // Status message
     std::string statusMessage;
     float statusTimer = 0.0f;
 
-    // Progress
+    // Background build: the worker fills pendingCbir while queries keep
+    // using cbir, and pollBuild() swaps it in between frames
     bool isBuilding = false;
     float buildProgress = 0.0f;
-
-    CBIRGUIApp() {}
+    double buildRate = 0.0;     // Images per second
+    double buildEta = 0.0;      // Seconds left
+    std::thread buildThread;
+    std::unique_ptr<CBIRSystem> pendingCbir;
+    std::atomic<size_t> buildDone{0};
+    std::atomic<size_t> buildTotal{0};
+    std::atomic<bool> buildCancel{false};
+    std::atomic<bool> buildFinished{false};
+    int buildCount = 0;         // Written by the worker before buildFinished
+    int buildFeatureType = -1;
+    std::chrono::steady_clock::time_point buildStart;
+
+    // Database memory, refreshed when the database or caches change (a
+    // full count walks every row, too slow for every frame)
+    MemoryStats memoryStats;
+
+    CBIRGUIApp() : cbir(new CBIRSystem()) {}
 
     ~CBIRGUIApp() {
+        stopBuild();
         cleanupTextures();
     }
 
@@ -173,11 +438,7 @@ public:
 
     void cleanupTextures() {
         deleteTexture(targetTexture);
-        for (auto& tex : resultTextures) {
-            deleteTexture(tex);
-        }
-        resultTextures.clear();
-        resultImages.clear();
+        atlas.shutdown();
     }
 
     void loadTargetImage(const std::string& path) {
@@ -192,42 +453,111 @@ public:
         }
     }
 
+    // Start building into a new system on a worker thread; the current
+    // database stays queryable until the new one is complete
     void buildDatabase() {
+        if (isBuilding) {
+            return;
+        }
         if (imageDir.empty()) {
             setStatus("Error: Image directory not set");
             return;
         }
 
-        isBuilding = true;
-        buildProgress = 0.0f;
-
-        // Clear previous results when building new database
-        cleanupResultTextures();
-
         FeatureType ft = static_cast<FeatureType>(currentFeatureType);
 
         if (ft == FeatureType::DNN_EMBEDDING && dnnCsvPath.empty()) {
             setStatus("Error: DNN CSV path required for dnn_embedding");
-            isBuilding = false;
             return;
         }
 
+        pendingCbir.reset(new CBIRSystem());
         if (!dnnCsvPath.empty()) {
-            cbir.setDNNCsvPath(dnnCsvPath);
+            pendingCbir->setDNNCsvPath(dnnCsvPath);
         }
+        pendingCbir->setMemoryBudget(cbir->getMemoryBudget());
 
+        isBuilding = true;
+        buildProgress = 0.0f;
+        buildRate = 0.0;
+        buildEta = 0.0;
+        buildDone.store(0);
+        buildTotal.store(0);
+        buildCancel.store(false);
+        buildFinished.store(false);
+        buildFeatureType = currentFeatureType;
+        buildStart = std::chrono::steady_clock::now();
+
+        // The text box rewrites imageDir every frame, so the worker gets a copy
+        std::string dir = imageDir;
+        CBIRSystem* system = pendingCbir.get();
+        buildThread = std::thread([this, system, dir, ft]() {
+            buildCount = system->buildDatabase(dir, ft, 0, [this](size_t done, size_t total) {
+                buildDone.store(done);
+                buildTotal.store(total);
+                return !buildCancel.load();
+            });
+            buildFinished.store(true);
+        });
         setStatus("Building database...");
-        int count = cbir.buildDatabase(imageDir, ft);
+    }
 
-        if (count > 0) {
+    void cancelBuild() {
+        if (isBuilding) {
+            buildCancel.store(true);
+        }
+    }
+
+    // Called once per frame: updates the progress and, when the worker is
+    // done, swaps the new database in
+    void pollBuild() {
+        if (!isBuilding) {
+            return;
+        }
+
+        size_t done = buildDone.load();
+        size_t total = buildTotal.load();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+        buildProgress = total > 0 ? static_cast<float>(done) / total : 0.0f;
+        buildRate = elapsed > 0.0 ? done / elapsed : 0.0;
+        buildEta = buildRate > 0.0 ? (total - done) / buildRate : 0.0;
+
+        if (!buildFinished.load()) {
+            return;
+        }
+        buildThread.join();
+        isBuilding = false;
+
+        if (buildCancel.load()) {
+            pendingCbir.reset();
+            setStatus("Build cancelled; previous database kept");
+        } else if (buildCount > 0) {
+            // Results, the k-NN graph and the clusters belong to the old database
+            cleanupResultTextures();
+            hasClusters = false;
+            cbir.swap(pendingCbir);
+            pendingCbir.reset();
             databaseBuilt = true;
-            databaseFeatureType = currentFeatureType;  // Record the feature type used
-            setStatus("Database built with " + std::to_string(count) + " images");
+            databaseFeatureType = buildFeatureType;  // Record the feature type used
+            setStatus("Database built with " + std::to_string(buildCount) + " images in " +
+                      std::to_string(static_cast<int>(elapsed)) + " s");
         } else {
-            setStatus("Error: Failed to build database");
+            bool overBudget = pendingCbir->getMemoryBudget() > 0;
+            pendingCbir.reset();
+            setStatus(overBudget ? "Error: Failed to build database (over the memory budget?)"
+                                 : "Error: Failed to build database");
         }
+        memoryStats = cbir->getMemoryStats();
+    }
 
+    // Cancel a running build and wait for the worker, e.g. on exit
+    void stopBuild() {
+        if (buildThread.joinable()) {
+            buildCancel.store(true);
+            buildThread.join();
+        }
         isBuilding = false;
+        pendingCbir.reset();
     }
 
     void performQuery() {
@@ -236,8 +566,10 @@ public:
             return;
         }
 
-        // Check if feature type has changed since database was built
-        if (databaseFeatureType != currentFeatureType) {
+        // Check if feature type has changed since database was built; while
+        // a build runs, the type it uses may query the old database
+        if (databaseFeatureType != currentFeatureType &&
+            !(isBuilding && currentFeatureType == buildFeatureType)) {
             setStatus("Error: Feature type changed. Please rebuild database.");
             return;
         }
@@ -252,7 +584,7 @@ public:
         // Clear previous results
         cleanupResultTextures();
 
-        results = cbir.query(targetImagePath, numResults + 1); // +1 to include query itself
+        results = cbir->query(targetImagePath, numResults + 1); // +1 to include query itself
 
         // Remove query image itself from results
         results.erase(std::remove_if(results.begin(), results.end(),
@@ -266,29 +598,117 @@ public:
             results.resize(numResults);
         }
 
-        // Load result images
-
+        // Thumbnails are requested as their cells become visible
         for (const auto& result : results) {
-            // Handle path correctly - avoid duplicate directory paths
-            std::string fullPath = result.imagePath;
-
-            // Check if result.imagePath contains the directory separator (has path component)
-            size_t lastSlash = result.imagePath.find_last_of("/\\");
-            if (lastSlash == std::string::npos) {
-                // Just a filename, prepend imageDir
-                fullPath = imageDir + "/" + result.imagePath;
+            resultPaths.push_back(resultPath(result));
+        }
+
+        hasResults = !results.empty();
+        memoryStats = cbir->getMemoryStats();
+        setStatus("Query completed. Found " + std::to_string(results.size()) + " matches");
+    }
+
+    // Called once per frame: uploads a few finished thumbnails
+    void pollThumbnails() {
+        atlas.beginFrame();
+        std::vector<ThumbnailResult> ready;
+        thumbnails.collect(ready, THUMBNAIL_UPLOADS_PER_FRAME);
+        std::vector<std::pair<std::string, cv::Mat>> uploads;
+        for (auto& thumbnail : ready) {
+            if (thumbnail.generation != thumbnailGeneration || thumbnail.index >= requestedPaths.size()) {
+                continue;
             }
-            // else: result.imagePath already contains path, use as-is
+            const std::string& path = requestedPaths[thumbnail.index];
+            if (thumbnail.image.empty()) {
+                failedThumbnails.insert(path);
+            } else {
+                uploads.push_back(std::make_pair(path, thumbnail.image));
+            }
+        }
 
-            cv::Mat img = cv::imread(fullPath);
-            if (!img.empty()) {
-                resultImages.push_back(img);
-                resultTextures.push_back(loadTextureFromMat(img));
+        // Thumbnails that found no room are asked for again while their
+        // cells are visible (from the memory cache); unusable ones show
+        // "No preview"
+        std::vector<std::string> retry, rejected;
+        atlas.upload(uploads, retry, rejected);
+        for (const auto& path : retry) {
+            requestedSet.erase(path);
+        }
+        failedThumbnails.insert(rejected.begin(), rejected.end());
+    }
+
+    // Ask for the thumbnails the visible cells lack. The queue is only
+    // replaced when a new cell needs one, so arrivals do not restart it
+    void requestThumbnails(const std::vector<std::string>& missing) {
+        bool changed = false;
+        for (const auto& path : missing) {
+            if (requestedSet.count(path) == 0) {
+                changed = true;
+                break;
             }
         }
+        if (!changed) {
+            return;
+        }
+        requestedPaths = missing;
+        requestedSet.clear();
+        requestedSet.insert(missing.begin(), missing.end());
+        thumbnailGeneration = thumbnails.request(requestedPaths);
+    }
 
+    // Keep thumbnails next to the feature file, so reopening it shows
+    // results without decoding the images again
+    void openThumbnailFile(const std::string& featureFile) {
+        std::string thumbnailFile = featureFile + ".thumbs";
+        if (thumbnails.cache().getFilename() != thumbnailFile) {
+            thumbnails.cache().open(thumbnailFile);
+        }
+    }
+
+    // File of a result; the same spelling cbir_build -T keys thumbnails by
+    std::string resultPath(const MatchResult& result) const {
+        return cbir->imageFilePath(result.imagePath);
+    }
+
+    // Show a cluster's images, nearest to its centroid first
+    void showCluster(int cluster) {
+        if (!hasClusters || cluster < 0 || static_cast<size_t>(cluster) >= clusters.numClusters()) {
+            return;
+        }
+        cleanupResultTextures();
+
+        const std::vector<std::string>& paths = cbir->getImagePaths();
+        const uint32_t* members = clusters.clusterMembers(cluster);
+        for (size_t i = 0; i < clusters.clusterSize(cluster); i++) {
+            results.push_back(MatchResult(paths[members[i]], clusters.distanceToCentroid(members[i])));
+            resultPaths.push_back(resultPath(results.back()));
+        }
+        browseCluster = cluster;
         hasResults = !results.empty();
-        setStatus("Query completed. Found " + std::to_string(results.size()) + " matches");
+        setStatus("Cluster " + std::to_string(cluster) + ": " + std::to_string(results.size()) + " images");
+    }
+
+    // Show the cluster holding the target image, if it is in the database
+    void showTargetCluster() {
+        int row = targetImagePath.empty() ? -1 : cbir->findImage(targetImagePath);
+        if (row < 0) {
+            setStatus("Error: Target image is not in the database");
+            return;
+        }
+        showCluster(static_cast<int>(clusters.clusterOf(row)));
+    }
+
+    // "More like this": make a result the target and query again; database
+    // images are a k-NN graph lookup when a graph is loaded
+    void queryFromResult(size_t index) {
+        if (index >= results.size()) {
+            return;
+        }
+        std::string path = resultPaths[index];
+        loadTargetImage(path);
+        if (targetImagePath == path) {
+            performQuery();
+        }
     }
 
     void saveFeatures(const std::string& filename) {
@@ -297,7 +717,8 @@ public:
             return;
         }
 
-        if (cbir.saveFeatures(filename) == 0) {
+        if (cbir->saveFeatures(filename) == 0) {
+            openThumbnailFile(filename);
             setStatus("Features saved to " + filename);
         } else {
             setStatus("Error: Failed to save features");
@@ -307,11 +728,15 @@ public:
     void loadFeatures(const std::string& filename) {
         // Clear previous results before loading new features
         cleanupResultTextures();
+        hasClusters = false;
 
-        if (cbir.loadFeatures(filename) > 0) {
+        if (cbir->loadFeatures(filename) > 0) {
             databaseBuilt = true;
+            if (!imageDir.empty()) {
+                cbir->setImageDirectory(imageDir);
+            }
             // Sync the feature type from loaded database
-            FeatureType loadedType = cbir.getFeatureType();
+            FeatureType loadedType = cbir->getFeatureType();
             switch (loadedType) {
                 case FeatureType::BASELINE: currentFeatureType = 0; break;
                 case FeatureType::HISTOGRAM: currentFeatureType = 1; break;
@@ -321,21 +746,45 @@ public:
                 case FeatureType::CUSTOM: currentFeatureType = 5; break;
             }
             databaseFeatureType = currentFeatureType;
-            setStatus("Features loaded from " + filename);
+            openThumbnailFile(filename);
+
+            // A k-NN graph next to the database answers queries on its own
+            // images instantly (see cbir_index -x knn)
+            std::string graphFile = filename + ".knn";
+            bool hasGraph = std::filesystem::exists(graphFile) &&
+                            neighborGraph.load(graphFile, *cbir) == 0 &&
+                            cbir->setNeighborGraph(&neighborGraph) == 0;
+
+            // Clusters next to it can be browsed (see cbir_index -x cluster)
+            std::string clusterFile = filename + ".cluster";
+            hasClusters = std::filesystem::exists(clusterFile) && clusters.load(clusterFile, *cbir) == 0;
+            browseCluster = 0;
+
+            std::string loaded = "Features";
+            if (hasGraph) {
+                loaded += hasClusters ? ", k-NN graph and clusters" : " and k-NN graph";
+            } else if (hasClusters) {
+                loaded += " and clusters";
+            }
+            setStatus(loaded + " loaded from " + filename);
+        } else if (cbir->getMemoryBudget() > 0 && cbir->estimateLoadBytes(filename, true) > cbir->getMemoryBudget()) {
+            setStatus("Error: " + filename + " does not fit the memory budget");
         } else {
             setStatus("Error: Failed to load features");
         }
+        memoryStats = cbir->getMemoryStats();
     }
 
 private:
+    // Uploaded thumbnails stay in the atlas for later queries
     void cleanupResultTextures() {
-        for (auto& tex : resultTextures) {
-            deleteTexture(tex);
-        }
-        resultTextures.clear();
-        resultImages.clear();
         results.clear();
+        resultPaths.clear();
         hasResults = false;
+        thumbnails.cancel();
+        requestedPaths.clear();
+        requestedSet.clear();
+        failedThumbnails.clear();
     }
 };
 
@@ -365,8 +814,12 @@ int main(int argc, char* argv[]) {
             g_app.imageDir = argv[++i];
         } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
             g_app.dnnCsvPath = argv[++i];
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            g_app.cbir->setMemoryBudget(static_cast<size_t>(std::atof(argv[++i]) * 1024.0 * 1024.0));
         } else if (strcmp(argv[i], "-h") == 0) {
-            std::cout << "Usage: " << argv[0] << " -d <image_dir> [-c <dnn_csv>]" << std::endl;
+            std::cout << "Usage: " << argv[0] << " -d <image_dir> [-c <dnn_csv>] [-B <megabytes>]" << std::endl;
+            std::cout << "  -B <megabytes>  Memory budget for the database (compact form or refused when over)"
+                      << std::endl;
             return 0;
         }
     }
@@ -407,10 +860,13 @@ int main(int argc, char* argv[]) {
     // Setup Platform/Renderer backends
     ImGui_ImplGlfw_InitForOpenGL(window, true);
     ImGui_ImplOpenGL3_Init(glsl_version);
+    g_app.atlas.init();
 
     // Main loop
     while (!glfwWindowShouldClose(window)) {
         glfwPollEvents();
+        g_app.pollBuild();
+        g_app.pollThumbnails();
 
         // Start ImGui frame
         ImGui_ImplOpenGL3_NewFrame();
@@ -434,12 +890,17 @@ int main(int argc, char* argv[]) {
         strncpy(dirBuf, g_app.imageDir.c_str(), sizeof(dirBuf) - 1);
         ImGui::Text("Image Directory:");
         ImGui::InputText("##dir", dirBuf, sizeof(dirBuf));
-        g_app.imageDir = dirBuf;
+        if (g_app.imageDir != dirBuf) {
+            g_app.imageDir = dirBuf;
+            // Loaded databases name their images relative to it
+            g_app.cbir->setImageDirectory(g_app.imageDir);
+        }
         ImGui::SameLine();
         if (ImGui::Button("Browse##dir", ImVec2(60, 20))) {
             std::string selectedDir = openDirectoryDialog();
             if (!selectedDir.empty()) {
                 g_app.imageDir = selectedDir;
+                g_app.cbir->setImageDirectory(g_app.imageDir);
                 strncpy(dirBuf, selectedDir.c_str(), sizeof(dirBuf) - 1);
             }
         }
@@ -497,19 +958,44 @@ int main(int argc, char* argv[]) {
 
         ImGui::Separator();
 
-        // Build database button
-        if (ImGui::Button("Build Database", ImVec2(150, 30))) {
-            g_app.buildDatabase();
-        }
-
+        // Build database button; the build runs in the background
         if (g_app.isBuilding) {
-            ImGui::SameLine();
-            ImGui::ProgressBar(g_app.buildProgress, ImVec2(150, 0), "Building...");
+            if (ImGui::Button("Cancel Build", ImVec2(150, 30))) {
+                g_app.cancelBuild();
+            }
+            char progressText[96];
+            if (g_app.buildCancel.load()) {
+                snprintf(progressText, sizeof(progressText), "Cancelling...");
+            } else if (g_app.buildTotal.load() == 0) {
+                snprintf(progressText, sizeof(progressText), "Scanning directory...");
+            } else {
+                snprintf(progressText, sizeof(progressText), "%zu / %zu  %.0f img/s  ETA %.0f s",
+                         g_app.buildDone.load(), g_app.buildTotal.load(), g_app.buildRate, g_app.buildEta);
+            }
+            ImGui::ProgressBar(g_app.buildProgress, ImVec2(-1, 0), progressText);
+        } else if (ImGui::Button("Build Database", ImVec2(150, 30))) {
+            g_app.buildDatabase();
         }
 
         ImGui::Text("Database Status: %s", g_app.databaseBuilt ? "Ready" : "Not Built");
         if (g_app.databaseBuilt) {
-            ImGui::Text("Images: %zu", g_app.cbir.getDatabaseSize());
+            ImGui::Text("Images: %zu", g_app.cbir->getDatabaseSize());
+            CacheStats cache = g_app.cbir->getCacheStats();
+            ImGui::Text("Cache hits: features %.0f%%, results %.0f%%",
+                        cache.featureHitRate() * 100.0f, cache.resultHitRate() * 100.0f);
+            const MemoryStats& memory = g_app.memoryStats;
+            if (memory.budgetBytes > 0) {
+                ImGui::Text("Memory: %.1f of %.0f MB%s", memory.total() / (1024.0 * 1024.0),
+                            memory.budgetBytes / (1024.0 * 1024.0), memory.compact ? " (compact)" : "");
+            } else {
+                ImGui::Text("Memory: %.1f MB", memory.total() / (1024.0 * 1024.0));
+            }
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("Features %.1f MB, paths %.1f MB, indexes %.1f MB,\ncaches %.1f MB, decode buffers %.1f MB",
+                                  memory.featureBytes / (1024.0 * 1024.0), memory.pathBytes / (1024.0 * 1024.0),
+                                  memory.indexBytes / (1024.0 * 1024.0), memory.cacheBytes / (1024.0 * 1024.0),
+                                  memory.decodeBytes / (1024.0 * 1024.0));
+            }
         }
 
         ImGui::Separator();
@@ -549,12 +1035,29 @@ int main(int argc, char* argv[]) {
 
         // Query settings
         ImGui::Text("Number of Results:");
-        ImGui::SliderInt("##num", &g_app.numResults, 1, 10);
+        ImGui::SliderInt("##num", &g_app.numResults, 1, MAX_QUERY_RESULTS, "%d", ImGuiSliderFlags_Logarithmic);
 
         if (ImGui::Button("Perform Query", ImVec2(150, 40))) {
             g_app.performQuery();
         }
 
+        // Cluster browsing, when the loaded database has clusters
+        if (g_app.hasClusters) {
+            ImGui::Separator();
+            int lastCluster = static_cast<int>(g_app.clusters.numClusters()) - 1;
+            ImGui::Text("Clusters: %d", lastCluster + 1);
+            ImGui::SliderInt("##cluster", &g_app.browseCluster, 0, lastCluster, "Cluster %d");
+            g_app.browseCluster = std::max(0, std::min(g_app.browseCluster, lastCluster));
+            ImGui::Text("%zu images", g_app.clusters.clusterSize(g_app.browseCluster));
+            if (ImGui::Button("Browse Cluster", ImVec2(120, 25))) {
+                g_app.showCluster(g_app.browseCluster);
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Target's Cluster", ImVec2(120, 25))) {
+                g_app.showTargetCluster();
+            }
+        }
+
         ImGui::Separator();
 
         // Status message
@@ -588,22 +1091,82 @@ int main(int argc, char* argv[]) {
         ImGui::Text("Query Results:");
 
         if (g_app.hasResults) {
-            for (size_t i = 0; i < g_app.results.size() && i < g_app.resultTextures.size(); i++) {
-                ImGui::BeginGroup();
-
-                ImGui::Text("%zu. %s", i + 1, g_app.results[i].imagePath.c_str());
-                ImGui::Text("   Distance: %.4f", g_app.results[i].distance);
-
-                if (g_app.resultTextures[i].texID != 0) {
-                    renderImage(g_app.resultTextures[i], 180, 120);
+            // Only the visible rows are laid out. Every cell has the same
+            // height (name, distance, thumbnail box, button), so the clipper
+            // can skip the rest
+            const float cellWidth = THUMBNAIL_WIDTH + 16.0f;
+            const float rowHeight = 3 * ImGui::GetTextLineHeightWithSpacing() + THUMBNAIL_HEIGHT +
+                                    ImGui::GetStyle().ItemSpacing.y;
+            ImGui::BeginChild("ResultGrid", ImVec2(0, 0), false);
+            int columns = std::max(1, static_cast<int>(ImGui::GetContentRegionAvail().x / cellWidth));
+            int count = static_cast<int>(g_app.results.size());
+            int rows = (count + columns - 1) / columns;
+
+            std::vector<std::string> missing;
+            int lastRow = 0;
+            int moreLikeThis = -1;
+            ImGuiListClipper clipper;
+            clipper.Begin(rows, rowHeight);
+            while (clipper.Step()) {
+                for (int row = clipper.DisplayStart; row < clipper.DisplayEnd; row++) {
+                    lastRow = std::max(lastRow, row);
+                    for (int col = 0; col < columns && row * columns + col < count; col++) {
+                        size_t i = static_cast<size_t>(row * columns + col);
+                        const std::string& path = g_app.resultPaths[i];
+                        if (col > 0) {
+                            ImGui::SameLine(col * cellWidth);
+                        }
+                        ImGui::BeginGroup();
+
+                        // Long names are cut from the front; the full path is in the tooltip
+                        std::string name = std::filesystem::path(path).filename().string();
+                        if (name.size() > 22) {
+                            name = "..." + name.substr(name.size() - 19);
+                        }
+                        ImGui::Text("%zu. %s", i + 1, name.c_str());
+                        if (ImGui::IsItemHovered()) {
+                            ImGui::SetTooltip("%s", g_app.results[i].imagePath.c_str());
+                        }
+                        ImGui::Text("   Distance: %.4f", g_app.results[i].distance);
+
+                        ImVec2 cell = ImGui::GetCursorScreenPos();
+                        ImGui::Dummy(ImVec2(THUMBNAIL_WIDTH, THUMBNAIL_HEIGHT));
+                        int slot = g_app.atlas.find(path);
+                        if (slot >= 0) {
+                            g_app.atlas.draw(slot, cell);
+                        } else {
+                            bool failed = g_app.failedThumbnails.count(path) > 0;
+                            if (!failed) {
+                                missing.push_back(path);
+                            }
+                            ImGui::GetWindowDrawList()->AddText(ImVec2(cell.x + 8, cell.y + 8),
+                                                                IM_COL32(160, 160, 160, 255),
+                                                                failed ? "No preview" : "Loading...");
+                        }
+                        if (ImGui::SmallButton(("More like this##" + std::to_string(i)).c_str())) {
+                            moreLikeThis = static_cast<int>(i);
+                        }
+
+                        ImGui::EndGroup();
+                    }
                 }
-
-                ImGui::EndGroup();
-
-                if ((i + 1) % 4 != 0 && i < g_app.results.size() - 1) {
-                    ImGui::SameLine();
+            }
+            clipper.End();
+            ImGui::EndChild();
+
+            // Load one row ahead so scrolling down finds thumbnails ready
+            for (int i = (lastRow + 1) * columns; i < std::min(count, (lastRow + 2) * columns); i++) {
+                const std::string& path = g_app.resultPaths[i];
+                if (!g_app.atlas.contains(path) && g_app.failedThumbnails.count(path) == 0) {
+                    missing.push_back(path);
                 }
             }
+            g_app.requestThumbnails(missing);
+
+            // Re-query after the loop; it replaces the results drawn above
+            if (moreLikeThis >= 0) {
+                g_app.queryFromResult(static_cast<size_t>(moreLikeThis));
+            }
         } else {
             ImGui::Text("No query results");
         }
@@ -625,6 +1188,8 @@ int main(int argc, char* argv[]) {
     }
 
     // Cleanup
+    g_app.stopBuild();
+    g_app.cleanupTextures();
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
@@ -0,0 +1,421 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Build a search index from an existing CBIR feature database.
+  Usage: ./cbir_index -i <features.csv> -x <index_type> [-o <index_file>] [options]
+*/
+
+#include "cbir.h"
+#include "cluster.h"
+#include "hnsw.h"
+#include "ivfpq.h"
+#include "knngraph.h"
+#include "lsh.h"
+#include "vptree.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+
+void printUsage(const char* programName) {
+    std::cout << "Usage: " << programName << " -i <features.csv> -x <index_type> [-o <index_file>] [options]" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -i <features.csv>   Feature database built by cbir_build" << std::endl;
+    std::cout << "  -x <index_type>     Index type:" << std::endl;
+    std::cout << "                        hnsw  - HNSW graph for approximate search (dnn_embedding)" << std::endl;
+    std::cout << "                        ivfpq - IVF + product quantization (baseline, dnn_embedding)" << std::endl;
+    std::cout << "                        vptree - exact metric tree (baseline, dnn_embedding)" << std::endl;
+    std::cout << "                        lsh   - binary signatures with multi-probe tables (all types)" << std::endl;
+    std::cout << "                        knn   - exact k nearest neighbours of every image (all types)" << std::endl;
+    std::cout << "                        cluster - k-means clusters for browsing and pruned search (all types)" << std::endl;
+    std::cout << "  -o <index_file>     Output index file (default: <features.csv>.<index_type>)" << std::endl;
+    std::cout << "  -M <links>          HNSW links per node (default 16)" << std::endl;
+    std::cout << "  -E <ef>             HNSW efConstruction (default 200)" << std::endl;
+    std::cout << "  -e <ef>             HNSW default efSearch stored in the index (default 64)" << std::endl;
+    std::cout << "  -L <nlist>          IVF-PQ coarse lists (default 256)" << std::endl;
+    std::cout << "  -Q <bytes>          IVF-PQ subquantizers, i.e. bytes per vector (default 16)" << std::endl;
+    std::cout << "  -T <count>          IVF-PQ training sample size, 0 = all (default 65536)" << std::endl;
+    std::cout << "  -I <iterations>     IVF-PQ / cluster k-means iterations (default 20)" << std::endl;
+    std::cout << "  -p <nprobe>         IVF-PQ default lists (default 8) / clusters (default 4) scanned per query" << std::endl;
+    std::cout << "  -B <bits>           LSH signature bits for projected types (default 256)" << std::endl;
+    std::cout << "  -H <tables>         LSH hash tables, 0 = popcount scan only (default 8)" << std::endl;
+    std::cout << "  -K <bits>           LSH key bits per table, at most 20 (default 12)" << std::endl;
+    std::cout << "  -R <radius>         LSH key bits flipped when probing, 0-2 (default 1)" << std::endl;
+    std::cout << "  -k <count>          LSH default candidates reranked exactly (default 200)" << std::endl;
+    std::cout << "  -N <k>              k-NN graph neighbours per image (default 10)" << std::endl;
+    std::cout << "  -D <distance>       k-NN graph: also list image pairs at most this far apart" << std::endl;
+    std::cout << "                      (near-duplicate report)" << std::endl;
+    std::cout << "  -C <clusters>       Number of clusters (default 64)" << std::endl;
+    std::cout << "  -S <rows>           Cluster mini-batch size, 0 = automatic (mini-batch from 100000 images)" << std::endl;
+    std::cout << "  -a <file.csv>       Also write each image's cluster as filename,cluster,distance" << std::endl;
+    std::cout << "  -j <threads>        Construction threads (default: all cores)" << std::endl;
+    std::cout << "  -b <sizes>          VP-tree benchmark on synthetic 147-dim baseline data instead of" << std::endl;
+    std::cout << "                      building an index, e.g. -b 10000,100000,1000000 (no -i needed)" << std::endl;
+    std::cout << "  -h                  Show this help message" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Examples:" << std::endl;
+    std::cout << "  " << programName << " -i features_dnn.csv -x hnsw" << std::endl;
+    std::cout << "  " << programName << " -i features_dnn.csv -x hnsw -M 32 -E 400 -j 8" << std::endl;
+    std::cout << "  " << programName << " -i features_baseline.csv -x ivfpq -L 1024 -Q 21" << std::endl;
+    std::cout << "  " << programName << " -i features_baseline.csv -x vptree" << std::endl;
+    std::cout << "  " << programName << " -i features_histogram.csv -x lsh -H 16 -K 14" << std::endl;
+    std::cout << "  " << programName << " -i features_dnn.csv -x knn -N 20 -D 0.05" << std::endl;
+    std::cout << "  " << programName << " -i features_histogram.csv -x cluster -C 256 -a clusters.csv" << std::endl;
+    std::cout << "  " << programName << " -x vptree -b 10000,100000,1000000,10000000" << std::endl;
+}
+
+// Synthetic baseline-like rows: 7x7x3 pixel values driven by a few latent
+// factors, since neighbouring pixels of real images are strongly correlated
+void makeSyntheticBaseline(size_t count, std::vector<FeatureVector>& rows, unsigned int seed) {
+    const int dim = 147;
+    const int factors = 6;
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+
+    std::vector<float> basis(factors * dim);
+    for (float& b : basis) {
+        b = gauss(rng) * 20.0f;
+    }
+
+    rows.assign(count, FeatureVector(dim, FeatureType::BASELINE));
+    for (size_t i = 0; i < count; i++) {
+        float z[factors];
+        for (float& v : z) {
+            v = gauss(rng);
+        }
+        for (int d = 0; d < dim; d++) {
+            float v = 128.0f + gauss(rng) * 2.0f;
+            for (int f = 0; f < factors; f++) {
+                v += z[f] * basis[f * dim + d];
+            }
+            rows[i][d] = std::round(std::min(255.0f, std::max(0.0f, v)));
+        }
+    }
+}
+
+// Node-visit ratio and latency of the VP-tree against brute force as the
+// database grows
+int runVPTreeBenchmark(const std::string& sizeList, int numThreads) {
+    const int numQueries = 100;
+    const int k = 10;
+
+    std::cout << "VP-tree benchmark (147-dim synthetic baseline, k=" << k << ", "
+              << numQueries << " queries per size)" << std::endl;
+    std::cout << "rows, build_s, nodes_visited_ratio, distance_ratio, vptree_ms, brute_ms, speedup" << std::endl;
+
+    std::stringstream ss(sizeList);
+    std::string token;
+    while (std::getline(ss, token, ',')) {
+        size_t count = std::strtoull(token.c_str(), nullptr, 10);
+        if (count == 0) {
+            continue;
+        }
+
+        std::vector<FeatureVector> rows;
+        makeSyntheticBaseline(count, rows, 42);
+
+        auto start = std::chrono::steady_clock::now();
+        VPTree tree;
+        if (tree.build(rows, FeatureType::BASELINE, false, numThreads) != 0) {
+            return -1;
+        }
+        double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        // Queries are perturbed database rows
+        std::mt19937 rng(7);
+        std::uniform_int_distribution<size_t> pick(0, count - 1);
+        std::normal_distribution<float> noise(0.0f, 3.0f);
+        double visitRatio = 0.0, distRatio = 0.0, treeMs = 0.0, bruteMs = 0.0;
+
+        for (int q = 0; q < numQueries; q++) {
+            FeatureVector query = rows[pick(rng)];
+            for (size_t d = 0; d < query.size(); d++) {
+                query[d] += noise(rng);
+            }
+
+            VPTreeStats stats;
+            auto t0 = std::chrono::steady_clock::now();
+            tree.search(query, k, &stats);
+            treeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+            t0 = std::chrono::steady_clock::now();
+            TopK top(k);
+            for (size_t i = 0; i < count; i++) {
+                top.push(sumSquaredDifference(query, rows[i]), static_cast<uint32_t>(i));
+            }
+            top.take();
+            bruteMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+            visitRatio += static_cast<double>(stats.nodesVisited) / tree.nodeCount();
+            distRatio += static_cast<double>(stats.distanceComputations) / count;
+        }
+
+        std::cout << count << ", " << buildSeconds << ", " << visitRatio / numQueries << ", "
+                  << distRatio / numQueries << ", " << treeMs / numQueries << ", "
+                  << bruteMs / numQueries << ", " << bruteMs / treeMs << std::endl;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    std::string featuresFile;
+    std::string indexType;
+    std::string indexFile;
+    HNSWParams hnswParams;
+    IVFPQParams ivfpqParams;
+    LSHParams lshParams;
+    KNNGraphParams knnParams;
+    ClusterParams clusterParams;
+    std::string assignmentsFile;
+    bool probesSet = false;
+    float duplicateDistance = 0.0f;
+    bool reportDuplicates = false;
+    std::string benchmarkSizes;
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            featuresFile = argv[++i];
+        } else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+            indexType = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            indexFile = argv[++i];
+        } else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc) {
+            hnswParams.M = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-E") == 0 && i + 1 < argc) {
+            hnswParams.efConstruction = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            hnswParams.efSearch = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) {
+            ivfpqParams.nlist = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-Q") == 0 && i + 1 < argc) {
+            ivfpqParams.numSubquantizers = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            ivfpqParams.trainSize = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+            ivfpqParams.iterations = std::atoi(argv[++i]);
+            clusterParams.iterations = ivfpqParams.iterations;
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            ivfpqParams.nprobe = std::atoi(argv[++i]);
+            probesSet = true;
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            lshParams.bits = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc) {
+            lshParams.tables = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-K") == 0 && i + 1 < argc) {
+            lshParams.keyBits = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+            lshParams.probeRadius = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            lshParams.rerank = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-N") == 0 && i + 1 < argc) {
+            knnParams.k = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-D") == 0 && i + 1 < argc) {
+            duplicateDistance = static_cast<float>(std::atof(argv[++i]));
+            reportDuplicates = true;
+        } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            clusterParams.k = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            clusterParams.batchSize = std::strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            assignmentsFile = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            hnswParams.numThreads = std::atoi(argv[++i]);
+            ivfpqParams.numThreads = hnswParams.numThreads;
+            lshParams.numThreads = hnswParams.numThreads;
+            knnParams.numThreads = hnswParams.numThreads;
+            clusterParams.numThreads = hnswParams.numThreads;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            benchmarkSizes = argv[++i];
+        } else if (strcmp(argv[i], "-h") == 0) {
+            printUsage(argv[0]);
+            return 0;
+        } else {
+            std::cerr << "Unknown option: " << argv[i] << std::endl;
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (!benchmarkSizes.empty()) {
+        if (indexType != "vptree") {
+            std::cerr << "Error: -b is only available for -x vptree" << std::endl;
+            return -1;
+        }
+        return runVPTreeBenchmark(benchmarkSizes, hnswParams.numThreads);
+    }
+
+    // Validate arguments
+    if (featuresFile.empty() || indexType.empty()) {
+        std::cerr << "Error: Missing required arguments" << std::endl;
+        printUsage(argv[0]);
+        return -1;
+    }
+    if (indexFile.empty()) {
+        indexFile = featuresFile + "." + indexType;
+    }
+
+    std::cout << "CBIR Index Tool" << std::endl;
+    std::cout << "===============" << std::endl;
+    std::cout << "Features file: " << featuresFile << std::endl;
+    std::cout << "Index type: " << indexType << std::endl;
+    std::cout << "Index file: " << indexFile << std::endl;
+    std::cout << std::endl;
+
+    CBIRSystem cbir;
+    if (cbir.loadFeatures(featuresFile) <= 0) {
+        std::cerr << "Error: Failed to load feature database" << std::endl;
+        return -1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    if (indexType == "hnsw") {
+        if (cbir.getFeatureType() != FeatureType::DNN_EMBEDDING) {
+            std::cout << "Warning: HNSW is tuned for dnn_embedding; "
+                      << featureTypeToString(cbir.getFeatureType())
+                      << " distances may not form a metric" << std::endl;
+        }
+
+        std::cout << "Building HNSW index (M=" << hnswParams.M
+                  << ", efConstruction=" << hnswParams.efConstruction << ")..." << std::endl;
+        HNSWIndex index;
+        if (index.build(cbir.getFeatures(), cbir.getFeatureType(), cbir.isNormalized(), hnswParams) != 0) {
+            std::cerr << "Error: Failed to build HNSW index" << std::endl;
+            return -1;
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Built in " << seconds << " s ("
+                  << index.memoryBytes() / (1024.0 * 1024.0) << " MB of links)" << std::endl;
+
+        if (index.save(indexFile) != 0) {
+            return -1;
+        }
+    } else if (indexType == "ivfpq") {
+        IVFPQIndex index;
+        if (index.build(cbir.getFeatures(), cbir.getFeatureType(), cbir.isNormalized(), ivfpqParams) != 0) {
+            std::cerr << "Error: Failed to build IVF-PQ index" << std::endl;
+            return -1;
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        size_t rawBytes = cbir.getDatabaseSize() * cbir.getFeatures()[0].size() * sizeof(float);
+        std::cout << "Built in " << seconds << " s (" << index.memoryBytes() / (1024.0 * 1024.0)
+                  << " MB vs " << rawBytes / (1024.0 * 1024.0) << " MB of raw features)" << std::endl;
+
+        if (index.save(indexFile) != 0) {
+            return -1;
+        }
+    } else if (indexType == "vptree") {
+        VPTree tree;
+        if (tree.build(cbir.getFeatures(), cbir.getFeatureType(), cbir.isNormalized(),
+                       hnswParams.numThreads) != 0) {
+            std::cerr << "Error: Failed to build VP-tree" << std::endl;
+            return -1;
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Built in " << seconds << " s (" << tree.nodeCount() << " nodes, "
+                  << tree.memoryBytes() / (1024.0 * 1024.0) << " MB)" << std::endl;
+
+        if (tree.save(indexFile) != 0) {
+            return -1;
+        }
+    } else if (indexType == "lsh") {
+        LSHIndex index;
+        if (index.build(cbir.getFeatures(), cbir.getFeatureType(), cbir.isNormalized(), lshParams) != 0) {
+            std::cerr << "Error: Failed to build LSH index" << std::endl;
+            return -1;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        size_t rawBytes = cbir.getDatabaseSize() * cbir.getFeatures()[0].size() * sizeof(float);
+        std::cout << "Built in " << seconds << " s (" << index.memoryBytes() / (1024.0 * 1024.0)
+                  << " MB vs " << rawBytes / (1024.0 * 1024.0) << " MB of raw features)" << std::endl;
+        if (index.save(indexFile) != 0) {
+            return -1;
+        }
+    } else if (indexType == "knn") {
+        std::cout << "Building k-NN graph (k=" << knnParams.k << ")..." << std::endl;
+        KNNGraph graph;
+        KNNGraphStats stats;
+        if (graph.build(cbir, knnParams, &stats) != 0) {
+            std::cerr << "Error: Failed to build k-NN graph" << std::endl;
+            return -1;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Built in " << seconds << " s (" << stats.distanceComputations << " distances, "
+                  << stats.tiles << " tiles of " << stats.blockRows << " rows, "
+                  << graph.memoryBytes() / (1024.0 * 1024.0) << " MB)" << std::endl;
+        if (graph.save(indexFile) != 0) {
+            return -1;
+        }
+
+        if (reportDuplicates) {
+            // Each pair once: from its lower row, or from the higher row when
+            // the lower row's list is already full of closer images
+            const std::vector<std::string>& paths = cbir.getImagePaths();
+            auto listed = [&](size_t from, uint32_t to) {
+                const Neighbor* neighbors = graph.neighbors(from);
+                for (int j = 0; j < graph.neighborCount(); j++) {
+                    if (neighbors[j].id == to) {
+                        return true;
+                    }
+                }
+                return false;
+            };
+            size_t pairs = 0;
+            std::cout << std::endl << "Image pairs within " << duplicateDistance << ":" << std::endl;
+            for (size_t row = 0; row < graph.size(); row++) {
+                const Neighbor* neighbors = graph.neighbors(row);
+                for (int j = 0; j < graph.neighborCount() && neighbors[j].distance <= duplicateDistance; j++) {
+                    if (neighbors[j].id > row || !listed(neighbors[j].id, static_cast<uint32_t>(row))) {
+                        std::cout << paths[row] << "," << paths[neighbors[j].id] << ","
+                                  << neighbors[j].distance << std::endl;
+                        pairs++;
+                    }
+                }
+            }
+            std::cout << pairs << " pairs (an image with more than " << graph.neighborCount()
+                      << " such neighbours lists only its nearest " << graph.neighborCount() << ")" << std::endl;
+        }
+    } else if (indexType == "cluster") {
+        if (probesSet) {
+            clusterParams.probes = ivfpqParams.nprobe;
+        }
+        std::cout << "Clustering into " << clusterParams.k << " clusters..." << std::endl;
+        ClusterIndex clusters;
+        ClusterBuildStats stats;
+        if (clusters.build(cbir, clusterParams, &stats) != 0) {
+            std::cerr << "Error: Failed to cluster feature database" << std::endl;
+            return -1;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        size_t smallest = cbir.getDatabaseSize(), largest = 0;
+        for (size_t c = 0; c < clusters.numClusters(); c++) {
+            smallest = std::min(smallest, clusters.clusterSize(c));
+            largest = std::max(largest, clusters.clusterSize(c));
+        }
+        std::cout << "Built in " << seconds << " s (" << stats.iterationsRun
+                  << (stats.miniBatch ? " mini-batch steps" : " iterations") << ", mean distance to centroid "
+                  << stats.meanDistance << ", clusters of " << smallest << "-" << largest << " images)"
+                  << std::endl;
+        if (clusters.save(indexFile) != 0) {
+            return -1;
+        }
+        if (!assignmentsFile.empty() && clusters.writeAssignments(assignmentsFile) != 0) {
+            return -1;
+        }
+    } else {
+        std::cerr << "Error: Unknown index type " << indexType << std::endl;
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    return 0;
+}
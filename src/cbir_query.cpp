@@ -5,11 +5,30 @@
   Usage: ./cbir_query -t <target_image> -f <feature_type> -i <features.csv> -n <num_results> [-c <dnn_csv>]
 */
 
+#include "cascade.h"
 #include "cbir.h"
+#include "cluster.h"
 #include "feature.h"
+#include "fusion.h"
+#include "hnsw.h"
+#include "ivfpq.h"
+#include "knngraph.h"
+#include "lsh.h"
+#include "metrics.h"
+#include "net.h"
+#include "shard.h"
+#include "trace.h"
+#include "vptree.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <fstream>
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
+#include <memory>
+#include <sstream>
 
 void printUsage(const char* programName) {
     std::cout << "Usage: " << programName << " -t <target_image> -f <feature_type> -i <features.csv> -n <num_results> [-c <dnn_csv>]" << std::endl;
@@ -26,12 +45,543 @@ void printUsage(const char* programName) {
     std::cout << "  -i <features.csv>   Input feature database file" << std::endl;
     std::cout << "  -n <num_results>    Number of top matches to return" << std::endl;
     std::cout << "  -c <dnn_csv>        Path to DNN embeddings CSV (required for dnn_embedding)" << std::endl;
+    std::cout << "  -m <mode>           Search mode:" << std::endl;
+    std::cout << "                        exact - full linear scan (default)" << std::endl;
+    std::cout << "                        hnsw  - approximate search with an HNSW index" << std::endl;
+    std::cout << "                        ivfpq - compressed approximate search with an IVF-PQ index" << std::endl;
+    std::cout << "                        early - exact pruned scan: early abandoning (baseline) or" << std::endl;
+    std::cout << "                                histogram pyramid bounds (histogram)" << std::endl;
+    std::cout << "                        vptree - exact search with a VP-tree (baseline, dnn_embedding)" << std::endl;
+    std::cout << "                        lsh   - binary signature prefilter with exact rerank (all types)" << std::endl;
+    std::cout << "                        cascade - -i database selects candidates, -I databases rerank them" << std::endl;
+    std::cout << "                        fusion - weighted single-pass query over -i and -I databases" << std::endl;
+    std::cout << "                        graph - database images looked up in a k-NN graph (all types)" << std::endl;
+    std::cout << "                        cluster - exact scan of the k-means clusters nearest the target" << std::endl;
+    std::cout << "                        range - stream every image within -R of the target, after" << std::endl;
+    std::cout << "                                listing byte-identical copies (exact duplicates)" << std::endl;
+    std::cout << "  -x <index_file>     Index file (default: <features.csv>.<mode>, built if missing)" << std::endl;
+    std::cout << "  -e <ef>             HNSW efSearch (default: value stored in the index)" << std::endl;
+    std::cout << "  -p <nprobe>         IVF-PQ lists / clusters to scan (default: value stored in the index)" << std::endl;
+    std::cout << "  -k <count>          LSH candidates reranked exactly (default: value stored in the index)" << std::endl;
+    std::cout << "  -S                  LSH: popcount scan over every signature instead of table probes" << std::endl;
+    std::cout << "  -I <features.csv>   Cascade/fusion: additional database (repeatable)" << std::endl;
+    std::cout << "  -M <m1,m2,...>      Cascade: candidates kept by each stage before the last (default: 100)" << std::endl;
+    std::cout << "  -w <w1,w2,...>      Fusion: weight of -i and each -I database (default: all 1)" << std::endl;
+    std::cout << "  -V                  Early abandon: visit high-variance dimensions first" << std::endl;
+    std::cout << "  -R <radius>         Range: largest distance reported (negative for histogram types," << std::endl;
+    std::cout << "                      whose distance is minus the intersection); -n caps the matches" << std::endl;
+    std::cout << "                      streamed (default: no cap). Uses <features.csv>.vptree (or -x)" << std::endl;
+    std::cout << "                      when present" << std::endl;
+    std::cout << "  -s <address>        Send the query to a running cbir_server (Unix socket path or" << std::endl;
+    std::cout << "                      localhost TCP port); -f names the server database, -i is not needed." << std::endl;
+    std::cout << "                      A comma-separated list queries every shard server and merges" << std::endl;
+    std::cout << "                      their results" << std::endl;
+    std::cout << "  -T <timeout_ms>     Shard queries: give up on a shard after this long (default 1000)" << std::endl;
+    std::cout << "  -r                  Report latency and recall@N against the exact scan" << std::endl;
+    std::cout << "  -P <metrics_file>   Write time per stage (read, decode, extract, scan, top-K, format)" << std::endl;
+    std::cout << "                      and counters on exit: Prometheus text for *.prom, JSON otherwise," << std::endl;
+    std::cout << "                      - for JSON on stdout" << std::endl;
+    std::cout << "  -B <megabytes>      Memory budget for the loaded databases: a database over it is held" << std::endl;
+    std::cout << "                      in compact form, exact queries on one too large even for that" << std::endl;
+    std::cout << "                      stream it from disk, other modes refuse it" << std::endl;
+    std::cout << "  -X <trace.json>     Record a timeline (load, target read/decode/extract, scan blocks," << std::endl;
+    std::cout << "                      merge, shard requests) as Chrome trace JSON for chrome://tracing" << std::endl;
+    std::cout << "                      or ui.perfetto.dev" << std::endl;
     std::cout << "  -h                  Show this help message" << std::endl;
     std::cout << std::endl;
     std::cout << "Examples:" << std::endl;
     std::cout << "  " << programName << " -t data/olympus/pic.1016.jpg -f baseline -i features_baseline.csv -n 3" << std::endl;
     std::cout << "  " << programName << " -t data/olympus/pic.0164.jpg -f histogram -i features_hist.csv -n 5" << std::endl;
     std::cout << "  " << programName << " -t data/olympus/pic.0893.jpg -f dnn_embedding -i features_dnn.csv -c resnet18_features.csv -n 3" << std::endl;
+    std::cout << "  " << programName << " -t data/olympus/pic.0893.jpg -f dnn_embedding -i features_dnn.csv -c resnet18_features.csv -n 10 -m hnsw -e 128 -r" << std::endl;
+    std::cout << "  " << programName << " -t data/olympus/pic.0893.jpg -f baseline -i features_baseline.csv -I features_dnn.csv -c resnet18_features.csv -n 10 -m cascade -M 200 -r" << std::endl;
+    std::cout << "  " << programName << " -t data/olympus/pic.0893.jpg -f histogram -i features_histogram.csv -I features_texture.csv -I features_dnn.csv -c resnet18_features.csv -n 10 -m fusion -w 1,1,2" << std::endl;
+    std::cout << "  " << programName << " -t data/olympus/pic.0164.jpg -f histogram -n 5 -s /tmp/cbir_server.sock" << std::endl;
+    std::cout << "  " << programName << " -t data/olympus/pic.1016.jpg -f baseline -i features_baseline.csv -m range -R 5000 -r" << std::endl;
+    std::cout << "  " << programName << " -t pic.0893.jpg -f dnn_embedding -i features_dnn.csv -c resnet18_features.csv -n 10 -m graph -r" << std::endl;
+    std::cout << "  " << programName << " -t data/olympus/pic.0164.jpg -f histogram -i features_histogram.csv -n 10 -m cluster -p 8 -r" << std::endl;
+    std::cout << "  " << programName << " -t data/olympus/pic.0164.jpg -f histogram -i features_histogram.csv -n 10 -B 256 -r" << std::endl;
+}
+
+double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool fileExists(const std::string& path) {
+    std::ifstream file(path);
+    return file.good();
+}
+
+// Parse a comma-separated list of candidate counts
+int parseCandidates(const std::string& list, std::vector<int>& counts) {
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        int value = std::atoi(item.c_str());
+        if (value <= 0) {
+            std::cerr << "Error: Invalid candidate count " << item << std::endl;
+            return -1;
+        }
+        counts.push_back(value);
+    }
+    return 0;
+}
+
+// Parse a comma-separated list of fusion weights
+int parseWeights(const std::string& list, std::vector<float>& weights) {
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        char* end = nullptr;
+        float value = std::strtof(item.c_str(), &end);
+        if (item.empty() || *end != '\0' || !std::isfinite(value) || value < 0.0f) {
+            std::cerr << "Error: Invalid weight " << item << std::endl;
+            return -1;
+        }
+        weights.push_back(value);
+    }
+    return 0;
+}
+
+// Load the -I databases used by cascade and fusion queries; they share
+// the primary database's memory budget, if it has one
+int loadExtraDatabases(const CBIRSystem& primary, const std::vector<std::string>& files,
+                       const std::string& dnnCsvPath, std::vector<std::unique_ptr<CBIRSystem>>& systems) {
+    size_t budget = primary.getMemoryBudget();
+    size_t used = primary.getMemoryStats().total();
+    for (const auto& file : files) {
+        std::unique_ptr<CBIRSystem> system(new CBIRSystem());
+        if (!dnnCsvPath.empty()) {
+            system->setDNNCsvPath(dnnCsvPath);
+        }
+        if (budget > 0) {
+            if (used >= budget) {
+                std::cerr << "Error: No memory budget left for database " << file << std::endl;
+                return -1;
+            }
+            system->setMemoryBudget(budget - used);
+        }
+        if (system->loadFeatures(file) <= 0) {
+            std::cerr << "Error: Failed to load database " << file << std::endl;
+            return -1;
+        }
+        systems.push_back(std::move(system));
+    }
+    return 0;
+}
+
+// Print a ranked result list
+void printResults(const std::string& targetImage, const std::vector<MatchResult>& results) {
+    ScopedStage timer(MetricStage::FORMAT);
+    std::cout << std::endl;
+    std::cout << "Top " << results.size() << " matches for " << targetImage << ":" << std::endl;
+    std::cout << "--------------------------------------------------" << std::endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        std::cout << i + 1 << ". " << results[i].imagePath
+                  << " (distance: " << results[i].distance << ")" << std::endl;
+    }
+}
+
+// Memory held by a database, by category
+void printMemoryStats(const MemoryStats& stats) {
+    const double mb = 1024.0 * 1024.0;
+    std::cout << "Memory: " << stats.total() / mb << " MB (features " << stats.featureBytes / mb << ", paths "
+              << stats.pathBytes / mb << ", indexes " << stats.indexBytes / mb << ", caches "
+              << stats.cacheBytes / mb << ", decode buffers " << stats.decodeBytes / mb << ")";
+    if (stats.budgetBytes > 0) {
+        std::cout << ", budget " << stats.budgetBytes / mb << " MB" << (stats.compact ? ", compact rows" : "");
+    }
+    std::cout << std::endl;
+}
+
+// Exact query over a database too large for the memory budget, streamed
+// from disk one row at a time
+int runStreaming(CBIRSystem& cbir, const std::string& featuresFile, const std::string& targetImage,
+                 int numResults, bool reportLatency) {
+    std::cout << "Note: " << featuresFile << " does not fit the memory budget even in compact form;"
+              << " streaming it from disk" << std::endl;
+    std::cout << "Querying..." << std::endl;
+
+    std::vector<MatchResult> results;
+    auto start = std::chrono::steady_clock::now();
+    if (cbir.streamQuery(featuresFile, targetImage, numResults, results) != 0 || results.empty()) {
+        std::cerr << "Error: Query returned no results" << std::endl;
+        return -1;
+    }
+    double queryMs = elapsedMs(start);
+
+    printResults(targetImage, results);
+    if (reportLatency) {
+        std::cout << std::endl;
+        std::cout << "Streaming scan latency: " << queryMs << " ms" << std::endl;
+        printMemoryStats(cbir.getMemoryStats());
+    }
+
+    std::cout << std::endl;
+    std::cout << "Query completed successfully." << std::endl;
+    return 0;
+}
+
+// Load the rerank databases and run a cascade query
+int runCascade(CBIRSystem& cbir, const std::vector<std::string>& rerankFiles, const std::string& dnnCsvPath,
+               const std::vector<int>& candidates, const std::string& targetImage, int numResults,
+               bool reportRecall) {
+    std::vector<std::unique_ptr<CBIRSystem>> rerankSystems;
+    if (loadExtraDatabases(cbir, rerankFiles, dnnCsvPath, rerankSystems) != 0) {
+        return -1;
+    }
+
+    std::vector<CascadeStage> stages;
+    stages.push_back(CascadeStage(&cbir, 0));
+    for (auto& system : rerankSystems) {
+        stages.push_back(CascadeStage(system.get(), 0));
+    }
+    for (size_t s = 0; s + 1 < stages.size(); s++) {
+        // The last listed count applies to any remaining stages
+        if (candidates.empty()) {
+            stages[s].candidates = 100;
+        } else {
+            stages[s].candidates = candidates[std::min(s, candidates.size() - 1)];
+        }
+    }
+
+    std::cout << "Querying..." << std::endl;
+    std::vector<MatchResult> results;
+    std::vector<CascadeStageStats> stats;
+    auto start = std::chrono::steady_clock::now();
+    if (cascadeQuery(targetImage, stages, numResults, results, &stats, reportRecall) != 0 || results.empty()) {
+        std::cerr << "Error: Query returned no results" << std::endl;
+        return -1;
+    }
+    double totalMs = elapsedMs(start);
+
+    printResults(targetImage, results);
+
+    if (reportRecall) {
+        double stagesMs = 0.0;
+        std::cout << std::endl;
+        for (size_t s = 0; s < stats.size(); s++) {
+            stagesMs += stats[s].latencyMs;
+            std::cout << "Stage " << s + 1 << " (" << featureTypeToString(stats[s].featureType) << "): "
+                      << stats[s].rowsCompared << " rows compared, " << stats[s].candidatesOut
+                      << " kept, " << stats[s].latencyMs << " ms, recall@" << numResults << " "
+                      << stats[s].recall << std::endl;
+        }
+        std::cout << "Cascade latency: " << stagesMs << " ms (with recall measurement: "
+                  << totalMs << " ms)" << std::endl;
+    }
+
+    std::cout << std::endl;
+    std::cout << "Query completed successfully." << std::endl;
+    return 0;
+}
+
+// Load the extra databases and run a weighted fusion query
+int runFusion(CBIRSystem& cbir, const std::vector<std::string>& extraFiles, const std::string& dnnCsvPath,
+              const std::vector<float>& weights, const std::string& targetImage, int numResults,
+              bool reportLatency) {
+    std::vector<std::unique_ptr<CBIRSystem>> extraSystems;
+    if (loadExtraDatabases(cbir, extraFiles, dnnCsvPath, extraSystems) != 0) {
+        return -1;
+    }
+    std::vector<CBIRSystem*> systems(1, &cbir);
+    for (auto& system : extraSystems) {
+        systems.push_back(system.get());
+    }
+    if (!weights.empty() && weights.size() != systems.size()) {
+        std::cerr << "Error: -w needs one weight per database (" << systems.size() << ")" << std::endl;
+        return -1;
+    }
+
+    FusedDatabase fused;
+    for (size_t c = 0; c < systems.size(); c++) {
+        if (fused.addColumn(systems[c], weights.empty() ? 1.0f : weights[c]) != 0) {
+            return -1;
+        }
+    }
+    if (fused.droppedImages() > 0) {
+        std::cout << "Warning: " << fused.droppedImages()
+                  << " images are missing from some databases and were left out" << std::endl;
+    }
+    fused.calibrate();
+
+    // Prepare every column's target first so the timing covers the scan only
+    std::cout << "Querying..." << std::endl;
+    std::vector<FeatureVector> targets(systems.size());
+    for (size_t c = 0; c < systems.size(); c++) {
+        if (systems[c]->extractTargetFeature(targetImage, targets[c]) != 0) {
+            std::cerr << "Error: Query returned no results" << std::endl;
+            return -1;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<MatchResult> results = fused.query(targets, numResults);
+    double fusedMs = elapsedMs(start);
+    if (results.empty()) {
+        std::cerr << "Error: Query returned no results" << std::endl;
+        return -1;
+    }
+
+    printResults(targetImage, results);
+
+    if (reportLatency) {
+        std::cout << std::endl;
+        for (size_t c = 0; c < systems.size(); c++) {
+            const FusionColumn& column = fused.column(c);
+            std::cout << "Column " << c + 1 << " (" << featureTypeToString(systems[c]->getFeatureType())
+                      << "): weight " << column.weight << ", distance mean " << column.mean
+                      << ", stddev " << (column.scale > 0.0f ? 1.0f / column.scale : 0.0f) << std::endl;
+        }
+
+        // The same work as separate full scans with the same top-N, for comparison
+        double separateMs = 0.0;
+        for (size_t c = 0; c < systems.size(); c++) {
+            systems[c]->clearCaches();
+            auto t0 = std::chrono::steady_clock::now();
+            systems[c]->query(targets[c], numResults);
+            separateMs += elapsedMs(t0);
+        }
+        std::cout << "Fused scan latency: " << fusedMs << " ms over " << fused.size() << " images" << std::endl;
+        std::cout << "Separate full scans (top " << numResults << "): " << separateMs << " ms" << std::endl;
+    }
+
+    std::cout << std::endl;
+    std::cout << "Query completed successfully." << std::endl;
+    return 0;
+}
+
+// Send the query to a cbir_server instead of loading the database
+int runClient(const std::string& address, const std::string& database, const std::string& targetImage,
+              int numResults, int timeoutMs, bool reportLatency) {
+    // The server resolves relative paths against its own working directory
+    std::string target = targetImage;
+    char resolved[PATH_MAX];
+    if (realpath(targetImage.c_str(), resolved) != nullptr) {
+        target = resolved;
+    }
+
+    std::vector<std::string> shards;
+    std::stringstream list(address);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        if (!item.empty()) {
+            shards.push_back(item);
+        }
+    }
+
+    std::vector<MatchResult> results;
+    std::vector<ShardReport> reports;
+    auto start = std::chrono::steady_clock::now();
+    if (shards.size() > 1) {
+        int answered = scatterGather(shards, database, target, numResults, timeoutMs, results, &reports);
+        if (answered < 0) {
+            std::cerr << "Error: No shard answered" << std::endl;
+            return -1;
+        }
+        if (static_cast<size_t>(answered) < shards.size()) {
+            std::cout << "Warning: partial results, " << shards.size() - answered << " of "
+                      << shards.size() << " shards did not answer" << std::endl;
+        }
+        for (const auto& r : reports) {
+            if (r.missingShards > 0) {
+                std::cout << "Warning: partial results, " << r.missingShards << " shards behind "
+                          << r.address << " did not answer" << std::endl;
+            }
+        }
+    } else {
+        RemoteQueryStatus status;
+        if (remoteQuery(address, database, numResults, target, results, -1, &status) != 0) {
+            std::cerr << "Error: " << status.error << std::endl;
+            return -1;
+        }
+        // A coordinator answers with whatever its shards returned in time
+        if (status.missingShards > 0) {
+            std::cout << "Warning: partial results, " << status.missingShards
+                      << " shards behind " << address << " did not answer" << std::endl;
+        }
+    }
+    double roundTripMs = elapsedMs(start);
+
+    printResults(targetImage, results);
+    if (reportLatency) {
+        std::cout << std::endl;
+        for (const auto& r : reports) {
+            std::cout << "Shard " << r.address << ": " << shardStatusToString(r.status) << ", "
+                      << r.latencyMs << " ms, " << r.results << " results";
+            if (r.missingShards > 0) {
+                std::cout << ", " << r.missingShards << " of its shards missing";
+            }
+            if (!r.error.empty()) {
+                std::cout << " (" << r.error << ")";
+            }
+            std::cout << std::endl;
+        }
+        std::cout << "Round-trip latency: " << roundTripMs << " ms" << std::endl;
+    }
+    return 0;
+}
+
+// List exact duplicates, then stream every match within the radius
+int runRange(CBIRSystem& cbir, const std::string& targetImage, float radius, int maxResults,
+             const std::string& indexFile, bool report) {
+    // Byte-identical copies need no feature work at all
+    if (cbir.hasContentHashes()) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<size_t> duplicates = cbir.findExactDuplicates(targetImage);
+        double hashMs = elapsedMs(start);
+        std::cout << "Exact duplicates of " << targetImage << ": " << duplicates.size() << std::endl;
+        for (size_t row : duplicates) {
+            std::cout << "  " << cbir.getImagePaths()[row] << std::endl;
+        }
+        if (report) {
+            std::cout << "Content hash lookup: " << hashMs << " ms" << std::endl;
+        }
+    } else {
+        std::cout << "No content hashes for this database (rebuild it with cbir_build to enable exact "
+                  << "duplicate lookups)" << std::endl;
+    }
+
+    FeatureVector targetFeature;
+    if (cbir.extractTargetFeature(targetImage, targetFeature) != 0) {
+        return -1;
+    }
+
+    // A VP-tree next to the database prunes whole subtrees (baseline and
+    // dnn_embedding databases only)
+    VPTree tree;
+    bool useTree = fileExists(indexFile) && tree.load(indexFile, cbir.getFeatures(), cbir.getFeatureType(),
+                                                          cbir.isNormalized()) == 0;
+
+    std::cout << std::endl;
+    std::cout << "Matches within " << radius << " of " << targetImage << " (unordered):" << std::endl;
+    std::cout << "--------------------------------------------------" << std::endl;
+    int matches = 0;
+    auto print = [&](const MatchResult& m) {
+        matches++;
+        std::cout << matches << ". " << m.imagePath << " (distance: " << m.distance << ")" << std::endl;
+        return maxResults <= 0 || matches < maxResults;
+    };
+
+    VPTreeStats treeStats;
+    ScanStats scanStats;
+    auto start = std::chrono::steady_clock::now();
+    if (useTree) {
+        tree.rangeVisit(targetFeature, radius, [&](const Neighbor& n) {
+            return print(MatchResult(cbir.getImagePaths()[n.id], n.distance));
+        }, &treeStats);
+    } else if (cbir.rangeQuery(targetFeature, radius, print, &scanStats) < 0) {
+        return -1;
+    }
+    double rangeMs = elapsedMs(start);
+
+    if (report) {
+        std::cout << std::endl;
+        if (useTree) {
+            std::cout << "VP-tree: visited " << treeStats.nodesVisited << " of " << tree.nodeCount()
+                      << " nodes, " << treeStats.distanceComputations << " distance computations" << std::endl;
+        } else {
+            std::cout << "Pruned scan: " << scanStats.rowsPruned << " of " << scanStats.rowsScanned
+                      << " rows discarded early, " << scanStats.workSaved() * 100.0
+                      << "% of distance work saved" << std::endl;
+        }
+
+        // The old way: rank the whole database, then cut at the radius
+        cbir.clearCaches();
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<MatchResult> all = cbir.query(targetFeature, -1);
+        size_t within = 0;
+        while (within < all.size() && all[within].distance <= radius) {
+            within++;
+        }
+        double sortMs = elapsedMs(t0);
+        std::cout << "Range latency: " << rangeMs << " ms" << std::endl;
+        std::cout << "Full ranking + cut: " << sortMs << " ms, " << within << " images within radius" << std::endl;
+    }
+
+    std::cout << std::endl;
+    std::cout << "Query completed successfully." << std::endl;
+    return 0;
+}
+
+// Load the HNSW index next to the database, building and saving it if missing
+int prepareHNSW(CBIRSystem& cbir, HNSWIndex& index, const std::string& indexFile) {
+    if (fileExists(indexFile)) {
+        return index.load(indexFile, cbir.getFeatures());
+    }
+
+    std::cout << "HNSW index " << indexFile << " not found, building it..." << std::endl;
+    if (index.build(cbir.getFeatures(), cbir.getFeatureType(), cbir.isNormalized(), HNSWParams()) != 0) {
+        return -1;
+    }
+    return index.save(indexFile);
+}
+
+// Load the IVF-PQ index next to the database, training and saving it if missing
+int prepareIVFPQ(CBIRSystem& cbir, IVFPQIndex& index, const std::string& indexFile) {
+    if (fileExists(indexFile)) {
+        return index.load(indexFile, cbir.getFeatures());
+    }
+
+    std::cout << "IVF-PQ index " << indexFile << " not found, training it..." << std::endl;
+    if (index.build(cbir.getFeatures(), cbir.getFeatureType(), cbir.isNormalized(), IVFPQParams()) != 0) {
+        return -1;
+    }
+    return index.save(indexFile);
+}
+
+// Load the LSH index next to the database, building and saving it if missing
+int prepareLSH(CBIRSystem& cbir, LSHIndex& index, const std::string& indexFile) {
+    if (fileExists(indexFile)) {
+        return index.load(indexFile, cbir.getFeatures(), cbir.getFeatureType(), cbir.isNormalized());
+    }
+
+    std::cout << "LSH index " << indexFile << " not found, building it..." << std::endl;
+    if (index.build(cbir.getFeatures(), cbir.getFeatureType(), cbir.isNormalized(), LSHParams()) != 0) {
+        return -1;
+    }
+    return index.save(indexFile);
+}
+
+// Load the k-NN graph next to the database, building and saving it if missing
+int prepareKNNGraph(CBIRSystem& cbir, KNNGraph& graph, const std::string& indexFile) {
+    if (fileExists(indexFile)) {
+        return graph.load(indexFile, cbir);
+    }
+
+    std::cout << "k-NN graph " << indexFile << " not found, building it..." << std::endl;
+    if (graph.build(cbir, KNNGraphParams()) != 0) {
+        return -1;
+    }
+    return graph.save(indexFile);
+}
+
+// Load the clusters next to the database, building and saving them if missing
+int prepareClusters(CBIRSystem& cbir, ClusterIndex& clusters, const std::string& indexFile) {
+    if (fileExists(indexFile)) {
+        return clusters.load(indexFile, cbir);
+    }
+
+    std::cout << "Clusters " << indexFile << " not found, building them..." << std::endl;
+    ClusterParams params;
+    params.k = static_cast<int>(std::min<size_t>(params.k, cbir.getDatabaseSize()));
+    if (clusters.build(cbir, params) != 0) {
+        return -1;
+    }
+    return clusters.save(indexFile);
+}
+
+// Load the VP-tree next to the database, building and saving it if missing
+int prepareVPTree(CBIRSystem& cbir, VPTree& tree, const std::string& indexFile) {
+    if (fileExists(indexFile)) {
+        return tree.load(indexFile, cbir.getFeatures(), cbir.getFeatureType(), cbir.isNormalized());
+    }
+
+    std::cout << "VP-tree " << indexFile << " not found, building it..." << std::endl;
+    if (tree.build(cbir.getFeatures(), cbir.getFeatureType(), cbir.isNormalized()) != 0) {
+        return -1;
+    }
+    return tree.save(indexFile);
 }
 
 int main(int argc, char* argv[]) {
@@ -39,7 +589,26 @@ int main(int argc, char* argv[]) {
     std::string featureTypeStr;
     std::string featuresFile;
     std::string dnnCsvPath;
+    std::string mode = "exact";
+    std::string indexFile;
+    int efSearch = 0;
+    int nprobe = 0;
+    int rerank = 0;
+    bool scanSignatures = false;
+    bool reportRecall = false;
+    bool reorderDims = false;
     int numResults = 3;
+    bool numResultsSet = false;
+    float radius = 0.0f;
+    bool radiusSet = false;
+    std::vector<std::string> extraFiles;
+    std::vector<int> candidates;
+    std::vector<float> weights;
+    std::string serverAddress;
+    int shardTimeoutMs = 1000;
+    std::string metricsFile;
+    std::string traceFile;
+    double memoryBudgetMb = 0.0;
 
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
@@ -51,8 +620,48 @@ int main(int argc, char* argv[]) {
             featuresFile = argv[++i];
         } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
             numResults = std::atoi(argv[++i]);
+            numResultsSet = true;
         } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
             dnnCsvPath = argv[++i];
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            mode = argv[++i];
+        } else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+            indexFile = argv[++i];
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            efSearch = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            nprobe = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            rerank = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-S") == 0) {
+            scanSignatures = true;
+        } else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+            extraFiles.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc) {
+            if (parseCandidates(argv[++i], candidates) != 0) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            if (parseWeights(argv[++i], weights) != 0) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            serverAddress = argv[++i];
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            shardTimeoutMs = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } else if (strcmp(argv[i], "-X") == 0 && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            memoryBudgetMb = std::atof(argv[++i]);
+        } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+            radius = static_cast<float>(std::atof(argv[++i]));
+            radiusSet = true;
+        } else if (strcmp(argv[i], "-V") == 0) {
+            reorderDims = true;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            reportRecall = true;
         } else if (strcmp(argv[i], "-h") == 0) {
             printUsage(argv[0]);
             return 0;
@@ -63,12 +672,53 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // Exported when main returns, on every path below
+    MetricsExport metricsExport(metricsFile);
+    TraceExport traceExport(traceFile);
+
+    // Client mode: the server already holds the database
+    if (!serverAddress.empty()) {
+        if (targetImage.empty() || featureTypeStr.empty()) {
+            std::cerr << "Error: Client mode needs -t <target_image> and -f <database>" << std::endl;
+            printUsage(argv[0]);
+            return -1;
+        }
+        return runClient(serverAddress, featureTypeStr, targetImage, numResults, shardTimeoutMs, reportRecall);
+    }
+
     // Validate arguments
     if (targetImage.empty() || featureTypeStr.empty() || featuresFile.empty()) {
         std::cerr << "Error: Missing required arguments" << std::endl;
         printUsage(argv[0]);
         return -1;
     }
+    if (mode != "exact" && mode != "hnsw" && mode != "ivfpq" && mode != "early" &&
+        mode != "vptree" && mode != "lsh" && mode != "cascade" &&
+        mode != "fusion" && mode != "range" && mode != "graph" && mode != "cluster") {
+        std::cerr << "Error: Unknown search mode " << mode << std::endl;
+        printUsage(argv[0]);
+        return -1;
+    }
+    if ((mode == "cascade" || mode == "fusion") && extraFiles.empty()) {
+        std::cerr << "Error: " << mode << " mode requires at least one -I <features.csv> database" << std::endl;
+        printUsage(argv[0]);
+        return -1;
+    }
+    if (mode == "range" && !radiusSet) {
+        std::cerr << "Error: range mode requires -R <radius>" << std::endl;
+        printUsage(argv[0]);
+        return -1;
+    }
+    if (indexFile.empty()) {
+        // Range queries share the VP-tree built for vptree mode
+        if (mode == "range") {
+            indexFile = featuresFile + ".vptree";
+        } else if (mode == "graph") {
+            indexFile = featuresFile + ".knn";
+        } else {
+            indexFile = featuresFile + "." + mode;
+        }
+    }
 
     // Convert feature type string to enum
     FeatureType featureType = stringToFeatureType(featureTypeStr);
@@ -86,6 +736,7 @@ int main(int argc, char* argv[]) {
     std::cout << "Feature type: " << featureTypeToString(featureType) << std::endl;
     std::cout << "Features file: " << featuresFile << std::endl;
     std::cout << "Number of results: " << numResults << std::endl;
+    std::cout << "Search mode: " << mode << std::endl;
     if (!dnnCsvPath.empty()) {
         std::cout << "DNN CSV: " << dnnCsvPath << std::endl;
     }
@@ -97,6 +748,14 @@ int main(int argc, char* argv[]) {
     if (!dnnCsvPath.empty()) {
         cbir.setDNNCsvPath(dnnCsvPath);
     }
+    if (memoryBudgetMb > 0.0) {
+        cbir.setMemoryBudget(static_cast<size_t>(memoryBudgetMb * 1024.0 * 1024.0));
+
+        // An exact scan needs only one row at a time
+        if (mode == "exact" && cbir.estimateLoadBytes(featuresFile, true) > cbir.getMemoryBudget()) {
+            return runStreaming(cbir, featuresFile, targetImage, numResults, reportRecall);
+        }
+    }
 
     // Load feature database
     if (cbir.loadFeatures(featuresFile) <= 0) {
@@ -112,9 +771,136 @@ int main(int argc, char* argv[]) {
         std::cout << "Using database feature type for query." << std::endl << std::endl;
     }
 
+    if (mode == "cascade") {
+        return runCascade(cbir, extraFiles, dnnCsvPath, candidates, targetImage, numResults, reportRecall);
+    }
+    if (mode == "fusion") {
+        return runFusion(cbir, extraFiles, dnnCsvPath, weights, targetImage, numResults, reportRecall);
+    }
+    if (mode == "range") {
+        return runRange(cbir, targetImage, radius, numResultsSet ? numResults : 0, indexFile, reportRecall);
+    }
+
     // Perform query
     std::cout << "Querying..." << std::endl;
-    std::vector<MatchResult> results = cbir.query(targetImage, numResults);
+    FeatureVector targetFeature;
+    if (cbir.extractTargetFeature(targetImage, targetFeature) != 0) {
+        std::cerr << "Error: Query returned no results" << std::endl;
+        return -1;
+    }
+
+    std::vector<MatchResult> results;
+    double queryMs = 0.0;
+    size_t indexBytes = 0;
+
+    if (mode == "hnsw") {
+        HNSWIndex index;
+        if (prepareHNSW(cbir, index, indexFile) != 0) {
+            std::cerr << "Error: Failed to prepare HNSW index" << std::endl;
+            return -1;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        results = cbir.toMatchResults(index.search(targetFeature, numResults, efSearch));
+        queryMs = elapsedMs(start);
+        indexBytes = index.memoryBytes();
+    } else if (mode == "ivfpq") {
+        IVFPQIndex index;
+        if (prepareIVFPQ(cbir, index, indexFile) != 0) {
+            std::cerr << "Error: Failed to prepare IVF-PQ index" << std::endl;
+            return -1;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        results = cbir.toMatchResults(index.search(targetFeature, numResults, nprobe));
+        queryMs = elapsedMs(start);
+        indexBytes = index.memoryBytes();
+    } else if (mode == "vptree") {
+        VPTree tree;
+        if (prepareVPTree(cbir, tree, indexFile) != 0) {
+            std::cerr << "Error: Failed to prepare VP-tree" << std::endl;
+            return -1;
+        }
+
+        VPTreeStats stats;
+        auto start = std::chrono::steady_clock::now();
+        results = cbir.toMatchResults(tree.search(targetFeature, numResults, &stats));
+        queryMs = elapsedMs(start);
+        indexBytes = tree.memoryBytes();
+
+        std::cout << "VP-tree: visited " << stats.nodesVisited << " of " << tree.nodeCount()
+                  << " nodes, " << stats.distanceComputations << " distance computations" << std::endl;
+    } else if (mode == "lsh") {
+        LSHIndex index;
+        if (prepareLSH(cbir, index, indexFile) != 0) {
+            std::cerr << "Error: Failed to prepare LSH index" << std::endl;
+            return -1;
+        }
+
+        LSHStats stats;
+        auto start = std::chrono::steady_clock::now();
+        if (scanSignatures) {
+            results = cbir.toMatchResults(index.scan(targetFeature, numResults, rerank, &stats));
+        } else {
+            results = cbir.toMatchResults(index.search(targetFeature, numResults, rerank, &stats));
+        }
+        queryMs = elapsedMs(start);
+        indexBytes = index.memoryBytes();
+
+        std::cout << "LSH: " << stats.bucketsProbed << " buckets probed, " << stats.signaturesCompared
+                  << " signatures compared, " << stats.distanceComputations << " rows reranked";
+        if (stats.fellBackToScan) {
+            std::cout << " (too few table candidates, scanned all signatures)";
+        }
+        std::cout << std::endl;
+    } else if (mode == "graph") {
+        KNNGraph graph;
+        if (prepareKNNGraph(cbir, graph, indexFile) != 0 || cbir.setNeighborGraph(&graph) != 0) {
+            std::cerr << "Error: Failed to prepare k-NN graph" << std::endl;
+            return -1;
+        }
+        if (numResults - 1 > graph.neighborCount()) {
+            std::cout << "Note: -n " << numResults << " is deeper than the graph (" << graph.neighborCount()
+                      << " neighbours), using a full scan" << std::endl;
+        } else if (cbir.findImage(targetImage) < 0) {
+            std::cout << "Note: target is not in the database, using a full scan" << std::endl;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        results = cbir.query(targetImage, numResults);
+        queryMs = elapsedMs(start);
+        indexBytes = graph.memoryBytes();
+        cbir.setNeighborGraph(nullptr);
+    } else if (mode == "cluster") {
+        ClusterIndex clusters;
+        if (prepareClusters(cbir, clusters, indexFile) != 0) {
+            std::cerr << "Error: Failed to prepare clusters" << std::endl;
+            return -1;
+        }
+
+        ClusterSearchStats stats;
+        auto start = std::chrono::steady_clock::now();
+        results = cbir.toMatchResults(clusters.search(targetFeature, numResults, nprobe, &stats));
+        queryMs = elapsedMs(start);
+        indexBytes = clusters.memoryBytes();
+
+        std::cout << "Clusters: scanned " << stats.clustersProbed << " of " << clusters.numClusters()
+                  << " clusters, " << stats.rowsScanned << " of " << cbir.getDatabaseSize() << " images"
+                  << std::endl;
+    } else if (mode == "early") {
+        ScanStats stats;
+        auto start = std::chrono::steady_clock::now();
+        results = cbir.queryEarlyAbandon(targetFeature, numResults, reorderDims, &stats);
+        queryMs = elapsedMs(start);
+
+        std::cout << "Pruned scan: " << stats.rowsPruned << " of " << stats.rowsScanned
+                  << " rows discarded early, " << stats.workSaved() * 100.0
+                  << "% of distance work saved" << std::endl;
+    } else {
+        auto start = std::chrono::steady_clock::now();
+        results = cbir.query(targetFeature, numResults);
+        queryMs = elapsedMs(start);
+    }
 
     if (results.empty()) {
         std::cerr << "Error: Query returned no results" << std::endl;
@@ -122,13 +908,25 @@ int main(int argc, char* argv[]) {
     }
 
     // Print results
-    std::cout << std::endl;
-    std::cout << "Top " << results.size() << " matches for " << targetImage << ":" << std::endl;
-    std::cout << "--------------------------------------------------" << std::endl;
+    printResults(targetImage, results);
 
-    for (size_t i = 0; i < results.size(); i++) {
-        std::cout << i + 1 << ". " << results[i].imagePath
-                  << " (distance: " << results[i].distance << ")" << std::endl;
+    if (reportRecall) {
+        // Time a real scan, not a result cache hit
+        cbir.clearCaches();
+        auto start = std::chrono::steady_clock::now();
+        std::vector<MatchResult> exact = cbir.query(targetFeature, numResults);
+        double exactMs = elapsedMs(start);
+
+        std::cout << std::endl;
+        std::cout << "Search latency (" << mode << "): " << queryMs << " ms" << std::endl;
+        std::cout << "Exact scan latency: " << exactMs << " ms" << std::endl;
+        std::cout << "Recall@" << numResults << ": " << recallAtK(exact, results) << std::endl;
+        if (indexBytes > 0) {
+            size_t rawBytes = cbir.getDatabaseSize() * targetFeature.size() * sizeof(float);
+            std::cout << "Index memory: " << indexBytes / (1024.0 * 1024.0) << " MB (raw features: "
+                      << rawBytes / (1024.0 * 1024.0) << " MB)" << std::endl;
+        }
+        printMemoryStats(cbir.getMemoryStats());
     }
 
     std::cout << std::endl;
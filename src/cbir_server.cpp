@@ -0,0 +1,544 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Long-running query server. Loads feature databases once and
+           answers queries over a Unix socket or localhost TCP port, or
+           coordinates queries across shard servers.
+  Usage: ./cbir_server -i [name=]<features.csv> [-i ...] [-s <socket>] [-p <port>] [-j <workers>]
+         [-B <max_batch>] [-W <window_ms>] [-P <metrics_file>] [-U <seconds>]
+         ./cbir_server -R <shard1,shard2,...> [-T <timeout_ms>] [-s <socket>] [-p <port>]
+*/
+
+#include "batcher.h"
+#include "cbir.h"
+#include "latency.h"
+#include "metrics.h"
+#include "net.h"
+#include "parallel.h"
+#include "shard.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void handleSignal(int) {
+    g_stop = 1;
+}
+
+void printUsage(const char* programName) {
+    std::cout << "Usage: " << programName << " -i [name=]<features.csv> [-i ...] [-s <socket>] [-p <port>] [-j <workers>]" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -i [name=]<file>    Feature database to serve (repeatable). Clients select it by" << std::endl;
+    std::cout << "                      name; the default name is its feature type, e.g. histogram" << std::endl;
+    std::cout << "  -c <dnn_csv>        Path to DNN embeddings CSV (for dnn_embedding targets)" << std::endl;
+    std::cout << "  -s <socket>         Unix socket path (default " << DEFAULT_SERVER_SOCKET << ")" << std::endl;
+    std::cout << "  -p <port>           Also listen on localhost TCP port" << std::endl;
+    std::cout << "  -j <workers>        Connection worker threads (default: 4 per core); at most this" << std::endl;
+    std::cout << "                      many queries are in flight, which bounds the batch size" << std::endl;
+    std::cout << "  -t <idle_seconds>   Close a connection after this long without a request, so idle clients" << std::endl;
+    std::cout << "                      cannot hold every worker (default 30, 0 = never)" << std::endl;
+    std::cout << "  -B <max_batch>      Most queries coalesced into one database scan, 1 = no batching" << std::endl;
+    std::cout << "                      (default 16)" << std::endl;
+    std::cout << "  -W <window_ms>      Longest wait for more queries to join a batch once queries queue up;" << std::endl;
+    std::cout << "                      a lone query is answered at once (default 1.0)" << std::endl;
+    std::cout << "  -e <executors>      Threads running batch scans (default: all cores)" << std::endl;
+    std::cout << "  -R <addresses>      Coordinator mode: forward each query to these shard servers" << std::endl;
+    std::cout << "                      (comma-separated) and merge their results instead of loading -i" << std::endl;
+    std::cout << "  -T <timeout_ms>     Coordinator: answer with partial results after this long (default 1000)" << std::endl;
+    std::cout << "  -P <metrics_file>   Rewrite stage timers and counters to this file every -U seconds and on" << std::endl;
+    std::cout << "                      exit: Prometheus text for *.prom (e.g. for the node_exporter textfile" << std::endl;
+    std::cout << "                      collector), JSON otherwise. The METRICS command returns them as JSON" << std::endl;
+    std::cout << "  -U <seconds>        Metrics file update interval (default 10)" << std::endl;
+    std::cout << "  -h                  Show this help message" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Examples:" << std::endl;
+    std::cout << "  " << programName << " -i features_histogram.csv -i features_dnn.csv -c resnet18_features.csv" << std::endl;
+    std::cout << "  " << programName << " -i colour=features_histogram.csv -p 7070 -j 8" << std::endl;
+    std::cout << "  " << programName << " -i features_baseline.csv -j 64 -B 32 -W 2" << std::endl;
+    std::cout << "  " << programName << " -i features_hist.shard0.csv -s /tmp/shard0.sock" << std::endl;
+    std::cout << "  " << programName << " -R /tmp/shard0.sock,/tmp/shard1.sock -T 500 -p 7070" << std::endl;
+    std::cout << "  " << programName << " -i features_histogram.csv -P /var/lib/node_exporter/cbir.prom" << std::endl;
+}
+
+struct ServerDatabase {
+    std::string name;
+    std::unique_ptr<CBIRSystem> system;
+};
+
+// Connections are queued by the accept loop and served by a fixed pool of
+// workers, one connection per worker at a time. With batching, workers hand
+// their queries to a QueryBatcher and wait on the future. A coordinator has
+// no databases and scatters every query to its shard servers instead.
+class QueryServer {
+private:
+    std::vector<ServerDatabase> databases;
+    std::unique_ptr<QueryBatcher> batcher;
+
+    std::vector<std::string> shards;
+    int shardTimeoutMs;
+    int idleTimeoutMs;
+    std::vector<std::unique_ptr<LatencyRecorder>> shardLatency;
+    std::vector<size_t> shardMisses;
+    size_t partialCount;
+    mutable std::mutex shardLock;
+    LatencyRecorder latency;
+    std::atomic<size_t> errorCount;
+
+    std::mutex queueLock;
+    std::condition_variable queueReady;
+    std::deque<int> pendingConnections;
+    std::set<int> activeConnections;
+    bool stopping;
+    std::vector<std::thread> workers;
+
+    CBIRSystem* findDatabase(const std::string& name) {
+        for (auto& db : databases) {
+            if (db.name == name) {
+                return db.system.get();
+            }
+        }
+        return nullptr;
+    }
+
+    void workerLoop() {
+        while (true) {
+            int fd;
+            {
+                std::unique_lock<std::mutex> guard(queueLock);
+                queueReady.wait(guard, [this]() { return stopping || !pendingConnections.empty(); });
+                if (stopping) {
+                    return;
+                }
+                fd = pendingConnections.front();
+                pendingConnections.pop_front();
+                activeConnections.insert(fd);
+            }
+
+            serveConnection(fd);
+
+            {
+                std::lock_guard<std::mutex> guard(queueLock);
+                activeConnections.erase(fd);
+            }
+            close(fd);
+        }
+    }
+
+    // A connection holds its worker until it closes, so one that sends
+    // nothing for idleTimeoutMs is dropped
+    void serveConnection(int fd) {
+        std::string pending, line;
+        while (readLine(fd, pending, line, idleTimeoutMs > 0 ? idleTimeoutMs : -1)) {
+            if (line == "QUIT") {
+                return;
+            }
+            if (!writeAll(fd, handleRequest(line))) {
+                return;
+            }
+        }
+    }
+
+public:
+    QueryServer() : shardTimeoutMs(1000), idleTimeoutMs(30000), partialCount(0), errorCount(0), stopping(false) {}
+
+    void setIdleTimeout(int timeoutMs) { idleTimeoutMs = timeoutMs; }
+
+    void setShards(const std::vector<std::string>& addresses, int timeoutMs) {
+        shards = addresses;
+        shardTimeoutMs = timeoutMs;
+        shardLatency.clear();
+        for (size_t s = 0; s < shards.size(); s++) {
+            shardLatency.push_back(std::unique_ptr<LatencyRecorder>(new LatencyRecorder()));
+        }
+        shardMisses.assign(shards.size(), 0);
+    }
+
+    // Scatter a query to the shards and record how each of them did
+    std::string coordinateQuery(const std::string& name, int topN, const std::string& target) {
+        std::vector<MatchResult> results;
+        std::vector<ShardReport> reports;
+        int answered = scatterGather(shards, name, target, topN, shardTimeoutMs, results, &reports);
+
+        {
+            std::lock_guard<std::mutex> guard(shardLock);
+            for (size_t s = 0; s < reports.size(); s++) {
+                if (reports[s].status == ShardStatus::OK) {
+                    shardLatency[s]->record(reports[s].latencyMs);
+                } else {
+                    shardMisses[s]++;
+                    std::cerr << "Warning: shard " << reports[s].address << " "
+                              << shardStatusToString(reports[s].status) << ": " << reports[s].error << std::endl;
+                }
+            }
+            if (answered > 0 && static_cast<size_t>(answered) < shards.size()) {
+                partialCount++;
+            }
+        }
+
+        if (answered < 0) {
+            errorCount++;
+            return "ERR no shard answered\n";
+        }
+        // Shards that are coordinators themselves may be missing some of theirs
+        int missing = static_cast<int>(shards.size()) - answered;
+        for (const auto& r : reports) {
+            missing += r.missingShards;
+        }
+        return formatQueryResponse(results, missing);
+    }
+
+    int addDatabase(const std::string& spec, const std::string& dnnCsvPath) {
+        std::string name, file = spec;
+        size_t eq = spec.find('=');
+        if (eq != std::string::npos) {
+            name = spec.substr(0, eq);
+            file = spec.substr(eq + 1);
+        }
+
+        ServerDatabase db;
+        db.system.reset(new CBIRSystem());
+        if (!dnnCsvPath.empty()) {
+            db.system->setDNNCsvPath(dnnCsvPath);
+        }
+        if (db.system->loadFeatures(file) <= 0) {
+            std::cerr << "Error: Failed to load feature database " << file << std::endl;
+            return -1;
+        }
+        db.name = name.empty() ? featureTypeToString(db.system->getFeatureType()) : name;
+        if (findDatabase(db.name) != nullptr) {
+            std::cerr << "Error: Two databases named " << db.name << "; use -i name=<file>" << std::endl;
+            return -1;
+        }
+
+        std::cout << "Serving " << db.name << " (" << db.system->getDatabaseSize() << " images from "
+                  << file << ")" << std::endl;
+        databases.push_back(std::move(db));
+        return 0;
+    }
+
+    // Answer one request line; every response ends with a newline
+    std::string handleRequest(const std::string& line) {
+        std::istringstream in(line);
+        std::string command;
+        in >> command;
+
+        if (command == "PING") {
+            return "OK pong\n";
+        }
+        if (command == "STATS") {
+            return "OK " + statsLine() + "\n";
+        }
+        if (command == "METRICS") {
+            std::ostringstream out;
+            out << "OK ";
+            writeMetricsJSON(out, metricsSnapshot(), true);
+            out << "\n";
+            return out.str();
+        }
+        if (command != "QUERY") {
+            errorCount++;
+            return "ERR unknown command " + command + "\n";
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::string name, target;
+        int topN = 0;
+        in >> name >> topN;
+        std::getline(in, target);
+        size_t first = target.find_first_not_of(" \t");
+        target = (first == std::string::npos) ? "" : target.substr(first);
+
+        if (topN <= 0 || target.empty()) {
+            errorCount++;
+            return "ERR usage: QUERY <db> <n> <target path>\n";
+        }
+        if (!shards.empty()) {
+            std::string response = coordinateQuery(name, topN, target);
+            latency.record(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            return response;
+        }
+
+        CBIRSystem* system = findDatabase(name);
+        if (system == nullptr) {
+            errorCount++;
+            return "ERR unknown database " + name + "\n";
+        }
+
+        FeatureVector targetFeature;
+        if (system->extractTargetFeature(target, targetFeature) != 0) {
+            errorCount++;
+            return "ERR cannot extract features from " + target + "\n";
+        }
+        std::vector<MatchResult> results;
+        if (batcher) {
+            results = batcher->submit(system, targetFeature, topN).get();
+        } else {
+            results = system->query(targetFeature, topN);
+        }
+        std::string response;
+        {
+            ScopedStage timer(MetricStage::FORMAT);
+            response = formatQueryResponse(results);
+        }
+        latency.record(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        return response;
+    }
+
+    std::string statsLine() const {
+        std::ostringstream out;
+        out << "queries=" << latency.count() << " errors=" << errorCount.load()
+            << " p50_ms=" << latency.percentile(50.0) << " p99_ms=" << latency.percentile(99.0)
+            << " max_ms=" << latency.percentile(100.0);
+        if (!shards.empty()) {
+            std::lock_guard<std::mutex> guard(shardLock);
+            out << " partial=" << partialCount;
+            for (size_t s = 0; s < shards.size(); s++) {
+                out << " shard" << s << "_p50_ms=" << shardLatency[s]->percentile(50.0)
+                    << " shard" << s << "_p99_ms=" << shardLatency[s]->percentile(99.0)
+                    << " shard" << s << "_misses=" << shardMisses[s];
+            }
+        }
+        size_t memoryBytes = 0;
+        for (const auto& db : databases) {
+            memoryBytes += db.system->getMemoryStats().total();
+        }
+        out << " memory_mb=" << memoryBytes / (1024.0 * 1024.0);
+        if (batcher) {
+            BatchStats batches = batcher->stats();
+            out << " batches=" << batches.batches << " mean_batch=" << batches.meanBatch()
+                << " max_batch=" << batches.largestBatch << " queue_p50_ms=" << batches.queueP50Ms
+                << " queue_p99_ms=" << batches.queueP99Ms;
+        }
+        return out.str();
+    }
+
+    void enableBatching(const BatchParams& params) {
+        batcher.reset(new QueryBatcher(params));
+    }
+
+    void start(int numWorkers) {
+        for (int i = 0; i < numWorkers; i++) {
+            workers.push_back(std::thread(&QueryServer::workerLoop, this));
+        }
+    }
+
+    void submit(int fd) {
+        {
+            std::lock_guard<std::mutex> guard(queueLock);
+            pendingConnections.push_back(fd);
+        }
+        queueReady.notify_one();
+    }
+
+    // Close idle connections and wait for the workers to finish
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(queueLock);
+            stopping = true;
+            for (int fd : activeConnections) {
+                shutdown(fd, SHUT_RDWR);
+            }
+            for (int fd : pendingConnections) {
+                close(fd);
+            }
+            pendingConnections.clear();
+        }
+        queueReady.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+        if (batcher) {
+            batcher->stop();
+        }
+    }
+};
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> databaseSpecs;
+    std::string dnnCsvPath;
+    std::string socketPath;
+    std::string tcpPort;
+    int numWorkers = 0;
+    BatchParams batchParams;
+    std::vector<std::string> shardAddresses;
+    int shardTimeoutMs = 1000;
+    double idleSeconds = 30.0;
+    std::string metricsFile;
+    double metricsInterval = 10.0;
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            databaseSpecs.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            dnnCsvPath = argv[++i];
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            tcpPort = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            numWorkers = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            idleSeconds = std::atof(argv[++i]);
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            batchParams.maxBatch = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-W") == 0 && i + 1 < argc) {
+            batchParams.windowMs = std::atof(argv[++i]);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            batchParams.numExecutors = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+            std::stringstream list(argv[++i]);
+            std::string address;
+            while (std::getline(list, address, ',')) {
+                if (!address.empty()) {
+                    shardAddresses.push_back(address);
+                }
+            }
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            shardTimeoutMs = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } else if (strcmp(argv[i], "-U") == 0 && i + 1 < argc) {
+            metricsInterval = std::atof(argv[++i]);
+        } else if (strcmp(argv[i], "-h") == 0) {
+            printUsage(argv[0]);
+            return 0;
+        } else {
+            std::cerr << "Unknown option: " << argv[i] << std::endl;
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (databaseSpecs.empty() == shardAddresses.empty()) {
+        std::cerr << "Error: Give either -i databases or -R shard servers" << std::endl;
+        printUsage(argv[0]);
+        return -1;
+    }
+    if (socketPath.empty() && tcpPort.empty()) {
+        socketPath = DEFAULT_SERVER_SOCKET;
+    }
+    if (metricsInterval <= 0.0) {
+        std::cerr << "Error: Metrics update interval must be positive" << std::endl;
+        return -1;
+    }
+    if (numWorkers <= 0) {
+        // Workers mostly wait on sockets and batches, so allow more than cores
+        numWorkers = 4 * defaultThreadCount();
+    }
+
+    std::cout << "CBIR Query Server" << std::endl;
+    std::cout << "=================" << std::endl;
+
+    QueryServer server;
+    for (const auto& spec : databaseSpecs) {
+        if (server.addDatabase(spec, dnnCsvPath) != 0) {
+            return -1;
+        }
+    }
+    if (!shardAddresses.empty()) {
+        server.setShards(shardAddresses, shardTimeoutMs);
+        std::cout << "Coordinating " << shardAddresses.size() << " shards (timeout "
+                  << shardTimeoutMs << " ms)" << std::endl;
+    }
+
+    std::vector<int> listeners;
+    // Identity of the socket file this process created, so shutdown never
+    // removes a file that replaced it
+    bool createdSocket = false;
+    struct stat socketInfo;
+    if (!socketPath.empty()) {
+        int fd = listenAddress(socketPath);
+        if (fd < 0) {
+            return -1;
+        }
+        createdSocket = lstat(socketPath.c_str(), &socketInfo) == 0 && S_ISSOCK(socketInfo.st_mode);
+        listeners.push_back(fd);
+        std::cout << "Listening on " << socketPath << std::endl;
+    }
+    if (!tcpPort.empty()) {
+        int fd = listenAddress(tcpPort);
+        if (fd < 0) {
+            return -1;
+        }
+        listeners.push_back(fd);
+        std::cout << "Listening on localhost:" << tcpPort << std::endl;
+    }
+
+    signal(SIGINT, handleSignal);
+    signal(SIGTERM, handleSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    server.setIdleTimeout(static_cast<int>(std::max(0.0, idleSeconds) * 1000.0));
+    if (batchParams.maxBatch > 1 && shardAddresses.empty()) {
+        server.enableBatching(batchParams);
+        std::cout << "Batching up to " << batchParams.maxBatch << " queries within "
+                  << batchParams.windowMs << " ms" << std::endl;
+    }
+    server.start(numWorkers);
+    std::cout << numWorkers << " workers ready (Ctrl+C to stop)" << std::endl;
+
+    // Accept loop; the poll timeout bounds how long a stop signal waits
+    std::vector<pollfd> fds(listeners.size());
+    for (size_t i = 0; i < listeners.size(); i++) {
+        fds[i].fd = listeners[i];
+        fds[i].events = POLLIN;
+    }
+    auto lastMetrics = std::chrono::steady_clock::now();
+    while (!g_stop) {
+        // Piggybacks on the poll timeout, so updates may run up to 250 ms late
+        if (!metricsFile.empty() &&
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - lastMetrics).count() >= metricsInterval) {
+            saveMetrics(metricsFile);
+            lastMetrics = std::chrono::steady_clock::now();
+        }
+
+        int ready = poll(fds.data(), fds.size(), 250);
+        if (ready <= 0) {
+            continue;
+        }
+        for (auto& p : fds) {
+            if (p.revents & POLLIN) {
+                int client = accept(p.fd, nullptr, nullptr);
+                if (client >= 0) {
+                    server.submit(client);
+                }
+            }
+        }
+    }
+
+    std::cout << std::endl << "Shutting down..." << std::endl;
+    for (int fd : listeners) {
+        close(fd);
+    }
+    struct stat currentInfo;
+    if (createdSocket && lstat(socketPath.c_str(), &currentInfo) == 0 && S_ISSOCK(currentInfo.st_mode) &&
+        currentInfo.st_dev == socketInfo.st_dev && currentInfo.st_ino == socketInfo.st_ino) {
+        unlink(socketPath.c_str());
+    }
+    server.stop();
+    std::cout << "Served " << server.statsLine() << std::endl;
+    if (!metricsFile.empty()) {
+        saveMetrics(metricsFile);
+    }
+
+    return 0;
+}
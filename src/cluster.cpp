@@ -0,0 +1,574 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Metric-aware k-means clustering of a feature database and
+           cluster-pruned search.
+*/
+
+#include "cluster.h"
+#include "cbir.h"
+#include "distance.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <random>
+
+namespace {
+
+const char CLUSTER_MAGIC[8] = {'C', 'B', 'I', 'R', 'C', 'L', 'S', 'T'};
+const uint32_t CLUSTER_VERSION = 1;
+
+// Databases at least this large use mini-batch updates by default
+const size_t MINI_BATCH_MIN_ROWS = 100000;
+const size_t DEFAULT_BATCH_ROWS = 4096;
+
+// k-means++ seeding runs on a sample of at most this many rows per cluster
+// (and at least SEED_SAMPLE_MIN rows)
+const size_t SEED_ROWS_PER_CLUSTER = 32;
+const size_t SEED_SAMPLE_MIN = 20000;
+
+template <typename T>
+void writeValue(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+bool readValue(std::ifstream& in, T& value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+} // namespace
+
+ClusterIndex::ClusterIndex()
+    : system(nullptr), featureType(FeatureType::BASELINE), normalized(false), dim(0), defaultProbes(4) {}
+
+float ClusterIndex::centroidDistance(const FeatureVector& a, const FeatureVector& centroid) const {
+    if (normalized) {
+        return normalizedCosineDistance(a, centroid);
+    }
+    return computeDistance(a, centroid, featureType);
+}
+
+void ClusterIndex::packCentroids() {
+    centroidColumns.clear();
+    if (!normalized && featureType != FeatureType::BASELINE && featureType != FeatureType::HISTOGRAM) {
+        return;
+    }
+    size_t k = centroids.size();
+    centroidColumns.resize(static_cast<size_t>(dim) * k);
+    for (size_t c = 0; c < k; c++) {
+        for (size_t d = 0; d < dim; d++) {
+            centroidColumns[d * k + c] = centroids[c][d];
+        }
+    }
+}
+
+uint32_t ClusterIndex::nearestCluster(size_t row, float& bestDist, std::vector<float>& sums) const {
+    const std::vector<float>& x = system->getFeatures()[row].data;
+    size_t k = centroids.size();
+    uint32_t best = 0;
+    bestDist = std::numeric_limits<float>::infinity();
+
+    if (centroidColumns.empty() || x.size() != dim) {
+        for (size_t c = 0; c < k; c++) {
+            float d = system->rowDistance(centroids[c], row);
+            if (d < bestDist) {
+                bestDist = d;
+                best = static_cast<uint32_t>(c);
+            }
+        }
+        return best;
+    }
+
+    // Each centroid's sum takes the dimensions in order with the centroid as
+    // the first operand, like rowDistance(), so the distances are the same
+    sums.assign(k, 0.0f);
+    float* acc = sums.data();
+    if (normalized) {
+        for (size_t d = 0; d < dim; d++) {
+            const float* column = &centroidColumns[d * k];
+            float v = x[d];
+            for (size_t c = 0; c < k; c++) {
+                acc[c] += column[c] * v;
+            }
+        }
+        for (size_t c = 0; c < k; c++) {
+            acc[c] = 1.0f - acc[c];
+        }
+    } else if (featureType == FeatureType::BASELINE) {
+        for (size_t d = 0; d < dim; d++) {
+            const float* column = &centroidColumns[d * k];
+            float v = x[d];
+            for (size_t c = 0; c < k; c++) {
+                float diff = column[c] - v;
+                acc[c] += diff * diff;
+            }
+        }
+    } else {
+        for (size_t d = 0; d < dim; d++) {
+            const float* column = &centroidColumns[d * k];
+            float v = x[d];
+            for (size_t c = 0; c < k; c++) {
+                acc[c] += std::min(column[c], v);
+            }
+        }
+        for (size_t c = 0; c < k; c++) {
+            acc[c] = -acc[c];
+        }
+    }
+
+    for (size_t c = 0; c < k; c++) {
+        if (acc[c] < bestDist) {
+            bestDist = acc[c];
+            best = static_cast<uint32_t>(c);
+        }
+    }
+    return best;
+}
+
+size_t ClusterIndex::assignAll(int numThreads) {
+    size_t n = system->getDatabaseSize();
+    int threads = numThreads > 0 ? numThreads : defaultThreadCount();
+    std::vector<size_t> changed(threads, 0);
+    packCentroids();
+
+    parallelFor(n, threads, 256, [&](size_t begin, size_t end, int t) {
+        std::vector<float> sums;
+        for (size_t row = begin; row < end; row++) {
+            float bestDist = 0.0f;
+            uint32_t best = nearestCluster(row, bestDist, sums);
+            if (assignment[row] != best) {
+                assignment[row] = best;
+                changed[t]++;
+            }
+            memberDistance[row] = bestDist;
+        }
+    });
+    return std::accumulate(changed.begin(), changed.end(), static_cast<size_t>(0));
+}
+
+void ClusterIndex::seedCentroids(const ClusterParams& params) {
+    const std::vector<FeatureVector>& features = system->getFeatures();
+    size_t n = features.size();
+    size_t k = static_cast<size_t>(params.k);
+    std::mt19937 rng(params.seed);
+
+    // Seed from a random sample; k-means++ costs a pass per centroid
+    size_t sampleSize = std::min(n, std::max(SEED_SAMPLE_MIN, k * SEED_ROWS_PER_CLUSTER));
+    std::vector<uint32_t> sample(n);
+    std::iota(sample.begin(), sample.end(), 0);
+    for (size_t i = 0; i < sampleSize && sampleSize < n; i++) {
+        std::uniform_int_distribution<size_t> pick(i, n - 1);
+        std::swap(sample[i], sample[pick(rng)]);
+    }
+    sample.resize(sampleSize);
+
+    // Dissimilarity is d(centroid, x) - d(x, x): zero for x itself under
+    // every distance here (histogram intersection is -sum(x) at best). The
+    // SSD is already a squared distance and the others behave like one
+    std::vector<float> self(sampleSize);
+    std::vector<float> minGap(sampleSize, std::numeric_limits<float>::infinity());
+    for (size_t s = 0; s < sampleSize; s++) {
+        self[s] = system->rowDistance(features[sample[s]], sample[s]);
+    }
+
+    centroids.clear();
+    std::uniform_int_distribution<size_t> first(0, sampleSize - 1);
+    size_t chosen = first(rng);
+    while (true) {
+        FeatureVector centroid(dim, featureType);
+        centroid.data = features[sample[chosen]].data;
+        centroids.push_back(centroid);
+        if (centroids.size() == k) {
+            break;
+        }
+
+        const FeatureVector& latest = centroids.back();
+        parallelFor(sampleSize, params.numThreads, 1024, [&](size_t begin, size_t end, int) {
+            for (size_t s = begin; s < end; s++) {
+                float gap = std::max(0.0f, system->rowDistance(latest, sample[s]) - self[s]);
+                minGap[s] = std::min(minGap[s], gap);
+            }
+        });
+
+        // Next centroid drawn with probability proportional to its gap
+        double total = 0.0;
+        for (float g : minGap) {
+            total += g;
+        }
+        if (total <= 0.0) {
+            chosen = first(rng);
+            continue;
+        }
+        std::uniform_real_distribution<double> draw(0.0, total);
+        double target = draw(rng);
+        chosen = sampleSize - 1;
+        for (size_t s = 0; s < sampleSize; s++) {
+            target -= minGap[s];
+            if (target < 0.0 && minGap[s] > 0.0f) {
+                chosen = s;
+                break;
+            }
+        }
+    }
+}
+
+int ClusterIndex::runLloyd(const ClusterParams& params) {
+    const std::vector<FeatureVector>& features = system->getFeatures();
+    size_t n = features.size();
+    size_t k = centroids.size();
+    std::mt19937 rng(params.seed + 1);
+    int iter = 0;
+
+    while (iter < params.iterations) {
+        size_t changed = assignAll(params.numThreads);
+        iter++;
+
+        // Bucket rows by cluster so each mean is computed by one thread
+        std::vector<size_t> start(k + 1, 0);
+        for (size_t i = 0; i < n; i++) {
+            start[assignment[i] + 1]++;
+        }
+        for (size_t c = 0; c < k; c++) {
+            start[c + 1] += start[c];
+        }
+        std::vector<uint32_t> rows(n);
+        std::vector<size_t> fill(start.begin(), start.end() - 1);
+        for (size_t i = 0; i < n; i++) {
+            rows[fill[assignment[i]]++] = static_cast<uint32_t>(i);
+        }
+
+        parallelFor(k, params.numThreads, 4, [&](size_t begin, size_t end, int) {
+            std::vector<double> sum(dim);
+            for (size_t c = begin; c < end; c++) {
+                if (start[c] == start[c + 1]) {
+                    continue;
+                }
+                std::fill(sum.begin(), sum.end(), 0.0);
+                for (size_t m = start[c]; m < start[c + 1]; m++) {
+                    const std::vector<float>& x = features[rows[m]].data;
+                    for (size_t d = 0; d < dim; d++) {
+                        sum[d] += x[d];
+                    }
+                }
+                double count = static_cast<double>(start[c + 1] - start[c]);
+                for (size_t d = 0; d < dim; d++) {
+                    centroids[c][d] = static_cast<float>(sum[d] / count);
+                }
+                if (normalized) {
+                    centroids[c].normalize();
+                }
+            }
+        });
+
+        // Re-seed empty clusters from random rows so k stays meaningful
+        bool reseeded = false;
+        std::uniform_int_distribution<size_t> pick(0, n - 1);
+        for (size_t c = 0; c < k; c++) {
+            if (start[c] == start[c + 1]) {
+                centroids[c].data = features[pick(rng)].data;
+                reseeded = true;
+            }
+        }
+        if (changed == 0 && !reseeded) {
+            break;
+        }
+    }
+    return iter;
+}
+
+int ClusterIndex::runMiniBatch(const ClusterParams& params, size_t batchSize) {
+    const std::vector<FeatureVector>& features = system->getFeatures();
+    size_t n = features.size();
+    std::mt19937 rng(params.seed + 1);
+    std::uniform_int_distribution<size_t> pick(0, n - 1);
+    std::vector<size_t> counts(centroids.size(), 0);
+    std::vector<uint32_t> batch(batchSize);
+    std::vector<uint32_t> nearest(batchSize);
+
+    for (int step = 0; step < params.batchSteps; step++) {
+        for (auto& row : batch) {
+            row = static_cast<uint32_t>(pick(rng));
+        }
+
+        packCentroids();
+        parallelFor(batchSize, params.numThreads, 64, [&](size_t begin, size_t end, int) {
+            std::vector<float> sums;
+            for (size_t b = begin; b < end; b++) {
+                // Cluster 0 when every distance is NaN, never last step's
+                float bestDist = 0.0f;
+                nearest[b] = nearestCluster(batch[b], bestDist, sums);
+            }
+        });
+
+        // Per-centroid learning rate 1/count: each centroid is the running
+        // mean of every row ever assigned to it
+        std::vector<bool> touched(centroids.size(), false);
+        for (size_t b = 0; b < batchSize; b++) {
+            uint32_t c = nearest[b];
+            float eta = 1.0f / static_cast<float>(++counts[c]);
+            const std::vector<float>& x = features[batch[b]].data;
+            std::vector<float>& centroid = centroids[c].data;
+            for (size_t d = 0; d < dim; d++) {
+                centroid[d] += eta * (x[d] - centroid[d]);
+            }
+            touched[c] = true;
+        }
+        if (normalized) {
+            for (size_t c = 0; c < centroids.size(); c++) {
+                if (touched[c]) {
+                    centroids[c].normalize();
+                }
+            }
+        }
+    }
+    return params.batchSteps;
+}
+
+void ClusterIndex::groupMembers() {
+    size_t n = assignment.size();
+    size_t k = centroids.size();
+    offsets.assign(k + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+        offsets[assignment[i] + 1]++;
+    }
+    for (size_t c = 0; c < k; c++) {
+        offsets[c + 1] += offsets[c];
+    }
+    members.resize(n);
+    std::vector<uint64_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < n; i++) {
+        members[fill[assignment[i]]++] = static_cast<uint32_t>(i);
+    }
+
+    // Nearest to the centroid first: the head of a cluster is its most
+    // typical image
+    for (size_t c = 0; c < k; c++) {
+        std::sort(members.begin() + offsets[c], members.begin() + offsets[c + 1],
+                  [&](uint32_t a, uint32_t b) {
+                      if (memberDistance[a] != memberDistance[b]) {
+                          return memberDistance[a] < memberDistance[b];
+                      }
+                      return a < b;
+                  });
+    }
+}
+
+int ClusterIndex::build(const CBIRSystem& database, const ClusterParams& params, ClusterBuildStats* stats) {
+    size_t n = database.getDatabaseSize();
+    if (n == 0) {
+        std::cerr << "Error: Cannot cluster an empty database" << std::endl;
+        return -1;
+    }
+    if (params.k <= 0 || static_cast<size_t>(params.k) > n) {
+        std::cerr << "Error: Cluster count must be between 1 and the database size (" << n << ")" << std::endl;
+        return -1;
+    }
+
+    system = &database;
+    featureType = database.getFeatureType();
+    normalized = database.isNormalized();
+    dim = static_cast<uint32_t>(database.getFeatures()[0].size());
+    defaultProbes = std::max(1, std::min(params.probes, params.k));
+    assignment.assign(n, std::numeric_limits<uint32_t>::max());
+    memberDistance.assign(n, 0.0f);
+
+    ClusterBuildStats local;
+    seedCentroids(params);
+
+    size_t batchSize = params.batchSize;
+    if (batchSize == 0 && n >= MINI_BATCH_MIN_ROWS) {
+        batchSize = DEFAULT_BATCH_ROWS;
+    }
+    if (batchSize > 0 && batchSize < n) {
+        local.miniBatch = true;
+        local.iterationsRun = runMiniBatch(params, batchSize);
+        assignAll(params.numThreads);
+    } else {
+        local.iterationsRun = runLloyd(params);
+        // The last update moved the centroids; assign against the final ones
+        assignAll(params.numThreads);
+    }
+    groupMembers();
+    centroidColumns.clear();
+    centroidColumns.shrink_to_fit();
+
+    // Mean distance to the centroid, measured from each row's best possible
+    // distance so histogram databases report a value that shrinks towards 0
+    std::vector<double> partial(params.numThreads > 0 ? params.numThreads : defaultThreadCount(), 0.0);
+    parallelFor(n, static_cast<int>(partial.size()), 1024, [&](size_t begin, size_t end, int t) {
+        for (size_t row = begin; row < end; row++) {
+            partial[t] += memberDistance[row] - database.rowDistance(database.getFeatures()[row], row);
+        }
+    });
+    local.meanDistance = std::accumulate(partial.begin(), partial.end(), 0.0) / n;
+
+    if (stats != nullptr) {
+        *stats = local;
+    }
+    return 0;
+}
+
+std::vector<Neighbor> ClusterIndex::search(const FeatureVector& target, int k, int probes,
+                                           ClusterSearchStats* stats) const {
+    ClusterSearchStats local;
+    if (system == nullptr || centroids.empty() || k <= 0) {
+        if (stats != nullptr) {
+            *stats = local;
+        }
+        return std::vector<Neighbor>();
+    }
+
+    size_t numProbes = static_cast<size_t>(probes > 0 ? probes : defaultProbes);
+    numProbes = std::min(numProbes, centroids.size());
+
+    std::vector<Neighbor> order(centroids.size());
+    for (size_t c = 0; c < centroids.size(); c++) {
+        order[c] = Neighbor(centroidDistance(target, centroids[c]), static_cast<uint32_t>(c));
+    }
+    std::partial_sort(order.begin(), order.begin() + numProbes, order.end());
+
+    TopK top(static_cast<size_t>(k));
+    for (size_t p = 0; p < numProbes; p++) {
+        uint32_t c = order[p].id;
+        for (uint64_t m = offsets[c]; m < offsets[c + 1]; m++) {
+            top.push(system->rowDistance(target, members[m]), members[m]);
+        }
+        local.rowsScanned += offsets[c + 1] - offsets[c];
+    }
+    local.clustersProbed = numProbes;
+
+    if (stats != nullptr) {
+        *stats = local;
+    }
+    return top.take();
+}
+
+int ClusterIndex::save(const std::string& filename) const {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for writing: " << filename << std::endl;
+        return -1;
+    }
+
+    uint32_t k = static_cast<uint32_t>(centroids.size());
+    uint64_t n = assignment.size();
+    file.write(CLUSTER_MAGIC, sizeof(CLUSTER_MAGIC));
+    writeValue(file, CLUSTER_VERSION);
+    writeValue(file, static_cast<uint32_t>(featureType));
+    writeValue(file, static_cast<uint8_t>(normalized ? 1 : 0));
+    writeValue(file, dim);
+    writeValue(file, k);
+    writeValue(file, static_cast<int32_t>(defaultProbes));
+    writeValue(file, n);
+    for (const auto& c : centroids) {
+        file.write(reinterpret_cast<const char*>(c.data.data()), dim * sizeof(float));
+    }
+    file.write(reinterpret_cast<const char*>(assignment.data()), n * sizeof(uint32_t));
+    file.write(reinterpret_cast<const char*>(memberDistance.data()), n * sizeof(float));
+
+    if (!file) {
+        std::cerr << "Error: Failed writing clusters " << filename << std::endl;
+        return -1;
+    }
+    std::cout << "Saved " << k << " clusters to " << filename << std::endl;
+    return 0;
+}
+
+int ClusterIndex::load(const std::string& filename, const CBIRSystem& database) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for reading: " << filename << std::endl;
+        return -1;
+    }
+
+    char magic[sizeof(CLUSTER_MAGIC)];
+    uint32_t version = 0, type = 0, fileDim = 0, k = 0;
+    uint8_t norm = 0;
+    int32_t probes = 0;
+    uint64_t n = 0;
+
+    if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, CLUSTER_MAGIC, sizeof(magic)) != 0 ||
+        !readValue(file, version) || version != CLUSTER_VERSION) {
+        std::cerr << "Error: " << filename << " is not a CBIR cluster file" << std::endl;
+        return -1;
+    }
+    if (!readValue(file, type) || !readValue(file, norm) || !readValue(file, fileDim) ||
+        !readValue(file, k) || !readValue(file, probes) || !readValue(file, n)) {
+        std::cerr << "Error: Truncated cluster file " << filename << std::endl;
+        return -1;
+    }
+    if (n != database.getDatabaseSize() || (n > 0 && fileDim != database.getFeatures()[0].size())) {
+        std::cerr << "Error: Clusters in " << filename << " were built for a different database ("
+                  << n << " x " << fileDim << ")" << std::endl;
+        return -1;
+    }
+    // Centroid distances are only valid for the metric they were built with
+    if (static_cast<FeatureType>(type) != database.getFeatureType() || (norm != 0) != database.isNormalized()) {
+        std::cerr << "Error: Clusters in " << filename << " were built for "
+                  << featureTypeToString(static_cast<FeatureType>(type)) << (norm != 0 ? " (normalized)" : "")
+                  << " features, database has " << featureTypeToString(database.getFeatureType())
+                  << (database.isNormalized() ? " (normalized)" : "") << std::endl;
+        return -1;
+    }
+    if (k == 0 || k > n || probes < 1 || static_cast<uint32_t>(probes) > k) {
+        std::cerr << "Error: Corrupt cluster file " << filename << std::endl;
+        return -1;
+    }
+
+    std::vector<FeatureVector> fileCentroids(k, FeatureVector(fileDim, static_cast<FeatureType>(type)));
+    for (auto& c : fileCentroids) {
+        file.read(reinterpret_cast<char*>(c.data.data()), fileDim * sizeof(float));
+    }
+    std::vector<uint32_t> fileAssignment(n);
+    std::vector<float> fileDistance(n);
+    file.read(reinterpret_cast<char*>(fileAssignment.data()), n * sizeof(uint32_t));
+    file.read(reinterpret_cast<char*>(fileDistance.data()), n * sizeof(float));
+    if (!file) {
+        std::cerr << "Error: Truncated cluster file " << filename << std::endl;
+        return -1;
+    }
+    for (uint32_t c : fileAssignment) {
+        if (c >= k) {
+            std::cerr << "Error: Corrupt cluster file " << filename << std::endl;
+            return -1;
+        }
+    }
+
+    system = &database;
+    featureType = static_cast<FeatureType>(type);
+    normalized = (norm != 0);
+    dim = fileDim;
+    defaultProbes = probes;
+    centroids.swap(fileCentroids);
+    assignment.swap(fileAssignment);
+    memberDistance.swap(fileDistance);
+    groupMembers();
+
+    std::cout << "Loaded " << k << " clusters from " << filename << std::endl;
+    return 0;
+}
+
+int ClusterIndex::writeAssignments(const std::string& filename) const {
+    std::ofstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for writing: " << filename << std::endl;
+        return -1;
+    }
+
+    file << "# CBIR Cluster Assignments\n";
+    file << "# Feature Type: " << featureTypeToString(featureType) << "\n";
+    file << "# Clusters: " << centroids.size() << "\n";
+    file << "# filename,cluster,distance to centroid\n";
+    const std::vector<std::string>& paths = system->getImagePaths();
+    for (size_t row = 0; row < assignment.size(); row++) {
+        file << paths[row] << "," << assignment[row] << "," << memberDistance[row] << "\n";
+    }
+
+    std::cout << "Saved cluster assignments to " << filename << std::endl;
+    return 0;
+}
@@ -37,6 +37,15 @@ float histogramIntersection(const FeatureVector& a, const FeatureVector& b) {
     return sum;
 }
 
+// Histogram intersection on raw bin arrays
+float histogramIntersection(const float* a, const float* b, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        sum += std::min(a[i], b[i]);
+    }
+    return sum;
+}
+
 // Histogram Intersection Distance
 // Returns negative similarity (so lower is better, like distance)
 float histogramIntersectionDistance(const FeatureVector& a, const FeatureVector& b) {
@@ -78,6 +87,21 @@ float cosineDistance(const FeatureVector& a, const FeatureVector& b) {
     return 1.0f - cosineSimilarity(a, b);
 }
 
+// Task 5: Cosine Distance for pre-normalized vectors
+// distance = 1 - dot(a, b), valid when both a and b have unit length
+float normalizedCosineDistance(const FeatureVector& a, const FeatureVector& b) {
+    if (a.size() != b.size()) {
+        // Same value cosineDistance returns on a size mismatch
+        return 2.0f;
+    }
+
+    float dotProduct = 0.0f;
+    for (size_t i = 0; i < a.size(); i++) {
+        dotProduct += a[i] * b[i];
+    }
+    return 1.0f - dotProduct;
+}
+
 // Weighted distance for combining multiple features
 float weightedDistance(const std::vector<float>& distances,
                        const std::vector<float>& weights) {
@@ -126,6 +150,53 @@ float l2Distance(const FeatureVector& a, const FeatureVector& b) {
     return std::sqrt(sum);
 }
 
+// Early-abandon loop: sums term(a[d], b[d]) block by block and stops
+// once the sum exceeds bound. Without an order the terms are added in the
+// same sequence as the exact functions, so surviving sums match bit for bit.
+template <typename Term>
+static float boundedSum(const FeatureVector& a, const FeatureVector& b, float bound,
+                        const std::vector<uint32_t>* order, size_t blockSize,
+                        size_t* dimsVisited, Term term) {
+    size_t n = a.size();
+    if (blockSize == 0) {
+        blockSize = n;
+    }
+
+    float sum = 0.0f;
+    size_t i = 0;
+    while (i < n) {
+        size_t end = std::min(i + blockSize, n);
+        if (order != nullptr) {
+            for (; i < end; i++) {
+                uint32_t d = (*order)[i];
+                sum += term(a[d], b[d]);
+            }
+        } else {
+            for (; i < end; i++) {
+                sum += term(a[i], b[i]);
+            }
+        }
+        if (sum > bound) {
+            break;
+        }
+    }
+
+    if (dimsVisited != nullptr) {
+        *dimsVisited = i;
+    }
+    return sum;
+}
+
+float sumSquaredDifferenceBounded(const FeatureVector& a, const FeatureVector& b, float bound,
+                                  const std::vector<uint32_t>* order, size_t blockSize,
+                                  size_t* dimsVisited) {
+    if (a.size() != b.size()) {
+        return -1.0f;
+    }
+    return boundedSum(a, b, bound, order, blockSize, dimsVisited,
+                      [](float x, float y) { float diff = x - y; return diff * diff; });
+}
+
 // Generic distance function dispatcher based on feature type
 float computeDistance(const FeatureVector& a, const FeatureVector& b, FeatureType type) {
     switch (type) {
@@ -132,6 +132,22 @@ int extractHistogram(const cv::Mat& image, FeatureVector& feature, int binsPerCh
     return 0;
 }
 
+// Sum 2x2x2 neighbouring bins into one coarse bin
+void downsampleHistogram(const float* histogram, int binsPerChannel, float* coarse) {
+    int half = binsPerChannel / 2;
+    std::fill(coarse, coarse + half * half * half, 0.0f);
+
+    for (int r = 0; r < binsPerChannel; r++) {
+        for (int g = 0; g < binsPerChannel; g++) {
+            for (int b = 0; b < binsPerChannel; b++) {
+                int idx = (r * binsPerChannel + g) * binsPerChannel + b;
+                int coarseIdx = ((r / 2) * half + g / 2) * half + b / 2;
+                coarse[coarseIdx] += histogram[idx];
+            }
+        }
+    }
+}
+
 // Task 3: Multi-histogram feature
 int extractMultiHistogram(const cv::Mat& image, FeatureVector& feature,
                           int binsPerChannel, bool splitHorizontal) {
@@ -0,0 +1,137 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Weighted multi-feature fusion implementation.
+*/
+
+#include "fusion.h"
+#include "distance.h"
+#include "topk.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+
+FusedDatabase::FusedDatabase() : droppedRows(0) {}
+
+int FusedDatabase::addColumn(CBIRSystem* system, float weight) {
+    if (system == nullptr || system->getDatabaseSize() == 0) {
+        std::cerr << "Error: Fusion column has no database" << std::endl;
+        return -1;
+    }
+    if (weight < 0.0f) {
+        std::cerr << "Error: Fusion weights must not be negative" << std::endl;
+        return -1;
+    }
+
+    FusionColumn column;
+    column.system = system;
+    column.weight = weight;
+    columns.push_back(column);
+    alignRows();
+    return 0;
+}
+
+void FusedDatabase::alignRows() {
+    const CBIRSystem* primary = columns[0].system;
+    const std::vector<std::string>& paths = primary->getImagePaths();
+
+    rowMaps.assign(columns.size(), std::vector<uint32_t>());
+    droppedRows = 0;
+    for (size_t row = 0; row < paths.size(); row++) {
+        std::vector<uint32_t> joined(columns.size());
+        bool found = true;
+        for (size_t c = 0; c < columns.size() && found; c++) {
+            int r = (c == 0) ? static_cast<int>(row) : columns[c].system->findImage(paths[row]);
+            found = (r >= 0);
+            joined[c] = static_cast<uint32_t>(r);
+        }
+        if (!found) {
+            droppedRows++;
+            continue;
+        }
+        for (size_t c = 0; c < columns.size(); c++) {
+            rowMaps[c].push_back(joined[c]);
+        }
+    }
+}
+
+void FusedDatabase::calibrate(size_t samplePairs, unsigned int seed) {
+    size_t rows = size();
+    if (rows < 2) {
+        return;
+    }
+
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<size_t> pick(0, rows - 1);
+    for (size_t c = 0; c < columns.size(); c++) {
+        const CBIRSystem* system = columns[c].system;
+        const std::vector<FeatureVector>& features = system->getFeatures();
+        double sum = 0.0, sumSq = 0.0;
+        size_t count = 0;
+        for (size_t s = 0; s < samplePairs; s++) {
+            size_t i = pick(rng), j = pick(rng);
+            if (i == j) {
+                continue;
+            }
+            // Stored rows are already prepared like query targets
+            double d = system->rowDistance(features[rowMaps[c][i]], rowMaps[c][j]);
+            if (!std::isfinite(d)) {
+                continue;
+            }
+            sum += d;
+            sumSq += d * d;
+            count++;
+        }
+        if (count == 0) {
+            continue;
+        }
+        double mean = sum / count;
+        double stddev = std::sqrt(std::max(0.0, sumSq / count - mean * mean));
+        columns[c].mean = static_cast<float>(mean);
+        columns[c].scale = stddev > 0.0 ? static_cast<float>(1.0 / stddev) : 1.0f;
+    }
+}
+
+std::vector<MatchResult> FusedDatabase::query(const std::string& targetImage, int topN) {
+    std::vector<FeatureVector> targets(columns.size());
+    for (size_t c = 0; c < columns.size(); c++) {
+        if (columns[c].system->extractTargetFeature(targetImage, targets[c]) != 0) {
+            return std::vector<MatchResult>();
+        }
+    }
+    return query(targets, topN);
+}
+
+std::vector<MatchResult> FusedDatabase::query(const std::vector<FeatureVector>& targets, int topN) const {
+    if (columns.empty() || targets.size() != columns.size()) {
+        std::cerr << "Error: Fused query needs one target feature per column" << std::endl;
+        return std::vector<MatchResult>();
+    }
+
+    std::vector<float> weights(columns.size());
+    for (size_t c = 0; c < columns.size(); c++) {
+        weights[c] = columns[c].weight;
+    }
+
+    // One pass over the joined rows; the top-K holds joined row numbers
+    size_t rows = size();
+    std::vector<float> distances(columns.size());
+    TopK top(topN < 0 ? rows : static_cast<size_t>(topN));
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t c = 0; c < columns.size(); c++) {
+            const FusionColumn& column = columns[c];
+            float d = column.system->rowDistance(targets[c], rowMaps[c][i]);
+            distances[c] = (d - column.mean) * column.scale;
+        }
+        top.push(weightedDistance(distances, weights), static_cast<uint32_t>(i));
+    }
+
+    std::vector<Neighbor> best = top.take();
+    std::vector<Neighbor> primaryRows;
+    primaryRows.reserve(best.size());
+    for (const Neighbor& n : best) {
+        primaryRows.push_back(Neighbor(n.distance, rowMaps[0][n.id]));
+    }
+    return columns[0].system->toMatchResults(primaryRows);
+}
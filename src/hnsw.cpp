@@ -0,0 +1,509 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: HNSW approximate nearest neighbour index implementation.
+*/
+
+#include "hnsw.h"
+#include "distance.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <random>
+
+namespace {
+
+const char HNSW_MAGIC[8] = {'C', 'B', 'I', 'R', 'H', 'N', 'S', 'W'};
+const uint32_t HNSW_VERSION = 1;
+
+// Per-thread visited marks. Bumping the epoch clears the set in O(1).
+struct VisitedSet {
+    std::vector<uint32_t> marks;
+    uint32_t epoch = 0;
+
+    void reset(size_t n) {
+        if (marks.size() != n) {
+            marks.assign(n, 0);
+            epoch = 0;
+        }
+        epoch++;
+        if (epoch == 0) {
+            std::fill(marks.begin(), marks.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    // Returns true the first time a node is visited
+    bool visit(uint32_t node) {
+        if (marks[node] == epoch) {
+            return false;
+        }
+        marks[node] = epoch;
+        return true;
+    }
+};
+
+thread_local VisitedSet tlsVisited;
+
+template <typename T>
+void writeValue(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+bool readValue(std::ifstream& in, T& value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+} // namespace
+
+HNSWIndex::HNSWIndex()
+    : data(nullptr), featureType(FeatureType::DNN_EMBEDDING), normalized(false),
+      maxM0(32), levelMult(0.0), entryPoint(0), maxLevel(-1) {}
+
+float HNSWIndex::distance(const FeatureVector& query, uint32_t node) const {
+    const FeatureVector& row = (*data)[node];
+    if (normalized) {
+        return normalizedCosineDistance(query, row);
+    }
+    return computeDistance(query, row, featureType);
+}
+
+float HNSWIndex::distance(uint32_t a, uint32_t b) const {
+    return distance((*data)[a], b);
+}
+
+uint32_t* HNSWIndex::linksAt(uint32_t node, int level) {
+    if (level == 0) {
+        return &level0Links[static_cast<size_t>(node) * (maxM0 + 1)];
+    }
+    return &upperLinks[node][static_cast<size_t>(level - 1) * (params.M + 1)];
+}
+
+const uint32_t* HNSWIndex::linksAt(uint32_t node, int level) const {
+    if (level == 0) {
+        return &level0Links[static_cast<size_t>(node) * (maxM0 + 1)];
+    }
+    return &upperLinks[node][static_cast<size_t>(level - 1) * (params.M + 1)];
+}
+
+std::vector<HNSWIndex::Candidate> HNSWIndex::searchLayer(const FeatureVector& query, uint32_t entry,
+                                                         int ef, int level, bool locked) const {
+    VisitedSet& visited = tlsVisited;
+    visited.reset(levels.size());
+
+    // Min-heap of nodes to expand, max-heap of the best ef found so far
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> toExpand;
+    std::priority_queue<Candidate> best;
+
+    float entryDist = distance(query, entry);
+    visited.visit(entry);
+    toExpand.push(Candidate(entryDist, entry));
+    best.push(Candidate(entryDist, entry));
+
+    std::vector<uint32_t> neighbors;
+    while (!toExpand.empty()) {
+        Candidate current = toExpand.top();
+        if (current.first > best.top().first && static_cast<int>(best.size()) >= ef) {
+            break;
+        }
+        toExpand.pop();
+
+        // Copy the link list so concurrent inserts cannot change it under us
+        {
+            std::unique_lock<std::mutex> lock;
+            if (locked) {
+                lock = std::unique_lock<std::mutex>(nodeLocks[current.second]);
+            }
+            const uint32_t* links = linksAt(current.second, level);
+            neighbors.assign(links + 1, links + 1 + links[0]);
+        }
+
+        for (uint32_t n : neighbors) {
+            if (!visited.visit(n)) {
+                continue;
+            }
+            float d = distance(query, n);
+            if (static_cast<int>(best.size()) < ef || d < best.top().first) {
+                toExpand.push(Candidate(d, n));
+                best.push(Candidate(d, n));
+                if (static_cast<int>(best.size()) > ef) {
+                    best.pop();
+                }
+            }
+        }
+    }
+
+    std::vector<Candidate> result;
+    result.reserve(best.size());
+    while (!best.empty()) {
+        result.push_back(best.top());
+        best.pop();
+    }
+    return result;
+}
+
+std::vector<uint32_t> HNSWIndex::selectNeighbors(std::vector<Candidate>& candidates, int m) const {
+    std::sort(candidates.begin(), candidates.end());
+
+    std::vector<uint32_t> selected;
+    for (const Candidate& c : candidates) {
+        if (static_cast<int>(selected.size()) >= m) {
+            break;
+        }
+        // Keep c only if it is closer to the base node than to any node
+        // already selected; this spreads links across directions
+        bool keep = true;
+        for (uint32_t s : selected) {
+            if (distance(c.second, s) < c.first) {
+                keep = false;
+                break;
+            }
+        }
+        if (keep) {
+            selected.push_back(c.second);
+        }
+    }
+    return selected;
+}
+
+void HNSWIndex::insert(uint32_t node) {
+    int level = levels[node];
+
+    // A node that raises the top layer holds the global lock for the whole
+    // insert so no other thread descends from a half-linked entry point
+    std::unique_lock<std::mutex> topLock(globalLock);
+    uint32_t current = entryPoint;
+    int currentMax = maxLevel;
+    if (level <= currentMax) {
+        topLock.unlock();
+    }
+
+    const FeatureVector& query = (*data)[node];
+    float currentDist = distance(query, current);
+
+    // Greedy descent through the layers above the node's own top layer
+    for (int l = currentMax; l > level; l--) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            std::vector<uint32_t> neighbors;
+            {
+                std::lock_guard<std::mutex> lock(nodeLocks[current]);
+                const uint32_t* links = linksAt(current, l);
+                neighbors.assign(links + 1, links + 1 + links[0]);
+            }
+            for (uint32_t n : neighbors) {
+                float d = distance(query, n);
+                if (d < currentDist) {
+                    currentDist = d;
+                    current = n;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    for (int l = std::min(level, currentMax); l >= 0; l--) {
+        std::vector<Candidate> candidates = searchLayer(query, current, params.efConstruction, l, true);
+        std::vector<uint32_t> selected = selectNeighbors(candidates, params.M);
+        int capacity = (l == 0) ? maxM0 : params.M;
+
+        {
+            std::lock_guard<std::mutex> lock(nodeLocks[node]);
+            uint32_t* links = linksAt(node, l);
+            links[0] = static_cast<uint32_t>(selected.size());
+            std::copy(selected.begin(), selected.end(), links + 1);
+        }
+
+        // Add the reverse links, pruning neighbours that are over capacity
+        for (uint32_t n : selected) {
+            std::lock_guard<std::mutex> lock(nodeLocks[n]);
+            uint32_t* links = linksAt(n, l);
+            if (static_cast<int>(links[0]) < capacity) {
+                links[1 + links[0]] = node;
+                links[0]++;
+                continue;
+            }
+            std::vector<Candidate> pool;
+            pool.reserve(links[0] + 1);
+            pool.push_back(Candidate(distance(n, node), node));
+            for (uint32_t i = 0; i < links[0]; i++) {
+                pool.push_back(Candidate(distance(n, links[1 + i]), links[1 + i]));
+            }
+            std::vector<uint32_t> kept = selectNeighbors(pool, capacity);
+            links[0] = static_cast<uint32_t>(kept.size());
+            std::copy(kept.begin(), kept.end(), links + 1);
+        }
+
+        // Closest candidate is the entry point for the next layer down
+        current = std::min_element(candidates.begin(), candidates.end())->second;
+    }
+
+    if (level > currentMax) {
+        entryPoint = node;
+        maxLevel = level;
+    }
+}
+
+int HNSWIndex::build(const std::vector<FeatureVector>& features, FeatureType type,
+                     bool isNormalized, const HNSWParams& buildParams) {
+    if (features.empty()) {
+        std::cerr << "Error: Cannot build HNSW index over an empty database" << std::endl;
+        return -1;
+    }
+    if (buildParams.M < 2 || buildParams.efConstruction < 1) {
+        std::cerr << "Error: HNSW requires M >= 2 and efConstruction >= 1" << std::endl;
+        return -1;
+    }
+
+    data = &features;
+    featureType = type;
+    normalized = isNormalized;
+    params = buildParams;
+    maxM0 = params.M * 2;
+    levelMult = 1.0 / std::log(static_cast<double>(params.M));
+
+    size_t n = features.size();
+
+    // Draw every node's top layer up front so construction is deterministic
+    // apart from thread interleaving
+    std::mt19937 rng(params.seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    levels.assign(n, 0);
+    upperLinks.assign(n, std::vector<uint32_t>());
+    for (size_t i = 0; i < n; i++) {
+        double r = uniform(rng);
+        levels[i] = static_cast<int>(-std::log(std::max(r, 1e-12)) * levelMult);
+        if (levels[i] > 0) {
+            upperLinks[i].assign(static_cast<size_t>(levels[i]) * (params.M + 1), 0);
+        }
+    }
+    level0Links.assign(n * (maxM0 + 1), 0);
+    std::vector<std::mutex>(n).swap(nodeLocks);
+
+    entryPoint = 0;
+    maxLevel = levels[0];
+
+    parallelFor(n - 1, params.numThreads, 64, [&](size_t begin, size_t end, int) {
+        for (size_t i = begin; i < end; i++) {
+            insert(static_cast<uint32_t>(i + 1));
+        }
+    });
+
+    std::vector<std::mutex>().swap(nodeLocks);
+    return 0;
+}
+
+std::vector<Neighbor> HNSWIndex::search(const FeatureVector& query, int k, int efSearch) const {
+    std::vector<Neighbor> results;
+    if (levels.empty() || data == nullptr || k <= 0) {
+        return results;
+    }
+
+    uint32_t current = entryPoint;
+    float currentDist = distance(query, current);
+    for (int l = maxLevel; l > 0; l--) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            const uint32_t* links = linksAt(current, l);
+            for (uint32_t i = 0; i < links[0]; i++) {
+                float d = distance(query, links[1 + i]);
+                if (d < currentDist) {
+                    currentDist = d;
+                    current = links[1 + i];
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    int ef = std::max(efSearch > 0 ? efSearch : params.efSearch, k);
+    std::vector<Candidate> candidates = searchLayer(query, current, ef, 0, false);
+
+    TopK top(k);
+    for (const Candidate& c : candidates) {
+        top.push(c.first, c.second);
+    }
+    return top.take();
+}
+
+int HNSWIndex::save(const std::string& filename) const {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for writing: " << filename << std::endl;
+        return -1;
+    }
+
+    uint32_t n = static_cast<uint32_t>(levels.size());
+    uint32_t dim = (data && !data->empty()) ? static_cast<uint32_t>((*data)[0].size()) : 0;
+
+    file.write(HNSW_MAGIC, sizeof(HNSW_MAGIC));
+    writeValue(file, HNSW_VERSION);
+    writeValue(file, static_cast<uint32_t>(featureType));
+    writeValue(file, static_cast<uint8_t>(normalized ? 1 : 0));
+    writeValue(file, n);
+    writeValue(file, dim);
+    writeValue(file, static_cast<int32_t>(params.M));
+    writeValue(file, static_cast<int32_t>(params.efConstruction));
+    writeValue(file, static_cast<int32_t>(params.efSearch));
+    writeValue(file, entryPoint);
+    writeValue(file, static_cast<int32_t>(maxLevel));
+
+    for (int level : levels) {
+        writeValue(file, static_cast<int32_t>(level));
+    }
+    file.write(reinterpret_cast<const char*>(level0Links.data()),
+               level0Links.size() * sizeof(uint32_t));
+    for (const auto& links : upperLinks) {
+        if (!links.empty()) {
+            file.write(reinterpret_cast<const char*>(links.data()), links.size() * sizeof(uint32_t));
+        }
+    }
+
+    if (!file) {
+        std::cerr << "Error: Failed writing HNSW index " << filename << std::endl;
+        return -1;
+    }
+    std::cout << "Saved HNSW index (" << n << " nodes) to " << filename << std::endl;
+    return 0;
+}
+
+int HNSWIndex::load(const std::string& filename, const std::vector<FeatureVector>& features) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for reading: " << filename << std::endl;
+        return -1;
+    }
+
+    char magic[sizeof(HNSW_MAGIC)];
+    uint32_t version = 0, type = 0, n = 0, dim = 0;
+    uint8_t norm = 0;
+    int32_t M = 0, efC = 0, efS = 0, topLevel = 0;
+    uint32_t entry = 0;
+
+    if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, HNSW_MAGIC, sizeof(magic)) != 0 ||
+        !readValue(file, version) || version != HNSW_VERSION) {
+        std::cerr << "Error: " << filename << " is not a CBIR HNSW index" << std::endl;
+        return -1;
+    }
+    if (!readValue(file, type) || !readValue(file, norm) || !readValue(file, n) ||
+        !readValue(file, dim) || !readValue(file, M) || !readValue(file, efC) ||
+        !readValue(file, efS) || !readValue(file, entry) || !readValue(file, topLevel)) {
+        std::cerr << "Error: Truncated HNSW index " << filename << std::endl;
+        return -1;
+    }
+
+    if (n != features.size() || (n > 0 && (dim != features[0].size() ||
+                                           static_cast<FeatureType>(type) != features[0].type))) {
+        std::cerr << "Error: HNSW index " << filename << " was built for a different database ("
+                  << n << " x " << dim << ")" << std::endl;
+        return -1;
+    }
+    if (M < 2 || M > std::numeric_limits<int32_t>::max() / 2 - 1 || efC < 1 || efS < 1 ||
+        topLevel < 0 || (n > 0 && entry >= n)) {
+        std::cerr << "Error: Corrupt HNSW index " << filename << std::endl;
+        return -1;
+    }
+
+    std::vector<int> fileLevels(n, 0);
+    for (uint32_t i = 0; i < n; i++) {
+        int32_t level = 0;
+        if (!readValue(file, level)) {
+            std::cerr << "Error: Truncated HNSW index " << filename << std::endl;
+            return -1;
+        }
+        if (level < 0 || level > topLevel) {
+            std::cerr << "Error: Corrupt HNSW index " << filename << std::endl;
+            return -1;
+        }
+        fileLevels[i] = level;
+    }
+    if (n > 0 && fileLevels[entry] != topLevel) {
+        std::cerr << "Error: Corrupt HNSW index " << filename << std::endl;
+        return -1;
+    }
+
+    // Size the link arrays from the header only if the file holds them, so
+    // a corrupt M or level cannot trigger a huge allocation
+    std::streampos linksStart = file.tellg();
+    file.seekg(0, std::ios::end);
+    uint64_t words = static_cast<uint64_t>(file.tellg() - linksStart) / sizeof(uint32_t);
+    file.seekg(linksStart);
+    if (n > 0 && static_cast<uint64_t>(M) * 2 + 1 > words / n) {
+        std::cerr << "Error: Truncated HNSW index " << filename << std::endl;
+        return -1;
+    }
+    uint64_t needed = static_cast<uint64_t>(n) * (static_cast<uint64_t>(M) * 2 + 1);
+    for (uint32_t i = 0; i < n; i++) {
+        needed += static_cast<uint64_t>(fileLevels[i]) * (static_cast<uint64_t>(M) + 1);
+        if (needed > words) {
+            std::cerr << "Error: Truncated HNSW index " << filename << std::endl;
+            return -1;
+        }
+    }
+
+    int fileM0 = M * 2;
+    std::vector<uint32_t> fileLevel0(static_cast<size_t>(n) * (fileM0 + 1), 0);
+    std::vector<std::vector<uint32_t>> fileUpper(n);
+    file.read(reinterpret_cast<char*>(fileLevel0.data()), fileLevel0.size() * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) {
+        if (fileLevels[i] > 0) {
+            fileUpper[i].assign(static_cast<size_t>(fileLevels[i]) * (M + 1), 0);
+            file.read(reinterpret_cast<char*>(fileUpper[i].data()),
+                      fileUpper[i].size() * sizeof(uint32_t));
+        }
+    }
+    if (!file) {
+        std::cerr << "Error: Truncated HNSW index " << filename << std::endl;
+        return -1;
+    }
+
+    // Searches follow links without checks: every count must fit its slot
+    // and every link on layer l must name a node that reaches layer l
+    for (uint32_t i = 0; i < n; i++) {
+        for (int l = 0; l <= fileLevels[i]; l++) {
+            const uint32_t* links = (l == 0) ? &fileLevel0[static_cast<size_t>(i) * (fileM0 + 1)]
+                                             : &fileUpper[i][static_cast<size_t>(l - 1) * (M + 1)];
+            bool valid = links[0] <= static_cast<uint32_t>(l == 0 ? fileM0 : M);
+            for (uint32_t j = 0; valid && j < links[0]; j++) {
+                valid = links[1 + j] < n && fileLevels[links[1 + j]] >= l;
+            }
+            if (!valid) {
+                std::cerr << "Error: Corrupt HNSW index " << filename << std::endl;
+                return -1;
+            }
+        }
+    }
+
+    data = &features;
+    featureType = static_cast<FeatureType>(type);
+    normalized = (norm != 0);
+    params.M = M;
+    params.efConstruction = efC;
+    params.efSearch = efS;
+    maxM0 = fileM0;
+    levelMult = 1.0 / std::log(static_cast<double>(M));
+    entryPoint = entry;
+    maxLevel = topLevel;
+    levels.swap(fileLevels);
+    level0Links.swap(fileLevel0);
+    upperLinks.swap(fileUpper);
+
+    std::cout << "Loaded HNSW index (" << n << " nodes) from " << filename << std::endl;
+    return 0;
+}
+
+size_t HNSWIndex::memoryBytes() const {
+    size_t bytes = levels.size() * sizeof(int) + level0Links.size() * sizeof(uint32_t);
+    for (const auto& links : upperLinks) {
+        bytes += sizeof(links) + links.size() * sizeof(uint32_t);
+    }
+    return bytes;
+}
@@ -0,0 +1,441 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: IVF-PQ index implementation.
+*/
+
+#include "ivfpq.h"
+#include "kmeans.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <random>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace {
+
+const char IVFPQ_MAGIC[8] = {'C', 'B', 'I', 'R', 'I', 'V', 'P', 'Q'};
+const uint32_t IVFPQ_VERSION = 1;
+
+template <typename T>
+void writeValue(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+bool readValue(std::ifstream& in, T& value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+template <typename T>
+void writeVector(std::ofstream& out, const std::vector<T>& values) {
+    uint64_t n = values.size();
+    writeValue(out, n);
+    if (n > 0) {
+        out.write(reinterpret_cast<const char*>(values.data()), n * sizeof(T));
+    }
+}
+
+template <typename T>
+bool readVector(std::ifstream& in, std::vector<T>& values) {
+    uint64_t n = 0;
+    if (!readValue(in, n)) {
+        return false;
+    }
+    // Never allocate more than the rest of the file can hold
+    std::streampos start = in.tellg();
+    in.seekg(0, std::ios::end);
+    uint64_t remaining = static_cast<uint64_t>(in.tellg() - start);
+    in.seekg(start);
+    if (!in || n > remaining / sizeof(T)) {
+        in.setstate(std::ios::failbit);
+        return false;
+    }
+    values.resize(n);
+    if (n > 0) {
+        in.read(reinterpret_cast<char*>(values.data()), n * sizeof(T));
+    }
+    return static_cast<bool>(in);
+}
+
+} // namespace
+
+IVFPQIndex::IVFPQIndex()
+    : featureType(FeatureType::BASELINE), cosine(false), dim(0), nlist(0), M(0),
+      ksub(0), nprobe(8), count(0) {}
+
+int IVFPQIndex::build(const std::vector<FeatureVector>& features, FeatureType type,
+                      bool isNormalized, const IVFPQParams& params) {
+    if (features.empty()) {
+        std::cerr << "Error: Cannot build IVF-PQ index over an empty database" << std::endl;
+        return -1;
+    }
+    if (type == FeatureType::BASELINE) {
+        cosine = false;
+    } else if (type == FeatureType::DNN_EMBEDDING && isNormalized) {
+        cosine = true;
+    } else {
+        std::cerr << "Error: IVF-PQ supports baseline (SSD/L2) and normalized dnn_embedding (cosine) "
+                  << "databases, not " << featureTypeToString(type) << std::endl;
+        return -1;
+    }
+    if (params.nlist < 1 || params.numSubquantizers < 1) {
+        std::cerr << "Error: IVF-PQ requires nlist >= 1 and at least one subquantizer" << std::endl;
+        return -1;
+    }
+
+    // Every row is encoded, so every row needs the trained dimension
+    for (const FeatureVector& f : features) {
+        if (f.size() != features[0].size()) {
+            std::cerr << "Error: Inconsistent feature dimensions in database" << std::endl;
+            return -1;
+        }
+    }
+
+    featureType = type;
+    dim = features[0].size();
+    count = features.size();
+    nprobe = params.nprobe;
+    M = static_cast<int>(std::min<size_t>(params.numSubquantizers, dim));
+
+    // Split dimensions as evenly as possible; dim need not divide by M
+    subOffsets.resize(M + 1);
+    for (int m = 0; m <= M; m++) {
+        subOffsets[m] = static_cast<uint32_t>(m * dim / M);
+    }
+
+    // Sample the training set
+    std::vector<size_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    size_t trainCount = count;
+    if (params.trainSize > 0 && static_cast<size_t>(params.trainSize) < count) {
+        std::mt19937 rng(params.seed);
+        std::shuffle(order.begin(), order.end(), rng);
+        trainCount = params.trainSize;
+    }
+
+    std::vector<float> train(trainCount * dim);
+    for (size_t i = 0; i < trainCount; i++) {
+        std::memcpy(&train[i * dim], features[order[i]].data.data(), dim * sizeof(float));
+    }
+
+    // Coarse quantizer
+    nlist = static_cast<int>(std::min<size_t>(params.nlist, trainCount));
+    std::cout << "Training coarse quantizer (" << nlist << " lists on "
+              << trainCount << " vectors)..." << std::endl;
+    if (kmeansTrain(train.data(), trainCount, dim, nlist, params.iterations,
+                    params.numThreads, params.seed, coarse) != 0) {
+        return -1;
+    }
+
+    // Residuals of the training vectors
+    parallelFor(trainCount, params.numThreads, 1024, [&](size_t begin, size_t end, int) {
+        for (size_t i = begin; i < end; i++) {
+            float* x = &train[i * dim];
+            int c = nearestCentroid(x, coarse.data(), nlist, dim);
+            const float* centroid = &coarse[static_cast<size_t>(c) * dim];
+            for (size_t d = 0; d < dim; d++) {
+                x[d] -= centroid[d];
+            }
+        }
+    });
+
+    // One codebook per subspace, trained on the residual subvectors
+    ksub = static_cast<int>(std::min<size_t>(256, trainCount));
+    codebooks.assign(static_cast<size_t>(ksub) * dim, 0.0f);
+    std::cout << "Training " << M << " PQ codebooks (" << ksub << " codewords each)..." << std::endl;
+    for (int m = 0; m < M; m++) {
+        size_t dsub = subDim(m);
+        std::vector<float> sub(trainCount * dsub);
+        for (size_t i = 0; i < trainCount; i++) {
+            std::memcpy(&sub[i * dsub], &train[i * dim + subOffsets[m]], dsub * sizeof(float));
+        }
+        std::vector<float> centroids;
+        if (kmeansTrain(sub.data(), trainCount, dsub, ksub, params.iterations,
+                        params.numThreads, params.seed + m + 1, centroids) != 0) {
+            return -1;
+        }
+        std::copy(centroids.begin(), centroids.end(), codebooks.begin() + static_cast<size_t>(ksub) * subOffsets[m]);
+    }
+
+    // Encode every database row
+    std::cout << "Encoding " << count << " vectors..." << std::endl;
+    std::vector<int> assignment(count);
+    std::vector<uint8_t> codes(count * M);
+    parallelFor(count, params.numThreads, 256, [&](size_t begin, size_t end, int) {
+        std::vector<float> residual(dim);
+        for (size_t i = begin; i < end; i++) {
+            const float* x = features[i].data.data();
+            int c = nearestCentroid(x, coarse.data(), nlist, dim);
+            assignment[i] = c;
+            const float* centroid = &coarse[static_cast<size_t>(c) * dim];
+            for (size_t d = 0; d < dim; d++) {
+                residual[d] = x[d] - centroid[d];
+            }
+            for (int m = 0; m < M; m++) {
+                codes[i * M + m] = static_cast<uint8_t>(
+                    nearestCentroid(&residual[subOffsets[m]], codebook(m), ksub, subDim(m)));
+            }
+        }
+    });
+
+    listIds.assign(nlist, std::vector<uint32_t>());
+    listCodes.assign(nlist, std::vector<uint8_t>());
+    for (size_t i = 0; i < count; i++) {
+        int c = assignment[i];
+        listIds[c].push_back(static_cast<uint32_t>(i));
+        listCodes[c].insert(listCodes[c].end(), codes.begin() + i * M, codes.begin() + (i + 1) * M);
+    }
+
+    return 0;
+}
+
+void IVFPQIndex::computeLookupTable(const float* residual, std::vector<float>& table) const {
+    table.resize(static_cast<size_t>(M) * ksub);
+    for (int m = 0; m < M; m++) {
+        size_t dsub = subDim(m);
+        const float* sub = residual + subOffsets[m];
+        const float* cb = codebook(m);
+        for (int j = 0; j < ksub; j++) {
+            table[m * ksub + j] = squaredL2(sub, cb + j * dsub, dsub);
+        }
+    }
+}
+
+void IVFPQIndex::scanList(int list, const std::vector<float>& table, TopK& top) const {
+    const std::vector<uint32_t>& ids = listIds[list];
+    const uint8_t* codes = listCodes[list].data();
+    const float* lut = table.data();
+
+#ifdef __AVX2__
+    // Gather 8 table entries (one per subquantizer) per instruction
+    const __m256i laneOffsets = _mm256_setr_epi32(0, ksub, 2 * ksub, 3 * ksub,
+                                                  4 * ksub, 5 * ksub, 6 * ksub, 7 * ksub);
+#endif
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        const uint8_t* code = codes + i * M;
+        int m = 0;
+        float dist = 0.0f;
+
+#ifdef __AVX2__
+        __m256 acc = _mm256_setzero_ps();
+        for (; m + 8 <= M; m += 8) {
+            __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(code + m));
+            __m256i idx = _mm256_add_epi32(_mm256_cvtepu8_epi32(bytes),
+                                           _mm256_add_epi32(laneOffsets, _mm256_set1_epi32(m * ksub)));
+            acc = _mm256_add_ps(acc, _mm256_i32gather_ps(lut, idx, 4));
+        }
+        __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+        half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+        dist = _mm_cvtss_f32(half);
+#else
+        // Four independent accumulators so the table loads overlap
+        float d0 = 0.0f, d1 = 0.0f, d2 = 0.0f, d3 = 0.0f;
+        for (; m + 4 <= M; m += 4) {
+            d0 += lut[m * ksub + code[m]];
+            d1 += lut[(m + 1) * ksub + code[m + 1]];
+            d2 += lut[(m + 2) * ksub + code[m + 2]];
+            d3 += lut[(m + 3) * ksub + code[m + 3]];
+        }
+        dist = (d0 + d1) + (d2 + d3);
+#endif
+        for (; m < M; m++) {
+            dist += lut[m * ksub + code[m]];
+        }
+
+        top.push(dist, ids[i]);
+    }
+}
+
+std::vector<Neighbor> IVFPQIndex::search(const FeatureVector& query, int k, int probes) const {
+    if (count == 0 || k <= 0 || query.size() != dim) {
+        return std::vector<Neighbor>();
+    }
+    if (probes <= 0) {
+        probes = nprobe;
+    }
+    probes = std::min(probes, nlist);
+
+    // Closest coarse centroids
+    std::vector<std::pair<float, int>> coarseDist(nlist);
+    for (int c = 0; c < nlist; c++) {
+        coarseDist[c] = std::make_pair(squaredL2(query.data.data(), &coarse[static_cast<size_t>(c) * dim], dim), c);
+    }
+    std::partial_sort(coarseDist.begin(), coarseDist.begin() + probes, coarseDist.end());
+
+    TopK top(k);
+    std::vector<float> residual(dim);
+    std::vector<float> table;
+    for (int p = 0; p < probes; p++) {
+        int list = coarseDist[p].second;
+        if (listIds[list].empty()) {
+            continue;
+        }
+        const float* centroid = &coarse[static_cast<size_t>(list) * dim];
+        for (size_t d = 0; d < dim; d++) {
+            residual[d] = query[d] - centroid[d];
+        }
+        computeLookupTable(residual.data(), table);
+        scanList(list, table, top);
+    }
+
+    std::vector<Neighbor> results = top.take();
+    if (cosine) {
+        // ||a - b||^2 = 2 - 2 cos for unit vectors
+        for (Neighbor& n : results) {
+            n.distance *= 0.5f;
+        }
+    }
+    return results;
+}
+
+int IVFPQIndex::save(const std::string& filename) const {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for writing: " << filename << std::endl;
+        return -1;
+    }
+
+    file.write(IVFPQ_MAGIC, sizeof(IVFPQ_MAGIC));
+    writeValue(file, IVFPQ_VERSION);
+    writeValue(file, static_cast<uint32_t>(featureType));
+    writeValue(file, static_cast<uint8_t>(cosine ? 1 : 0));
+    writeValue(file, static_cast<uint64_t>(dim));
+    writeValue(file, static_cast<int32_t>(nlist));
+    writeValue(file, static_cast<int32_t>(M));
+    writeValue(file, static_cast<int32_t>(ksub));
+    writeValue(file, static_cast<int32_t>(nprobe));
+    writeValue(file, static_cast<uint64_t>(count));
+    writeVector(file, subOffsets);
+    writeVector(file, coarse);
+    writeVector(file, codebooks);
+    for (int c = 0; c < nlist; c++) {
+        writeVector(file, listIds[c]);
+        writeVector(file, listCodes[c]);
+    }
+
+    if (!file) {
+        std::cerr << "Error: Failed writing IVF-PQ index " << filename << std::endl;
+        return -1;
+    }
+    std::cout << "Saved IVF-PQ index (" << count << " vectors) to " << filename << std::endl;
+    return 0;
+}
+
+int IVFPQIndex::load(const std::string& filename, const std::vector<FeatureVector>& features) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for reading: " << filename << std::endl;
+        return -1;
+    }
+
+    char magic[sizeof(IVFPQ_MAGIC)];
+    uint32_t version = 0, type = 0;
+    uint8_t cos = 0;
+    uint64_t fileDim = 0, fileCount = 0;
+    int32_t fileNlist = 0, fileM = 0, fileKsub = 0, fileNprobe = 0;
+    std::vector<uint32_t> fileOffsets;
+    std::vector<float> fileCoarse, fileCodebooks;
+
+    if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, IVFPQ_MAGIC, sizeof(magic)) != 0 ||
+        !readValue(file, version) || version != IVFPQ_VERSION) {
+        std::cerr << "Error: " << filename << " is not a CBIR IVF-PQ index" << std::endl;
+        return -1;
+    }
+    if (!readValue(file, type) || !readValue(file, cos) || !readValue(file, fileDim) ||
+        !readValue(file, fileNlist) || !readValue(file, fileM) || !readValue(file, fileKsub) ||
+        !readValue(file, fileNprobe) || !readValue(file, fileCount) ||
+        !readVector(file, fileOffsets) || !readVector(file, fileCoarse) || !readVector(file, fileCodebooks)) {
+        std::cerr << "Error: Truncated IVF-PQ index " << filename << std::endl;
+        return -1;
+    }
+
+    if (fileCount != features.size() || (fileCount > 0 && (fileDim != features[0].size() ||
+                                                           static_cast<FeatureType>(type) != features[0].type))) {
+        std::cerr << "Error: IVF-PQ index " << filename << " was built for a different database ("
+                  << fileCount << " x " << fileDim << ")" << std::endl;
+        return -1;
+    }
+
+    // search() indexes the centroids, codebooks and lookup tables with these
+    // values without checks
+    bool valid = fileCount > 0 && fileNlist >= 1 && fileM >= 1 && static_cast<uint64_t>(fileM) <= fileDim &&
+                 fileKsub >= 1 && fileKsub <= 256 && fileNprobe >= 1 &&
+                 fileOffsets.size() == static_cast<size_t>(fileM) + 1 && fileOffsets[0] == 0 &&
+                 fileOffsets[fileM] == fileDim &&
+                 fileCoarse.size() / fileDim == static_cast<uint64_t>(fileNlist) &&
+                 fileCoarse.size() % fileDim == 0 &&
+                 fileCodebooks.size() == static_cast<uint64_t>(fileKsub) * fileDim;
+    for (int32_t m = 0; valid && m < fileM; m++) {
+        valid = fileOffsets[m] < fileOffsets[m + 1];
+    }
+    if (!valid) {
+        std::cerr << "Error: Corrupt IVF-PQ index " << filename << std::endl;
+        return -1;
+    }
+
+    // Each row must be in exactly one list, with one in-range code per subspace
+    std::vector<std::vector<uint32_t>> fileIds(fileNlist);
+    std::vector<std::vector<uint8_t>> fileCodes(fileNlist);
+    std::vector<uint8_t> listed(fileCount, 0);
+    for (int32_t c = 0; c < fileNlist; c++) {
+        if (!readVector(file, fileIds[c]) || !readVector(file, fileCodes[c])) {
+            std::cerr << "Error: Truncated IVF-PQ index " << filename << std::endl;
+            return -1;
+        }
+        valid = fileCodes[c].size() == fileIds[c].size() * fileM;
+        for (size_t i = 0; valid && i < fileIds[c].size(); i++) {
+            uint32_t id = fileIds[c][i];
+            valid = id < fileCount && !listed[id];
+            if (valid) {
+                listed[id] = 1;
+            }
+        }
+        for (size_t i = 0; valid && i < fileCodes[c].size(); i++) {
+            valid = fileCodes[c][i] < fileKsub;
+        }
+        if (!valid) {
+            std::cerr << "Error: Corrupt IVF-PQ index " << filename << std::endl;
+            return -1;
+        }
+    }
+    if (std::find(listed.begin(), listed.end(), 0) != listed.end()) {
+        std::cerr << "Error: Corrupt IVF-PQ index " << filename << std::endl;
+        return -1;
+    }
+
+    featureType = static_cast<FeatureType>(type);
+    cosine = (cos != 0);
+    dim = fileDim;
+    nlist = fileNlist;
+    M = fileM;
+    ksub = fileKsub;
+    nprobe = fileNprobe;
+    count = fileCount;
+    subOffsets.swap(fileOffsets);
+    coarse.swap(fileCoarse);
+    codebooks.swap(fileCodebooks);
+    listIds.swap(fileIds);
+    listCodes.swap(fileCodes);
+
+    std::cout << "Loaded IVF-PQ index (" << count << " vectors, " << nlist << " lists, "
+              << M << " bytes/vector) from " << filename << std::endl;
+    return 0;
+}
+
+size_t IVFPQIndex::memoryBytes() const {
+    size_t bytes = (coarse.size() + codebooks.size()) * sizeof(float) +
+                   subOffsets.size() * sizeof(uint32_t);
+    for (int c = 0; c < nlist; c++) {
+        bytes += listIds[c].size() * sizeof(uint32_t) + listCodes[c].size();
+    }
+    return bytes;
+}
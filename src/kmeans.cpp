@@ -0,0 +1,139 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: K-means clustering implementation.
+*/
+
+#include "kmeans.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <random>
+
+float squaredL2(const float* a, const float* b, size_t dim) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < dim; i++) {
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+int nearestCentroid(const float* point, const float* centroids, int k, size_t dim, float* dist) {
+    int best = 0;
+    float bestDist = std::numeric_limits<float>::max();
+    for (int c = 0; c < k; c++) {
+        float d = squaredL2(point, centroids + static_cast<size_t>(c) * dim, dim);
+        if (d < bestDist) {
+            bestDist = d;
+            best = c;
+        }
+    }
+    if (dist != nullptr) {
+        *dist = bestDist;
+    }
+    return best;
+}
+
+int kmeansTrain(const float* points, size_t n, size_t dim, int k, int iterations,
+                int numThreads, unsigned int seed, std::vector<float>& centroids) {
+    if (n == 0 || dim == 0 || k <= 0) {
+        std::cerr << "Error: k-means needs points and k > 0" << std::endl;
+        return -1;
+    }
+    if (static_cast<size_t>(k) > n) {
+        std::cerr << "Error: k-means with k=" << k << " needs at least " << k
+                  << " points, got " << n << std::endl;
+        return -1;
+    }
+    if (numThreads <= 0) {
+        numThreads = defaultThreadCount();
+    }
+
+    // Initialize from k distinct random points
+    std::mt19937 rng(seed);
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), rng);
+
+    centroids.assign(static_cast<size_t>(k) * dim, 0.0f);
+    for (int c = 0; c < k; c++) {
+        std::memcpy(&centroids[c * dim], points + order[c] * dim, dim * sizeof(float));
+    }
+
+    std::vector<int> assignment(n, -1);
+
+    for (int iter = 0; iter < iterations; iter++) {
+        // Assignment step
+        std::vector<size_t> changed(numThreads, 0);
+        parallelFor(n, numThreads, 1024, [&](size_t begin, size_t end, int t) {
+            for (size_t i = begin; i < end; i++) {
+                int c = nearestCentroid(points + i * dim, centroids.data(), k, dim);
+                if (c != assignment[i]) {
+                    assignment[i] = c;
+                    changed[t]++;
+                }
+            }
+        });
+
+        // Bucket points by cluster so the update step can run per cluster
+        std::vector<size_t> start(k + 1, 0);
+        for (size_t i = 0; i < n; i++) {
+            start[assignment[i] + 1]++;
+        }
+        for (int c = 0; c < k; c++) {
+            start[c + 1] += start[c];
+        }
+        std::vector<size_t> members(n);
+        std::vector<size_t> fill(start.begin(), start.end() - 1);
+        for (size_t i = 0; i < n; i++) {
+            members[fill[assignment[i]]++] = i;
+        }
+
+        // Update step
+        parallelFor(k, numThreads, 8, [&](size_t begin, size_t end, int) {
+            std::vector<double> sum(dim);
+            for (size_t c = begin; c < end; c++) {
+                if (start[c] == start[c + 1]) {
+                    continue;
+                }
+                std::fill(sum.begin(), sum.end(), 0.0);
+                for (size_t m = start[c]; m < start[c + 1]; m++) {
+                    const float* p = points + members[m] * dim;
+                    for (size_t d = 0; d < dim; d++) {
+                        sum[d] += p[d];
+                    }
+                }
+                double count = static_cast<double>(start[c + 1] - start[c]);
+                for (size_t d = 0; d < dim; d++) {
+                    centroids[c * dim + d] = static_cast<float>(sum[d] / count);
+                }
+            }
+        });
+
+        // Re-seed empty clusters from random points so k stays meaningful
+        std::vector<int> emptyClusters;
+        for (int c = 0; c < k; c++) {
+            if (start[c] == start[c + 1]) {
+                emptyClusters.push_back(c);
+            }
+        }
+        std::uniform_int_distribution<size_t> pick(0, n - 1);
+        for (int c : emptyClusters) {
+            std::memcpy(&centroids[c * dim], points + pick(rng) * dim, dim * sizeof(float));
+        }
+
+        size_t totalChanged = 0;
+        for (size_t ch : changed) {
+            totalChanged += ch;
+        }
+        if (totalChanged == 0 && emptyClusters.empty()) {
+            break;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,235 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: All-pairs k-nearest-neighbour graph of a feature database (self-join).
+*/
+
+#include "knngraph.h"
+#include "cbir.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+const char KNNGRAPH_MAGIC[8] = {'C', 'B', 'I', 'R', 'K', 'N', 'N', 'G'};
+const uint32_t KNNGRAPH_VERSION = 2;
+
+// Smallest row block; tiny blocks spend more time scheduling than comparing
+const size_t MIN_BLOCK_ROWS = 16;
+
+template <typename T>
+void writeValue(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+bool readValue(std::ifstream& in, T& value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+} // namespace
+
+KNNGraph::KNNGraph() : k(0), count(0), dim(0), featureType(FeatureType::BASELINE), normalized(false) {}
+
+int KNNGraph::build(const CBIRSystem& system, const KNNGraphParams& params, KNNGraphStats* stats) {
+    const std::vector<FeatureVector>& features = system.getFeatures();
+    size_t n = features.size();
+    if (n < 2) {
+        std::cerr << "Error: A k-NN graph needs at least two images" << std::endl;
+        return -1;
+    }
+    if (params.k <= 0) {
+        std::cerr << "Error: Invalid neighbour count " << params.k << std::endl;
+        return -1;
+    }
+
+    k = static_cast<uint32_t>(std::min<size_t>(params.k, n - 1));
+    count = n;
+    dim = static_cast<uint32_t>(features[0].size());
+    featureType = system.getFeatureType();
+    normalized = system.isNormalized();
+
+    // Two blocks of rows per tile stay resident while every pair is compared
+    size_t rowBytes = std::max<size_t>(1, dim * sizeof(float));
+    size_t blockRows = std::max(MIN_BLOCK_ROWS, params.blockBytes / (2 * rowBytes));
+    size_t numBlocks = (n + blockRows - 1) / blockRows;
+
+    std::vector<TopK> heaps(n, TopK(k));
+    KNNGraphStats local;
+    local.blockRows = blockRows;
+
+    // Compare every row of block a with every row of block b. Symmetric
+    // tiles update both sides; a diagonal tile visits each pair once
+    auto tile = [&](size_t a, size_t b, bool both) {
+        size_t aEnd = std::min(n, (a + 1) * blockRows);
+        size_t bEnd = std::min(n, (b + 1) * blockRows);
+        for (size_t i = a * blockRows; i < aEnd; i++) {
+            size_t j = b * blockRows;
+            if (a == b && both) {
+                j = i + 1;
+            }
+            for (; j < bEnd; j++) {
+                if (j == i) {
+                    continue;
+                }
+                float d = system.rowDistance(features[i], j);
+                heaps[i].push(d, static_cast<uint32_t>(j));
+                if (both) {
+                    heaps[j].push(d, static_cast<uint32_t>(i));
+                }
+            }
+        }
+    };
+
+    if (params.symmetric) {
+        // Diagonal tiles first, then a round-robin schedule over the
+        // off-diagonal tiles: within a round every block appears in exactly
+        // one tile, so tiles of a round never touch the same heaps
+        parallelFor(numBlocks, params.numThreads, 1, [&](size_t begin, size_t end, int) {
+            for (size_t b = begin; b < end; b++) {
+                tile(b, b, true);
+            }
+        });
+        local.tiles += numBlocks;
+
+        size_t slots = numBlocks + (numBlocks % 2);  // A dummy block pads odd counts
+        std::vector<std::pair<size_t, size_t>> round;
+        for (size_t r = 0; r + 1 < slots; r++) {
+            round.clear();
+            round.push_back(std::make_pair(r, slots - 1));
+            for (size_t i = 1; i < slots / 2; i++) {
+                round.push_back(std::make_pair((r + i) % (slots - 1), (r + slots - 1 - i) % (slots - 1)));
+            }
+            round.erase(std::remove_if(round.begin(), round.end(),
+                                       [&](const std::pair<size_t, size_t>& t) {
+                                           return t.first >= numBlocks || t.second >= numBlocks;
+                                       }),
+                        round.end());
+
+            parallelFor(round.size(), params.numThreads, 1, [&](size_t begin, size_t end, int) {
+                for (size_t t = begin; t < end; t++) {
+                    tile(round[t].first, round[t].second, true);
+                }
+            });
+            local.tiles += round.size();
+        }
+        local.distanceComputations = n * (n - 1) / 2;
+    } else {
+        // Each thread owns whole row blocks and only updates their heaps
+        parallelFor(numBlocks, params.numThreads, 1, [&](size_t begin, size_t end, int) {
+            for (size_t a = begin; a < end; a++) {
+                for (size_t b = 0; b < numBlocks; b++) {
+                    tile(a, b, false);
+                }
+            }
+        });
+        local.tiles = numBlocks * numBlocks;
+        local.distanceComputations = n * (n - 1);
+    }
+
+    edges.resize(n * k);
+    for (size_t i = 0; i < n; i++) {
+        std::vector<Neighbor> row = heaps[i].take();
+        std::copy(row.begin(), row.end(), edges.begin() + i * k);
+    }
+
+    if (stats != nullptr) {
+        *stats = local;
+    }
+    return 0;
+}
+
+int KNNGraph::save(const std::string& filename) const {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for writing: " << filename << std::endl;
+        return -1;
+    }
+
+    file.write(KNNGRAPH_MAGIC, sizeof(KNNGRAPH_MAGIC));
+    writeValue(file, KNNGRAPH_VERSION);
+    writeValue(file, static_cast<uint32_t>(featureType));
+    writeValue(file, static_cast<uint8_t>(normalized ? 1 : 0));
+    writeValue(file, dim);
+    writeValue(file, k);
+    writeValue(file, count);
+    file.write(reinterpret_cast<const char*>(edges.data()), edges.size() * sizeof(Neighbor));
+
+    if (!file) {
+        std::cerr << "Error: Failed writing k-NN graph " << filename << std::endl;
+        return -1;
+    }
+    std::cout << "Saved k-NN graph (" << count << " images x " << k << " neighbours) to "
+              << filename << std::endl;
+    return 0;
+}
+
+int KNNGraph::load(const std::string& filename, const CBIRSystem& database) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for reading: " << filename << std::endl;
+        return -1;
+    }
+
+    char magic[sizeof(KNNGRAPH_MAGIC)];
+    uint32_t version = 0, type = 0, fileDim = 0, fileK = 0;
+    uint8_t norm = 0;
+    uint64_t fileCount = 0;
+
+    if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, KNNGRAPH_MAGIC, sizeof(magic)) != 0 ||
+        !readValue(file, version) || version != KNNGRAPH_VERSION) {
+        std::cerr << "Error: " << filename << " is not a CBIR k-NN graph" << std::endl;
+        return -1;
+    }
+    if (!readValue(file, type) || !readValue(file, norm) || !readValue(file, fileDim) ||
+        !readValue(file, fileK) || !readValue(file, fileCount)) {
+        std::cerr << "Error: Truncated k-NN graph " << filename << std::endl;
+        return -1;
+    }
+    const std::vector<FeatureVector>& features = database.getFeatures();
+    if (fileCount != features.size() || (fileCount > 0 && fileDim != features[0].size())) {
+        std::cerr << "Error: k-NN graph " << filename << " was built for a different database ("
+                  << fileCount << " x " << fileDim << ")" << std::endl;
+        return -1;
+    }
+    // Neighbour distances are only valid for the metric they were built with
+    if (static_cast<FeatureType>(type) != database.getFeatureType() || (norm != 0) != database.isNormalized()) {
+        std::cerr << "Error: k-NN graph " << filename << " was built for "
+                  << featureTypeToString(static_cast<FeatureType>(type)) << (norm != 0 ? " (normalized)" : "")
+                  << " features, database has " << featureTypeToString(database.getFeatureType())
+                  << (database.isNormalized() ? " (normalized)" : "") << std::endl;
+        return -1;
+    }
+    if (fileCount > 0 && fileK >= fileCount) {
+        std::cerr << "Error: Corrupt k-NN graph " << filename << std::endl;
+        return -1;
+    }
+
+    std::vector<Neighbor> fileEdges(fileCount * fileK);
+    file.read(reinterpret_cast<char*>(fileEdges.data()), fileEdges.size() * sizeof(Neighbor));
+    if (!file) {
+        std::cerr << "Error: Truncated k-NN graph " << filename << std::endl;
+        return -1;
+    }
+    // graphQuery() indexes the database with these ids
+    for (const auto& e : fileEdges) {
+        if (e.id >= fileCount) {
+            std::cerr << "Error: Corrupt k-NN graph " << filename << std::endl;
+            return -1;
+        }
+    }
+
+    edges.swap(fileEdges);
+    featureType = static_cast<FeatureType>(type);
+    normalized = (norm != 0);
+    dim = fileDim;
+    k = fileK;
+    count = fileCount;
+
+    std::cout << "Loaded k-NN graph (" << count << " images x " << k << " neighbours) from "
+              << filename << std::endl;
+    return 0;
+}
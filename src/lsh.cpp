@@ -0,0 +1,532 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Binary signature index implementation.
+*/
+
+#include "lsh.h"
+#include "distance.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <random>
+
+namespace {
+
+const char LSH_MAGIC[8] = {'C', 'B', 'I', 'R', 'L', 'S', 'H', 'I'};
+const uint32_t LSH_VERSION = 1;
+const int MAX_KEY_BITS = 20;
+
+// Databases smaller than this are scanned on the calling thread
+const size_t PARALLEL_SCAN_ROWS = 1 << 18;
+
+template <typename T>
+void writeValue(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+bool readValue(std::ifstream& in, T& value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+template <typename T>
+void writeVector(std::ofstream& out, const std::vector<T>& values) {
+    writeValue(out, static_cast<uint64_t>(values.size()));
+    out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+}
+
+template <typename T>
+bool readVector(std::ifstream& in, std::vector<T>& values) {
+    uint64_t count = 0;
+    if (!readValue(in, count)) {
+        return false;
+    }
+    // Never allocate more than the rest of the file can hold
+    std::streampos start = in.tellg();
+    in.seekg(0, std::ios::end);
+    uint64_t remaining = static_cast<uint64_t>(in.tellg() - start);
+    in.seekg(start);
+    if (!in || count > remaining / sizeof(T)) {
+        in.setstate(std::ios::failbit);
+        return false;
+    }
+    values.resize(count);
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(values.data()), count * sizeof(T)));
+}
+
+// Compiles to the popcnt instruction when the target has one
+// (e.g. make ARCH_FLAGS=-mpopcnt or -march=native)
+inline uint32_t popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<uint32_t>(__builtin_popcountll(x));
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return static_cast<uint32_t>((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+inline uint32_t hammingDistance(const uint64_t* a, const uint64_t* b, uint32_t words) {
+    uint32_t d = 0;
+    for (uint32_t w = 0; w < words; w++) {
+        d += popcount64(a[w] ^ b[w]);
+    }
+    return d;
+}
+
+inline bool testBit(const uint64_t* signature, uint32_t bit) {
+    return (signature[bit >> 6] >> (bit & 63)) & 1;
+}
+
+} // namespace
+
+LSHIndex::LSHIndex()
+    : data(nullptr), featureType(FeatureType::BASELINE), cosine(false), thresholded(false), dim(0), words(0),
+      defaultRerank(200), numTables(0), keyBits(0), probeRadius(0) {}
+
+float LSHIndex::rowDistance(const FeatureVector& query, uint32_t row) const {
+    if (cosine) {
+        return normalizedCosineDistance(query, (*data)[row]);
+    }
+    return computeDistance(query, (*data)[row], featureType);
+}
+
+void LSHIndex::signature(const FeatureVector& feature, uint64_t* out) const {
+    std::fill(out, out + words, 0ULL);
+    if (feature.size() != dim) {
+        return;
+    }
+
+    if (thresholded) {
+        for (uint32_t d = 0; d < dim; d++) {
+            if (feature[d] > offsets[d]) {
+                out[d >> 6] |= 1ULL << (d & 63);
+            }
+        }
+        return;
+    }
+
+    // Projections are stored dimension-major so the inner loop over bits
+    // vectorizes without a horizontal reduction
+    uint32_t bits = words * 64;
+    std::vector<float> dots(bits, 0.0f);
+    for (uint32_t d = 0; d < dim; d++) {
+        float c = feature[d] - offsets[d];
+        const float* p = &projections[static_cast<size_t>(d) * bits];
+        for (uint32_t b = 0; b < bits; b++) {
+            dots[b] += p[b] * c;
+        }
+    }
+    for (uint32_t b = 0; b < bits; b++) {
+        if (dots[b] > 0.0f) {
+            out[b >> 6] |= 1ULL << (b & 63);
+        }
+    }
+}
+
+uint32_t LSHIndex::tableKey(const uint64_t* signature, uint32_t table) const {
+    const uint32_t* positions = &keyPositions[static_cast<size_t>(table) * keyBits];
+    uint32_t key = 0;
+    for (uint32_t j = 0; j < keyBits; j++) {
+        key |= static_cast<uint32_t>(testBit(signature, positions[j])) << j;
+    }
+    return key;
+}
+
+void LSHIndex::buildTables(unsigned int seed, int numThreads) {
+    size_t rows = size();
+    uint32_t totalBits = words * 64;
+    uint32_t usedBits = thresholded ? dim : totalBits;
+
+    // Bits that never change carry no information; sample keys from the rest
+    std::vector<size_t> setCount(usedBits, 0);
+    for (size_t r = 0; r < rows; r++) {
+        const uint64_t* sig = &signatures[r * words];
+        for (uint32_t b = 0; b < usedBits; b++) {
+            setCount[b] += testBit(sig, b);
+        }
+    }
+    std::vector<uint32_t> pool;
+    for (uint32_t b = 0; b < usedBits; b++) {
+        if (setCount[b] > 0 && setCount[b] < rows) {
+            pool.push_back(b);
+        }
+    }
+    if (pool.size() < keyBits) {
+        pool.resize(usedBits);
+        std::iota(pool.begin(), pool.end(), 0);
+    }
+    keyBits = std::min<uint32_t>(keyBits, static_cast<uint32_t>(pool.size()));
+
+    std::mt19937 rng(seed + 1);
+    keyPositions.resize(static_cast<size_t>(numTables) * keyBits);
+    for (uint32_t t = 0; t < numTables; t++) {
+        std::shuffle(pool.begin(), pool.end(), rng);
+        std::copy(pool.begin(), pool.begin() + keyBits, keyPositions.begin() + static_cast<size_t>(t) * keyBits);
+    }
+
+    // Counting sort of the rows by key, one table per task
+    size_t buckets = static_cast<size_t>(1) << keyBits;
+    bucketStart.assign(numTables * (buckets + 1), 0);
+    bucketRows.resize(numTables * rows);
+    parallelFor(numTables, numThreads, 1, [&](size_t begin, size_t end, int) {
+        std::vector<uint32_t> keys(rows);
+        for (size_t t = begin; t < end; t++) {
+            uint32_t* start = &bucketStart[t * (buckets + 1)];
+            for (size_t r = 0; r < rows; r++) {
+                keys[r] = tableKey(&signatures[r * words], static_cast<uint32_t>(t));
+                start[keys[r] + 1]++;
+            }
+            for (size_t b = 0; b < buckets; b++) {
+                start[b + 1] += start[b];
+            }
+            std::vector<uint32_t> fill(start, start + buckets);
+            uint32_t* out = &bucketRows[t * rows];
+            for (size_t r = 0; r < rows; r++) {
+                out[fill[keys[r]]++] = static_cast<uint32_t>(r);
+            }
+        }
+    });
+}
+
+int LSHIndex::build(const std::vector<FeatureVector>& features, FeatureType type, bool isNormalized,
+                    const LSHParams& params) {
+    if (features.empty()) {
+        std::cerr << "Error: Cannot build LSH index over an empty database" << std::endl;
+        return -1;
+    }
+    if (params.bits <= 0 || params.tables < 0 || params.probeRadius < 0 || params.probeRadius > 2) {
+        std::cerr << "Error: Invalid LSH parameters" << std::endl;
+        return -1;
+    }
+    if (params.tables > 0 && (params.keyBits <= 0 || params.keyBits > MAX_KEY_BITS)) {
+        std::cerr << "Error: LSH key bits must be between 1 and " << MAX_KEY_BITS << std::endl;
+        return -1;
+    }
+
+    data = &features;
+    featureType = type;
+    cosine = (type == FeatureType::DNN_EMBEDDING && isNormalized);
+    thresholded = (type == FeatureType::HISTOGRAM || type == FeatureType::MULTI_HISTOGRAM);
+    dim = static_cast<uint32_t>(features[0].size());
+    defaultRerank = static_cast<uint32_t>(std::max(1, params.rerank));
+    numTables = static_cast<uint32_t>(params.tables);
+    keyBits = static_cast<uint32_t>(params.keyBits);
+    probeRadius = static_cast<uint32_t>(params.probeRadius);
+
+    for (const auto& f : features) {
+        if (f.size() != dim) {
+            std::cerr << "Error: LSH index needs equal-length feature vectors" << std::endl;
+            return -1;
+        }
+    }
+
+    // Database mean: projection center, or per-bin threshold for histograms
+    offsets.assign(dim, 0.0f);
+    if (!cosine) {
+        std::vector<double> sum(dim, 0.0);
+        for (const auto& f : features) {
+            for (uint32_t d = 0; d < dim; d++) {
+                sum[d] += f[d];
+            }
+        }
+        for (uint32_t d = 0; d < dim; d++) {
+            offsets[d] = static_cast<float>(sum[d] / features.size());
+        }
+    }
+
+    projections.clear();
+    if (thresholded) {
+        words = (dim + 63) / 64;
+    } else {
+        words = static_cast<uint32_t>((params.bits + 63) / 64);
+        std::mt19937 rng(params.seed);
+        std::normal_distribution<float> gauss(0.0f, 1.0f);
+        projections.resize(static_cast<size_t>(words) * 64 * dim);
+        for (float& p : projections) {
+            p = gauss(rng);
+        }
+    }
+
+    signatures.assign(features.size() * words, 0ULL);
+    parallelFor(features.size(), params.numThreads, 1024, [&](size_t begin, size_t end, int) {
+        for (size_t r = begin; r < end; r++) {
+            signature(features[r], &signatures[r * words]);
+        }
+    });
+
+    keyPositions.clear();
+    bucketStart.clear();
+    bucketRows.clear();
+    if (numTables > 0) {
+        buildTables(params.seed, params.numThreads);
+    }
+
+    std::cout << "Built LSH index: " << features.size() << " rows, " << words * 64 << "-bit signatures, "
+              << numTables << " tables x " << keyBits << " key bits" << std::endl;
+    return 0;
+}
+
+std::vector<Neighbor> LSHIndex::rerankCandidates(const FeatureVector& query, const std::vector<Neighbor>& candidates,
+                                                 int k, LSHStats& stats) const {
+    TopK top(k);
+    for (const auto& c : candidates) {
+        top.push(rowDistance(query, c.id), c.id);
+    }
+    stats.distanceComputations += candidates.size();
+    return top.take();
+}
+
+std::vector<Neighbor> LSHIndex::scan(const FeatureVector& query, int k, int rerank, LSHStats* stats) const {
+    LSHStats local;
+    if (data == nullptr || k <= 0 || query.size() != dim) {
+        if (stats != nullptr) {
+            *stats = local;
+        }
+        return std::vector<Neighbor>();
+    }
+
+    size_t candidates = static_cast<size_t>(std::max(k, rerank > 0 ? rerank : static_cast<int>(defaultRerank)));
+    std::vector<uint64_t> sig(words);
+    signature(query, sig.data());
+
+    // Each thread keeps its own best signatures; merged afterwards
+    size_t rows = size();
+    int threads = rows >= PARALLEL_SCAN_ROWS ? defaultThreadCount() : 1;
+    std::vector<TopK> partial(threads, TopK(candidates));
+    parallelFor(rows, threads, 1 << 16, [&](size_t begin, size_t end, int thread) {
+        TopK& top = partial[thread];
+        const uint64_t* row = &signatures[begin * words];
+        for (size_t r = begin; r < end; r++, row += words) {
+            top.push(static_cast<float>(hammingDistance(sig.data(), row, words)), static_cast<uint32_t>(r));
+        }
+    });
+    local.signaturesCompared = rows;
+
+    TopK merged(candidates);
+    for (auto& top : partial) {
+        for (const auto& n : top.take()) {
+            merged.push(n.distance, n.id);
+        }
+    }
+
+    std::vector<Neighbor> results = rerankCandidates(query, merged.take(), k, local);
+    if (stats != nullptr) {
+        *stats = local;
+    }
+    return results;
+}
+
+std::vector<Neighbor> LSHIndex::search(const FeatureVector& query, int k, int rerank, LSHStats* stats) const {
+    if (numTables == 0) {
+        return scan(query, k, rerank, stats);
+    }
+
+    LSHStats local;
+    if (data == nullptr || k <= 0 || query.size() != dim) {
+        if (stats != nullptr) {
+            *stats = local;
+        }
+        return std::vector<Neighbor>();
+    }
+
+    size_t candidates = static_cast<size_t>(std::max(k, rerank > 0 ? rerank : static_cast<int>(defaultRerank)));
+    std::vector<uint64_t> sig(words);
+    signature(query, sig.data());
+
+    // Probe each table's own bucket, then buckets whose keys differ in up to
+    // probeRadius bits
+    size_t rows = size();
+    size_t buckets = static_cast<size_t>(1) << keyBits;
+    std::vector<uint32_t> found;
+    for (uint32_t t = 0; t < numTables; t++) {
+        uint32_t key = tableKey(sig.data(), t);
+        const uint32_t* start = &bucketStart[t * (buckets + 1)];
+        const uint32_t* tableRows = &bucketRows[t * rows];
+
+        auto probe = [&](uint32_t b) {
+            found.insert(found.end(), tableRows + start[b], tableRows + start[b + 1]);
+            local.bucketsProbed++;
+        };
+        probe(key);
+        if (probeRadius >= 1) {
+            for (uint32_t i = 0; i < keyBits; i++) {
+                probe(key ^ (1u << i));
+                if (probeRadius >= 2) {
+                    for (uint32_t j = i + 1; j < keyBits; j++) {
+                        probe(key ^ (1u << i) ^ (1u << j));
+                    }
+                }
+            }
+        }
+    }
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+
+    if (found.size() < static_cast<size_t>(k)) {
+        size_t probed = local.bucketsProbed;
+        std::vector<Neighbor> results = scan(query, k, rerank, &local);
+        local.bucketsProbed = probed;
+        local.fellBackToScan = true;
+        if (stats != nullptr) {
+            *stats = local;
+        }
+        return results;
+    }
+
+    TopK top(candidates);
+    for (uint32_t row : found) {
+        top.push(static_cast<float>(hammingDistance(sig.data(), &signatures[static_cast<size_t>(row) * words], words)),
+                 row);
+    }
+    local.signaturesCompared = found.size();
+
+    std::vector<Neighbor> results = rerankCandidates(query, top.take(), k, local);
+    if (stats != nullptr) {
+        *stats = local;
+    }
+    return results;
+}
+
+int LSHIndex::save(const std::string& filename) const {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for writing: " << filename << std::endl;
+        return -1;
+    }
+
+    file.write(LSH_MAGIC, sizeof(LSH_MAGIC));
+    writeValue(file, LSH_VERSION);
+    writeValue(file, static_cast<uint32_t>(featureType));
+    writeValue(file, static_cast<uint8_t>(cosine ? 1 : 0));
+    writeValue(file, static_cast<uint8_t>(thresholded ? 1 : 0));
+    writeValue(file, dim);
+    writeValue(file, words);
+    writeValue(file, defaultRerank);
+    writeValue(file, numTables);
+    writeValue(file, keyBits);
+    writeValue(file, probeRadius);
+    writeVector(file, projections);
+    writeVector(file, offsets);
+    writeVector(file, signatures);
+    writeVector(file, keyPositions);
+    writeVector(file, bucketStart);
+    writeVector(file, bucketRows);
+
+    if (!file) {
+        std::cerr << "Error: Failed writing LSH index " << filename << std::endl;
+        return -1;
+    }
+    std::cout << "Saved LSH index (" << size() << " signatures) to " << filename << std::endl;
+    return 0;
+}
+
+int LSHIndex::load(const std::string& filename, const std::vector<FeatureVector>& features,
+                   FeatureType type, bool isNormalized) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for reading: " << filename << std::endl;
+        return -1;
+    }
+
+    char magic[sizeof(LSH_MAGIC)];
+    uint32_t version = 0, fileType = 0;
+    uint8_t cos = 0, thresh = 0;
+    uint32_t fileDim = 0, fileWords = 0, fileRerank = 0, fileTables = 0, fileKeyBits = 0, fileRadius = 0;
+    std::vector<float> fileProjections, fileOffsets;
+    std::vector<uint64_t> fileSignatures;
+    std::vector<uint32_t> fileKeyPositions, fileBucketStart, fileBucketRows;
+    if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, LSH_MAGIC, sizeof(magic)) != 0 ||
+        !readValue(file, version) || version != LSH_VERSION) {
+        std::cerr << "Error: " << filename << " is not a CBIR LSH index" << std::endl;
+        return -1;
+    }
+    if (!readValue(file, fileType) || !readValue(file, cos) || !readValue(file, thresh) ||
+        !readValue(file, fileDim) || !readValue(file, fileWords) || !readValue(file, fileRerank) ||
+        !readValue(file, fileTables) || !readValue(file, fileKeyBits) || !readValue(file, fileRadius) ||
+        !readVector(file, fileProjections) || !readVector(file, fileOffsets) ||
+        !readVector(file, fileSignatures) || !readVector(file, fileKeyPositions) ||
+        !readVector(file, fileBucketStart) || !readVector(file, fileBucketRows)) {
+        std::cerr << "Error: Truncated LSH index " << filename << std::endl;
+        return -1;
+    }
+
+    uint64_t rows = features.size();
+    uint64_t fileRows = fileWords > 0 ? fileSignatures.size() / fileWords : 0;
+    if (rows == 0 || fileRows != rows || fileDim != features[0].size()) {
+        std::cerr << "Error: LSH index " << filename << " was built for a different database ("
+                  << fileRows << " x " << fileDim << ")" << std::endl;
+        return -1;
+    }
+    // Signatures and reranked distances depend on the metric the index was built for
+    bool dbCosine = (type == FeatureType::DNN_EMBEDDING && isNormalized);
+    if (static_cast<FeatureType>(fileType) != type || (cos != 0) != dbCosine) {
+        std::cerr << "Error: LSH index " << filename << " was built for "
+                  << featureTypeToString(static_cast<FeatureType>(fileType)) << (cos != 0 ? " (normalized)" : "")
+                  << " features, database has " << featureTypeToString(type)
+                  << (dbCosine ? " (normalized)" : "") << std::endl;
+        return -1;
+    }
+
+    // search() and signature() index every array with these values without
+    // checks, so their sizes must all agree
+    bool fileThresholded = (thresh != 0);
+    uint64_t bits = static_cast<uint64_t>(fileWords) * 64;
+    uint64_t usedBits = fileThresholded ? fileDim : bits;
+    uint64_t buckets = static_cast<uint64_t>(1) << std::min<uint32_t>(fileKeyBits, MAX_KEY_BITS);
+    bool valid = fileThresholded == (type == FeatureType::HISTOGRAM || type == FeatureType::MULTI_HISTOGRAM) &&
+                 fileRerank >= 1 && fileSignatures.size() == rows * fileWords &&
+                 fileOffsets.size() == fileDim && fileKeyBits <= static_cast<uint32_t>(MAX_KEY_BITS) &&
+                 fileRadius <= 2;
+    if (fileThresholded) {
+        valid = valid && fileWords == (fileDim + 63) / 64 && fileProjections.empty();
+    } else {
+        valid = valid && fileDim > 0 && fileProjections.size() / fileDim == bits &&
+                fileProjections.size() % fileDim == 0;
+    }
+    valid = valid && fileKeyPositions.size() == static_cast<uint64_t>(fileTables) * fileKeyBits &&
+            fileBucketStart.size() == (fileTables > 0 ? fileTables * (buckets + 1) : 0) &&
+            fileBucketRows.size() == fileTables * rows;
+    for (size_t i = 0; valid && i < fileKeyPositions.size(); i++) {
+        valid = fileKeyPositions[i] < usedBits;
+    }
+    for (uint64_t t = 0; valid && t < fileTables; t++) {
+        const uint32_t* start = &fileBucketStart[t * (buckets + 1)];
+        valid = start[0] == 0 && start[buckets] == rows;
+        for (uint64_t b = 0; valid && b < buckets; b++) {
+            valid = start[b] <= start[b + 1];
+        }
+    }
+    for (size_t i = 0; valid && i < fileBucketRows.size(); i++) {
+        valid = fileBucketRows[i] < rows;
+    }
+    if (!valid) {
+        std::cerr << "Error: Corrupt LSH index " << filename << std::endl;
+        return -1;
+    }
+
+    data = &features;
+    featureType = type;
+    cosine = dbCosine;
+    thresholded = fileThresholded;
+    dim = fileDim;
+    words = fileWords;
+    defaultRerank = fileRerank;
+    numTables = fileTables;
+    keyBits = fileKeyBits;
+    probeRadius = fileRadius;
+    projections.swap(fileProjections);
+    offsets.swap(fileOffsets);
+    signatures.swap(fileSignatures);
+    keyPositions.swap(fileKeyPositions);
+    bucketStart.swap(fileBucketStart);
+    bucketRows.swap(fileBucketRows);
+
+    std::cout << "Loaded LSH index (" << size() << " signatures) from " << filename << std::endl;
+    return 0;
+}
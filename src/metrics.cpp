@@ -0,0 +1,287 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Always-on pipeline metrics: per-stage timers and counters,
+           accumulated per thread and exported as JSON or Prometheus text.
+*/
+
+#include "metrics.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// One per recording thread. Only the owner writes, so updates are a relaxed
+// load and store rather than a locked read-modify-write; readers on other
+// threads may see a value one update old
+struct ThreadBlock {
+    std::atomic<uint64_t> stageCalls[NUM_METRIC_STAGES];
+    std::atomic<uint64_t> stageNs[NUM_METRIC_STAGES];
+    std::atomic<uint64_t> counters[NUM_METRIC_COUNTERS];
+
+    ThreadBlock() {
+        for (int i = 0; i < NUM_METRIC_STAGES; i++) {
+            stageCalls[i].store(0, std::memory_order_relaxed);
+            stageNs[i].store(0, std::memory_order_relaxed);
+        }
+        for (int i = 0; i < NUM_METRIC_COUNTERS; i++) {
+            counters[i].store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+inline void bump(std::atomic<uint64_t>& value, uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+struct Registry {
+    std::mutex lock;
+    std::vector<ThreadBlock*> live;
+    MetricsSnapshot retired;    // Totals of threads that have exited
+    MetricsSnapshot baseline;   // Totals at the last resetMetrics()
+    std::chrono::steady_clock::time_point start;
+
+    Registry() : start(std::chrono::steady_clock::now()) {}
+};
+
+// Never destroyed: threads may still record while statics are torn down
+Registry& registry() {
+    static Registry* instance = new Registry();
+    return *instance;
+}
+
+// Allocations by threads without a block (before registration, while
+// registering, after exit); constant-initialized so operator new can use it
+// at any time
+std::atomic<uint64_t> g_orphanAllocations(0);
+
+thread_local ThreadBlock* tlsBlock = nullptr;
+// Set while the block is being created and after it is retired, so the
+// allocations made in between do not recurse into registration
+thread_local bool tlsBusy = false;
+
+void retireBlock() {
+    tlsBusy = true;
+    ThreadBlock* block = tlsBlock;
+    tlsBlock = nullptr;
+    if (block == nullptr) {
+        return;
+    }
+
+    Registry& r = registry();
+    {
+        std::lock_guard<std::mutex> guard(r.lock);
+        for (int i = 0; i < NUM_METRIC_STAGES; i++) {
+            r.retired.stageCalls[i] += block->stageCalls[i].load(std::memory_order_relaxed);
+            r.retired.stageNs[i] += block->stageNs[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < NUM_METRIC_COUNTERS; i++) {
+            r.retired.counters[i] += block->counters[i].load(std::memory_order_relaxed);
+        }
+        r.live.erase(std::remove(r.live.begin(), r.live.end(), block), r.live.end());
+    }
+    delete block;
+}
+
+struct BlockOwner {
+    ~BlockOwner() { retireBlock(); }
+};
+
+ThreadBlock* currentBlock() {
+    if (tlsBlock != nullptr || tlsBusy) {
+        return tlsBlock;
+    }
+
+    tlsBusy = true;
+    ThreadBlock* block = new ThreadBlock();
+    Registry& r = registry();
+    {
+        std::lock_guard<std::mutex> guard(r.lock);
+        r.live.push_back(block);
+    }
+    // Folds the block into the totals when this thread exits
+    static thread_local BlockOwner owner;
+    (void)owner;
+    tlsBlock = block;
+    tlsBusy = false;
+    return block;
+}
+
+// Totals over retired and live threads; the caller holds the lock
+MetricsSnapshot collect(Registry& r) {
+    MetricsSnapshot total = r.retired;
+    for (const ThreadBlock* block : r.live) {
+        for (int i = 0; i < NUM_METRIC_STAGES; i++) {
+            total.stageCalls[i] += block->stageCalls[i].load(std::memory_order_relaxed);
+            total.stageNs[i] += block->stageNs[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < NUM_METRIC_COUNTERS; i++) {
+            total.counters[i] += block->counters[i].load(std::memory_order_relaxed);
+        }
+    }
+    total.counters[static_cast<int>(MetricCounter::ALLOCATIONS)] +=
+        g_orphanAllocations.load(std::memory_order_relaxed);
+    return total;
+}
+
+const char* STAGE_NAMES[NUM_METRIC_STAGES] = {"scan_dir", "read_file", "decode", "extract",
+                                              "distance_scan", "top_k", "format"};
+
+const char* COUNTER_NAMES[NUM_METRIC_COUNTERS] = {"images_processed", "images_failed", "bytes_read",
+                                                  "queries", "rows_scanned", "allocations"};
+
+const char* COUNTER_HELP[NUM_METRIC_COUNTERS] = {
+    "Images read and feature-extracted.",
+    "Images that could not be read, decoded or extracted.",
+    "Image file bytes read from disk.",
+    "Query targets answered.",
+    "Database rows compared against a query target.",
+    "Heap allocations made by the process."};
+
+bool endsWith(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+} // namespace
+
+void recordStage(MetricStage stage, uint64_t ns) {
+    ThreadBlock* block = currentBlock();
+    if (block == nullptr) {
+        return;
+    }
+    int s = static_cast<int>(stage);
+    bump(block->stageCalls[s], 1);
+    bump(block->stageNs[s], ns);
+}
+
+void addMetric(MetricCounter counter, uint64_t amount) {
+    ThreadBlock* block = currentBlock();
+    if (block != nullptr) {
+        bump(block->counters[static_cast<int>(counter)], amount);
+    }
+}
+
+void countAllocation() {
+    ThreadBlock* block = currentBlock();
+    if (block != nullptr) {
+        bump(block->counters[static_cast<int>(MetricCounter::ALLOCATIONS)], 1);
+    } else {
+        g_orphanAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+MetricsSnapshot metricsSnapshot() {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    MetricsSnapshot total = collect(r);
+    for (int i = 0; i < NUM_METRIC_STAGES; i++) {
+        total.stageCalls[i] -= r.baseline.stageCalls[i];
+        total.stageNs[i] -= r.baseline.stageNs[i];
+    }
+    for (int i = 0; i < NUM_METRIC_COUNTERS; i++) {
+        total.counters[i] -= r.baseline.counters[i];
+    }
+    total.uptimeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - r.start).count();
+    return total;
+}
+
+void resetMetrics() {
+    // Totals only grow, so a reset just moves the baseline
+    Registry& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    r.baseline = collect(r);
+    r.start = std::chrono::steady_clock::now();
+}
+
+const char* metricStageName(MetricStage stage) {
+    return STAGE_NAMES[static_cast<int>(stage)];
+}
+
+const char* metricCounterName(MetricCounter counter) {
+    return COUNTER_NAMES[static_cast<int>(counter)];
+}
+
+void writeMetricsJSON(std::ostream& out, const MetricsSnapshot& snapshot, bool compact) {
+    const char* nl = compact ? "" : "\n";
+    const char* in1 = compact ? "" : "  ";
+    const char* in2 = compact ? "" : "    ";
+    const char* sp = compact ? "" : " ";
+
+    out << "{" << nl << in1 << "\"uptime_seconds\":" << sp << snapshot.uptimeSeconds << "," << nl;
+    out << in1 << "\"stages\":" << sp << "{" << nl;
+    for (int i = 0; i < NUM_METRIC_STAGES; i++) {
+        uint64_t calls = snapshot.stageCalls[i];
+        double totalMs = snapshot.stageNs[i] / 1e6;
+        out << in2 << "\"" << STAGE_NAMES[i] << "\":" << sp << "{\"calls\":" << sp << calls << "," << sp
+            << "\"total_ms\":" << sp << totalMs << "," << sp << "\"mean_us\":" << sp
+            << (calls > 0 ? snapshot.stageNs[i] / 1e3 / calls : 0.0) << "}"
+            << (i + 1 < NUM_METRIC_STAGES ? "," : "") << nl;
+    }
+    out << in1 << "}," << nl;
+    out << in1 << "\"counters\":" << sp << "{" << nl;
+    for (int i = 0; i < NUM_METRIC_COUNTERS; i++) {
+        out << in2 << "\"" << COUNTER_NAMES[i] << "\":" << sp << snapshot.counters[i]
+            << (i + 1 < NUM_METRIC_COUNTERS ? "," : "") << nl;
+    }
+    out << in1 << "}" << nl << "}" << nl;
+}
+
+void writeMetricsPrometheus(std::ostream& out, const MetricsSnapshot& snapshot) {
+    out << "# HELP cbir_stage_seconds_total Time spent in each pipeline stage, summed over threads.\n";
+    out << "# TYPE cbir_stage_seconds_total counter\n";
+    for (int i = 0; i < NUM_METRIC_STAGES; i++) {
+        out << "cbir_stage_seconds_total{stage=\"" << STAGE_NAMES[i] << "\"} " << snapshot.stageNs[i] / 1e9
+            << "\n";
+    }
+    out << "# HELP cbir_stage_calls_total Timed calls of each pipeline stage.\n";
+    out << "# TYPE cbir_stage_calls_total counter\n";
+    for (int i = 0; i < NUM_METRIC_STAGES; i++) {
+        out << "cbir_stage_calls_total{stage=\"" << STAGE_NAMES[i] << "\"} " << snapshot.stageCalls[i] << "\n";
+    }
+    for (int i = 0; i < NUM_METRIC_COUNTERS; i++) {
+        out << "# HELP cbir_" << COUNTER_NAMES[i] << "_total " << COUNTER_HELP[i] << "\n";
+        out << "# TYPE cbir_" << COUNTER_NAMES[i] << "_total counter\n";
+        out << "cbir_" << COUNTER_NAMES[i] << "_total " << snapshot.counters[i] << "\n";
+    }
+    out << "# HELP cbir_uptime_seconds Seconds since the metrics were started or reset.\n";
+    out << "# TYPE cbir_uptime_seconds gauge\n";
+    out << "cbir_uptime_seconds " << snapshot.uptimeSeconds << "\n";
+}
+
+int saveMetrics(const std::string& filename) {
+    MetricsSnapshot snapshot = metricsSnapshot();
+    if (filename == "-") {
+        writeMetricsJSON(std::cout, snapshot);
+        return 0;
+    }
+
+    // Write a temporary file and rename it over the old one
+    std::string tempFile = filename + ".tmp";
+    {
+        std::ofstream file(tempFile);
+        if (!file.is_open()) {
+            std::cerr << "Error: Cannot open file for writing: " << tempFile << std::endl;
+            return -1;
+        }
+        if (endsWith(filename, ".prom") || endsWith(filename, ".txt")) {
+            writeMetricsPrometheus(file, snapshot);
+        } else {
+            writeMetricsJSON(file, snapshot);
+        }
+        if (!file) {
+            std::cerr << "Error: Failed writing metrics to " << tempFile << std::endl;
+            return -1;
+        }
+    }
+    if (std::rename(tempFile.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Error: Cannot replace " << filename << std::endl;
+        std::remove(tempFile.c_str());
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,31 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Global operator new replacement that feeds the allocations
+           counter in metrics.h. Linked only into the tools that export
+           metrics; cbir_bench has its own replacement.
+*/
+
+#include "metrics.h"
+#include <cstdlib>
+#include <new>
+
+// Counts allocations made through operator new (the array and nothrow forms
+// forward here). OpenCV pixel buffers come from cv::fastMalloc and are not
+// counted
+void* operator new(size_t size) {
+    countAllocation();
+    void* p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
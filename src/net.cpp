@@ -0,0 +1,361 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Socket helpers and line protocol implementation.
+*/
+
+#include "net.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
+// A peer that hung up must not kill the process with SIGPIPE
+#ifdef MSG_NOSIGNAL
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+
+const char* DEFAULT_SERVER_SOCKET = "/tmp/cbir_server.sock";
+
+// Returns the TCP port for "8080" / "localhost:8080" / "127.0.0.1:8080",
+// or 0 if the address is a Unix socket path
+static int tcpPort(const std::string& address) {
+    std::string port = address;
+    size_t colon = address.rfind(':');
+    if (colon != std::string::npos) {
+        std::string host = address.substr(0, colon);
+        if (host != "localhost" && host != "127.0.0.1") {
+            return 0;
+        }
+        port = address.substr(colon + 1);
+    }
+    if (port.empty() || port.find_first_not_of("0123456789") != std::string::npos) {
+        return 0;
+    }
+    int value = std::atoi(port.c_str());
+    return (value > 0 && value < 65536) ? value : 0;
+}
+
+static sockaddr_in loopbackAddress(int port) {
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return addr;
+}
+
+static bool unixAddress(const std::string& path, sockaddr_un& addr) {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Error: Socket path too long: " << path << std::endl;
+        return false;
+    }
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return true;
+}
+
+int listenAddress(const std::string& address, int backlog) {
+    int port = tcpPort(address);
+    int fd = socket(port > 0 ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        std::cerr << "Error: Cannot create socket: " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+
+    int result;
+    if (port > 0) {
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in addr = loopbackAddress(port);
+        result = bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    } else {
+        sockaddr_un addr;
+        if (!unixAddress(address, addr)) {
+            close(fd);
+            return -1;
+        }
+        // Only a stale socket from a previous run is removed: never another
+        // kind of file, and never the socket of a server that still answers
+        struct stat info;
+        if (lstat(address.c_str(), &info) == 0) {
+            if (!S_ISSOCK(info.st_mode)) {
+                std::cerr << "Error: Cannot listen on " << address << ": file exists and is not a socket"
+                          << std::endl;
+                close(fd);
+                return -1;
+            }
+            int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+            bool live = probe >= 0 && connect(probe, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+            if (probe >= 0) {
+                close(probe);
+            }
+            if (live) {
+                std::cerr << "Error: Cannot listen on " << address << ": address in use by a running server"
+                          << std::endl;
+                close(fd);
+                return -1;
+            }
+            unlink(address.c_str());
+        }
+        result = bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    }
+
+    if (result != 0 || listen(fd, backlog) != 0) {
+        std::cerr << "Error: Cannot listen on " << address << ": " << std::strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// connect() that gives up after timeoutMs (negative: blocking connect)
+static int connectWithin(int fd, const sockaddr* addr, socklen_t length, int timeoutMs) {
+    if (timeoutMs < 0) {
+        return connect(fd, addr, length);
+    }
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return -1;
+    }
+    int result = connect(fd, addr, length);
+    if (result != 0 && errno == EINPROGRESS) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        while (true) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            pollfd p;
+            p.fd = fd;
+            p.events = POLLOUT;
+            int ready = poll(&p, 1, static_cast<int>(std::max<long long>(0, left)));
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+            } else if (ready > 0) {
+                // The outcome of the connect is the socket's pending error
+                int error = 0;
+                socklen_t size = sizeof(error);
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) == 0 && error == 0) {
+                    result = 0;
+                } else {
+                    errno = error != 0 ? error : errno;
+                }
+            }
+            break;
+        }
+    }
+
+    // Later reads and writes block (readLine() polls for its own timeout)
+    int saved = errno;
+    fcntl(fd, F_SETFL, flags);
+    errno = saved;
+    return result;
+}
+
+int connectAddress(const std::string& address, int timeoutMs) {
+    int port = tcpPort(address);
+    int fd = socket(port > 0 ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        std::cerr << "Error: Cannot create socket: " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+
+    int result;
+    if (port > 0) {
+        sockaddr_in addr = loopbackAddress(port);
+        result = connectWithin(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr), timeoutMs);
+    } else {
+        sockaddr_un addr;
+        if (!unixAddress(address, addr)) {
+            close(fd);
+            return -1;
+        }
+        result = connectWithin(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr), timeoutMs);
+    }
+
+#ifdef SO_NOSIGPIPE
+    int noSigPipe = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+
+    if (result != 0) {
+        int saved = errno;
+        std::cerr << "Error: Cannot connect to " << address << ": " << std::strerror(saved) << std::endl;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+bool readLine(int fd, std::string& pending, std::string& line, int timeoutMs) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (true) {
+        size_t newline = pending.find('\n');
+        if (newline != std::string::npos) {
+            line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            return true;
+        }
+
+        if (timeoutMs >= 0) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            pollfd p;
+            p.fd = fd;
+            p.events = POLLIN;
+            int ready = poll(&p, 1, static_cast<int>(std::max<long long>(0, left)));
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+                return false;
+            }
+            if (ready < 0) {
+                return false;
+            }
+        }
+
+        char buffer[4096];
+        ssize_t count = read(fd, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count == 0) {
+            errno = 0;
+            return false;
+        }
+        if (count < 0) {
+            return false;
+        }
+        pending.append(buffer, static_cast<size_t>(count));
+    }
+}
+
+bool writeAll(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t count = send(fd, data.data() + written, data.size() - written, SEND_FLAGS);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        written += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+std::string formatQueryRequest(const std::string& database, int topN, const std::string& targetImage) {
+    std::ostringstream out;
+    out << "QUERY " << database << " " << topN << " " << targetImage << "\n";
+    return out.str();
+}
+
+std::string formatQueryResponse(const std::vector<MatchResult>& results, int missingShards) {
+    std::ostringstream out;
+    out << "OK " << results.size();
+    if (missingShards > 0) {
+        out << " partial=" << missingShards;
+    }
+    out << "\n";
+    // Enough digits that the client reads back the same float, so merged
+    // shard lists order exactly as one database would
+    out << std::setprecision(std::numeric_limits<float>::max_digits10);
+    for (const auto& r : results) {
+        out << r.distance << "\t" << r.imagePath << "\n";
+    }
+    return out.str();
+}
+
+int remoteQuery(const std::string& address, const std::string& database, int topN,
+                const std::string& targetImage, std::vector<MatchResult>& results,
+                int timeoutMs, RemoteQueryStatus* status) {
+    results.clear();
+    std::string message;
+    bool timedOut = false;
+    int missingShards = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    // Milliseconds left before timeoutMs runs out (negative: no limit)
+    auto remaining = [&]() -> int {
+        if (timeoutMs < 0) {
+            return -1;
+        }
+        long long used = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        return static_cast<int>(std::max<long long>(0, timeoutMs - used));
+    };
+
+    int fd = connectAddress(address, remaining());
+    if (fd < 0) {
+        timedOut = (errno == ETIMEDOUT);
+        message = (timedOut ? "timed out connecting to " : "cannot connect to ") + address;
+    } else {
+        std::string pending, line;
+        if (!writeAll(fd, formatQueryRequest(database, topN, targetImage) + "QUIT\n")) {
+            message = "cannot send to " + address;
+        } else if (!readLine(fd, pending, line, remaining())) {
+            timedOut = (errno == ETIMEDOUT);
+            message = (timedOut ? "timed out waiting for " : "no response from ") + address;
+        } else if (line.compare(0, 3, "OK ") != 0) {
+            message = "server: " + (line.compare(0, 4, "ERR ") == 0 ? line.substr(4) : line);
+        } else {
+            // "OK <count>" with " partial=<k>" from a coordinator missing k shards
+            char* end = nullptr;
+            size_t count = std::strtoul(line.c_str() + 3, &end, 10);
+            const char* partial = std::strstr(end, "partial=");
+            if (partial != nullptr) {
+                missingShards = std::atoi(partial + 8);
+            }
+            for (size_t i = 0; i < count; i++) {
+                size_t tab;
+                if (!readLine(fd, pending, line, remaining()) || (tab = line.find('\t')) == std::string::npos) {
+                    timedOut = (errno == ETIMEDOUT);
+                    message = (timedOut ? "timed out reading from " : "truncated response from ") + address;
+                    results.clear();
+                    break;
+                }
+                results.push_back(MatchResult(line.substr(tab + 1), std::strtof(line.c_str(), nullptr)));
+            }
+        }
+        close(fd);
+    }
+
+    if (status != nullptr) {
+        status->timedOut = timedOut;
+        status->missingShards = missingShards;
+        status->error = message;
+    }
+    if (message.empty()) {
+        return 0;
+    }
+    if (status == nullptr) {
+        std::cerr << "Error: " << message << std::endl;
+    }
+    return -1;
+}
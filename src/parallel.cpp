@@ -0,0 +1,77 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Minimal thread helpers for parallel index construction and scans.
+*/
+
+#include "parallel.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+// Runs one chunk, as a trace span while tracing is on so a timeline shows
+// which worker ran what, and for how long
+static void runChunk(size_t begin, size_t end, int threadIndex,
+                     const std::function<void(size_t, size_t, int)>& body) {
+    if (!tracingEnabled()) {
+        body(begin, end, threadIndex);
+        return;
+    }
+    char detail[48];
+    std::snprintf(detail, sizeof(detail), "items %zu-%zu", begin, end);
+    TraceSpan span("chunk", "parallel", detail);
+    body(begin, end, threadIndex);
+}
+
+int defaultThreadCount() {
+    unsigned int n = std::thread::hardware_concurrency();
+    return n > 0 ? static_cast<int>(n) : 1;
+}
+
+void parallelFor(size_t count, int numThreads, size_t grain,
+                 const std::function<void(size_t, size_t, int)>& body) {
+    if (count == 0) {
+        return;
+    }
+    if (numThreads <= 0) {
+        numThreads = defaultThreadCount();
+    }
+    if (grain == 0) {
+        grain = 1;
+    }
+
+    // No point starting more threads than there are chunks
+    size_t chunks = (count + grain - 1) / grain;
+    numThreads = static_cast<int>(std::min<size_t>(numThreads, chunks));
+
+    if (numThreads == 1) {
+        runChunk(0, count, 0, body);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&](int threadIndex) {
+        if (threadIndex > 0 && tracingEnabled()) {
+            setTraceThreadName("worker " + std::to_string(threadIndex));
+        }
+        while (true) {
+            size_t begin = next.fetch_add(grain);
+            if (begin >= count) {
+                break;
+            }
+            runChunk(begin, std::min(begin + grain, count), threadIndex, body);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < numThreads; t++) {
+        threads.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto& th : threads) {
+        th.join();
+    }
+}
@@ -0,0 +1,86 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Scatter-gather implementation.
+*/
+
+#include "shard.h"
+#include "net.h"
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+std::string shardStatusToString(ShardStatus status) {
+    switch (status) {
+        case ShardStatus::OK: return "ok";
+        case ShardStatus::TIMEOUT: return "timeout";
+        case ShardStatus::FAILED: return "failed";
+        default: return "unknown";
+    }
+}
+
+int scatterGather(const std::vector<std::string>& shards, const std::string& database,
+                  const std::string& targetImage, int topN, int timeoutMs,
+                  std::vector<MatchResult>& results, std::vector<ShardReport>* reports) {
+    results.clear();
+    std::vector<ShardReport> shardReports(shards.size());
+    std::vector<std::vector<MatchResult>> shardResults(shards.size());
+
+    // Every request carries the same timeout, so joining is bounded by it
+    std::vector<std::thread> threads;
+    for (size_t s = 0; s < shards.size(); s++) {
+        threads.push_back(std::thread([&, s]() {
+            ShardReport& report = shardReports[s];
+            report.address = shards[s];
+            if (tracingEnabled()) {
+                setTraceThreadName("shard " + shards[s]);
+            }
+            TraceSpan span("shard_query", "query", shards[s]);
+            auto start = std::chrono::steady_clock::now();
+            RemoteQueryStatus status;
+            if (remoteQuery(shards[s], database, topN, targetImage, shardResults[s], timeoutMs, &status) == 0) {
+                report.status = ShardStatus::OK;
+                report.results = shardResults[s].size();
+                report.missingShards = status.missingShards;
+            } else {
+                report.status = status.timedOut ? ShardStatus::TIMEOUT : ShardStatus::FAILED;
+                report.error = status.error;
+            }
+            report.latencyMs = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+        }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    TraceSpan span("merge", "query");
+    int answered = 0;
+    for (size_t s = 0; s < shards.size(); s++) {
+        if (shardReports[s].status == ShardStatus::OK) {
+            answered++;
+            results.insert(results.end(), shardResults[s].begin(), shardResults[s].end());
+        }
+    }
+
+    // Shards share the metric, so their distances merge directly
+    std::sort(results.begin(), results.end(), [](const MatchResult& a, const MatchResult& b) {
+        if (a.distance != b.distance) {
+            return a.distance < b.distance;
+        }
+        return a.imagePath < b.imagePath;
+    });
+    // An image held by more than one shard (e.g. a replica) is listed once
+    results.erase(std::unique(results.begin(), results.end(),
+                              [](const MatchResult& a, const MatchResult& b) { return a.imagePath == b.imagePath; }),
+                  results.end());
+    if (topN >= 0 && results.size() > static_cast<size_t>(topN)) {
+        results.resize(topN);
+    }
+
+    if (reports != nullptr) {
+        *reports = shardReports;
+    }
+    return answered > 0 ? answered : -1;
+}
@@ -0,0 +1,403 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Deterministic synthetic images and DNN embeddings for benchmarks
+           and scale tests.
+*/
+
+#include "synth.h"
+#include "parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <sys/stat.h>
+
+namespace {
+
+// Mixes a 64-bit value into a well-distributed seed (splitmix64 finalizer)
+uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Separate streams for scene layouts, per-image jitter and embeddings
+uint64_t sceneSeed(const SynthParams& params, int scene) {
+    return mix(mix(params.seed) ^ (0x5CE0ULL << 32 | static_cast<uint32_t>(scene)));
+}
+
+uint64_t imageSeed(const SynthParams& params, size_t index) {
+    return mix(mix(params.seed + 1) ^ index);
+}
+
+struct Blob {
+    float color[3];
+    float cx, cy, radius;  // Fractions of the image size
+};
+
+struct Scene {
+    float skyTop[3], skyBottom[3];
+    float groundNear[3], groundFar[3];
+    float horizon;       // Fraction of the height
+    float textureFreq;   // Radians per pixel at 320 pixels wide
+    float textureAmp;
+    Blob blobs[3];
+};
+
+Scene makeScene(const SynthParams& params, int scene) {
+    std::mt19937_64 rng(sceneSeed(params, scene));
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::uniform_real_distribution<float> channel(0.0f, 255.0f);
+    Scene s;
+
+    if (params.palette == SynthPalette::NATURAL) {
+        // BGR base colours, varied per scene
+        static const float skies[3][3] = {{210, 150, 80}, {170, 165, 160}, {120, 150, 230}};
+        static const float grounds[3][3] = {{50, 130, 60}, {40, 80, 120}, {110, 110, 105}};
+        const float* sky = skies[rng() % 3];
+        const float* ground = grounds[rng() % 3];
+        for (int c = 0; c < 3; c++) {
+            s.skyTop[c] = std::min(255.0f, sky[c] * (0.7f + 0.4f * unit(rng)));
+            s.skyBottom[c] = s.skyTop[c] + (255.0f - s.skyTop[c]) * (0.3f + 0.5f * unit(rng));
+            s.groundFar[c] = std::min(255.0f, ground[c] * (0.7f + 0.6f * unit(rng)));
+            s.groundNear[c] = s.groundFar[c] * (0.4f + 0.5f * unit(rng));
+        }
+    } else {
+        for (int c = 0; c < 3; c++) {
+            s.skyTop[c] = channel(rng);
+            s.skyBottom[c] = s.skyTop[c] + (255.0f - s.skyTop[c]) * 0.5f * unit(rng);
+            s.groundFar[c] = channel(rng);
+            s.groundNear[c] = s.groundFar[c] * (0.4f + 0.6f * unit(rng));
+        }
+    }
+    s.horizon = 0.25f + 0.5f * unit(rng);
+    s.textureFreq = 0.05f + 0.6f * unit(rng);
+    s.textureAmp = 40.0f * unit(rng) * params.textureStrength;
+    for (auto& b : s.blobs) {
+        for (float& c : b.color) {
+            // Natural scenes get muted objects rather than saturated ones
+            c = params.palette == SynthPalette::NATURAL ? 40.0f + 160.0f * unit(rng) : channel(rng);
+        }
+        b.cx = unit(rng);
+        b.cy = unit(rng);
+        b.radius = 0.04f + 0.16f * unit(rng);
+    }
+    return s;
+}
+
+unsigned char clampPixel(float v) {
+    return static_cast<unsigned char>(v < 0.0f ? 0.0f : (v > 255.0f ? 255.0f : v + 0.5f));
+}
+
+int makeDirectory(const std::string& dir) {
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        std::cerr << "Error: Cannot create directory " << dir << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+} // namespace
+
+std::string synthImageName(size_t index, const std::string& extension) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "synth%08zu.", index);
+    return name + extension;
+}
+
+std::string synthImagePath(const SynthParams& params, size_t index) {
+    std::string name = synthImageName(index, params.format);
+    if (params.imagesPerDir <= 0) {
+        return name;
+    }
+    size_t leaf = index / static_cast<size_t>(params.imagesPerDir);
+    char prefix[48];
+    std::snprintf(prefix, sizeof(prefix), "%03zu/%03zu/", leaf / 1000, leaf % 1000);
+    return prefix + name;
+}
+
+long long synthDuplicateOf(const SynthParams& params, size_t index, size_t first) {
+    if (params.duplicateRate <= 0.0f || index <= first) {
+        return -1;
+    }
+    uint64_t r = mix(imageSeed(params, index) + 3);
+    if ((r >> 11) * (1.0 / 9007199254740992.0) >= params.duplicateRate) {
+        return -1;
+    }
+    // Source among the previous million images of this run (never below
+    // first), resolved to an original so duplicates of duplicates render in
+    // one step
+    size_t window = std::min<size_t>(index - first, 1000000);
+    size_t source = index - 1 - mix(r) % window;
+    long long parent = synthDuplicateOf(params, source, first);
+    return parent >= 0 ? parent : static_cast<long long>(source);
+}
+
+namespace {
+
+// Scene of an image that is not a near-duplicate
+int originalScene(const SynthParams& params, size_t index) {
+    return static_cast<int>(mix(imageSeed(params, index)) % static_cast<uint64_t>(params.scenes));
+}
+
+} // namespace
+
+int synthSceneOf(const SynthParams& params, size_t index, size_t first) {
+    long long source = synthDuplicateOf(params, index, first);
+    return originalScene(params, source >= 0 ? static_cast<size_t>(source) : index);
+}
+
+namespace {
+
+void renderOriginal(const SynthParams& params, size_t index, cv::Mat& image) {
+    const int width = params.width;
+    const int height = params.height;
+    Scene s = makeScene(params, originalScene(params, index));
+
+    // Per-image variation around the scene
+    std::mt19937_64 rng(imageSeed(params, index));
+    std::uniform_real_distribution<float> jitter(-1.0f, 1.0f);
+    float horizon = (s.horizon + 0.05f * jitter(rng)) * height;
+    float brightness = 20.0f * jitter(rng);
+    float phase = 3.14159f * jitter(rng);
+    float noiseAmp = 8.0f + 4.0f * jitter(rng);
+    Blob blobs[3];
+    for (int b = 0; b < 3; b++) {
+        blobs[b] = s.blobs[b];
+        blobs[b].cx += 0.05f * jitter(rng);
+        blobs[b].cy += 0.05f * jitter(rng);
+    }
+
+    // Separable ground texture: one sine table per axis
+    float freq = s.textureFreq * 320.0f / width;
+    std::vector<float> waveX(width), waveY(height);
+    for (int x = 0; x < width; x++) {
+        waveX[x] = std::sin(x * freq + phase);
+    }
+    for (int y = 0; y < height; y++) {
+        waveY[y] = std::sin(y * freq * 0.7f);
+    }
+
+    image.create(height, width, CV_8UC3);
+    uint64_t noiseState = mix(imageSeed(params, index) + 7) | 1;
+    float scale = static_cast<float>(std::min(width, height));
+
+    for (int y = 0; y < height; y++) {
+        cv::Vec3b* row = image.ptr<cv::Vec3b>(y);
+        float base[3];
+        bool sky = y < horizon;
+        float t = sky ? y / std::max(horizon, 1.0f) : (y - horizon) / std::max(height - horizon, 1.0f);
+        for (int c = 0; c < 3; c++) {
+            base[c] = sky ? s.skyTop[c] + (s.skyBottom[c] - s.skyTop[c]) * t
+                          : s.groundFar[c] + (s.groundNear[c] - s.groundFar[c]) * t;
+        }
+
+        for (int x = 0; x < width; x++) {
+            const float* color = base;
+            for (const auto& b : blobs) {
+                float dx = (x - b.cx * width) / scale;
+                float dy = (y - b.cy * height) / scale;
+                if (dx * dx + dy * dy < b.radius * b.radius) {
+                    color = b.color;
+                }
+            }
+
+            float texture = sky ? 0.0f : s.textureAmp * waveX[x] * waveY[y];
+            for (int c = 0; c < 3; c++) {
+                // xorshift64 noise: cheap enough to run per channel
+                noiseState ^= noiseState << 13;
+                noiseState ^= noiseState >> 7;
+                noiseState ^= noiseState << 17;
+                float noise = noiseAmp * ((noiseState >> 40) / 8388608.0f - 1.0f);
+                row[x][c] = clampPixel(color[c] + texture + brightness + noise);
+            }
+        }
+    }
+}
+
+// A near-duplicate is its source shifted by a few pixels, with its own
+// brightness change and noise
+void renderDuplicate(const SynthParams& params, size_t index, size_t source, cv::Mat& image) {
+    cv::Mat original;
+    renderOriginal(params, source, original);
+
+    const int width = params.width;
+    const int height = params.height;
+    std::mt19937_64 rng(imageSeed(params, index));
+    std::uniform_real_distribution<float> jitter(-1.0f, 1.0f);
+    int shiftX = static_cast<int>(0.03f * width * jitter(rng));
+    int shiftY = static_cast<int>(0.03f * height * jitter(rng));
+    float brightness = 12.0f * jitter(rng);
+    float noiseAmp = 4.0f;
+
+    image.create(height, width, CV_8UC3);
+    uint64_t noiseState = mix(imageSeed(params, index) + 7) | 1;
+    for (int y = 0; y < height; y++) {
+        const cv::Vec3b* src = original.ptr<cv::Vec3b>(std::min(std::max(y + shiftY, 0), height - 1));
+        cv::Vec3b* row = image.ptr<cv::Vec3b>(y);
+        for (int x = 0; x < width; x++) {
+            const cv::Vec3b& pixel = src[std::min(std::max(x + shiftX, 0), width - 1)];
+            for (int c = 0; c < 3; c++) {
+                noiseState ^= noiseState << 13;
+                noiseState ^= noiseState >> 7;
+                noiseState ^= noiseState << 17;
+                float noise = noiseAmp * ((noiseState >> 40) / 8388608.0f - 1.0f);
+                row[x][c] = clampPixel(pixel[c] + brightness + noise);
+            }
+        }
+    }
+}
+
+} // namespace
+
+void renderSynthImage(const SynthParams& params, size_t index, cv::Mat& image, size_t first) {
+    long long source = synthDuplicateOf(params, index, first);
+    if (source >= 0) {
+        renderDuplicate(params, index, static_cast<size_t>(source), image);
+    } else {
+        renderOriginal(params, index, image);
+    }
+}
+
+void synthEmbedding(const SynthParams& params, size_t index, std::vector<float>& embedding, size_t first) {
+    long long source = synthDuplicateOf(params, index, first);
+    size_t original = source >= 0 ? static_cast<size_t>(source) : index;
+    // One distribution per engine: normal_distribution caches its second
+    // value, which would otherwise leak between the streams
+    std::normal_distribution<float> sceneGauss(0.0f, 1.0f), imageGauss(0.0f, 1.0f);
+    std::mt19937_64 sceneRng(sceneSeed(params, originalScene(params, original)) + 1);
+    std::mt19937_64 imageRng(imageSeed(params, original) + 1);
+
+    embedding.resize(params.embeddingDim);
+    for (auto& v : embedding) {
+        v = sceneGauss(sceneRng) + 0.35f * imageGauss(imageRng);
+    }
+    if (source >= 0) {
+        std::normal_distribution<float> dupGauss(0.0f, 1.0f);
+        std::mt19937_64 dupRng(imageSeed(params, index) + 1);
+        for (auto& v : embedding) {
+            v += 0.05f * dupGauss(dupRng);
+        }
+    }
+}
+
+std::string describeSynthParams(const SynthParams& params) {
+    std::ostringstream out;
+    out << params.width << "x" << params.height << " " << params.scenes << " " << params.embeddingDim << " "
+        << params.seed << " " << (params.palette == SynthPalette::NATURAL ? "natural" : "random") << " "
+        << params.textureStrength << " " << params.duplicateRate << " " << params.imagesPerDir << " "
+        << params.format << " " << params.jpegQuality;
+    return out.str();
+}
+
+int writeSynthCorpus(const std::string& dir, size_t first, size_t count, const SynthParams& params,
+                     const std::string& embeddingsCsv, int numThreads,
+                     const std::function<void(size_t, size_t)>& progress) {
+    if (params.width < 8 || params.height < 8 || params.scenes < 1 || params.embeddingDim < 1 ||
+        params.duplicateRate < 0.0f || params.duplicateRate > 1.0f ||
+        (params.format != "jpg" && params.format != "png")) {
+        std::cerr << "Error: Invalid synthetic corpus parameters" << std::endl;
+        return -1;
+    }
+    if (makeDirectory(dir) != 0) {
+        return -1;
+    }
+
+    // Create the leaf directories up front so the writers never race on mkdir
+    if (params.imagesPerDir > 0 && count > 0) {
+        size_t perDir = static_cast<size_t>(params.imagesPerDir);
+        size_t lastTop = static_cast<size_t>(-1);
+        for (size_t leaf = first / perDir; leaf <= (first + count - 1) / perDir; leaf++) {
+            char top[16], sub[32];
+            std::snprintf(top, sizeof(top), "%03zu", leaf / 1000);
+            std::snprintf(sub, sizeof(sub), "%03zu/%03zu", leaf / 1000, leaf % 1000);
+            if (leaf / 1000 != lastTop && makeDirectory(dir + "/" + top) != 0) {
+                return -1;
+            }
+            lastTop = leaf / 1000;
+            if (makeDirectory(dir + "/" + sub) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    std::ofstream csv;
+    if (!embeddingsCsv.empty()) {
+        csv.open(embeddingsCsv);
+        if (!csv.is_open()) {
+            std::cerr << "Error: Cannot open file for writing: " << embeddingsCsv << std::endl;
+            return -1;
+        }
+    }
+    // Chunks generated separately (first > 0) keep their own manifest
+    std::string manifestPath = dir + "/manifest.csv";
+    if (first > 0) {
+        manifestPath = dir + "/manifest_" + std::to_string(first) + ".csv";
+    }
+    std::ofstream manifest(manifestPath);
+    if (!manifest.is_open()) {
+        std::cerr << "Error: Cannot open file for writing: " << manifestPath << std::endl;
+        return -1;
+    }
+
+    // Rendering and encoding dominate, so they run in parallel; every image
+    // depends only on its index, so the output does not depend on threads
+    std::vector<int> writeParams;
+    if (params.format == "jpg") {
+        writeParams = {cv::IMWRITE_JPEG_QUALITY, params.jpegQuality};
+    }
+    std::atomic<bool> failed(false);
+    std::atomic<size_t> done(0);
+    parallelFor(count, numThreads, 16, [&](size_t begin, size_t end, int threadIndex) {
+        cv::Mat image;
+        for (size_t i = first + begin; i < first + end && !failed; i++) {
+            std::string path = dir + "/" + synthImagePath(params, i);
+            renderSynthImage(params, i, image, first);
+            if (!cv::imwrite(path, image, writeParams)) {
+                std::cerr << "Error: Cannot write image " << path << std::endl;
+                failed = true;
+            }
+        }
+        size_t written = done += end - begin;
+        if (progress && threadIndex == 0) {
+            progress(written, count);
+        }
+    });
+    if (failed) {
+        return -1;
+    }
+    if (progress) {
+        progress(count, count);
+    }
+
+    std::vector<float> embedding;
+    manifest << "filename,scene,duplicate_of\n";
+    for (size_t i = first; i < first + count; i++) {
+        std::string name = synthImagePath(params, i);
+        long long source = synthDuplicateOf(params, i, first);
+        manifest << name << "," << synthSceneOf(params, i, first) << ","
+                 << (source >= 0 ? synthImagePath(params, static_cast<size_t>(source)) : "") << "\n";
+
+        if (csv.is_open()) {
+            synthEmbedding(params, i, embedding, first);
+            csv << name;
+            for (float v : embedding) {
+                csv << "," << v;
+            }
+            csv << "\n";
+        }
+    }
+    if (!manifest || (csv.is_open() && !csv)) {
+        std::cerr << "Error: Failed writing corpus metadata in " << dir << std::endl;
+        return -1;
+    }
+    return static_cast<int>(count);
+}
@@ -0,0 +1,372 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Result thumbnails: reduced-scale decoding, a packed on-disk
+           thumbnail file and a background loader for the GUI.
+*/
+
+#include "thumbnail.h"
+#include "parallel.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+const char THUMBNAIL_MAGIC[8] = {'C', 'B', 'I', 'R', 'T', 'H', 'M', 'B'};
+const uint32_t THUMBNAIL_VERSION = 1;
+const uint64_t HEADER_BYTES = sizeof(THUMBNAIL_MAGIC) + 3 * sizeof(uint32_t);
+
+// Longer stored paths mean a damaged record
+const uint32_t MAX_PATH_BYTES = 4096;
+
+const int JPEG_QUALITY = 90;
+
+template <typename T>
+void writeValue(std::ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+bool readValue(std::istream& in, T& value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+// Modification time and size of an image file; false if it cannot be read
+bool imageStamp(const std::string& path, int64_t& mtime, int64_t& size) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        return false;
+    }
+    mtime = static_cast<int64_t>(info.st_mtime);
+    size = static_cast<int64_t>(info.st_size);
+    return true;
+}
+
+int reducedReadFlag(int scale) {
+    switch (scale) {
+        case 8: return cv::IMREAD_REDUCED_COLOR_8;
+        case 4: return cv::IMREAD_REDUCED_COLOR_4;
+        case 2: return cv::IMREAD_REDUCED_COLOR_2;
+        default: return cv::IMREAD_COLOR;
+    }
+}
+
+} // namespace
+
+int makeThumbnail(const std::string& path, cv::Mat& thumbnail) {
+    // The 1/8 decode is cheap and gives the image size; a finer scale is
+    // decoded only when 1/8 would come out smaller than the box
+    cv::Mat image = cv::imread(path, cv::IMREAD_REDUCED_COLOR_8);
+    if (image.empty()) {
+        return -1;
+    }
+    double fit = std::min(static_cast<double>(THUMBNAIL_WIDTH) / (image.cols * 8.0),
+                          static_cast<double>(THUMBNAIL_HEIGHT) / (image.rows * 8.0));
+    int scale = 8;
+    while (scale > 1 && scale * fit > 1.0) {
+        scale /= 2;
+    }
+    if (scale < 8) {
+        image = cv::imread(path, reducedReadFlag(scale));
+        if (image.empty()) {
+            return -1;
+        }
+    }
+
+    // Shrink into the box; smaller images are kept at their size
+    fit = std::min(static_cast<double>(THUMBNAIL_WIDTH) / image.cols,
+                   static_cast<double>(THUMBNAIL_HEIGHT) / image.rows);
+    if (fit < 1.0) {
+        cv::Size size(std::max(1, static_cast<int>(std::lround(image.cols * fit))),
+                      std::max(1, static_cast<int>(std::lround(image.rows * fit))));
+        cv::resize(image, thumbnail, size, 0, 0, cv::INTER_AREA);
+    } else {
+        thumbnail = image;
+    }
+    return 0;
+}
+
+ThumbnailCache::ThumbnailCache() : fileEnd(0) {}
+
+ThumbnailCache::~ThumbnailCache() {
+    close();
+}
+
+int ThumbnailCache::open(const std::string& path) {
+    std::lock_guard<std::mutex> guard(lock);
+    file.close();
+    index.clear();
+    filename.clear();
+    fileEnd = 0;
+
+    // Index the records of an existing file up to the last complete one
+    uint64_t validEnd = 0;
+    {
+        std::ifstream in(path, std::ios::binary);
+        char magic[sizeof(THUMBNAIL_MAGIC)];
+        uint32_t version = 0, width = 0, height = 0;
+        if (in.is_open() && in.read(magic, sizeof(magic)) &&
+            std::memcmp(magic, THUMBNAIL_MAGIC, sizeof(magic)) == 0 && readValue(in, version) &&
+            version == THUMBNAIL_VERSION && readValue(in, width) && readValue(in, height) &&
+            width == static_cast<uint32_t>(THUMBNAIL_WIDTH) && height == static_cast<uint32_t>(THUMBNAIL_HEIGHT)) {
+            in.seekg(0, std::ios::end);
+            uint64_t total = static_cast<uint64_t>(in.tellg());
+            in.seekg(HEADER_BYTES);
+            validEnd = HEADER_BYTES;
+
+            uint32_t pathLength = 0, length = 0;
+            int64_t mtime = 0, size = 0;
+            std::string imagePath;
+            while (readValue(in, pathLength) && pathLength <= MAX_PATH_BYTES) {
+                imagePath.resize(pathLength);
+                if (!in.read(&imagePath[0], pathLength) || !readValue(in, mtime) || !readValue(in, size) ||
+                    !readValue(in, length)) {
+                    break;
+                }
+                uint64_t offset = static_cast<uint64_t>(in.tellg());
+                if (offset + length > total) {
+                    break;
+                }
+                in.seekg(length, std::ios::cur);
+                index[imagePath] = Entry{offset, length, mtime, size};
+                validEnd = offset + length;
+            }
+        }
+    }
+
+    if (validEnd == 0) {
+        // New file, or one from another version or thumbnail size
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(THUMBNAIL_MAGIC, sizeof(THUMBNAIL_MAGIC));
+        writeValue(out, THUMBNAIL_VERSION);
+        writeValue(out, static_cast<uint32_t>(THUMBNAIL_WIDTH));
+        writeValue(out, static_cast<uint32_t>(THUMBNAIL_HEIGHT));
+        if (!out) {
+            std::cerr << "Error: Cannot create thumbnail file " << path << std::endl;
+            return -1;
+        }
+        validEnd = HEADER_BYTES;
+    } else if (truncate(path.c_str(), static_cast<off_t>(validEnd)) != 0) {
+        // Drop a partial last record so new records follow the last good one
+        std::cerr << "Error: Cannot repair thumbnail file " << path << std::endl;
+        index.clear();
+        return -1;
+    }
+
+    file.open(path, std::ios::in | std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open thumbnail file " << path << std::endl;
+        index.clear();
+        return -1;
+    }
+    filename = path;
+    fileEnd = validEnd;
+    return static_cast<int>(index.size());
+}
+
+void ThumbnailCache::close() {
+    std::lock_guard<std::mutex> guard(lock);
+    file.close();
+    index.clear();
+    filename.clear();
+    fileEnd = 0;
+}
+
+bool ThumbnailCache::isOpen() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return file.is_open();
+}
+
+std::string ThumbnailCache::getFilename() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return filename;
+}
+
+size_t ThumbnailCache::size() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return index.size();
+}
+
+bool ThumbnailCache::get(const std::string& path, cv::Mat& thumbnail) {
+    int64_t mtime = 0, size = 0;
+    if (!imageStamp(path, mtime, size)) {
+        return false;
+    }
+
+    // Only the read holds the lock; decoding runs in parallel
+    std::vector<uchar> bytes;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = index.find(path);
+        if (!file.is_open() || it == index.end() || it->second.mtime != mtime || it->second.size != size) {
+            return false;
+        }
+        bytes.resize(it->second.length);
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(it->second.offset));
+        if (!file.read(reinterpret_cast<char*>(bytes.data()), bytes.size())) {
+            return false;
+        }
+    }
+
+    cv::Mat image = cv::imdecode(bytes, cv::IMREAD_COLOR);
+    if (image.empty()) {
+        return false;
+    }
+    thumbnail = image;
+    return true;
+}
+
+int ThumbnailCache::put(const std::string& path, const cv::Mat& thumbnail) {
+    int64_t mtime = 0, size = 0;
+    std::vector<uchar> bytes;
+    if (path.size() > MAX_PATH_BYTES || !imageStamp(path, mtime, size) ||
+        !cv::imencode(".jpg", thumbnail, bytes, {cv::IMWRITE_JPEG_QUALITY, JPEG_QUALITY})) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (!file.is_open()) {
+        return -1;
+    }
+    file.clear();
+    file.seekp(static_cast<std::streamoff>(fileEnd));
+    writeValue(file, static_cast<uint32_t>(path.size()));
+    file.write(path.data(), path.size());
+    writeValue(file, mtime);
+    writeValue(file, size);
+    writeValue(file, static_cast<uint32_t>(bytes.size()));
+    uint64_t offset = fileEnd + sizeof(uint32_t) + path.size() + 2 * sizeof(int64_t) + sizeof(uint32_t);
+    file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    file.flush();
+    if (!file) {
+        // A partial record is dropped by the next open()
+        std::cerr << "Error: Failed writing thumbnail file " << filename << std::endl;
+        return -1;
+    }
+    index[path] = Entry{offset, static_cast<uint32_t>(bytes.size()), mtime, size};
+    fileEnd = offset + bytes.size();
+    return 0;
+}
+
+int ThumbnailCache::fetch(const std::string& path, cv::Mat& thumbnail) {
+    if (get(path, thumbnail)) {
+        return 0;
+    }
+    if (makeThumbnail(path, thumbnail) != 0) {
+        return -1;
+    }
+    put(path, thumbnail);
+    return 0;
+}
+
+int ThumbnailCache::addImages(const std::vector<std::string>& paths, int numThreads) {
+    if (!isOpen()) {
+        std::cerr << "Error: Thumbnail file is not open" << std::endl;
+        return -1;
+    }
+
+    std::atomic<int> made(0);
+    parallelFor(paths.size(), numThreads, 16, [&](size_t begin, size_t end, int) {
+        cv::Mat thumbnail;
+        for (size_t i = begin; i < end; i++) {
+            if (get(paths[i], thumbnail)) {
+                continue;
+            }
+            if (makeThumbnail(paths[i], thumbnail) != 0) {
+                std::cerr << "Warning: Cannot load image " << paths[i] << std::endl;
+                continue;
+            }
+            if (put(paths[i], thumbnail) == 0) {
+                made++;
+            }
+        }
+    });
+    return made.load();
+}
+
+ThumbnailLoader::ThumbnailLoader(int numThreads, size_t memoryEntries)
+    : memoryCache(memoryEntries), generation(0), stopping(false) {
+    int count = numThreads > 0 ? numThreads : defaultThreadCount();
+    for (int i = 0; i < count; i++) {
+        workers.emplace_back(&ThumbnailLoader::workerLoop, this);
+    }
+}
+
+ThumbnailLoader::~ThumbnailLoader() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThumbnailLoader::workerLoop() {
+    while (true) {
+        Request request;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            request = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        // Memory first, then the thumbnail file, then the image itself. The
+        // memory key carries the file's stamp, so an edited image misses
+        ThumbnailResult result;
+        result.generation = request.generation;
+        result.index = request.index;
+        int64_t mtime = -1, size = -1;
+        imageStamp(request.path, mtime, size);
+        std::string key = request.path + '|' + std::to_string(mtime) + '|' + std::to_string(size);
+        if (!memoryCache.get(key, result.image) && diskCache.fetch(request.path, result.image) == 0) {
+            memoryCache.put(key, result.image);
+        }
+
+        // Thumbnails of an earlier request are not delivered, but stay cached
+        std::lock_guard<std::mutex> guard(lock);
+        if (request.generation == generation) {
+            finished.push_back(std::move(result));
+        }
+    }
+}
+
+uint64_t ThumbnailLoader::request(const std::vector<std::string>& paths) {
+    uint64_t current;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        current = ++generation;
+        queue.clear();
+        finished.clear();
+        for (size_t i = 0; i < paths.size(); i++) {
+            queue.push_back(Request{current, i, paths[i]});
+        }
+    }
+    changed.notify_all();
+    return current;
+}
+
+void ThumbnailLoader::cancel() {
+    request(std::vector<std::string>());
+}
+
+size_t ThumbnailLoader::collect(std::vector<ThumbnailResult>& out, size_t maxResults) {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t count = std::min(maxResults, finished.size());
+    for (size_t i = 0; i < count; i++) {
+        out.push_back(std::move(finished.front()));
+        finished.pop_front();
+    }
+    return count;
+}
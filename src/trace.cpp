@@ -0,0 +1,199 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Optional timeline tracing: scoped spans recorded into per-thread
+           ring buffers and written as Chrome trace JSON (chrome://tracing,
+           ui.perfetto.dev).
+*/
+
+#include "trace.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> g_tracingEnabled(false);
+
+namespace {
+
+struct TraceEvent {
+    const char* name;
+    const char* category;
+    int64_t startNs;      // Since startTracing()
+    int64_t durationNs;
+    char detail[48];
+};
+
+// Written only by its thread: the slot is filled first, then the count is
+// published with a release store, so recording takes no lock. When full,
+// the oldest spans are overwritten
+struct TraceBuffer {
+    std::vector<TraceEvent> events;
+    std::atomic<uint64_t> count;
+    int tid;
+    std::string name;
+
+    TraceBuffer(size_t capacity, int threadId) : events(capacity), count(0), tid(threadId) {}
+};
+
+struct TraceRegistry {
+    std::mutex lock;
+    // Kept after their threads exit, until the next startTracing()
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+    size_t capacity;
+    // Bumped by startTracing(); a thread whose buffer is from an older trace
+    // registers a new one
+    std::atomic<uint64_t> generation;
+    std::chrono::steady_clock::time_point epoch;
+
+    TraceRegistry() : capacity(1 << 15), generation(0), epoch(std::chrono::steady_clock::now()) {}
+};
+
+TraceRegistry& registry() {
+    static TraceRegistry* instance = new TraceRegistry();
+    return *instance;
+}
+
+thread_local TraceBuffer* tlsBuffer = nullptr;
+thread_local uint64_t tlsGeneration = 0;
+
+TraceBuffer* currentBuffer() {
+    TraceRegistry& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    uint64_t generation = r.generation.load(std::memory_order_relaxed);
+    if (tlsBuffer == nullptr || tlsGeneration != generation) {
+        int tid = static_cast<int>(r.buffers.size());
+        r.buffers.push_back(std::unique_ptr<TraceBuffer>(new TraceBuffer(r.capacity, tid)));
+        r.buffers.back()->name = "thread " + std::to_string(tid);
+        tlsBuffer = r.buffers.back().get();
+        tlsGeneration = generation;
+    }
+    return tlsBuffer;
+}
+
+// The registry lock is only taken on a thread's first span of a trace
+TraceBuffer* threadBuffer() {
+    if (tlsBuffer != nullptr && tlsGeneration == registry().generation.load(std::memory_order_acquire)) {
+        return tlsBuffer;
+    }
+    return currentBuffer();
+}
+
+void writeEscaped(std::ostream& out, const char* s) {
+    for (; *s != '\0'; s++) {
+        unsigned char c = static_cast<unsigned char>(*s);
+        if (c == '"' || c == '\\') {
+            out << '\\' << *s;
+        } else if (c < 0x20) {
+            char code[8];
+            std::snprintf(code, sizeof(code), "\\u%04x", c);
+            out << code;
+        } else {
+            out << *s;
+        }
+    }
+}
+
+} // namespace
+
+void startTracing(size_t eventsPerThread) {
+    TraceRegistry& r = registry();
+    {
+        std::lock_guard<std::mutex> guard(r.lock);
+        r.buffers.clear();
+        r.capacity = eventsPerThread > 0 ? eventsPerThread : 1;
+        r.generation.fetch_add(1, std::memory_order_release);
+        r.epoch = std::chrono::steady_clock::now();
+    }
+    g_tracingEnabled.store(true, std::memory_order_relaxed);
+    setTraceThreadName("main");
+}
+
+void stopTracing() {
+    g_tracingEnabled.store(false, std::memory_order_relaxed);
+}
+
+void setTraceThreadName(const std::string& name) {
+    if (!tracingEnabled()) {
+        return;
+    }
+    TraceBuffer* buffer = threadBuffer();
+    std::lock_guard<std::mutex> guard(registry().lock);
+    buffer->name = name;
+}
+
+void traceSpan(const char* name, const char* category, std::chrono::steady_clock::time_point start,
+               std::chrono::steady_clock::time_point end, const char* detail) {
+    TraceBuffer* buffer = threadBuffer();
+    uint64_t index = buffer->count.load(std::memory_order_relaxed);
+    TraceEvent& event = buffer->events[index % buffer->events.size()];
+    event.name = name;
+    event.category = category;
+    event.startNs = std::chrono::duration_cast<std::chrono::nanoseconds>(start - registry().epoch).count();
+    event.durationNs = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    if (detail != nullptr) {
+        std::strncpy(event.detail, detail, sizeof(event.detail) - 1);
+        event.detail[sizeof(event.detail) - 1] = '\0';
+    } else {
+        event.detail[0] = '\0';
+    }
+    buffer->count.store(index + 1, std::memory_order_release);
+}
+
+int writeTrace(const std::string& filename) {
+    std::ofstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for writing: " << filename << std::endl;
+        return -1;
+    }
+
+    TraceRegistry& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    uint64_t overwritten = 0;
+    bool first = true;
+    char number[64];
+
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    for (const auto& buffer : r.buffers) {
+        file << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+             << buffer->tid << ", \"args\": {\"name\": \"";
+        writeEscaped(file, buffer->name.c_str());
+        file << "\"}}";
+        first = false;
+
+        uint64_t count = buffer->count.load(std::memory_order_acquire);
+        uint64_t capacity = buffer->events.size();
+        uint64_t begin = count > capacity ? count - capacity : 0;
+        overwritten += begin;
+        for (uint64_t i = begin; i < count; i++) {
+            const TraceEvent& event = buffer->events[i % capacity];
+            // Complete events; timestamps in microseconds
+            std::snprintf(number, sizeof(number), "%.3f, \"dur\": %.3f", event.startNs / 1e3,
+                          event.durationNs / 1e3);
+            file << ",\n{\"name\": \"" << event.name << "\", \"cat\": \"" << event.category
+                 << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->tid << ", \"ts\": " << number;
+            if (event.detail[0] != '\0') {
+                file << ", \"args\": {\"detail\": \"";
+                writeEscaped(file, event.detail);
+                file << "\"}";
+            }
+            file << "}";
+        }
+    }
+    file << "\n]}\n";
+
+    if (overwritten > 0) {
+        std::cerr << "Warning: " << overwritten << " early trace events were overwritten (ring buffer full)"
+                  << std::endl;
+    }
+    if (!file) {
+        std::cerr << "Error: Failed writing trace to " << filename << std::endl;
+        return -1;
+    }
+    std::cout << "Saved trace to " << filename << std::endl;
+    return 0;
+}
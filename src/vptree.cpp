@@ -0,0 +1,394 @@
+/*
+  Name: Borui Chen
+  Date: 2026-02-03
+  Purpose: Vantage-point tree implementation.
+*/
+
+#include "vptree.h"
+#include "distance.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <numeric>
+
+namespace {
+
+const char VPTREE_MAGIC[8] = {'C', 'B', 'I', 'R', 'V', 'P', 'T', 'R'};
+const uint32_t VPTREE_VERSION = 1;
+
+// Relative slack on the pruning radius; float rounding can bend the triangle
+// inequality slightly and an exact index must never prune a true match
+const float PRUNE_SLACK = 1.0001f;
+
+template <typename T>
+void writeValue(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+bool readValue(std::ifstream& in, T& value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+} // namespace
+
+VPTree::VPTree()
+    : data(nullptr), featureType(FeatureType::BASELINE), cosine(false), leafSize(8), root(-1) {}
+
+float VPTree::rowDistance(const FeatureVector& query, uint32_t row) const {
+    if (cosine) {
+        return normalizedCosineDistance(query, (*data)[row]);
+    }
+    return sumSquaredDifference(query, (*data)[row]);
+}
+
+float VPTree::toMetric(float distance) const {
+    if (distance == std::numeric_limits<float>::infinity()) {
+        return distance;
+    }
+    return std::sqrt(std::max(0.0f, cosine ? 2.0f * distance : distance));
+}
+
+int32_t VPTree::buildNode(uint32_t begin, uint32_t end, std::vector<Node>& out,
+                          int parallelDepth, std::mt19937& rng) {
+    if (begin >= end) {
+        return -1;
+    }
+
+    Node node;
+    node.vantage = 0;
+    node.radius = 0.0f;
+    node.inside = -1;
+    node.outside = -1;
+    node.begin = begin;
+    node.end = end;
+
+    if (end - begin <= leafSize) {
+        out.push_back(node);
+        return static_cast<int32_t>(out.size() - 1);
+    }
+
+    // Random vantage point moved to the front of the range
+    std::uniform_int_distribution<uint32_t> pick(begin, end - 1);
+    std::swap(items[begin], items[pick(rng)]);
+    node.vantage = items[begin];
+
+    // Split the remaining rows at the median distance from the vantage point
+    const FeatureVector& vantage = (*data)[node.vantage];
+    std::vector<std::pair<float, uint32_t>> dist;
+    dist.reserve(end - begin - 1);
+    for (uint32_t i = begin + 1; i < end; i++) {
+        dist.push_back(std::make_pair(toMetric(rowDistance(vantage, items[i])), items[i]));
+    }
+    size_t half = dist.size() / 2;
+    std::nth_element(dist.begin(), dist.begin() + half, dist.end());
+    node.radius = dist[half].first;
+    for (size_t i = 0; i < dist.size(); i++) {
+        items[begin + 1 + i] = dist[i].second;
+    }
+    std::vector<std::pair<float, uint32_t>>().swap(dist);
+
+    uint32_t mid = static_cast<uint32_t>(begin + 1 + half);
+    int32_t index = static_cast<int32_t>(out.size());
+    out.push_back(node);
+
+    int32_t inside = -1;
+    int32_t outside = -1;
+    if (parallelDepth > 0) {
+        // Build the inside subtree on another thread into its own node list,
+        // then append it with its child indices shifted
+        std::vector<Node> insideNodes;
+        std::mt19937 insideRng(rng());
+        auto future = std::async(std::launch::async, [&]() {
+            return buildNode(begin + 1, mid, insideNodes, parallelDepth - 1, insideRng);
+        });
+        outside = buildNode(mid, end, out, parallelDepth - 1, rng);
+        int32_t insideRoot = future.get();
+
+        int32_t offset = static_cast<int32_t>(out.size());
+        for (Node n : insideNodes) {
+            if (n.inside >= 0) {
+                n.inside += offset;
+            }
+            if (n.outside >= 0) {
+                n.outside += offset;
+            }
+            out.push_back(n);
+        }
+        inside = insideRoot >= 0 ? insideRoot + offset : -1;
+    } else {
+        inside = buildNode(begin + 1, mid, out, 0, rng);
+        outside = buildNode(mid, end, out, 0, rng);
+    }
+
+    out[index].inside = inside;
+    out[index].outside = outside;
+    return index;
+}
+
+int VPTree::build(const std::vector<FeatureVector>& features, FeatureType type, bool isNormalized,
+                  int numThreads, uint32_t leafRows, unsigned int seed) {
+    if (features.empty()) {
+        std::cerr << "Error: Cannot build VP-tree over an empty database" << std::endl;
+        return -1;
+    }
+    if (type == FeatureType::BASELINE) {
+        cosine = false;
+    } else if (type == FeatureType::DNN_EMBEDDING && isNormalized) {
+        cosine = true;
+    } else {
+        std::cerr << "Error: VP-tree supports baseline (SSD/L2) and normalized dnn_embedding "
+                  << "databases, not " << featureTypeToString(type) << std::endl;
+        return -1;
+    }
+
+    data = &features;
+    featureType = type;
+    leafSize = std::max<uint32_t>(1, leafRows);
+    items.resize(features.size());
+    std::iota(items.begin(), items.end(), 0);
+    nodes.clear();
+
+    if (numThreads <= 0) {
+        numThreads = defaultThreadCount();
+    }
+    int parallelDepth = 0;
+    while ((1 << parallelDepth) < numThreads) {
+        parallelDepth++;
+    }
+
+    std::mt19937 rng(seed);
+    root = buildNode(0, static_cast<uint32_t>(items.size()), nodes, parallelDepth, rng);
+    return 0;
+}
+
+void VPTree::searchNode(int32_t index, const FeatureVector& query, TopK& top, VPTreeStats& stats) const {
+    const Node& node = nodes[index];
+    stats.nodesVisited++;
+
+    if (node.isLeaf()) {
+        for (uint32_t i = node.begin; i < node.end; i++) {
+            top.push(rowDistance(query, items[i]), items[i]);
+        }
+        stats.distanceComputations += node.end - node.begin;
+        return;
+    }
+
+    float d = rowDistance(query, node.vantage);
+    stats.distanceComputations++;
+    top.push(d, node.vantage);
+    float m = toMetric(d);
+
+    // Visit the side the query falls in first so the bound shrinks sooner
+    int32_t first = (m <= node.radius) ? node.inside : node.outside;
+    int32_t second = (m <= node.radius) ? node.outside : node.inside;
+    for (int32_t child : {first, second}) {
+        if (child < 0) {
+            continue;
+        }
+        float tau = toMetric(top.bound()) * PRUNE_SLACK;
+        bool reachable = (child == node.inside) ? (m - tau <= node.radius)
+                                                : (m + tau >= node.radius);
+        if (reachable) {
+            searchNode(child, query, top, stats);
+        }
+    }
+}
+
+std::vector<Neighbor> VPTree::search(const FeatureVector& query, int k, VPTreeStats* stats) const {
+    VPTreeStats local;
+    TopK top(k > 0 ? k : 0);
+    if (root >= 0 && k > 0) {
+        searchNode(root, query, top, local);
+    }
+    if (stats != nullptr) {
+        *stats = local;
+    }
+    return top.take();
+}
+
+bool VPTree::rangeNode(int32_t index, const FeatureVector& query, float metricRadius, float radius,
+                       const std::function<bool(const Neighbor&)>& visit, VPTreeStats& stats) const {
+    const Node& node = nodes[index];
+    stats.nodesVisited++;
+
+    if (node.isLeaf()) {
+        for (uint32_t i = node.begin; i < node.end; i++) {
+            float d = rowDistance(query, items[i]);
+            stats.distanceComputations++;
+            if (d <= radius && !visit(Neighbor(d, items[i]))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    float d = rowDistance(query, node.vantage);
+    stats.distanceComputations++;
+    if (d <= radius && !visit(Neighbor(d, node.vantage))) {
+        return false;
+    }
+    float m = toMetric(d);
+
+    if (node.inside >= 0 && m - metricRadius <= node.radius &&
+        !rangeNode(node.inside, query, metricRadius, radius, visit, stats)) {
+        return false;
+    }
+    if (node.outside >= 0 && m + metricRadius >= node.radius &&
+        !rangeNode(node.outside, query, metricRadius, radius, visit, stats)) {
+        return false;
+    }
+    return true;
+}
+
+bool VPTree::rangeVisit(const FeatureVector& query, float radius,
+                        const std::function<bool(const Neighbor&)>& visit, VPTreeStats* stats) const {
+    VPTreeStats local;
+    bool finished = true;
+    if (root >= 0 && radius >= 0.0f) {
+        finished = rangeNode(root, query, toMetric(radius) * PRUNE_SLACK, radius, visit, local);
+    }
+    if (stats != nullptr) {
+        *stats = local;
+    }
+    return finished;
+}
+
+std::vector<Neighbor> VPTree::rangeSearch(const FeatureVector& query, float radius, VPTreeStats* stats) const {
+    std::vector<Neighbor> results;
+    rangeVisit(query, radius, [&](const Neighbor& n) {
+        results.push_back(n);
+        return true;
+    }, stats);
+    std::sort(results.begin(), results.end());
+    return results;
+}
+
+int VPTree::save(const std::string& filename) const {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for writing: " << filename << std::endl;
+        return -1;
+    }
+
+    uint64_t nodeCount = nodes.size();
+    uint64_t itemCount = items.size();
+    uint32_t dim = (data && !data->empty()) ? static_cast<uint32_t>((*data)[0].size()) : 0;
+
+    file.write(VPTREE_MAGIC, sizeof(VPTREE_MAGIC));
+    writeValue(file, VPTREE_VERSION);
+    writeValue(file, static_cast<uint32_t>(featureType));
+    writeValue(file, static_cast<uint8_t>(cosine ? 1 : 0));
+    writeValue(file, dim);
+    writeValue(file, leafSize);
+    writeValue(file, root);
+    writeValue(file, nodeCount);
+    writeValue(file, itemCount);
+    file.write(reinterpret_cast<const char*>(nodes.data()), nodeCount * sizeof(Node));
+    file.write(reinterpret_cast<const char*>(items.data()), itemCount * sizeof(uint32_t));
+
+    if (!file) {
+        std::cerr << "Error: Failed writing VP-tree " << filename << std::endl;
+        return -1;
+    }
+    std::cout << "Saved VP-tree (" << nodeCount << " nodes) to " << filename << std::endl;
+    return 0;
+}
+
+int VPTree::load(const std::string& filename, const std::vector<FeatureVector>& features,
+                 FeatureType type, bool isNormalized) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open file for reading: " << filename << std::endl;
+        return -1;
+    }
+
+    char magic[sizeof(VPTREE_MAGIC)];
+    uint32_t version = 0, fileType = 0, dim = 0, fileLeafSize = 0;
+    uint8_t cos = 0;
+    int32_t fileRoot = -1;
+    uint64_t nodeCount = 0, itemCount = 0;
+
+    if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, VPTREE_MAGIC, sizeof(magic)) != 0 ||
+        !readValue(file, version) || version != VPTREE_VERSION) {
+        std::cerr << "Error: " << filename << " is not a CBIR VP-tree" << std::endl;
+        return -1;
+    }
+    if (!readValue(file, fileType) || !readValue(file, cos) || !readValue(file, dim) ||
+        !readValue(file, fileLeafSize) || !readValue(file, fileRoot) ||
+        !readValue(file, nodeCount) || !readValue(file, itemCount)) {
+        std::cerr << "Error: Truncated VP-tree " << filename << std::endl;
+        return -1;
+    }
+    if (itemCount != features.size() || (itemCount > 0 && dim != features[0].size())) {
+        std::cerr << "Error: VP-tree " << filename << " was built for a different database ("
+                  << itemCount << " x " << dim << ")" << std::endl;
+        return -1;
+    }
+    // Tree radii are only valid for the metric the tree was built with
+    bool dbCosine = (type == FeatureType::DNN_EMBEDDING && isNormalized);
+    if (static_cast<FeatureType>(fileType) != type || (cos != 0) != dbCosine) {
+        std::cerr << "Error: VP-tree " << filename << " was built for "
+                  << featureTypeToString(static_cast<FeatureType>(fileType)) << (cos != 0 ? " (normalized)" : "")
+                  << " features, database has " << featureTypeToString(type)
+                  << (dbCosine ? " (normalized)" : "") << std::endl;
+        return -1;
+    }
+
+    // A tree has fewer nodes than rows plus one; anything else is corrupt
+    if (nodeCount > itemCount + 1 || fileRoot < -1 || fileRoot >= static_cast<int64_t>(nodeCount) ||
+        (fileRoot < 0 && itemCount > 0)) {
+        std::cerr << "Error: Corrupt VP-tree " << filename << std::endl;
+        return -1;
+    }
+
+    std::vector<Node> fileNodes(nodeCount);
+    std::vector<uint32_t> fileItems(itemCount);
+    file.read(reinterpret_cast<char*>(fileNodes.data()), nodeCount * sizeof(Node));
+    file.read(reinterpret_cast<char*>(fileItems.data()), itemCount * sizeof(uint32_t));
+    if (!file) {
+        std::cerr << "Error: Truncated VP-tree " << filename << std::endl;
+        return -1;
+    }
+
+    // Searches follow these indices without checks. Children always come
+    // after their parent, which also rules out cycles
+    for (uint64_t i = 0; i < nodeCount; i++) {
+        const Node& n = fileNodes[i];
+        bool valid = n.begin <= n.end && n.end <= itemCount;
+        for (int32_t child : {n.inside, n.outside}) {
+            valid = valid && child >= -1 && (child < 0 || (static_cast<uint64_t>(child) > i &&
+                                                            static_cast<uint64_t>(child) < nodeCount));
+        }
+        if (!n.isLeaf()) {
+            valid = valid && n.vantage < itemCount;
+        }
+        if (!valid) {
+            std::cerr << "Error: Corrupt VP-tree " << filename << std::endl;
+            return -1;
+        }
+    }
+    for (uint32_t row : fileItems) {
+        if (row >= itemCount) {
+            std::cerr << "Error: Corrupt VP-tree " << filename << std::endl;
+            return -1;
+        }
+    }
+
+    nodes.swap(fileNodes);
+    items.swap(fileItems);
+
+    data = &features;
+    featureType = type;
+    cosine = dbCosine;
+    leafSize = fileLeafSize;
+    root = fileRoot;
+
+    std::cout << "Loaded VP-tree (" << nodeCount << " nodes) from " << filename << std::endl;
+    return 0;
+}